@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "ConnectMarkCache.h"
+
+bool ConnectMarkCache::get(uint32_t generation, uid_t uid, uint32_t* mark) const {
+    if (generation == 0) {
+        return false;
+    }
+    const uint32_t seq = mSeq.load(std::memory_order_acquire);
+    if (seq & 1) {
+        return false;
+    }
+    const uint32_t cachedGeneration = mGeneration.load(std::memory_order_relaxed);
+    const uid_t cachedUid = mUid.load(std::memory_order_relaxed);
+    const uint32_t cachedMark = mMark.load(std::memory_order_relaxed);
+    // Orders the loads above before the check below, so a put() that overlapped them is noticed.
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (mSeq.load(std::memory_order_relaxed) != seq) {
+        return false;
+    }
+    if (cachedGeneration != generation || cachedUid != uid) {
+        return false;
+    }
+    *mark = cachedMark;
+    return true;
+}
+
+void ConnectMarkCache::put(uint32_t generation, uid_t uid, uint32_t mark) {
+    if (generation == 0) {
+        return;
+    }
+    // Writers don't wait for each other. The loser's answer is simply not cached.
+    uint32_t seq = mSeq.load(std::memory_order_relaxed);
+    if ((seq & 1) || !mSeq.compare_exchange_strong(seq, seq + 1, std::memory_order_relaxed)) {
+        return;
+    }
+    // Orders the odd seq before the stores below, so a get() that sees any of them
+    // also sees the seq change, and misses.
+    std::atomic_thread_fence(std::memory_order_release);
+    mGeneration.store(generation, std::memory_order_relaxed);
+    mUid.store(uid, std::memory_order_relaxed);
+    mMark.store(mark, std::memory_order_relaxed);
+    mSeq.store(seq + 2, std::memory_order_release);
+}
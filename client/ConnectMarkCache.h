@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_CLIENT_CONNECT_MARK_CACHE_H
+#define NETD_CLIENT_CONNECT_MARK_CACHE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+
+// Holds the fwmark that the server last set for connect(), along with the generation it was set in
+// and the effective uid it was set for. An answer is only ever returned for the same generation and
+// uid, so bumping the generation invalidates it.
+//
+// The three values are kept consistent with a seqlock, so that get() never blocks and never
+// returns a mark together with the generation or uid of a different answer.
+class ConnectMarkCache {
+public:
+    constexpr ConnectMarkCache() : mSeq(0), mGeneration(0), mUid(0), mMark(0) {}
+
+    // Returns true and sets |*mark| if the cached answer was given in |generation| for |uid|.
+    // Never returns true for generation zero, which means the generation is unknown.
+    bool get(uint32_t generation, uid_t uid, uint32_t* mark) const;
+
+    // Caches |mark| as the answer given in |generation| for |uid|. If another thread is doing the
+    // same, only one of the answers is cached.
+    void put(uint32_t generation, uid_t uid, uint32_t mark);
+
+private:
+    std::atomic<uint32_t> mSeq;  // Odd while a put() is in progress.
+    std::atomic<uint32_t> mGeneration;
+    std::atomic<uid_t> mUid;
+    std::atomic<uint32_t> mMark;
+};
+
+#endif  // NETD_CLIENT_CONNECT_MARK_CACHE_H
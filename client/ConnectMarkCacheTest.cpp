@@ -0,0 +1,108 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * ConnectMarkCacheTest.cpp - unit tests for ConnectMarkCache.cpp
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "ConnectMarkCache.h"
+
+TEST(ConnectMarkCacheTest, TestEmpty) {
+    ConnectMarkCache cache;
+    uint32_t mark = 42;
+    EXPECT_FALSE(cache.get(1, 0, &mark));
+    // Generation zero means the generation is unknown, even though the empty cache holds zeros.
+    EXPECT_FALSE(cache.get(0, 0, &mark));
+    EXPECT_EQ(42U, mark);
+}
+
+TEST(ConnectMarkCacheTest, TestGenerationBumpInvalidates) {
+    ConnectMarkCache cache;
+    uint32_t mark;
+    cache.put(5, 10001, 0x30064);
+    ASSERT_TRUE(cache.get(5, 10001, &mark));
+    EXPECT_EQ(0x30064U, mark);
+
+    // The server bumped the generation, so the answer is stale until the server is asked again.
+    EXPECT_FALSE(cache.get(6, 10001, &mark));
+    cache.put(6, 10001, 0x30065);
+    ASSERT_TRUE(cache.get(6, 10001, &mark));
+    EXPECT_EQ(0x30065U, mark);
+    EXPECT_FALSE(cache.get(5, 10001, &mark));
+
+    // Generations wrap around without going through zero.
+    cache.put(0xffffffff, 10001, 0x30066);
+    EXPECT_FALSE(cache.get(1, 10001, &mark));
+    ASSERT_TRUE(cache.get(0xffffffff, 10001, &mark));
+    EXPECT_EQ(0x30066U, mark);
+}
+
+TEST(ConnectMarkCacheTest, TestUidMustMatch) {
+    ConnectMarkCache cache;
+    uint32_t mark;
+    cache.put(5, 10001, 0x30064);
+    EXPECT_FALSE(cache.get(5, 10002, &mark));
+    EXPECT_FALSE(cache.get(5, 0, &mark));
+}
+
+TEST(ConnectMarkCacheTest, TestGenerationZeroIsNotCached) {
+    ConnectMarkCache cache;
+    uint32_t mark;
+    cache.put(5, 10001, 0x30064);
+    cache.put(0, 10001, 0x30065);
+    EXPECT_FALSE(cache.get(0, 10001, &mark));
+    ASSERT_TRUE(cache.get(5, 10001, &mark));
+    EXPECT_EQ(0x30064U, mark);
+}
+
+TEST(ConnectMarkCacheTest, TestConcurrentPutsAreNeverTorn) {
+    // Every answer that's put has the same generation, uid and mark. A get() that mixed the values
+    // of two answers would return a mark that doesn't match the generation it was asked for.
+    ConnectMarkCache cache;
+    std::atomic<uint32_t> latest(1);
+    std::atomic<bool> done(false);
+    const uint32_t kPuts = 100000;
+
+    std::vector<std::thread> writers;
+    for (uint32_t i = 0; i < 2; ++i) {
+        writers.emplace_back([&cache, &latest, i] {
+            for (uint32_t generation = 1 + i; generation <= kPuts; generation += 2) {
+                cache.put(generation, generation, generation);
+                latest = generation;
+            }
+        });
+    }
+    std::thread reader([&cache, &latest, &done] {
+        while (!done) {
+            const uint32_t generation = latest;
+            uint32_t mark;
+            if (cache.get(generation, generation, &mark)) {
+                EXPECT_EQ(generation, mark);
+            }
+            // No answer has the uid of one put() and the generation of another.
+            EXPECT_FALSE(cache.get(generation, generation + 1, &mark));
+        }
+    });
+    for (std::thread& writer : writers) {
+        writer.join();
+    }
+    done = true;
+    reader.join();
+}
@@ -19,47 +19,52 @@
 #include "FwmarkCommand.h"
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <condition_variable>
+#include <map>
+#include <mutex>
+
 namespace {
 
-const sockaddr_un FWMARK_SERVER_PATH = {AF_UNIX, "/dev/socket/fwmarkd"};
+sockaddr_un gServerAddress = {AF_UNIX, "/dev/socket/fwmarkd"};
 
-}  // namespace
+// How long to use connections of our own after the server refuses a persistent one.
+const time_t kRefusedRetrySec = 60;
 
-bool FwmarkClient::shouldSetFwmark(int family) {
-    return (family == AF_INET || family == AF_INET6) && !getenv("ANDROID_NO_USE_FWMARK_CLIENT");
+time_t monotonicSeconds() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
 }
 
-FwmarkClient::FwmarkClient() : mChannel(-1) {
-}
-
-FwmarkClient::~FwmarkClient() {
-    if (mChannel >= 0) {
-        close(mChannel);
-    }
-}
-
-int FwmarkClient::send(FwmarkCommand* data, int fd) {
-    mChannel = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-    if (mChannel == -1) {
+int connectToServer() {
+    int channel = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (channel == -1) {
         return -errno;
     }
-
-    if (TEMP_FAILURE_RETRY(connect(mChannel, reinterpret_cast<const sockaddr*>(&FWMARK_SERVER_PATH),
-                                   sizeof(FWMARK_SERVER_PATH))) == -1) {
-        // If we are unable to connect to the fwmark server, assume there's no error. This protects
-        // against future changes if the fwmark server goes away.
-        return 0;
+    if (TEMP_FAILURE_RETRY(connect(channel, reinterpret_cast<const sockaddr*>(&gServerAddress),
+                                   sizeof(gServerAddress))) == -1) {
+        int error = -errno;
+        close(channel);
+        return error;
     }
+    return channel;
+}
 
+// Sends |len| bytes at |data| on |channel|. Unless |command| doesn't take a socket, also sends
+// |fd| as ancillary data.
+int sendCommand(int channel, const FwmarkCommand& command, void* data, size_t len, int fd) {
     iovec iov;
     iov.iov_base = data;
-    iov.iov_len = sizeof(*data);
+    iov.iov_len = len;
 
     msghdr message;
     memset(&message, 0, sizeof(message));
@@ -71,7 +76,8 @@ int FwmarkClient::send(FwmarkCommand* data, int fd) {
         char cmsg[CMSG_SPACE(sizeof(fd))];
     } cmsgu;
 
-    if (data->cmdId != FwmarkCommand::QUERY_USER_ACCESS) {
+    if (command.cmdId != FwmarkCommand::QUERY_USER_ACCESS &&
+        command.cmdId != FwmarkCommand::GET_GENERATION) {
         memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
         message.msg_control = cmsgu.cmsg;
         message.msg_controllen = sizeof(cmsgu.cmsg);
@@ -83,9 +89,368 @@ int FwmarkClient::send(FwmarkCommand* data, int fd) {
         memcpy(CMSG_DATA(cmsgh), &fd, sizeof(fd));
     }
 
-    if (TEMP_FAILURE_RETRY(sendmsg(mChannel, &message, 0)) == -1) {
+    if (TEMP_FAILURE_RETRY(sendmsg(channel, &message, MSG_NOSIGNAL)) == -1) {
         return -errno;
     }
+    return 0;
+}
+
+// Reads a FwmarkResponse from |channel| into |response|, along with the file descriptor that came
+// with it, if any, into |fd|. Returns the number of bytes read, or -1 on failure.
+ssize_t receiveResponse(int channel, FwmarkResponse* response, int* fd) {
+    iovec iov;
+    iov.iov_base = response;
+    iov.iov_len = sizeof(*response);
+
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    union {
+        cmsghdr cmh;
+        char cmsg[CMSG_SPACE(sizeof(*fd))];
+    } cmsgu;
+
+    memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
+    message.msg_control = cmsgu.cmsg;
+    message.msg_controllen = sizeof(cmsgu.cmsg);
+
+    *fd = -1;
+    ssize_t length = TEMP_FAILURE_RETRY(recvmsg(channel, &message,
+                                                MSG_WAITALL | MSG_CMSG_CLOEXEC));
+    cmsghdr* const cmsgh = CMSG_FIRSTHDR(&message);
+    if (cmsgh && cmsgh->cmsg_level == SOL_SOCKET && cmsgh->cmsg_type == SCM_RIGHTS &&
+        cmsgh->cmsg_len == CMSG_LEN(sizeof(*fd))) {
+        memcpy(fd, CMSG_DATA(cmsgh), sizeof(*fd));
+    }
+    return length;
+}
+
+// A persistent connection to the fwmark server, shared by all threads in the process. This saves
+// a socket(), connect() and close(), and a round trip through the server's accept(), on every
+// command. Threads send their FwmarkRequests on it as they come, and whichever thread is waiting
+// reads the responses and hands them to the threads they belong to.
+//
+// The server identifies the client by the credentials the connection was opened with. So, a child
+// process must not use the connection it inherited across fork(), and a process that changes its
+// effective uid must open a new connection.
+//
+// Nothing stops the application from closing the connection's file descriptor behind our back, and
+// the number may then be reused for a file of its own. So, the descriptor is checked against the
+// socket that was connected before every command, and forgotten without being closed or written to
+// if it has changed.
+//
+// The server only keeps so many persistent connections. Past that, it refuses new ones, and the
+// commands go on connections of their own for a while before a persistent one is tried again.
+class PersistentChannel {
+public:
+    static PersistentChannel* get();
+
+    // Sends |command| and waits for the response, which it stores in |*error|. If the server sent
+    // a file descriptor with the response, stores it in |*responseFd|, or closes it if that is
+    // null. Returns false if the command could not be sent or the connection failed before the
+    // response arrived. The command may or may not have been applied in that case, but all of
+    // them are idempotent, so the caller can simply send it again on a connection of its own.
+    bool send(const FwmarkCommand& command, int fd, int* error, int* responseFd);
+
+    // Closes the connection, if any, and forgets that the server refused one. The next command
+    // opens a new one.
+    void disconnect();
+
+    // Returns the file descriptor of the connection, or -1 if there is none.
+    int getChannel();
+
+private:
+    struct Response {
+        int error;
+        int fd;
+    };
+
+    PersistentChannel();
+
+    static void lockBeforeFork();
+    static void unlockAfterForkInParent();
+    static void resetAfterForkInChild();
+
+    int connectLocked();
+    void disconnectLocked();
+    bool isOursLocked() const;
+    void forgetLocked();
+
+    static PersistentChannel* sInstance;
+
+    std::mutex mLock;
+    std::condition_variable mChanged;
+    int mChannel;
+    dev_t mDev;  // The device and inode of the socket that mChannel was connected as.
+    ino_t mIno;
+    uid_t mEuid;  // The effective uid that mChannel was opened with.
+    time_t mRefusedUntil;  // Don't connect until then, because the server refused us.
+    unsigned mGeneration;  // Incremented whenever mChannel is closed.
+    uint32_t mNextSeq;
+    uint32_t mAck;  // The seq of the last response read from the server.
+    bool mReading;  // A thread is reading from mChannel without holding mLock.
+    std::map<uint32_t, Response> mResponses;  // Read for threads that haven't seen them yet.
+};
+
+PersistentChannel* PersistentChannel::sInstance = nullptr;
+
+PersistentChannel* PersistentChannel::get() {
+    // Never deleted, since other threads may still be using it while the process exits.
+    static PersistentChannel* instance = new PersistentChannel();
+    return instance;
+}
+
+PersistentChannel::PersistentChannel() :
+        mChannel(-1), mDev(0), mIno(0), mEuid(0), mRefusedUntil(0), mGeneration(0), mNextSeq(1),
+        mAck(0), mReading(false) {
+    sInstance = this;
+    pthread_atfork(lockBeforeFork, unlockAfterForkInParent, resetAfterForkInChild);
+}
+
+void PersistentChannel::lockBeforeFork() {
+    sInstance->mLock.lock();
+}
+
+void PersistentChannel::unlockAfterForkInParent() {
+    sInstance->mLock.unlock();
+}
+
+void PersistentChannel::resetAfterForkInChild() {
+    // The child has only the thread that called fork(), so nobody else is reading from or waiting
+    // on the inherited connection. Closing the child's copy leaves the parent's connection alone.
+    PersistentChannel* channel = sInstance;
+    channel->mReading = false;
+    channel->disconnectLocked();
+    channel->mLock.unlock();
+}
+
+int PersistentChannel::connectLocked() {
+    if (mChannel >= 0 && !isOursLocked()) {
+        forgetLocked();
+    }
+    uid_t euid = geteuid();
+    if (mChannel >= 0 && mEuid != euid) {
+        disconnectLocked();
+    }
+    if (mChannel >= 0) {
+        // If the uid changed, a reader is still blocked on the old connection, and will close it.
+        return mEuid == euid ? 0 : -EAGAIN;
+    }
+    if (mRefusedUntil && monotonicSeconds() < mRefusedUntil) {
+        return -EUSERS;
+    }
+    mRefusedUntil = 0;
+    int channel = connectToServer();
+    if (channel < 0) {
+        return channel;
+    }
+    struct stat st;
+    if (fstat(channel, &st) == -1) {
+        int error = -errno;
+        close(channel);
+        return error;
+    }
+    mChannel = channel;
+    mDev = st.st_dev;
+    mIno = st.st_ino;
+    mEuid = euid;
+    mNextSeq = 1;
+    mAck = 0;
+    return 0;
+}
+
+void PersistentChannel::disconnectLocked() {
+    if (mChannel < 0) {
+        return;
+    }
+    if (!isOursLocked()) {
+        forgetLocked();
+        return;
+    }
+    if (mReading) {
+        // Another thread is blocked reading. Wake it up, and let it close the socket once it's
+        // done with it, so that the file descriptor can't be reused under it.
+        shutdown(mChannel, SHUT_RDWR);
+        return;
+    }
+    close(mChannel);
+    forgetLocked();
+}
+
+bool PersistentChannel::isOursLocked() const {
+    struct stat st;
+    return fstat(mChannel, &st) == 0 && st.st_dev == mDev && st.st_ino == mIno;
+}
+
+// Drops mChannel without closing it, and fails the commands that are waiting on it. A thread that
+// is still reading from it finds out when it returns, by the change in mGeneration.
+void PersistentChannel::forgetLocked() {
+    mChannel = -1;
+    mReading = false;
+    mGeneration++;
+    for (const auto& response : mResponses) {
+        if (response.second.fd != -1) {
+            close(response.second.fd);
+        }
+    }
+    mResponses.clear();
+    mChanged.notify_all();
+}
+
+bool PersistentChannel::send(const FwmarkCommand& command, int fd, int* error,
+                             int* responseFd) {
+    std::unique_lock<std::mutex> lock(mLock);
+
+    if (connectLocked()) {
+        return false;
+    }
+    const unsigned generation = mGeneration;
+
+    // Never have more requests outstanding than the server allows.
+    while (mNextSeq - mAck > FwmarkRequest::MAX_IN_FLIGHT) {
+        mChanged.wait(lock);
+        if (mGeneration != generation) {
+            return false;
+        }
+    }
+
+    FwmarkRequest request;
+    memset(&request, 0, sizeof(request));
+    request.version = FwmarkRequest::VERSION;
+    request.seq = mNextSeq++;
+    request.ack = mAck;
+    request.command = command;
+    if (sendCommand(mChannel, command, &request, sizeof(request), fd)) {
+        disconnectLocked();
+        return false;
+    }
+
+    while (mGeneration == generation) {
+        auto response = mResponses.find(request.seq);
+        if (response != mResponses.end()) {
+            *error = response->second.error;
+            if (responseFd) {
+                *responseFd = response->second.fd;
+            } else if (response->second.fd != -1) {
+                close(response->second.fd);
+            }
+            mResponses.erase(response);
+            return true;
+        }
+        if (mReading) {
+            mChanged.wait(lock);
+            continue;
+        }
+
+        // Nobody is reading, so read the next response, whoever it's for.
+        int channel = mChannel;
+        mReading = true;
+        lock.unlock();
+        FwmarkResponse fwmarkResponse;
+        int receivedFd;
+        ssize_t length = receiveResponse(channel, &fwmarkResponse, &receivedFd);
+        lock.lock();
+        if (mGeneration != generation) {
+            // The connection was forgotten while we were reading from it.
+            if (receivedFd != -1) {
+                close(receivedFd);
+            }
+            return false;
+        }
+        mReading = false;
+
+        if (length == sizeof(fwmarkResponse) && fwmarkResponse.seq == 0) {
+            // The server has too many persistent connections, and didn't apply the command.
+            if (receivedFd != -1) {
+                close(receivedFd);
+            }
+            mRefusedUntil = monotonicSeconds() + kRefusedRetrySec;
+            disconnectLocked();
+            return false;
+        }
+        if (length != sizeof(fwmarkResponse) || fwmarkResponse.seq != mAck + 1) {
+            // The server closed the connection, or we were asked to close it.
+            if (receivedFd != -1) {
+                close(receivedFd);
+            }
+            disconnectLocked();
+            return false;
+        }
+        mAck = fwmarkResponse.seq;
+        mResponses[fwmarkResponse.seq] = Response{fwmarkResponse.error, receivedFd};
+        mChanged.notify_all();
+    }
+    return false;
+}
+
+void PersistentChannel::disconnect() {
+    std::lock_guard<std::mutex> lock(mLock);
+    mRefusedUntil = 0;
+    disconnectLocked();
+}
+
+int PersistentChannel::getChannel() {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mChannel;
+}
+
+}  // namespace
+
+bool FwmarkClient::shouldSetFwmark(int family) {
+    return (family == AF_INET || family == AF_INET6) && !getenv("ANDROID_NO_USE_FWMARK_CLIENT");
+}
+
+FwmarkClient::FwmarkClient() : mChannel(-1) {
+}
+
+FwmarkClient::~FwmarkClient() {
+    if (mChannel >= 0) {
+        close(mChannel);
+    }
+}
+
+int FwmarkClient::send(FwmarkCommand* data, int fd) {
+    return send(data, fd, nullptr);
+}
+
+int FwmarkClient::send(FwmarkCommand* data, int fd, int* responseFd) {
+    if (responseFd) {
+        *responseFd = -1;
+    }
+    int error;
+    if (PersistentChannel::get()->send(*data, fd, &error, responseFd)) {
+        return error;
+    }
+    return sendOnce(data, fd);
+}
+
+void FwmarkClient::setServerAddress(const sockaddr_un& address) {
+    PersistentChannel::get()->disconnect();
+    gServerAddress = address;
+}
+
+int FwmarkClient::getPersistentChannel() {
+    return PersistentChannel::get()->getChannel();
+}
+
+int FwmarkClient::sendOnce(FwmarkCommand* data, int fd) {
+    mChannel = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (mChannel == -1) {
+        return -errno;
+    }
+
+    if (TEMP_FAILURE_RETRY(connect(mChannel, reinterpret_cast<const sockaddr*>(&gServerAddress),
+                                   sizeof(gServerAddress))) == -1) {
+        // If we are unable to connect to the fwmark server, assume there's no error. This protects
+        // against future changes if the fwmark server goes away.
+        return 0;
+    }
+
+    if (int error = sendCommand(mChannel, *data, data, sizeof(*data), fd)) {
+        return error;
+    }
 
     int error = 0;
 
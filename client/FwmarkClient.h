@@ -18,6 +18,7 @@
 #define NETD_CLIENT_FWMARK_CLIENT_H
 
 #include <sys/socket.h>
+#include <sys/un.h>
 
 struct FwmarkCommand;
 
@@ -32,9 +33,29 @@ public:
 
     // Sends |data| to the fwmark server, along with |fd| as ancillary data using cmsg(3).
     // Returns 0 on success or a negative errno value on failure.
+    //
+    // Commands normally go over a connection that is shared by all threads in the process and kept
+    // open between commands. If that doesn't work, this falls back to a connection of its own.
     int send(FwmarkCommand* data, int fd);
 
+    // Like send(), but also returns the file descriptor, if any, that the server sent with its
+    // response in |*responseFd|, or -1 if there was none. The caller must close it.
+    int send(FwmarkCommand* data, int fd, int* responseFd);
+
+protected:
+    // For testing.
+    friend class FwmarkClientTest;
+
+    // Sends commands to the server at |address| instead of fwmarkd. Closes the persistent
+    // connection, if any.
+    static void setServerAddress(const sockaddr_un& address);
+
+    // Returns the file descriptor of the persistent connection, or -1 if there is none.
+    static int getPersistentChannel();
+
 private:
+    int sendOnce(FwmarkCommand* data, int fd);
+
     int mChannel;
 };
 
@@ -0,0 +1,300 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * FwmarkClientTest.cpp - unit tests for the persistent connection in FwmarkClient.cpp
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "FwmarkClient.h"
+#include "FwmarkCommand.h"
+
+namespace {
+
+// A command as seen by the fake server.
+struct Received {
+    int connection;  // Connections are numbered in the order they were accepted.
+    pid_t pid;  // The pid of the process that opened the connection.
+    uint32_t seq;  // 0 for a bare FwmarkCommand.
+    uint32_t ack;
+    unsigned netId;
+};
+
+}  // namespace
+
+// Plays fwmarkd on an abstract unix socket. Requests get a FwmarkResponse whose error is minus the
+// command's netId, and bare FwmarkCommands get minus the netId as a bare int, as fwmarkd would.
+class FwmarkClientTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        // The leading NUL puts it in the abstract namespace.
+        snprintf(address.sun_path + 1, sizeof(address.sun_path) - 1, "fwmarkd_test_%d", getpid());
+        mListener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ASSERT_NE(-1, mListener);
+        ASSERT_EQ(0, bind(mListener, reinterpret_cast<const sockaddr*>(&address), sizeof(address)))
+                << strerror(errno);
+        ASSERT_EQ(0, listen(mListener, 8));
+        ASSERT_EQ(0, pipe2(mStopPipe, O_CLOEXEC));
+        mServer = std::thread([this] { serve(); });
+        FwmarkClient::setServerAddress(address);
+    }
+
+    void TearDown() override {
+        FwmarkClient::setServerAddress({AF_UNIX, "/dev/socket/fwmarkd"});
+        if (mServer.joinable()) {
+            close(mStopPipe[1]);
+            mServer.join();
+            close(mStopPipe[0]);
+        }
+        close(mListener);
+    }
+
+    static int send(unsigned netId) {
+        FwmarkCommand command = {FwmarkCommand::QUERY_USER_ACCESS, netId, 0};
+        return FwmarkClient().send(&command, -1);
+    }
+
+    static int getPersistentChannel() {
+        return FwmarkClient::getPersistentChannel();
+    }
+
+    std::vector<Received> received() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mReceived;
+    }
+
+    // Makes the server close persistent connections instead of answering them.
+    void dropPersistentConnections() {
+        std::lock_guard<std::mutex> lock(mLock);
+        mDropPersistent = true;
+    }
+
+    // Makes the server refuse persistent connections, as fwmarkd does when it has too many.
+    void refusePersistentConnections() {
+        std::lock_guard<std::mutex> lock(mLock);
+        mRefusePersistent = true;
+    }
+
+private:
+    struct Connection {
+        int fd;
+        int number;
+        pid_t pid;
+    };
+
+    void serve() {
+        std::vector<Connection> connections;
+        int accepted = 0;
+        while (true) {
+            std::vector<pollfd> fds = {{mStopPipe[0], POLLIN, 0}, {mListener, POLLIN, 0}};
+            for (const Connection& connection : connections) {
+                fds.push_back({connection.fd, POLLIN, 0});
+            }
+            if (poll(fds.data(), fds.size(), -1) == -1 || fds[0].revents) {
+                break;
+            }
+            if (fds[1].revents & POLLIN) {
+                int fd = accept4(mListener, nullptr, nullptr, SOCK_CLOEXEC);
+                ucred cred = {};
+                socklen_t len = sizeof(cred);
+                getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len);
+                connections.push_back({fd, accepted++, cred.pid});
+            }
+            for (size_t i = 2; i < fds.size(); ++i) {
+                if (fds[i].revents && !handle(connections[i - 2])) {
+                    close(connections[i - 2].fd);
+                    connections[i - 2].fd = -1;
+                }
+            }
+            for (auto it = connections.begin(); it != connections.end();) {
+                it = (it->fd == -1) ? connections.erase(it) : it + 1;
+            }
+        }
+        for (const Connection& connection : connections) {
+            close(connection.fd);
+        }
+    }
+
+    // Reads and answers one command. Returns false if the connection should be closed.
+    bool handle(const Connection& connection) {
+        FwmarkRequest request;
+        ssize_t length = recv(connection.fd, &request, sizeof(request), 0);
+        if (length <= 0) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mLock);
+        if (length == sizeof(FwmarkCommand)) {
+            FwmarkCommand command;
+            memcpy(&command, &request, sizeof(command));
+            mReceived.push_back({connection.number, connection.pid, 0, 0, command.netId});
+            int error = -static_cast<int>(command.netId);
+            ::send(connection.fd, &error, sizeof(error), MSG_NOSIGNAL);
+            return false;
+        }
+        EXPECT_EQ(ssize_t(sizeof(request)), length);
+        EXPECT_EQ(uint32_t(FwmarkRequest::VERSION), request.version);
+        mReceived.push_back({connection.number, connection.pid, request.seq, request.ack,
+                             request.command.netId});
+        if (mDropPersistent) {
+            return false;
+        }
+        if (mRefusePersistent) {
+            FwmarkResponse response = {0, -EUSERS};
+            ::send(connection.fd, &response, sizeof(response), MSG_NOSIGNAL);
+            return false;
+        }
+        FwmarkResponse response = {request.seq, -static_cast<int>(request.command.netId)};
+        return ::send(connection.fd, &response, sizeof(response), MSG_NOSIGNAL) ==
+                sizeof(response);
+    }
+
+    int mListener = -1;
+    int mStopPipe[2] = {-1, -1};
+    std::thread mServer;
+    std::mutex mLock;
+    std::vector<Received> mReceived;
+    bool mDropPersistent = false;
+    bool mRefusePersistent = false;
+};
+
+TEST_F(FwmarkClientTest, TestCommandsShareOneConnection) {
+    EXPECT_EQ(-100, send(100));
+    EXPECT_EQ(-101, send(101));
+    EXPECT_EQ(-102, send(102));
+
+    std::vector<Received> commands = received();
+    ASSERT_EQ(3U, commands.size());
+    for (uint32_t i = 0; i < 3; ++i) {
+        EXPECT_EQ(0, commands[i].connection);
+        EXPECT_EQ(getpid(), commands[i].pid);
+        EXPECT_EQ(i + 1, commands[i].seq);
+        EXPECT_EQ(i, commands[i].ack);
+    }
+}
+
+TEST_F(FwmarkClientTest, TestFallsBackToOneShotWhenServerDisconnects) {
+    EXPECT_EQ(-100, send(100));
+    dropPersistentConnections();
+
+    // The server drops the request, so the command is sent again as a bare FwmarkCommand on a
+    // connection of its own, and its error still comes back.
+    EXPECT_EQ(-101, send(101));
+    EXPECT_EQ(-102, send(102));
+
+    std::vector<Received> commands = received();
+    ASSERT_EQ(5U, commands.size());
+    EXPECT_EQ(0, commands[1].connection);
+    EXPECT_EQ(2U, commands[1].seq);
+    EXPECT_EQ(1, commands[2].connection);
+    EXPECT_EQ(0U, commands[2].seq);
+    EXPECT_EQ(101U, commands[2].netId);
+    // The next command tries a new persistent connection, which starts over at seq 1.
+    EXPECT_EQ(2, commands[3].connection);
+    EXPECT_EQ(1U, commands[3].seq);
+    EXPECT_EQ(3, commands[4].connection);
+    EXPECT_EQ(0U, commands[4].seq);
+    EXPECT_EQ(102U, commands[4].netId);
+}
+
+TEST_F(FwmarkClientTest, TestStopsTryingWhenServerRefuses) {
+    refusePersistentConnections();
+
+    // The refused command is sent again on a connection of its own, and so are the next ones,
+    // without asking for a persistent connection each time.
+    EXPECT_EQ(-100, send(100));
+    EXPECT_EQ(-101, send(101));
+    EXPECT_EQ(-1, getPersistentChannel());
+
+    std::vector<Received> commands = received();
+    ASSERT_EQ(3U, commands.size());
+    EXPECT_EQ(1U, commands[0].seq);
+    EXPECT_EQ(100U, commands[0].netId);
+    EXPECT_EQ(0U, commands[1].seq);
+    EXPECT_EQ(100U, commands[1].netId);
+    EXPECT_EQ(0U, commands[2].seq);
+    EXPECT_EQ(101U, commands[2].netId);
+}
+
+TEST_F(FwmarkClientTest, TestChildReconnectsAfterFork) {
+    EXPECT_EQ(-100, send(100));
+
+    pid_t pid = fork();
+    ASSERT_NE(-1, pid);
+    if (pid == 0) {
+        // The inherited connection belongs to the parent. Only async-signal-safe calls and the
+        // client itself here, since the server thread didn't come along.
+        _exit(getPersistentChannel() == -1 && send(200) == -200 ? 0 : 1);
+    }
+    int status;
+    ASSERT_EQ(pid, TEMP_FAILURE_RETRY(waitpid(pid, &status, 0)));
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(0, WEXITSTATUS(status));
+
+    // The parent's connection is unaffected by the child closing its copy.
+    EXPECT_EQ(-101, send(101));
+
+    std::vector<Received> commands = received();
+    ASSERT_EQ(3U, commands.size());
+    EXPECT_EQ(1, commands[1].connection);
+    EXPECT_EQ(pid, commands[1].pid);
+    EXPECT_EQ(1U, commands[1].seq);
+    EXPECT_EQ(0, commands[2].connection);
+    EXPECT_EQ(getpid(), commands[2].pid);
+    EXPECT_EQ(2U, commands[2].seq);
+}
+
+TEST_F(FwmarkClientTest, TestReusedFileDescriptorIsNotWritten) {
+    EXPECT_EQ(-100, send(100));
+    const int channel = getPersistentChannel();
+    ASSERT_NE(-1, channel);
+
+    // The application closes the connection and the number is reused for one of its own files.
+    int pipeFds[2];
+    ASSERT_EQ(0, pipe2(pipeFds, O_CLOEXEC | O_NONBLOCK));
+    ASSERT_EQ(channel, dup3(pipeFds[1], channel, O_CLOEXEC));
+
+    EXPECT_EQ(-101, send(101));
+    char buf[1];
+    EXPECT_EQ(-1, read(pipeFds[0], buf, sizeof(buf)));
+    EXPECT_EQ(EAGAIN, errno);
+    // The pipe is still open: the client forgot the descriptor rather than closing it.
+    EXPECT_EQ(1, write(channel, "x", 1));
+    EXPECT_NE(channel, getPersistentChannel());
+
+    std::vector<Received> commands = received();
+    ASSERT_EQ(2U, commands.size());
+    EXPECT_EQ(1, commands[1].connection);
+    EXPECT_EQ(1U, commands[1].seq);
+
+    close(channel);
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+}
@@ -17,11 +17,14 @@
 #include "NetdClient.h"
 
 #include <errno.h>
+#include <sys/capability.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include <atomic>
 
+#include "ConnectMarkCache.h"
 #include "Fwmark.h"
 #include "FwmarkClient.h"
 #include "FwmarkCommand.h"
@@ -43,6 +46,113 @@ Accept4FunctionType libcAccept4 = 0;
 ConnectFunctionType libcConnect = 0;
 SocketFunctionType libcSocket = 0;
 
+// Processes that may set SO_MARK themselves cache the server's answer to ON_CONNECT, and use it to
+// mark sockets that have neither the explicit nor the protect bit set. For those sockets, the
+// answer depends only on the uid, and the server increments a generation number that it shares
+// with all clients whenever the answer may have changed. All other processes and sockets go to
+// the server as usual.
+//
+// Whether a process may set SO_MARK is checked once, by looking for CAP_NET_ADMIN, so that other
+// processes never ask for the generation. If the process later loses the capability, the first
+// setsockopt() that fails turns the cache off.
+enum {
+    MARK_PRIVILEGE_UNKNOWN,
+    MARK_PRIVILEGE_GRANTED,
+    MARK_PRIVILEGE_DENIED,
+};
+
+std::atomic_int markPrivilege(MARK_PRIVILEGE_UNKNOWN);
+std::atomic_bool generationRequested(false);
+std::atomic<const FwmarkGeneration*> generationPage(nullptr);
+ConnectMarkCache connectMarkCache;
+
+bool hasMarkPrivilege() {
+    int privilege = markPrivilege;
+    if (privilege == MARK_PRIVILEGE_UNKNOWN) {
+        __user_cap_header_struct header = {_LINUX_CAPABILITY_VERSION_3, 0};
+        __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3] = {};
+        const bool granted = capget(&header, data) == 0 &&
+                (data[CAP_TO_INDEX(CAP_NET_ADMIN)].effective & CAP_TO_MASK(CAP_NET_ADMIN));
+        privilege = granted ? MARK_PRIVILEGE_GRANTED : MARK_PRIVILEGE_DENIED;
+        // Don't overwrite a denial from a failed setsockopt() in another thread.
+        int expected = MARK_PRIVILEGE_UNKNOWN;
+        if (!markPrivilege.compare_exchange_strong(expected, privilege)) {
+            privilege = expected;
+        }
+    }
+    return privilege == MARK_PRIVILEGE_GRANTED;
+}
+
+// Returns the current generation, or zero if it's not available. The server is asked for the
+// generation page only once per process; it stays mapped across fork() and netd restarts.
+uint32_t getGeneration() {
+    const FwmarkGeneration* page = generationPage;
+    if (!page && !generationRequested.exchange(true)) {
+        FwmarkCommand command = {FwmarkCommand::GET_GENERATION, 0, 0};
+        int fd;
+        if (FwmarkClient().send(&command, -1, &fd) == 0 && fd != -1) {
+            void* mapped = mmap(NULL, sizeof(FwmarkGeneration), PROT_READ, MAP_SHARED, fd, 0);
+            if (mapped != MAP_FAILED) {
+                page = static_cast<const FwmarkGeneration*>(mapped);
+                generationPage = page;
+            }
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    return page ? page->generation.load() : 0;
+}
+
+// Marks |sockfd| for connect() from the cached answer. Returns false if the caller must ask the
+// server instead.
+bool markForConnectFromCache(int sockfd) {
+    const FwmarkGeneration* page = generationPage;
+    if (!page || !hasMarkPrivilege()) {
+        return false;
+    }
+    uint32_t mark;
+    if (!connectMarkCache.get(page->generation.load(), geteuid(), &mark)) {
+        return false;
+    }
+
+    Fwmark fwmark;
+    socklen_t fwmarkLen = sizeof(fwmark.intValue);
+    if (getsockopt(sockfd, SOL_SOCKET, SO_MARK, &fwmark.intValue, &fwmarkLen) == -1 ||
+        fwmark.explicitlySelected || fwmark.protectedFromVpn) {
+        return false;
+    }
+    Fwmark answer;
+    answer.intValue = mark;
+    fwmark.netId = answer.netId;
+    fwmark.permission = answer.permission;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_MARK, &fwmark.intValue, sizeof(fwmark.intValue)) == -1) {
+        if (errno == EPERM) {
+            markPrivilege = MARK_PRIVILEGE_DENIED;
+        }
+        return false;
+    }
+    return true;
+}
+
+// Caches the mark that the server set on |sockfd| for connect(), if it is an answer that can be
+// reused. |generation| must have been read before the server was asked, so that if the state
+// changed in the meantime, the answer is already stale when it's cached.
+void cacheMarkForConnect(int sockfd, uint32_t generation) {
+    if (generation == 0) {
+        return;
+    }
+    Fwmark fwmark;
+    socklen_t fwmarkLen = sizeof(fwmark.intValue);
+    // ON_CONNECT never changes these bits. If they're clear now, they were clear before, and the
+    // server picked the NetId and permission for the uid alone.
+    if (getsockopt(sockfd, SOL_SOCKET, SO_MARK, &fwmark.intValue, &fwmarkLen) == -1 ||
+        fwmark.explicitlySelected || fwmark.protectedFromVpn) {
+        return;
+    }
+    connectMarkCache.put(generation, geteuid(), fwmark.intValue);
+}
+
 int closeFdAndSetErrno(int fd, int error) {
     close(fd);
     errno = -error;
@@ -73,12 +183,18 @@ int netdClientAccept4(int sockfd, sockaddr* addr, socklen_t* addrlen, int flags)
 }
 
 int netdClientConnect(int sockfd, const sockaddr* addr, socklen_t addrlen) {
-    if (sockfd >= 0 && addr && FwmarkClient::shouldSetFwmark(addr->sa_family)) {
+    if (sockfd >= 0 && addr && FwmarkClient::shouldSetFwmark(addr->sa_family) &&
+        !markForConnectFromCache(sockfd)) {
+        const bool cacheable = hasMarkPrivilege();
+        const uint32_t generation = cacheable ? getGeneration() : 0;
         FwmarkCommand command = {FwmarkCommand::ON_CONNECT, 0, 0};
         if (int error = FwmarkClient().send(&command, sockfd)) {
             errno = -error;
             return -1;
         }
+        if (cacheable) {
+            cacheMarkForConnect(sockfd, generation);
+        }
     }
     return libcConnect(sockfd, addr, addrlen);
 }
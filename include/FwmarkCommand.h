@@ -17,8 +17,11 @@
 #ifndef NETD_INCLUDE_FWMARK_COMMAND_H
 #define NETD_INCLUDE_FWMARK_COMMAND_H
 
+#include <stdint.h>
 #include <sys/types.h>
 
+#include <atomic>
+
 // Commands sent from clients to the fwmark server to mark sockets (i.e., set their SO_MARK).
 struct FwmarkCommand {
     enum {
@@ -28,10 +31,50 @@ struct FwmarkCommand {
         PROTECT_FROM_VPN,
         SELECT_FOR_USER,
         QUERY_USER_ACCESS,
+        GET_GENERATION,
     } cmdId;
     unsigned netId;  // used only in the SELECT_NETWORK command; ignored otherwise.
     uid_t uid;  // used only in the SELECT_FOR_USER and QUERY_USER_ACCESS commands;
                 // ignored otherwise.
 };
 
+// A FwmarkCommand sent on a persistent connection. A client that sends a bare FwmarkCommand gets
+// a bare int error in response, after which the server closes the connection. A client that sends
+// a FwmarkRequest instead gets a FwmarkResponse and may keep sending requests on the same
+// connection.
+//
+// Requests on a connection are numbered 1, 2, 3, ... in |seq|, and responses are sent in the same
+// order. In |ack|, the client tells the server the |seq| of the last response it has read. A client
+// that has more than MAX_IN_FLIGHT responses outstanding, or that does not read its responses, is
+// disconnected.
+//
+// The server keeps a limited number of persistent connections, and closes those that stay idle. A
+// request that would open one too many is not applied. Instead, it gets a FwmarkResponse whose
+// |seq| is zero, and the connection is closed. The client should then send its commands as bare
+// FwmarkCommands for a while.
+struct FwmarkRequest {
+    enum {
+        VERSION = 1,
+        MAX_IN_FLIGHT = 16,
+    };
+
+    uint32_t version;  // VERSION.
+    uint32_t seq;
+    uint32_t ack;
+    FwmarkCommand command;
+};
+
+struct FwmarkResponse {
+    uint32_t seq;  // The |seq| of the request that this responds to, or 0 if it was refused.
+    int32_t error;  // 0 on success or a negative errno value on failure.
+};
+
+// The contents of the file that the server sends in response to GET_GENERATION, which is only
+// supported on persistent connections. The server increments |generation| whenever it changes any
+// state that the answer to ON_CONNECT depends on, so a client that caches that answer can tell
+// when it has become stale. The generation is never zero.
+struct FwmarkGeneration {
+    std::atomic<uint32_t> generation;
+};
+
 #endif  // NETD_INCLUDE_FWMARK_COMMAND_H
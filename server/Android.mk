@@ -30,6 +30,8 @@ LOCAL_AIDL_INCLUDES := $(LOCAL_PATH)/binder
 LOCAL_C_INCLUDES := $(LOCAL_PATH)/binder
 LOCAL_SRC_FILES := \
         binder/android/net/INetd.aidl \
+        binder/android/net/ResolverStats.cpp \
+        binder/android/net/TetherStatsParcel.cpp \
         binder/android/net/UidRange.cpp
 
 include $(BUILD_SHARED_LIBRARY)
@@ -75,13 +77,23 @@ LOCAL_SRC_FILES := \
         ClatdController.cpp \
         CommandListener.cpp \
         Controllers.cpp \
+        DnsCache.cpp \
+        DnsEventReporter.cpp \
         DnsProxyListener.cpp \
+        DnsQueryEngine.cpp \
+        DnsResponseBuffer.cpp \
+        DnsServerStats.cpp \
+        DnsSingleFlight.cpp \
+        DnsWorkerPool.cpp \
         DummyNetwork.cpp \
         DumpWriter.cpp \
         FirewallController.cpp \
+        FwmarkSequenceChecker.cpp \
         FwmarkServer.cpp \
         IdletimerController.cpp \
         InterfaceController.cpp \
+        IptablesRestoreController.cpp \
+        IptablesTransaction.cpp \
         LocalNetwork.cpp \
         MDnsSdListener.cpp \
         NatController.cpp \
@@ -92,16 +104,22 @@ LOCAL_SRC_FILES := \
         NetlinkManager.cpp \
         Network.cpp \
         NetworkController.cpp \
+        NfacctSocket.cpp \
         PhysicalNetwork.cpp \
         PppController.cpp \
+        QuotaRegistry.cpp \
         ResolverController.cpp \
+        Rfc6724Sort.cpp \
         RouteController.cpp \
         SockDiag.cpp \
         SoftapController.cpp \
         StrictController.cpp \
         TetherController.cpp \
+        TetherCounters.cpp \
+        UidCounters.cpp \
         UidRanges.cpp \
         VirtualNetwork.cpp \
+        VpnUidIndex.cpp \
         main.cpp \
         oem_iptables_hook.cpp \
         binder/android/net/metrics/IDnsEventListener.aidl \
@@ -146,21 +164,43 @@ include $(CLEAR_VARS)
 LOCAL_MODULE := netd_unit_test
 LOCAL_CFLAGS := -Wall -Werror -Wunused-parameter
 LOCAL_C_INCLUDES := \
+        bionic/libc/dns/include \
+        system/netd/client \
         system/netd/include \
         system/netd/server \
         system/netd/server/binder \
+        system/netd/tests \
         system/core/logwrapper/include \
 
 LOCAL_SRC_FILES := \
         NetdConstants.cpp IptablesBaseTest.cpp \
+        DnsCache.cpp DnsCacheTest.cpp \
+        DnsEventReporter.cpp DnsEventReporterTest.cpp \
+        DnsQueryEngine.cpp DnsQueryEngineTest.cpp ../tests/dns_responder.cpp \
+        DnsResponseBuffer.cpp DnsResponseBufferTest.cpp \
+        DnsServerStats.cpp DnsServerStatsTest.cpp \
+        DnsSingleFlight.cpp DnsSingleFlightTest.cpp \
+        DnsWorkerPool.cpp DnsWorkerPoolTest.cpp DumpWriter.cpp \
+        IptablesRestoreController.cpp IptablesRestoreControllerTest.cpp \
+        IptablesTransaction.cpp IptablesTransactionTest.cpp \
         BandwidthController.cpp BandwidthControllerTest.cpp \
+        QuotaRegistry.cpp QuotaRegistryTest.cpp \
+        NfacctSocket.cpp UidCounters.cpp UidCountersTest.cpp \
+        TetherCounters.cpp TetherCountersTest.cpp \
         FirewallControllerTest.cpp FirewallController.cpp \
+        FwmarkSequenceChecker.cpp FwmarkSequenceCheckerTest.cpp \
+        ../client/ConnectMarkCache.cpp ../client/ConnectMarkCacheTest.cpp \
+        ../client/FwmarkClient.cpp ../client/FwmarkClientTest.cpp \
         NatControllerTest.cpp NatController.cpp \
+        RcuSnapshotTest.cpp \
+        Rfc6724Sort.cpp Rfc6724SortTest.cpp \
+        RouteController.cpp RouteControllerTest.cpp DummyNetwork.cpp Network.cpp \
         SockDiagTest.cpp SockDiag.cpp \
         StrictController.cpp StrictControllerTest.cpp \
         UidRanges.cpp \
+        VirtualNetwork.cpp VpnUidIndex.cpp VpnUidIndexTest.cpp \
 
 LOCAL_MODULE_TAGS := tests
-LOCAL_SHARED_LIBRARIES := liblog libbase libcutils liblogwrap libsysutils
+LOCAL_SHARED_LIBRARIES := liblog libbase libcutils liblogwrap libnetutils libsysutils libutils
 include $(BUILD_NATIVE_TEST)
 
@@ -22,6 +22,7 @@
  * If they ever were to allow it, then netd/ would need some tweaking.
  */
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -49,12 +50,14 @@
 #define LOG_TAG "BandwidthController"
 #include <cutils/log.h>
 #include <cutils/properties.h>
-#include <logwrap/logwrap.h>
 
 #include "NetdConstants.h"
 #include "BandwidthController.h"
+#include "IptablesTransaction.h"
 #include "NatController.h"  /* For LOCAL_TETHER_COUNTERS_CHAIN */
+#include "QuotaRegistry.h"
 #include "ResponseCode.h"
+#include "UidCounters.h"
 
 /* Alphabetical */
 #define ALERT_IPT_TEMPLATE "%s %s -m quota2 ! --quota %" PRId64" --name %s"
@@ -64,15 +67,13 @@ const char* BandwidthController::LOCAL_OUTPUT = "bw_OUTPUT";
 const char* BandwidthController::LOCAL_RAW_PREROUTING = "bw_raw_PREROUTING";
 const char* BandwidthController::LOCAL_MANGLE_POSTROUTING = "bw_mangle_POSTROUTING";
 
-auto BandwidthController::execFunction = android_fork_execvp;
 auto BandwidthController::popenFunction = popen;
 auto BandwidthController::iptablesRestoreFunction = execIptablesRestore;
+auto BandwidthController::iptablesRestoreSilentlyFunction = execIptablesRestoreSilently;
 
 namespace {
 
 const char ALERT_GLOBAL_NAME[] = "globalAlert";
-const int  MAX_CMD_ARGS = 32;
-const int  MAX_CMD_LEN = 1024;
 const int  MAX_IFACENAME_LEN = 64;
 const int  MAX_IPT_OUTPUT_LINE_LEN = 256;
 
@@ -136,12 +137,24 @@ const int  MAX_IPT_OUTPUT_LINE_LEN = 256;
  *      iptables -R 1 bw_data_saver --jump REJECT --reject-with icmp-port-unreachable
  *    Disable data saver:
  *      iptables -R 1 bw_data_saver --jump RETURN
+ *
+ * * Per-uid counters:
+ *  - bw_INPUT and bw_OUTPUT end by jumping to bw_uid_INPUT and bw_uid_OUTPUT, which only
+ *    count into nfacct objects, so only traffic the costly chains let through is counted.
+ *    E.g. counting app_3 on iface0:
+ *      iptables -A bw_uid_INPUT -i iface0 -m owner --uid-owner app_3 \
+ *          -m nfacct --nfacct-name bwu<app_3>_iface0_r
+ *      iptables -A bw_uid_OUTPUT -o iface0 -m owner --uid-owner app_3 \
+ *          -m nfacct --nfacct-name bwu<app_3>_iface0_t
  */
 
 const std::string COMMIT_AND_CLOSE = "COMMIT\n\x04";
 const std::string DATA_SAVER_ENABLE_COMMAND = "-R bw_data_saver 1";
 const std::string HAPPY_BOX_WHITELIST_COMMAND = android::base::StringPrintf(
     "-I bw_happy_box -m owner --uid-owner %d-%d --jump RETURN", 0, MAX_SYSTEM_UID);
+/* The last rules of the boxes, which pass on what the box did not decide. */
+const std::string PENALTY_BOX_END_COMMAND = "-A bw_penalty_box --jump bw_happy_box";
+const std::string HAPPY_BOX_END_COMMAND = "-A bw_happy_box --jump bw_data_saver";
 
 static const std::vector<std::string> IPT_FLUSH_COMMANDS = {
     /*
@@ -153,6 +166,8 @@ static const std::vector<std::string> IPT_FLUSH_COMMANDS = {
     ":bw_INPUT -",
     ":bw_OUTPUT -",
     ":bw_FORWARD -",
+    ":bw_uid_INPUT -",
+    ":bw_uid_OUTPUT -",
     ":bw_happy_box -",
     ":bw_penalty_box -",
     ":bw_data_saver -",
@@ -170,9 +185,11 @@ static const std::vector<std::string> IPT_BASIC_ACCOUNTING_COMMANDS = {
     "*filter",
     "-A bw_INPUT -m owner --socket-exists", /* This is a tracking rule. */
     "-A bw_OUTPUT -m owner --socket-exists", /* This is a tracking rule. */
+    "-A bw_INPUT --jump bw_uid_INPUT",
+    "-A bw_OUTPUT --jump bw_uid_OUTPUT",
     "-A bw_costly_shared --jump bw_penalty_box",
-    "-A bw_penalty_box --jump bw_happy_box",
-    "-A bw_happy_box --jump bw_data_saver",
+    PENALTY_BOX_END_COMMAND,
+    HAPPY_BOX_END_COMMAND,
     "-A bw_data_saver -j RETURN",
     HAPPY_BOX_WHITELIST_COMMAND,
     "COMMIT",
@@ -189,36 +206,14 @@ static const std::vector<std::string> IPT_BASIC_ACCOUNTING_COMMANDS = {
 
 }  // namespace
 
-BandwidthController::BandwidthController(void) {
-}
-
-int BandwidthController::runIpxtablesCmd(const char *cmd, IptJumpOp jumpHandling,
-                                         IptFailureLog failureHandling) {
-    int res = 0;
-
-    ALOGV("runIpxtablesCmd(cmd=%s)", cmd);
-    res |= runIptablesCmd(cmd, jumpHandling, IptIpV4, failureHandling);
-    res |= runIptablesCmd(cmd, jumpHandling, IptIpV6, failureHandling);
-    return res;
-}
-
-int BandwidthController::StrncpyAndCheck(char *buffer, const char *src, size_t buffSize) {
-
-    memset(buffer, '\0', buffSize);  // strncpy() is not filling leftover with '\0'
-    strncpy(buffer, src, buffSize);
-    return buffer[buffSize - 1];
+BandwidthController::BandwidthController(TetherCounters* tetherCounters)
+        : sharedQuotaBytes(0), sharedAlertBytes(0), globalAlertBytes(0),
+          globalAlertTetherCount(0), uidCountersSupported(true), tetherCounters(tetherCounters),
+          dataSaverEnabled(false) {
 }
 
-int BandwidthController::runIptablesCmd(const char *cmd, IptJumpOp jumpHandling,
-                                        IptIpVer iptVer, IptFailureLog failureHandling) {
-    char buffer[MAX_CMD_LEN];
-    const char *argv[MAX_CMD_ARGS];
-    int argc = 0;
-    char *next = buffer;
-    char *tmp;
-    int res;
-    int status = 0;
-
+void BandwidthController::addIpxtablesCmd(IptablesTransaction* t, const std::string& cmd,
+                                          IptJumpOp jumpHandling) {
     std::string fullCmd = cmd;
 
     switch (jumpHandling) {
@@ -237,45 +232,55 @@ int BandwidthController::runIptablesCmd(const char *cmd, IptJumpOp jumpHandling,
         break;
     }
 
-    fullCmd.insert(0, " -w ");
-    fullCmd.insert(0, iptVer == IptIpV4 ? IPTABLES_PATH : IP6TABLES_PATH);
+    t->add(V4V6, "filter", fullCmd);
+}
 
-    if (StrncpyAndCheck(buffer, fullCmd.c_str(), sizeof(buffer))) {
-        ALOGE("iptables command too long");
-        return -1;
+int BandwidthController::runIpxtablesCmd(const char *cmd, IptJumpOp jumpHandling,
+                                         IptFailureLog failureHandling) {
+    ALOGV("runIpxtablesCmd(cmd=%s)", cmd);
+    IptablesTransaction t(restoreFunctionFor(failureHandling), iptablesRestoreSilentlyFunction);
+    addIpxtablesCmd(&t, cmd, jumpHandling);
+    /* Like the rule itself, deleting it from one family must not depend on the other. */
+    if (!strncmp(cmd, "-D ", 3)) {
+        return t.commitBestEffort();
     }
+    return t.commit();
+}
 
-    argc = 0;
-    while ((tmp = strsep(&next, " "))) {
-        argv[argc++] = tmp;
-        if (argc >= MAX_CMD_ARGS) {
-            ALOGE("iptables argument overflow");
-            return -1;
-        }
-    }
+IptablesTransaction::RestoreFunction BandwidthController::restoreFunctionFor(
+        IptFailureLog failureHandling) {
+    return failureHandling == IptFailHide ? iptablesRestoreSilentlyFunction
+                                          : iptablesRestoreFunction;
+}
 
-    argv[argc] = NULL;
-    res = execFunction(argc, (char **)argv, &status, false,
-            failureHandling == IptFailShow);
-    res = res || !WIFEXITED(status) || WEXITSTATUS(status);
-    if (res && failureHandling == IptFailShow) {
-      ALOGE("runIptablesCmd(): res=%d status=%d failed %s", res, status,
-            fullCmd.c_str());
-    }
-    return res;
+int BandwidthController::StrncpyAndCheck(char *buffer, const char *src, size_t buffSize) {
+
+    memset(buffer, '\0', buffSize);  // strncpy() is not filling leftover with '\0'
+    strncpy(buffer, src, buffSize);
+    return buffer[buffSize - 1];
 }
 
 void BandwidthController::flushCleanTables(bool doClean) {
     /* Flush and remove the bw_costly_<iface> tables */
     flushExistingCostlyTables(doClean);
 
+    /* The boxes are about to be empty, and bw_data_saver is only set up again with RETURN. */
+    quotas.forgetAll();
+    naughtyAppUids.clear();
+    niceAppUids.clear();
+    dataSaverEnabled = false;
+
     std::string commands = android::base::Join(IPT_FLUSH_COMMANDS, '\n');
     iptablesRestoreFunction(V4V6, commands);
+
+    /* No rule counts into the uid counters any more, so they can all go. */
+    uidCounters.clear();
 }
 
 int BandwidthController::setupIptablesHooks(void) {
     /* flush+clean is allowed to fail */
     flushCleanTables(true);
+    probeUidCounters();
     return 0;
 }
 
@@ -310,24 +315,33 @@ int BandwidthController::disableBandwidthControl(void) {
 }
 
 int BandwidthController::enableDataSaver(bool enable) {
-    return runIpxtablesCmd(DATA_SAVER_ENABLE_COMMAND.c_str(),
-                           enable ? IptJumpReject : IptJumpReturn, IptFailShow);
+    if (enable == dataSaverEnabled) {
+        return 0;
+    }
+    int res = runIpxtablesCmd(DATA_SAVER_ENABLE_COMMAND.c_str(),
+                              enable ? IptJumpReject : IptJumpReturn, IptFailShow);
+    if (!res) {
+        dataSaverEnabled = enable;
+    }
+    return res;
 }
 
 int BandwidthController::runCommands(int numCommands, const char *commands[],
                                      RunCmdErrHandling cmdErrHandling) {
-    int res = 0;
     IptFailureLog failureLogging = IptFailShow;
     if (cmdErrHandling == RunCmdFailureOk) {
         failureLogging = IptFailHide;
     }
     ALOGV("runCommands(): %d commands", numCommands);
+    IptablesTransaction t(restoreFunctionFor(failureLogging), iptablesRestoreSilentlyFunction);
     for (int cmdNum = 0; cmdNum < numCommands; cmdNum++) {
-        res = runIpxtablesCmd(commands[cmdNum], IptJumpNoAdd, failureLogging);
-        if (res && cmdErrHandling != RunCmdFailureOk)
-            return res;
+        addIpxtablesCmd(&t, commands[cmdNum], IptJumpNoAdd);
     }
-    return 0;
+    if (cmdErrHandling == RunCmdFailureOk) {
+        t.commitBestEffort();
+        return 0;
+    }
+    return t.commit();
 }
 
 std::string BandwidthController::makeIptablesSpecialAppCmd(IptOp op, int uid, const char *chain) {
@@ -374,36 +388,36 @@ int BandwidthController::removeNiceApps(int numUids, char *appUids[]) {
     return manipulateNiceApps(numUids, appUids, SpecialAppOpRemove);
 }
 
+int BandwidthController::replaceNaughtyApps(const std::vector<int32_t>& appUids) {
+    return replaceSpecialApps("bw_penalty_box", naughtyAppUids, appUids, IptJumpReject,
+                              {}, PENALTY_BOX_END_COMMAND);
+}
+
+int BandwidthController::replaceNiceApps(const std::vector<int32_t>& appUids) {
+    return replaceSpecialApps("bw_happy_box", niceAppUids, appUids, IptJumpReturn,
+                              { HAPPY_BOX_WHITELIST_COMMAND }, HAPPY_BOX_END_COMMAND);
+}
+
 int BandwidthController::manipulateNaughtyApps(int numUids, char *appStrUids[], SpecialAppOp appOp) {
-    return manipulateSpecialApps(numUids, appStrUids, "bw_penalty_box", IptJumpReject, appOp);
+    return manipulateSpecialApps(numUids, appStrUids, "bw_penalty_box", naughtyAppUids,
+                                 IptJumpReject, appOp);
 }
 
 int BandwidthController::manipulateNiceApps(int numUids, char *appStrUids[], SpecialAppOp appOp) {
-    return manipulateSpecialApps(numUids, appStrUids, "bw_happy_box", IptJumpReturn, appOp);
+    return manipulateSpecialApps(numUids, appStrUids, "bw_happy_box", niceAppUids,
+                                 IptJumpReturn, appOp);
 }
 
 int BandwidthController::manipulateRestrictAppsOnData(int numUids, char *appUids[],
         RestrictAppOp appOp) {
-    int ret = manipulateRestrictApps(numUids, appUids, "INPUT -i rmnet_data0",
-            restrictAppUidsOnData, appOp);
-    if (ret != 0) {
-        return ret;
-    } else {
-        return manipulateRestrictApps(numUids, appUids, "OUTPUT -o rmnet_data0",
-                restrictAppUidsOnData, appOp);
-    }
+    return manipulateRestrictApps(numUids, appUids,
+            { "INPUT -i rmnet_data0", "OUTPUT -o rmnet_data0" }, restrictAppUidsOnData, appOp);
 }
 
 int BandwidthController::manipulateRestrictAppsOnWlan(int numUids, char *appUids[],
         RestrictAppOp appOp) {
-    int ret = manipulateRestrictApps(numUids, appUids,"INPUT -i wlan0",
-            restrictAppUidsOnWlan, appOp);
-    if (ret != 0) {
-        return ret;
-    } else {
-        return manipulateRestrictApps(numUids, appUids,"OUTPUT -o wlan0",
-                restrictAppUidsOnWlan, appOp);
-    }
+    return manipulateRestrictApps(numUids, appUids,
+            { "INPUT -i wlan0", "OUTPUT -o wlan0" }, restrictAppUidsOnWlan, appOp);
 }
 int BandwidthController::addRestrictAppsOnData(int numUids, char *appUids[]) {
     return manipulateRestrictAppsOnData(numUids, appUids, RestrictAppOpAdd);
@@ -423,126 +437,172 @@ int BandwidthController::removeRestrictAppsOnWlan(int numUids, char *appUids[])
 
 
 int BandwidthController::manipulateRestrictApps(int numUids, char *appStrUids[],
-                                               const char *chain,
-                                               std::list<int /*appUid*/> &restrictAppUids,
+                                               const std::vector<std::string>& chains,
+                                               UidSet& restrictAppUids,
                                                RestrictAppOp appOp) {
-    int uidNum;
-    const char *failLogTemplate;
-    IptOp op;
-    int appUids[numUids];
-    std::string iptCmd;
-    std::list<int /*uid*/>::iterator it;
-    bool isOutputChain = !strncmp(chain, "OUTPUT", strlen("OUTPUT"));
-    switch (appOp) {
-        case RestrictAppOpAdd:
-            op = IptOpInsert;
-            failLogTemplate = "Failed to add app uid %s(%d) to %s.";
-            break;
-        case RestrictAppOpRemove:
-            op = IptOpDelete;
-            failLogTemplate = "Failed to delete app uid %s(%d) from %s box.";
-            break;
-        default:
-            ALOGE("Unexpected app Op %d", appOp);
-            return -1;
+    std::vector<int> appUids;
+    if (!parseUids(numUids, appStrUids, chains[0].c_str(), &appUids)) {
+        return -1;
     }
-    for (uidNum = 0; uidNum < numUids; uidNum++) {
-        char *end;
-        appUids[uidNum] = strtoul(appStrUids[uidNum], &end, 0);
-        if (*end || !*appStrUids[uidNum]) {
-            ALOGE(failLogTemplate, appStrUids[uidNum], appUids[uidNum], chain);
-            goto fail_parse;
+
+    UidSet target = restrictAppUids;
+    for (int uid : appUids) {
+        if (appOp == RestrictAppOpAdd) {
+            target.insert(uid);
+        } else if (restrictAppUids.count(uid)) {
+            target.erase(uid);
+        } else {
+            /* Nothing is removed unless every uid is there to remove. */
+            ALOGE("No such appUid %d to remove", uid);
+            return -1;
         }
     }
+    return updateUidRules(restrictAppUids, target, chains, IptJumpReject);
+}
 
-    for (uidNum = 0; uidNum < numUids; uidNum++) {
-        int uid = appUids[uidNum];
-        for (it = restrictAppUids.begin(); it != restrictAppUids.end(); it++) {
-            if (*it == uid)
-                break;
-        }
-        bool found = (it != restrictAppUids.end());
+int BandwidthController::manipulateSpecialApps(int numUids, char *appStrUids[],
+                                               const char *chain, UidSet& appUids,
+                                               IptJumpOp jumpHandling, SpecialAppOp appOp) {
+    std::vector<int> uids;
+    if (!parseUids(numUids, appStrUids, chain, &uids)) {
+        return -1;
+    }
 
-        if (appOp == RestrictAppOpRemove) {
-            if (!found) {
-                ALOGE("No such appUid %d to remove", uid);
-                return -1;
-            }
-            restrictAppUids.erase(it);
+    /* The framework often resends whole lists, so most of these are usually no-ops. */
+    UidSet target = appUids;
+    for (int uid : uids) {
+        if (appOp == SpecialAppOpAdd) {
+            target.insert(uid);
         } else {
-            if (found && !isOutputChain) {
-                ALOGE("appUid %d exists already", uid);
-                return -1;
-            }
-            restrictAppUids.push_front(uid);
-        }
-
-        iptCmd = makeIptablesSpecialAppCmd(op, uid, chain);
-        if (runIpxtablesCmd(iptCmd.c_str(), IptJumpReject)) {
-            ALOGE(failLogTemplate, appStrUids[uidNum], uid, chain);
-            goto fail_with_uidNum;
+            target.erase(uid);
         }
     }
-    return 0;
-
-fail_with_uidNum:
-    /* Try to remove the uid that failed in any case*/
-    iptCmd = makeIptablesSpecialAppCmd(IptOpDelete, appUids[uidNum], chain);
-    runIpxtablesCmd(iptCmd.c_str(), IptJumpReject);
-fail_parse:
-    return -1;
+    return updateUidRules(appUids, target, { chain }, jumpHandling);
 }
 
-int BandwidthController::manipulateSpecialApps(int numUids, char *appStrUids[],
-                                               const char *chain,
-                                               IptJumpOp jumpHandling, SpecialAppOp appOp) {
+int BandwidthController::replaceSpecialApps(const char *chain, UidSet& appUids,
+                                            const std::vector<int32_t>& uids,
+                                            IptJumpOp jumpHandling,
+                                            const std::vector<std::string>& startCommands,
+                                            const std::string& endCommand) {
+    UidSet target(uids.begin(), uids.end());
+    if (target == appUids) {
+        return 0;
+    }
 
-    int uidNum;
-    const char *failLogTemplate;
-    IptOp op;
-    int appUids[numUids];
-    std::string iptCmd;
+    std::vector<int> sortedUids(target.begin(), target.end());
+    std::sort(sortedUids.begin(), sortedUids.end());
 
-    switch (appOp) {
-    case SpecialAppOpAdd:
-        op = IptOpInsert;
-        failLogTemplate = "Failed to add app uid %s(%d) to %s.";
-        break;
-    case SpecialAppOpRemove:
-        op = IptOpDelete;
-        failLogTemplate = "Failed to delete app uid %s(%d) from %s box.";
-        break;
-    default:
-        ALOGE("Unexpected app Op %d", appOp);
+    /*
+     * Like FirewallController::replaceUidChain(), redeclaring the chain flushes it, and the kernel
+     * swaps in the whole filter table at once, so there is no point at which the box is empty.
+     * The jumps to it from the costly chains stay as they are.
+     */
+    const char *jump = (jumpHandling == IptJumpReject) ? "REJECT" : "RETURN";
+    std::string commands = android::base::StringPrintf("*filter\n:%s -\n", chain);
+    for (const auto& command : startCommands) {
+        commands += command + "\n";
+    }
+    for (int uid : sortedUids) {
+        android::base::StringAppendF(&commands, "-A %s -m owner --uid-owner %d --jump %s\n",
+                                     chain, uid, jump);
+    }
+    commands += endCommand + "\n";
+    commands += COMMIT_AND_CLOSE;
+
+    /*
+     * If one family fails, the other may already hold the new list. Keep the old state: replacing
+     * doesn't depend on it, and the framework always follows up with the whole list again.
+     */
+    if (iptablesRestoreFunction(V4V6, commands)) {
+        ALOGE("Failed to replace %zu app uids in %s", sortedUids.size(), chain);
         return -1;
     }
+    appUids = std::move(target);
+    return 0;
+}
 
-    for (uidNum = 0; uidNum < numUids; uidNum++) {
+bool BandwidthController::parseUids(int numUids, char *appStrUids[], const char *chain,
+                                    std::vector<int> *uids) {
+    uids->clear();
+    uids->reserve(numUids);
+    for (int uidNum = 0; uidNum < numUids; uidNum++) {
         char *end;
-        appUids[uidNum] = strtoul(appStrUids[uidNum], &end, 0);
+        int uid = strtoul(appStrUids[uidNum], &end, 0);
         if (*end || !*appStrUids[uidNum]) {
-            ALOGE(failLogTemplate, appStrUids[uidNum], appUids[uidNum], chain);
-            goto fail_parse;
+            ALOGE("Invalid app uid %s(%d) for %s", appStrUids[uidNum], uid, chain);
+            return false;
         }
+        uids->push_back(uid);
+    }
+    return true;
+}
+
+int BandwidthController::updateUidRules(UidSet& current, const UidSet& target,
+                                        const std::vector<std::string>& chains,
+                                        IptJumpOp jumpHandling) {
+    std::vector<int> added, removed;
+    for (int uid : target) {
+        if (!current.count(uid)) added.push_back(uid);
+    }
+    for (int uid : current) {
+        if (!target.count(uid)) removed.push_back(uid);
+    }
+    if (added.empty() && removed.empty()) {
+        return 0;
     }
 
-    for (uidNum = 0; uidNum < numUids; uidNum++) {
-        int uid = appUids[uidNum];
+    /* Hash order varies, and tests (and humans reading the rules) like a stable one. */
+    std::sort(added.begin(), added.end());
+    std::sort(removed.begin(), removed.end());
 
-        iptCmd = makeIptablesSpecialAppCmd(op, uid, chain);
-        if (runIpxtablesCmd(iptCmd.c_str(), jumpHandling)) {
-            ALOGE(failLogTemplate, appStrUids[uidNum], uid, chain);
-            goto fail_with_uidNum;
+    IptablesTransaction t(iptablesRestoreFunction, iptablesRestoreSilentlyFunction);
+    for (const auto& chain : chains) {
+        for (int uid : removed) {
+            addIpxtablesCmd(&t, makeIptablesSpecialAppCmd(IptOpDelete, uid, chain.c_str()),
+                            jumpHandling);
+        }
+        for (int uid : added) {
+            addIpxtablesCmd(&t, makeIptablesSpecialAppCmd(IptOpInsert, uid, chain.c_str()),
+                            jumpHandling);
         }
     }
-    return 0;
 
-fail_with_uidNum:
-    /* Try to remove the uid that failed in any case*/
-    iptCmd = makeIptablesSpecialAppCmd(IptOpDelete, appUids[uidNum], chain);
-    runIpxtablesCmd(iptCmd.c_str(), jumpHandling);
-fail_parse:
-    return -1;
+    /*
+     * Either all uids are added, or none are. Removing is best-effort: once we've tried, the rule
+     * is gone either way, so the uid is forgotten even if iptables complained.
+     */
+    int res = added.empty() ? t.commitBestEffort() : t.commit();
+    if (res == 0 || added.empty()) {
+        current = target;
+    } else {
+        /*
+         * One family may have taken the batch before the other failed, and the transaction can't
+         * always undo that: its rollback can fail too, and deletes are never undone. Bring both
+         * families back in line with what we remember instead: none of the added uids have a rule,
+         * and neither have the removed ones, so they are forgotten too.
+         */
+        for (const auto& chain : chains) {
+            for (int uid : removed) {
+                addIpxtablesCmd(&t, makeIptablesSpecialAppCmd(IptOpDelete, uid, chain.c_str()),
+                                jumpHandling);
+            }
+            for (int uid : added) {
+                addIpxtablesCmd(&t, makeIptablesSpecialAppCmd(IptOpDelete, uid, chain.c_str()),
+                                jumpHandling);
+            }
+        }
+        t.commitBestEffort();
+        for (int uid : removed) {
+            current.erase(uid);
+        }
+    }
+    if (res) {
+        ALOGE("Failed to add %zu and remove %zu app uids in %s", added.size(), removed.size(),
+              chains[0].c_str());
+        return -1;
+    }
+    return 0;
 }
 
 std::string BandwidthController::makeIptablesQuotaCmd(IptOp op, const char *costName, int64_t quota) {
@@ -577,11 +637,10 @@ std::string BandwidthController::makeIptablesQuotaCmd(IptOp op, const char *cost
 }
 
 int BandwidthController::prepCostlyIface(const char *ifn, QuotaType quotaType) {
-    char cmd[MAX_CMD_LEN];
-    int res = 0, res1, res2;
     int ruleInsertPos = 1;
     std::string costString;
     const char *costCString;
+    IptablesTransaction t(iptablesRestoreFunction, iptablesRestoreSilentlyFunction);
 
     /* The "-N costly" is created upfront, no need to handle it here. */
     switch (quotaType) {
@@ -590,18 +649,11 @@ int BandwidthController::prepCostlyIface(const char *ifn, QuotaType quotaType) {
         costString += ifn;
         costCString = costString.c_str();
         /*
-         * Flush the bw_costly_<iface> is allowed to fail in case it didn't exist.
-         * Creating a new one is allowed to fail in case it existed.
+         * Declaring bw_costly_<iface> creates it if it didn't exist, and flushes it if it did.
          * This helps with netd restarts.
          */
-        snprintf(cmd, sizeof(cmd), "-F %s", costCString);
-        res1 = runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
-        snprintf(cmd, sizeof(cmd), "-N %s", costCString);
-        res2 = runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
-        res = (res1 && res2) || (!res1 && !res2);
-
-        snprintf(cmd, sizeof(cmd), "-A %s -j bw_penalty_box", costCString);
-        res |= runIpxtablesCmd(cmd, IptJumpNoAdd);
+        t.addf(V4V6, "filter", ":%s -", costCString);
+        t.addf(V4V6, "filter", "-A %s -j bw_penalty_box", costCString);
         break;
     case QuotaShared:
         costCString = "bw_costly_shared";
@@ -616,29 +668,21 @@ int BandwidthController::prepCostlyIface(const char *ifn, QuotaType quotaType) {
         ruleInsertPos = 2;
     }
 
-    snprintf(cmd, sizeof(cmd), "-D bw_INPUT -i %s --jump %s", ifn, costCString);
-    runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
-
-    snprintf(cmd, sizeof(cmd), "-I bw_INPUT %d -i %s --jump %s", ruleInsertPos, ifn, costCString);
-    res |= runIpxtablesCmd(cmd, IptJumpNoAdd);
+    /* Remove any jumps left over from before. These are allowed to fail. */
+    IptablesTransaction cleanup(iptablesRestoreSilentlyFunction);
+    cleanup.addf(V4V6, "filter", "-D bw_INPUT -i %s --jump %s", ifn, costCString);
+    cleanup.addf(V4V6, "filter", "-D bw_OUTPUT -o %s --jump %s", ifn, costCString);
+    cleanup.addf(V4V6, "filter", "-D bw_FORWARD -o %s --jump %s", ifn, costCString);
+    cleanup.commitBestEffort();
 
-    snprintf(cmd, sizeof(cmd), "-D bw_OUTPUT -o %s --jump %s", ifn, costCString);
-    runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
+    t.addf(V4V6, "filter", "-I bw_INPUT %d -i %s --jump %s", ruleInsertPos, ifn, costCString);
+    t.addf(V4V6, "filter", "-I bw_OUTPUT %d -o %s --jump %s", ruleInsertPos, ifn, costCString);
+    t.addf(V4V6, "filter", "-A bw_FORWARD -o %s --jump %s", ifn, costCString);
 
-    snprintf(cmd, sizeof(cmd), "-I bw_OUTPUT %d -o %s --jump %s", ruleInsertPos, ifn, costCString);
-    res |= runIpxtablesCmd(cmd, IptJumpNoAdd);
-
-    snprintf(cmd, sizeof(cmd), "-D bw_FORWARD -o %s --jump %s", ifn, costCString);
-    runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
-    snprintf(cmd, sizeof(cmd), "-A bw_FORWARD -o %s --jump %s", ifn, costCString);
-    res |= runIpxtablesCmd(cmd, IptJumpNoAdd);
-
-    return res;
+    return t.commit();
 }
 
 int BandwidthController::cleanupCostlyIface(const char *ifn, QuotaType quotaType) {
-    char cmd[MAX_CMD_LEN];
-    int res = 0;
     std::string costString;
     const char *costCString;
 
@@ -656,21 +700,18 @@ int BandwidthController::cleanupCostlyIface(const char *ifn, QuotaType quotaType
         return -1;
     }
 
-    snprintf(cmd, sizeof(cmd), "-D bw_INPUT -i %s --jump %s", ifn, costCString);
-    res |= runIpxtablesCmd(cmd, IptJumpNoAdd);
+    IptablesTransaction t(iptablesRestoreFunction, iptablesRestoreSilentlyFunction);
+    t.addf(V4V6, "filter", "-D bw_INPUT -i %s --jump %s", ifn, costCString);
     for (const auto tableName : {LOCAL_OUTPUT, LOCAL_FORWARD}) {
-        snprintf(cmd, sizeof(cmd), "-D %s -o %s --jump %s", tableName, ifn, costCString);
-        res |= runIpxtablesCmd(cmd, IptJumpNoAdd);
+        t.addf(V4V6, "filter", "-D %s -o %s --jump %s", tableName, ifn, costCString);
     }
 
     /* The "-N bw_costly_shared" is created upfront, no need to handle it here. */
     if (quotaType == QuotaUnique) {
-        snprintf(cmd, sizeof(cmd), "-F %s", costCString);
-        res |= runIpxtablesCmd(cmd, IptJumpNoAdd);
-        snprintf(cmd, sizeof(cmd), "-X %s", costCString);
-        res |= runIpxtablesCmd(cmd, IptJumpNoAdd);
+        t.addf(V4V6, "filter", "-F %s", costCString);
+        t.addf(V4V6, "filter", "-X %s", costCString);
     }
-    return res;
+    return t.commitBestEffort();
 }
 
 int BandwidthController::setInterfaceSharedQuota(const char *iface, int64_t maxBytes) {
@@ -678,9 +719,7 @@ int BandwidthController::setInterfaceSharedQuota(const char *iface, int64_t maxB
     int res = 0;
     std::string quotaCmd;
     std::string ifaceName;
-    ;
     const char *costName = "shared";
-    std::list<std::string>::iterator it;
 
     if (!maxBytes) {
         /* Don't talk about -1, deprecate it. */
@@ -700,12 +739,7 @@ int BandwidthController::setInterfaceSharedQuota(const char *iface, int64_t maxB
     }
 
     /* Insert ingress quota. */
-    for (it = sharedQuotaIfaces.begin(); it != sharedQuotaIfaces.end(); it++) {
-        if (*it == ifaceName)
-            break;
-    }
-
-    if (it == sharedQuotaIfaces.end()) {
+    if (!sharedQuotaIfaces.count(ifaceName)) {
         res |= prepCostlyIface(ifn, QuotaShared);
         if (sharedQuotaIfaces.empty()) {
             quotaCmd = makeIptablesQuotaCmd(IptOpInsert, costName, maxBytes);
@@ -716,7 +750,7 @@ int BandwidthController::setInterfaceSharedQuota(const char *iface, int64_t maxB
             }
             sharedQuotaBytes = maxBytes;
         }
-        sharedQuotaIfaces.push_front(ifaceName);
+        sharedQuotaIfaces.insert(ifaceName);
 
     }
 
@@ -746,7 +780,6 @@ int BandwidthController::removeInterfaceSharedQuota(const char *iface) {
     char ifn[MAX_IFACENAME_LEN];
     int res = 0;
     std::string ifaceName;
-    std::list<std::string>::iterator it;
     const char *costName = "shared";
 
     if (!isIfaceName(iface))
@@ -757,10 +790,7 @@ int BandwidthController::removeInterfaceSharedQuota(const char *iface) {
     }
     ifaceName = ifn;
 
-    for (it = sharedQuotaIfaces.begin(); it != sharedQuotaIfaces.end(); it++) {
-        if (*it == ifaceName)
-            break;
-    }
+    auto it = sharedQuotaIfaces.find(ifaceName);
     if (it == sharedQuotaIfaces.end()) {
         ALOGE("No such iface %s to delete", ifn);
         return -1;
@@ -773,6 +803,7 @@ int BandwidthController::removeInterfaceSharedQuota(const char *iface) {
         std::string quotaCmd;
         quotaCmd = makeIptablesQuotaCmd(IptOpDelete, costName, sharedQuotaBytes);
         res |= runIpxtablesCmd(quotaCmd.c_str(), IptJumpReject);
+        quotas.forget(costName);
         sharedQuotaBytes = 0;
         if (sharedAlertBytes) {
             removeSharedAlert();
@@ -787,7 +818,6 @@ int BandwidthController::setInterfaceQuota(const char *iface, int64_t maxBytes)
     int res = 0;
     std::string ifaceName;
     const char *costName;
-    std::list<QuotaInfo>::iterator it;
     std::string quotaCmd;
 
     if (!isIfaceName(iface))
@@ -810,11 +840,7 @@ int BandwidthController::setInterfaceQuota(const char *iface, int64_t maxBytes)
     costName = iface;
 
     /* Insert ingress quota. */
-    for (it = quotaIfaces.begin(); it != quotaIfaces.end(); it++) {
-        if (it->ifaceName == ifaceName)
-            break;
-    }
-
+    auto it = quotaIfaces.find(ifaceName);
     if (it == quotaIfaces.end()) {
         /* Preparing the iface adds a penalty/happy box check */
         res |= prepCostlyIface(ifn, QuotaUnique);
@@ -830,15 +856,15 @@ int BandwidthController::setInterfaceQuota(const char *iface, int64_t maxBytes)
             goto fail;
         }
 
-        quotaIfaces.push_front(QuotaInfo(ifaceName, maxBytes, 0));
+        quotaIfaces.emplace(ifaceName, QuotaInfo(ifaceName, maxBytes, 0));
 
-    } else {
+    } else if (it->second.quota != maxBytes) {
         res |= updateQuota(costName, maxBytes);
         if (res) {
             ALOGE("Failed update quota for %s", iface);
             goto fail;
         }
-        it->quota = maxBytes;
+        it->second.quota = maxBytes;
     }
     return 0;
 
@@ -858,24 +884,94 @@ int BandwidthController::getInterfaceSharedQuota(int64_t *bytes) {
 }
 
 int BandwidthController::getInterfaceQuota(const char *costName, int64_t *bytes) {
-    FILE *fp;
-    char *fname;
-    int scanRes;
-
     if (!isIfaceName(costName))
         return -1;
 
-    asprintf(&fname, "/proc/net/xt_quota/%s", costName);
-    fp = fopen(fname, "re");
-    free(fname);
-    if (!fp) {
-        ALOGE("Reading quota %s failed (%s)", costName, strerror(errno));
+    return quotas.get(costName, bytes) ? -1 : 0;
+}
+
+int BandwidthController::getQuotas(QuotaRegistry::QuotaList *quotaList) {
+    std::vector<std::string> names;
+    if (!sharedQuotaIfaces.empty()) {
+        names.push_back("shared");
+    }
+    for (const auto& it : quotaIfaces) {
+        names.push_back(it.first);
+    }
+    std::sort(names.begin(), names.end());
+
+    quotaList->clear();
+    return quotas.getAll(names, quotaList) ? -1 : 0;
+}
+
+void BandwidthController::addUidCounterRules(IptablesTransaction *t, IptOp op, int32_t uid,
+                                             const std::string& iface) {
+    const char *opFlag = (op == IptOpDelete) ? "-D" : "-A";
+    std::string inIface, outIface;
+    if (!iface.empty()) {
+        inIface = " -i " + iface;
+        outIface = " -o " + iface;
+    }
+    t->addf(V4V6, "filter", "%s bw_uid_INPUT%s -m owner --uid-owner %d -m nfacct --nfacct-name %s",
+            opFlag, inIface.c_str(), uid, UidCounters::rxName(uid, iface).c_str());
+    t->addf(V4V6, "filter", "%s bw_uid_OUTPUT%s -m owner --uid-owner %d -m nfacct --nfacct-name %s",
+            opFlag, outIface.c_str(), uid, UidCounters::txName(uid, iface).c_str());
+}
+
+void BandwidthController::probeUidCounters() {
+    /*
+     * Nothing jumps to bw_uid_INPUT or bw_uid_OUTPUT until bandwidth control is enabled, so the
+     * probe counter's rules never see a packet. The uid is the overflow uid, which no app has.
+     */
+    const int32_t probeUid = 65534;
+    uidCountersSupported = true;
+    if (addUidCounter(probeUid, "")) {
+        ALOGW("Kernel lacks nfacct or its iptables match, uid counters are disabled");
+        uidCountersSupported = false;
+        return;
+    }
+    removeUidCounter(probeUid, "");
+}
+
+int BandwidthController::addUidCounter(int32_t uid, const std::string& iface) {
+    if (!uidCountersSupported || uid < 0 || (!iface.empty() && !isIfaceName(iface.c_str()))) {
+        return -1;
+    }
+    if (uidCounters.contains(uid, iface)) {
+        return 0;
+    }
+    if (uidCounters.add(uid, iface)) {
+        return -1;
+    }
+
+    IptablesTransaction t(iptablesRestoreFunction, iptablesRestoreSilentlyFunction);
+    addUidCounterRules(&t, IptOpAppend, uid, iface);
+    if (t.commit()) {
+        ALOGE("Failed to add counter rules for uid %d on \"%s\"", uid, iface.c_str());
+        uidCounters.remove(uid, iface);
         return -1;
     }
-    scanRes = fscanf(fp, "%" SCNd64, bytes);
-    ALOGV("Read quota res=%d bytes=%" PRId64, scanRes, *bytes);
-    fclose(fp);
-    return scanRes == 1 ? 0 : -1;
+    return 0;
+}
+
+int BandwidthController::removeUidCounter(int32_t uid, const std::string& iface) {
+    if (!uidCountersSupported || !uidCounters.contains(uid, iface)) {
+        return -1;
+    }
+
+    /* The nfacct objects can only be deleted once no rule uses them. */
+    IptablesTransaction t(iptablesRestoreFunction, iptablesRestoreSilentlyFunction);
+    addUidCounterRules(&t, IptOpDelete, uid, iface);
+    t.commitBestEffort();
+    return uidCounters.remove(uid, iface) ? -1 : 0;
+}
+
+int BandwidthController::getUidStats(uint64_t since, std::vector<uint8_t> *snapshot) {
+    if (!uidCountersSupported || uidCounters.refresh()) {
+        return -1;
+    }
+    uidCounters.getSnapshot(since, snapshot);
+    return 0;
 }
 
 int BandwidthController::removeInterfaceQuota(const char *iface) {
@@ -883,7 +979,6 @@ int BandwidthController::removeInterfaceQuota(const char *iface) {
     char ifn[MAX_IFACENAME_LEN];
     int res = 0;
     std::string ifaceName;
-    std::list<QuotaInfo>::iterator it;
 
     if (!isIfaceName(iface))
         return -1;
@@ -893,11 +988,7 @@ int BandwidthController::removeInterfaceQuota(const char *iface) {
     }
     ifaceName = ifn;
 
-    for (it = quotaIfaces.begin(); it != quotaIfaces.end(); it++) {
-        if (it->ifaceName == ifaceName)
-            break;
-    }
-
+    auto it = quotaIfaces.find(ifaceName);
     if (it == quotaIfaces.end()) {
         ALOGE("No such iface %s to delete", ifn);
         return -1;
@@ -906,36 +997,25 @@ int BandwidthController::removeInterfaceQuota(const char *iface) {
     /* This also removes the quota command of CostlyIface chain. */
     res |= cleanupCostlyIface(ifn, QuotaUnique);
 
+    /* The quota and alert go away with the chain. */
+    quotas.forget(ifaceName);
+    quotas.forget(ifaceName + "Alert");
     quotaIfaces.erase(it);
 
     return res;
 }
 
 int BandwidthController::updateQuota(const char *quotaName, int64_t bytes) {
-    FILE *fp;
-    char *fname;
-
     if (!isIfaceName(quotaName)) {
         ALOGE("updateQuota: Invalid quotaName \"%s\"", quotaName);
         return -1;
     }
 
-    asprintf(&fname, "/proc/net/xt_quota/%s", quotaName);
-    fp = fopen(fname, "we");
-    free(fname);
-    if (!fp) {
-        ALOGE("Updating quota %s failed (%s)", quotaName, strerror(errno));
-        return -1;
-    }
-    fprintf(fp, "%" PRId64"\n", bytes);
-    fclose(fp);
-    return 0;
+    return quotas.set(quotaName, bytes) ? -1 : 0;
 }
 
 int BandwidthController::runIptablesAlertCmd(IptOp op, const char *alertName, int64_t bytes) {
-    int res = 0;
     const char *opFlag;
-    char *alertQuotaCmd;
 
     switch (op) {
     case IptOpInsert:
@@ -953,15 +1033,10 @@ int BandwidthController::runIptablesAlertCmd(IptOp op, const char *alertName, in
         break;
     }
 
-    asprintf(&alertQuotaCmd, ALERT_IPT_TEMPLATE, opFlag, "bw_INPUT",
-        bytes, alertName);
-    res |= runIpxtablesCmd(alertQuotaCmd, IptJumpNoAdd);
-    free(alertQuotaCmd);
-    asprintf(&alertQuotaCmd, ALERT_IPT_TEMPLATE, opFlag, "bw_OUTPUT",
-        bytes, alertName);
-    res |= runIpxtablesCmd(alertQuotaCmd, IptJumpNoAdd);
-    free(alertQuotaCmd);
-    return res;
+    IptablesTransaction t(iptablesRestoreFunction, iptablesRestoreSilentlyFunction);
+    t.addf(V4V6, "filter", ALERT_IPT_TEMPLATE, opFlag, "bw_INPUT", bytes, alertName);
+    t.addf(V4V6, "filter", ALERT_IPT_TEMPLATE, opFlag, "bw_OUTPUT", bytes, alertName);
+    return op == IptOpDelete ? t.commitBestEffort() : t.commit();
 }
 
 int BandwidthController::runIptablesAlertFwdCmd(IptOp op, const char *alertName, int64_t bytes) {
@@ -1000,6 +1075,9 @@ int BandwidthController::setGlobalAlert(int64_t bytes) {
         ALOGE("Invalid bytes value. 1..max_int64.");
         return -1;
     }
+    if (bytes == globalAlertBytes) {
+        return 0;
+    }
     if (globalAlertBytes) {
         res = updateQuota(alertName, bytes);
     } else {
@@ -1047,6 +1125,7 @@ int BandwidthController::removeGlobalAlert(void) {
     if (globalAlertTetherCount) {
         res |= runIptablesAlertFwdCmd(IptOpDelete, alertName, globalAlertBytes);
     }
+    quotas.forget(alertName);
     globalAlertBytes = 0;
     return res;
 }
@@ -1092,8 +1171,6 @@ int BandwidthController::removeSharedAlert(void) {
 }
 
 int BandwidthController::setInterfaceAlert(const char *iface, int64_t bytes) {
-    std::list<QuotaInfo>::iterator it;
-
     if (!isIfaceName(iface)) {
         ALOGE("setInterfaceAlert: Invalid iface \"%s\"", iface);
         return -1;
@@ -1103,38 +1180,28 @@ int BandwidthController::setInterfaceAlert(const char *iface, int64_t bytes) {
         ALOGE("Invalid bytes value. 1..max_int64.");
         return -1;
     }
-    for (it = quotaIfaces.begin(); it != quotaIfaces.end(); it++) {
-        if (it->ifaceName == iface)
-            break;
-    }
-
+    auto it = quotaIfaces.find(iface);
     if (it == quotaIfaces.end()) {
         ALOGE("Need to have a prior interface quota set to set an alert");
         return -1;
     }
 
-    return setCostlyAlert(iface, bytes, &it->alert);
+    return setCostlyAlert(iface, bytes, &it->second.alert);
 }
 
 int BandwidthController::removeInterfaceAlert(const char *iface) {
-    std::list<QuotaInfo>::iterator it;
-
     if (!isIfaceName(iface)) {
         ALOGE("removeInterfaceAlert: Invalid iface \"%s\"", iface);
         return -1;
     }
 
-    for (it = quotaIfaces.begin(); it != quotaIfaces.end(); it++) {
-        if (it->ifaceName == iface)
-            break;
-    }
-
+    auto it = quotaIfaces.find(iface);
     if (it == quotaIfaces.end()) {
         ALOGE("No prior alert set for interface %s", iface);
         return -1;
     }
 
-    return removeCostlyAlert(iface, &it->alert);
+    return removeCostlyAlert(iface, &it->second.alert);
 }
 
 int BandwidthController::setCostlyAlert(const char *costName, int64_t bytes, int64_t *alertBytes) {
@@ -1152,9 +1219,12 @@ int BandwidthController::setCostlyAlert(const char *costName, int64_t bytes, int
         ALOGE("Invalid bytes value. 1..max_int64.");
         return -1;
     }
+    if (bytes == *alertBytes) {
+        return 0;
+    }
     asprintf(&alertName, "%sAlert", costName);
     if (*alertBytes) {
-        res = updateQuota(alertName, *alertBytes);
+        res = updateQuota(alertName, bytes);
     } else {
         asprintf(&chainName, "bw_costly_%s", costName);
         asprintf(&alertQuotaCmd, ALERT_IPT_TEMPLATE, "-A", chainName, bytes, alertName);
@@ -1190,34 +1260,158 @@ int BandwidthController::removeCostlyAlert(const char *costName, int64_t *alertB
     free(alertQuotaCmd);
     free(chainName);
 
+    quotas.forget(alertName);
     *alertBytes = 0;
     free(alertName);
     return res;
 }
 
-void BandwidthController::addStats(TetherStatsList& statsList, const TetherStats& stats) {
-    for (TetherStats& existing : statsList) {
-        if (existing.addStatsIfMatch(stats)) {
-            return;
-        }
+void BandwidthController::TetherStatsList::add(const TetherStats& stats) {
+    auto it = mIndex.find(key(stats.intIface, stats.extIface));
+    if (it != mIndex.end()) {
+        mStats[it->second].addStatsIfMatch(stats);
+        return;
     }
     // No match. Insert a new interface pair.
-    statsList.push_back(stats);
+    mIndex[key(stats.intIface, stats.extIface)] = mStats.size();
+    mStats.push_back(stats);
+}
+
+std::vector<BandwidthController::TetherStats>
+BandwidthController::TetherStatsList::release() {
+    mIndex.clear();
+    return std::move(mStats);
+}
+
+BandwidthController::TetherStats* BandwidthController::TetherStatsList::find(
+        const std::string& intIface, const std::string& extIface) {
+    auto it = mIndex.find(key(intIface, extIface));
+    return (it != mIndex.end()) ? &mStats[it->second] : nullptr;
 }
 
+namespace {
+
 /*
- * Parse the ptks and bytes out of:
+ * Finds the next whitespace-separated token of |*line|, stores its length in |*len| and advances
+ * |*line| past it. Returns the start of the token, which is empty at the end of the line.
+ */
+const char *nextToken(const char **line, size_t *len) {
+    const char *start = *line + strspn(*line, " \t\n");
+    *len = strcspn(start, " \t\n");
+    *line = start + *len;
+    return start;
+}
+
+bool tokenIs(const char *token, size_t len, const char *expected) {
+    return len == strlen(expected) && !strncmp(token, expected, len);
+}
+
+/*
+ * Parses one tether counter rule out of iptables -nvx -L output:
+ *       26     2373 RETURN     all  --  wlan0  rmnet0  0.0.0.0/0            0.0.0.0/0
+ * ip6tables leaves the opt column empty:
+ *       26     2373 RETURN     all      wlan0  rmnet0  ::/0                 ::/0
+ * Returns false for every other line, including the chain and column headers.
+ * This runs for every line on every stats poll, so it avoids sscanf().
+ */
+bool parseTetherCounterRule(const char *line, std::string *iface0, std::string *iface1,
+                            int64_t *packets, int64_t *bytes) {
+    char *end;
+    *packets = strtoll(line, &end, 10);
+    if (end == line || !isspace(*end)) {
+        return false;
+    }
+    line = end;
+    *bytes = strtoll(line, &end, 10);
+    if (end == line || !isspace(*end)) {
+        return false;
+    }
+    line = end;
+
+    size_t len;
+    const char *token = nextToken(&line, &len);
+    if (!tokenIs(token, len, "RETURN")) {
+        return false;
+    }
+    token = nextToken(&line, &len);
+    if (!tokenIs(token, len, "all")) {
+        return false;
+    }
+    size_t inLen;
+    const char *in = nextToken(&line, &inLen);
+    if (tokenIs(in, inLen, "--")) {
+        in = nextToken(&line, &inLen);
+    }
+    size_t outLen;
+    const char *out = nextToken(&line, &outLen);
+    // The source and destination columns must follow.
+    nextToken(&line, &len);
+    if (!inLen || !outLen || !len) {
+        return false;
+    }
+    iface0->assign(in, inLen);
+    iface1->assign(out, outLen);
+    return true;
+}
+
+bool matchesFilter(const BandwidthController::TetherStats& filter,
+                   const BandwidthController::TetherStats& stats) {
+    return (filter.intIface.empty() || filter.intIface == stats.intIface) &&
+           (filter.extIface.empty() || filter.extIface == stats.extIface);
+}
+
+}  // namespace
+
+void BandwidthController::addPairCounter(TetherStatsList& pairs, const std::string& iface0,
+                                         const std::string& iface1, int64_t packets,
+                                         int64_t bytes) {
+    TetherStats *stats = pairs.find(iface1, iface0);
+    if (stats) {
+        stats->txPackets = packets;
+        stats->txBytes = bytes;
+    } else if ((stats = pairs.find(iface0, iface1)) != nullptr) {
+        stats->rxPackets = packets;
+        stats->rxBytes = bytes;
+    } else {
+        pairs.add(TetherStats(iface0, iface1, bytes, packets, -1, -1));
+    }
+}
+
+int BandwidthController::addMatchingPairs(const TetherStats& filter, const TetherStatsList& pairs,
+                                          TetherStatsList& statsList) {
+    bool filterPair = filter.intIface[0] && filter.extIface[0];
+
+    int statsFound = 0;
+    for (const TetherStats& stats : pairs) {
+        if (!matchesFilter(filter, stats)) {
+            continue;
+        }
+        /* It is always an error to find only one side of the stats. */
+        if (stats.txBytes == -1) {
+            ALOGE("No tx counters for %s %s", stats.intIface.c_str(), stats.extIface.c_str());
+            return -1;
+        }
+        statsList.add(stats);
+        statsFound++;
+    }
+
+    /* It is an error to find nothing when not filtering. */
+    if (!statsFound && !filterPair) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Parse the pkts and bytes out of:
  *   Chain natctrl_tether_counters (4 references)
  *       pkts      bytes target     prot opt in     out     source               destination
  *         26     2373 RETURN     all  --  wlan0  rmnet0  0.0.0.0/0            0.0.0.0/0
  *         27     2002 RETURN     all  --  rmnet0 wlan0   0.0.0.0/0            0.0.0.0/0
  *       1040   107471 RETURN     all  --  bt-pan rmnet0  0.0.0.0/0            0.0.0.0/0
  *       1450  1708806 RETURN     all  --  rmnet0 bt-pan  0.0.0.0/0            0.0.0.0/0
- * or:
- *   Chain natctrl_tether_counters (0 references)
- *       pkts      bytes target     prot opt in     out     source               destination
- *          0        0 RETURN     all      wlan0  rmnet_data0  ::/0                 ::/0
- *          0        0 RETURN     all      rmnet_data0 wlan0   ::/0                 ::/0
+ * or the IPv6 equivalent, which has no "--" in the opt column. Rules that count into nfacct
+ * objects have "nfacct-name <name>" after the destination.
  *
  * It results in an error if invoked and no tethering counter rules exist. The constraint
  * helps detect complete parsing failure.
@@ -1225,107 +1419,43 @@ void BandwidthController::addStats(TetherStatsList& statsList, const TetherStats
 int BandwidthController::addForwardChainStats(const TetherStats& filter,
                                               TetherStatsList& statsList, FILE *fp,
                                               std::string &extraProcessingInfo) {
-    int res;
-    char lineBuffer[MAX_IPT_OUTPUT_LINE_LEN];
-    char iface0[MAX_IPT_OUTPUT_LINE_LEN];
-    char iface1[MAX_IPT_OUTPUT_LINE_LEN];
-    char rest[MAX_IPT_OUTPUT_LINE_LEN];
-
-    TetherStats stats;
-    char *buffPtr;
+    char *line = nullptr;
+    size_t lineLen = 0;
+    std::string iface0, iface1;
     int64_t packets, bytes;
-    int statsFound = 0;
-
-    bool filterPair = filter.intIface[0] && filter.extIface[0];
+    TetherStatsList familyStats;
 
     char *filterMsg = filter.getStatsLine();
     ALOGV("filter: %s",  filterMsg);
     free(filterMsg);
 
-    stats = filter;
-
-    while (NULL != (buffPtr = fgets(lineBuffer, MAX_IPT_OUTPUT_LINE_LEN, fp))) {
-        /* Clean up, so a failed parse can still print info */
-        iface0[0] = iface1[0] = rest[0] = packets = bytes = 0;
-        if (strstr(buffPtr, "0.0.0.0")) {
-            // IPv4 has -- indicating what to do with fragments...
-            //       26     2373 RETURN     all  --  wlan0  rmnet0  0.0.0.0/0            0.0.0.0/0
-            res = sscanf(buffPtr, "%" SCNd64" %" SCNd64" RETURN all -- %s %s 0.%s",
-                    &packets, &bytes, iface0, iface1, rest);
-        } else {
-            // ... but IPv6 does not.
-            //       26     2373 RETURN     all      wlan0  rmnet0  ::/0                 ::/0
-            res = sscanf(buffPtr, "%" SCNd64" %" SCNd64" RETURN all %s %s ::/%s",
-                    &packets, &bytes, iface0, iface1, rest);
-        }
-        ALOGV("parse res=%d iface0=<%s> iface1=<%s> pkts=%" PRId64" bytes=%" PRId64" rest=<%s> orig line=<%s>", res,
-             iface0, iface1, packets, bytes, rest, buffPtr);
-        extraProcessingInfo += buffPtr;
-
-        if (res != 5) {
+    // Whole lines, however long, so that a long line is never parsed in pieces.
+    while (getline(&line, &lineLen, fp) != -1) {
+        if (!parseTetherCounterRule(line, &iface0, &iface1, &packets, &bytes)) {
             continue;
         }
-        /*
-         * The following assumes that the 1st rule has in:extIface out:intIface,
-         * which is what NatController sets up.
-         * If not filtering, the 1st match rx, and sets up the pair for the tx side.
-         */
-        if (filter.intIface[0] && filter.extIface[0]) {
-            if (filter.intIface == iface0 && filter.extIface == iface1) {
-                ALOGV("2Filter RX iface_in=%s iface_out=%s rx_bytes=%" PRId64" rx_packets=%" PRId64" ", iface0, iface1, bytes, packets);
-                stats.rxPackets = packets;
-                stats.rxBytes = bytes;
-            } else if (filter.intIface == iface1 && filter.extIface == iface0) {
-                ALOGV("2Filter TX iface_in=%s iface_out=%s rx_bytes=%" PRId64" rx_packets=%" PRId64" ", iface0, iface1, bytes, packets);
-                stats.txPackets = packets;
-                stats.txBytes = bytes;
-            }
-        } else if (filter.intIface[0] || filter.extIface[0]) {
-            if (filter.intIface == iface0 || filter.extIface == iface1) {
-                ALOGV("1Filter RX iface_in=%s iface_out=%s rx_bytes=%" PRId64" rx_packets=%" PRId64" ", iface0, iface1, bytes, packets);
-                stats.intIface = iface0;
-                stats.extIface = iface1;
-                stats.rxPackets = packets;
-                stats.rxBytes = bytes;
-            } else if (filter.intIface == iface1 || filter.extIface == iface0) {
-                ALOGV("1Filter TX iface_in=%s iface_out=%s rx_bytes=%" PRId64" rx_packets=%" PRId64" ", iface0, iface1, bytes, packets);
-                stats.intIface = iface1;
-                stats.extIface = iface0;
-                stats.txPackets = packets;
-                stats.txBytes = bytes;
-            }
-        } else /* if (!filter.intFace[0] && !filter.extIface[0]) */ {
-            if (!stats.intIface[0]) {
-                ALOGV("0Filter RX iface_in=%s iface_out=%s rx_bytes=%" PRId64" rx_packets=%" PRId64" ", iface0, iface1, bytes, packets);
-                stats.intIface = iface0;
-                stats.extIface = iface1;
-                stats.rxPackets = packets;
-                stats.rxBytes = bytes;
-            } else if (stats.intIface == iface1 && stats.extIface == iface0) {
-                ALOGV("0Filter TX iface_in=%s iface_out=%s rx_bytes=%" PRId64" rx_packets=%" PRId64" ", iface0, iface1, bytes, packets);
-                stats.txPackets = packets;
-                stats.txBytes = bytes;
-            }
-        }
-        if (stats.rxBytes != -1 && stats.txBytes != -1) {
-            ALOGV("rx_bytes=%" PRId64" tx_bytes=%" PRId64" filterPair=%d", stats.rxBytes, stats.txBytes, filterPair);
-            addStats(statsList, stats);
-            if (filterPair) {
-                return 0;
-            } else {
-                statsFound++;
-                stats = filter;
-            }
-        }
+        ALOGV("iface0=<%s> iface1=<%s> pkts=%" PRId64" bytes=%" PRId64" orig line=<%s>",
+              iface0.c_str(), iface1.c_str(), packets, bytes, line);
+        extraProcessingInfo += line;
+        addPairCounter(familyStats, iface0, iface1, packets, bytes);
     }
+    free(line);
 
-    /* It is always an error to find only one side of the stats. */
-    /* It is an error to find nothing when not filtering. */
-    if (((stats.rxBytes == -1) != (stats.txBytes == -1)) ||
-        (!statsFound && !filterPair)) {
-        return -1;
-    }
-    return 0;
+    return addMatchingPairs(filter, familyStats, statsList);
+}
+
+int BandwidthController::addTetherCounterStats(
+        const TetherStats& filter, TetherStatsList& statsList,
+        const std::vector<TetherCounters::Counter>& counters, std::string &extraProcessingInfo) {
+    TetherStatsList pairs;
+    for (const auto& counter : counters) {
+        extraProcessingInfo += android::base::StringPrintf(
+                "%s %s %" PRIu64" %" PRIu64"\n", counter.inIface.c_str(),
+                counter.outIface.c_str(), counter.packets, counter.bytes);
+        addPairCounter(pairs, counter.inIface, counter.outIface, counter.packets,
+                       counter.bytes);
+    }
+    return addMatchingPairs(filter, pairs, statsList);
 }
 
 char *BandwidthController::TetherStats::getStatsLine(void) const {
@@ -1342,18 +1472,29 @@ std::string getTetherStatsCommand(const char *binary) {
      * not easy to use. They require the known iptables match modules to be
      * preloaded/linked, and require apparently a lot of wrapper code to get
      * the wanted info.
+     *
+     * Only the counters chain is listed. iptables-save would print the whole filter table,
+     * which holds thousands of per-uid rules on a busy device, on every stats poll.
      */
     return android::base::StringPrintf("%s -nvx -w -L %s", binary,
                                        NatController::LOCAL_TETHER_COUNTERS_CHAIN);
 }
 
-int BandwidthController::getTetherStats(SocketClient *cli, TetherStats& filter,
-                                        std::string &extraProcessingInfo) {
+int BandwidthController::readTetherStats(const TetherStats& filter, TetherStatsList& statsList,
+                                         std::string &extraProcessingInfo) {
     int res = 0;
     std::string fullCmd;
     FILE *iptOutput;
 
-    TetherStatsList statsList;
+    if (tetherCounters && tetherCounters->isEnabled()) {
+        std::vector<TetherCounters::Counter> counters;
+        res = tetherCounters->read(&counters);
+        if (res == 0) {
+            return addTetherCounterStats(filter, statsList, counters, extraProcessingInfo);
+        }
+        /* The rules still have iptables counters of their own. */
+        ALOGE("Failed to read tether counters (%s), listing iptables", strerror(-res));
+    }
 
     for (const auto binary : {IPTABLES_PATH, IP6TABLES_PATH}) {
         fullCmd = getTetherStatsCommand(binary);
@@ -1370,6 +1511,27 @@ int BandwidthController::getTetherStats(SocketClient *cli, TetherStats& filter,
             return res;
         }
     }
+    return 0;
+}
+
+int BandwidthController::getTetherStats(std::vector<TetherStats> *statsList,
+                                        std::string &extraProcessingInfo) {
+    TetherStatsList stats;
+    int res = readTetherStats(TetherStats(), stats, extraProcessingInfo);
+    if (res != 0) {
+        return res;
+    }
+    *statsList = stats.release();
+    return 0;
+}
+
+int BandwidthController::getTetherStats(SocketClient *cli, TetherStats& filter,
+                                        std::string &extraProcessingInfo) {
+    TetherStatsList statsList;
+    int res = readTetherStats(filter, statsList, extraProcessingInfo);
+    if (res != 0) {
+        return res;
+    }
 
     if (filter.intIface[0] && filter.extIface[0] && statsList.size() == 1) {
         cli->sendMsg(ResponseCode::TetheringStatsResult, statsList[0].getStatsLine(), false);
@@ -1377,12 +1539,10 @@ int BandwidthController::getTetherStats(SocketClient *cli, TetherStats& filter,
         for (const auto& stats: statsList) {
             cli->sendMsg(ResponseCode::TetheringStatsListResult, stats.getStatsLine(), false);
         }
-        if (res == 0) {
-            cli->sendMsg(ResponseCode::CommandOkay, "Tethering stats list completed", false);
-        }
+        cli->sendMsg(ResponseCode::CommandOkay, "Tethering stats list completed", false);
     }
 
-    return res;
+    return 0;
 }
 
 void BandwidthController::flushExistingCostlyTables(bool doClean) {
@@ -1406,8 +1566,8 @@ void BandwidthController::parseAndFlushCostlyTables(FILE *fp, bool doRemove) {
     int res;
     char lineBuffer[MAX_IPT_OUTPUT_LINE_LEN];
     char costlyIfaceName[MAX_IPT_OUTPUT_LINE_LEN];
-    char cmd[MAX_CMD_LEN];
     char *buffPtr;
+    IptablesTransaction t(iptablesRestoreSilentlyFunction);
 
     while (NULL != (buffPtr = fgets(lineBuffer, MAX_IPT_OUTPUT_LINE_LEN, fp))) {
         costlyIfaceName[0] = '\0';   /* So that debugging output always works */
@@ -1422,11 +1582,10 @@ void BandwidthController::parseAndFlushCostlyTables(FILE *fp, bool doRemove) {
             continue;
         }
 
-        snprintf(cmd, sizeof(cmd), "-F bw_costly_%s", costlyIfaceName);
-        runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
+        t.addf(V4V6, "filter", "-F bw_costly_%s", costlyIfaceName);
         if (doRemove) {
-            snprintf(cmd, sizeof(cmd), "-X bw_costly_%s", costlyIfaceName);
-            runIpxtablesCmd(cmd, IptJumpNoAdd, IptFailHide);
+            t.addf(V4V6, "filter", "-X bw_costly_%s", costlyIfaceName);
         }
     }
+    t.commitBestEffort();
 }
@@ -16,14 +16,20 @@
 #ifndef _BANDWIDTH_CONTROLLER_H
 #define _BANDWIDTH_CONTROLLER_H
 
-#include <list>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>  // for pair
+#include <vector>
 
 #include <sysutils/SocketClient.h>
 #include <utils/RWLock.h>
 
+#include "IptablesTransaction.h"
 #include "NetdConstants.h"
+#include "QuotaRegistry.h"
+#include "TetherCounters.h"
+#include "UidCounters.h"
 
 class BandwidthController {
 public:
@@ -65,7 +71,9 @@ public:
         }
     };
 
-    BandwidthController();
+    // Tethering stats come from |tetherCounters| if NatController counts into them, or from the
+    // iptables counters of NatController's rules otherwise.
+    explicit BandwidthController(TetherCounters* tetherCounters = nullptr);
 
     int setupIptablesHooks(void);
 
@@ -81,11 +89,37 @@ public:
     int getInterfaceQuota(const char *iface, int64_t *bytes);
     int removeInterfaceQuota(const char *iface);
 
+    /*
+     * Reads the bytes left in the shared quota, named "shared", and in every interface quota, in
+     * one call. Quotas that can't be read are left out, and make the result -1.
+     */
+    int getQuotas(QuotaRegistry::QuotaList *quotaList);
+
+    /*
+     * Per-uid traffic counters, kept in nfacct objects that rules in bw_uid_INPUT and
+     * bw_uid_OUTPUT count into. An empty iface counts the uid's traffic on all interfaces.
+     * They fail with -1 if setupIptablesHooks() found that the kernel can't do this.
+     */
+    int addUidCounter(int32_t uid, const std::string& iface);
+    int removeUidCounter(int32_t uid, const std::string& iface);
+    /*
+     * Reads all uid counters, and replaces |snapshot| with the packed UidCounters snapshot of
+     * those that changed after generation |since|, or of all of them if |since| is 0.
+     */
+    int getUidStats(uint64_t since, std::vector<uint8_t> *snapshot);
+
     int addNaughtyApps(int numUids, char *appUids[]);
     int removeNaughtyApps(int numUids, char *appUids[]);
     int addNiceApps(int numUids, char *appUids[]);
     int removeNiceApps(int numUids, char *appUids[]);
 
+    /*
+     * Replace the whole contents of bw_penalty_box / bw_happy_box with appUids, atomically and
+     * with one iptables-restore payload. The system uids always stay in bw_happy_box.
+     */
+    int replaceNaughtyApps(const std::vector<int32_t>& appUids);
+    int replaceNiceApps(const std::vector<int32_t>& appUids);
+
     int setGlobalAlert(int64_t bytes);
     int removeGlobalAlert(void);
     int setGlobalAlertInForwardChain(void);
@@ -113,6 +147,12 @@ public:
      */
     int getTetherStats(SocketClient *cli, TetherStats &stats, std::string &extraProcessingInfo);
 
+    /*
+     * Replaces |statsList| with the stats of all tethering interface pairs, with no text
+     * formatting. Same errors as above.
+     */
+    int getTetherStats(std::vector<TetherStats> *statsList, std::string &extraProcessingInfo);
+
     static const char* LOCAL_INPUT;
     static const char* LOCAL_FORWARD;
     static const char* LOCAL_OUTPUT;
@@ -129,7 +169,6 @@ protected:
         int64_t alert;
     };
 
-    enum IptIpVer { IptIpV4, IptIpV6 };
     enum IptOp { IptOpInsert, IptOpReplace, IptOpDelete, IptOpAppend };
     enum IptJumpOp { IptJumpReject, IptJumpReturn, IptJumpNoAdd };
     enum SpecialAppOp { SpecialAppOpAdd, SpecialAppOpRemove };
@@ -142,8 +181,14 @@ protected:
     enum IptFailureLog { IptFailShow, IptFailHide = IptFailShow };
 #endif
 
+    /*
+     * The uids that currently have a rule in one of the uid chains we own. Adding a uid that is
+     * already there, or removing one that isn't, doesn't touch iptables at all.
+     */
+    typedef std::unordered_set<int> UidSet;
+
     int manipulateSpecialApps(int numUids, char *appStrUids[],
-                               const char *chain,
+                               const char *chain, UidSet& appUids,
                                IptJumpOp jumpHandling, SpecialAppOp appOp);
     int manipulateNaughtyApps(int numUids, char *appStrUids[], SpecialAppOp appOp);
     int manipulateNiceApps(int numUids, char *appStrUids[], SpecialAppOp appOp);
@@ -151,15 +196,41 @@ protected:
     int manipulateRestrictAppsOnData(int numUids, char* appStrUids[], RestrictAppOp appOp);
     int manipulateRestrictAppsOnWlan(int numUids, char* appStrUids[], RestrictAppOp appOp);
     int manipulateRestrictApps(int numUids, char *appStrUids[],
-                               const char *chain,
-                               std::list<int /*appUid*/> &restrictAppUids,
-                               RestrictAppOp appOp);
+                               const std::vector<std::string>& chains,
+                               UidSet& restrictAppUids, RestrictAppOp appOp);
+
+    /*
+     * Rebuilds chain with startCommands, a rule for each of uids, and endCommand, and updates
+     * appUids to match. Nothing runs if appUids already holds exactly these uids.
+     */
+    int replaceSpecialApps(const char *chain, UidSet& appUids, const std::vector<int32_t>& uids,
+                           IptJumpOp jumpHandling, const std::vector<std::string>& startCommands,
+                           const std::string& endCommand);
+
+    // Parses appStrUids into uids. Returns false if one of them is not a number.
+    static bool parseUids(int numUids, char *appStrUids[], const char *chain,
+                          std::vector<int> *uids);
+
+    /*
+     * Takes the uid rules in each of chains from current to target with one iptables-restore
+     * batch: rules are inserted for the uids only in target, and deleted for the uids only in
+     * current. Nothing runs if the two are the same. Updates current once the rules are in place.
+     * If inserting fails, the rules of every uid involved are deleted from both families, and
+     * current keeps only the uids that were in neither list.
+     */
+    int updateUidRules(UidSet& current, const UidSet& target,
+                       const std::vector<std::string>& chains, IptJumpOp jumpHandling);
 
     int prepCostlyIface(const char *ifn, QuotaType quotaType);
     int cleanupCostlyIface(const char *ifn, QuotaType quotaType);
 
     std::string makeIptablesSpecialAppCmd(IptOp op, int uid, const char *chain);
     std::string makeIptablesQuotaCmd(IptOp op, const char *costName, int64_t quota);
+    /* Adds (IptOpAppend) or deletes (IptOpDelete) the rules that count into a uid counter. */
+    static void addUidCounterRules(IptablesTransaction *t, IptOp op, int32_t uid,
+                                   const std::string& iface);
+    /* Sets uidCountersSupported by adding a counter and removing it again. */
+    void probeUidCounters();
 
     int runIptablesAlertCmd(IptOp op, const char *alertName, int64_t bytes);
     int runIptablesAlertFwdCmd(IptOp op, const char *alertName, int64_t bytes);
@@ -169,8 +240,10 @@ protected:
     /* Runs for both ipv4 and ipv6 iptables, appends -j REJECT --reject-with ...  */
     static int runIpxtablesCmd(const char *cmd, IptJumpOp jumpHandling,
                                IptFailureLog failureHandling = IptFailShow);
-    static int runIptablesCmd(const char *cmd, IptJumpOp jumpHandling, IptIpVer iptIpVer,
-                              IptFailureLog failureHandling = IptFailShow);
+    /* Adds cmd to t for both ipv4 and ipv6 iptables, with the same jump handling as above. */
+    static void addIpxtablesCmd(IptablesTransaction* t, const std::string& cmd,
+                                IptJumpOp jumpHandling);
+    static IptablesTransaction::RestoreFunction restoreFunctionFor(IptFailureLog failureHandling);
 
 
     // Provides strncpy() + check overflow.
@@ -181,14 +254,72 @@ protected:
     int setCostlyAlert(const char *costName, int64_t bytes, int64_t *alertBytes);
     int removeCostlyAlert(const char *costName, int64_t *alertBytes);
 
-    typedef std::vector<TetherStats> TetherStatsList;
+    /*
+     * Tether stats in the order their interface pairs were first seen, indexed by interface pair.
+     */
+    class TetherStatsList {
+    public:
+        // Adds |stats| to the entry for the same interface pair, or appends a new entry.
+        void add(const TetherStats& stats);
+        // Returns the entry for the given pair, or nullptr. Invalidated by add().
+        TetherStats* find(const std::string& intIface, const std::string& extIface);
+        // Moves all entries out, leaving the list empty.
+        std::vector<TetherStats> release();
+
+        size_t size() const { return mStats.size(); }
+        const TetherStats& operator[](size_t i) const { return mStats[i]; }
+        std::vector<TetherStats>::const_iterator begin() const { return mStats.begin(); }
+        std::vector<TetherStats>::const_iterator end() const { return mStats.end(); }
+
+    private:
+        // Interface names never contain spaces.
+        static std::string key(const std::string& intIface, const std::string& extIface) {
+            return intIface + " " + extIface;
+        }
+
+        std::vector<TetherStats> mStats;
+        std::unordered_map<std::string, size_t> mIndex;
+    };
 
-    static void addStats(TetherStatsList& statsList, const TetherStats& stats);
+    /*
+     * Adds the counter of traffic from iface0 to iface1 to the pair it belongs to in pairs.
+     * NatController counts in:intIface out:extIface (rx) of each pair before in:extIface
+     * out:intIface (tx), so the first counter seen for two interfaces names the pair.
+     */
+    static void addPairCounter(TetherStatsList& pairs, const std::string& iface0,
+                               const std::string& iface1, int64_t packets, int64_t bytes);
+
+    /*
+     * Adds the pairs that match filter to statsList. It is an error to find a pair with only one
+     * direction, or to find nothing when not filtering.
+     */
+    static int addMatchingPairs(const TetherStats& filter, const TetherStatsList& pairs,
+                                TetherStatsList& statsList);
 
+    /*
+     * Adds the tether counters in the iptables -nvx -L output in fp to statsList.
+     * extraProcessingInfo: contains raw parsed data, and error info.
+     */
     static int addForwardChainStats(const TetherStats& filter,
                                     TetherStatsList& statsList, FILE *fp,
                                     std::string &extraProcessingInfo);
 
+    /*
+     * Adds the tether counters read from nfacct, which cover both IP families, to statsList.
+     * extraProcessingInfo: contains raw data, and error info.
+     */
+    static int addTetherCounterStats(const TetherStats& filter, TetherStatsList& statsList,
+                                     const std::vector<TetherCounters::Counter>& counters,
+                                     std::string &extraProcessingInfo);
+
+    /*
+     * Adds the tether counters that match filter to statsList. They are read with one nfacct dump
+     * if NatController counts into tetherCounters. Otherwise, or if that fails, the tether
+     * counters chain is listed for each IP family.
+     */
+    int readTetherStats(const TetherStats& filter, TetherStatsList& statsList,
+                        std::string &extraProcessingInfo);
+
 
     /*
      * stats should never have only intIface initialized. Other 3 combos are ok.
@@ -220,7 +351,7 @@ protected:
 
     /*------------------*/
 
-    std::list<std::string> sharedQuotaIfaces;
+    std::unordered_set<std::string> sharedQuotaIfaces;
     int64_t sharedQuotaBytes;
     int64_t sharedAlertBytes;
     int64_t globalAlertBytes;
@@ -234,16 +365,30 @@ protected:
      */
     int globalAlertTetherCount;
 
-    std::list<QuotaInfo> quotaIfaces;
+    std::unordered_map<std::string, QuotaInfo> quotaIfaces;  // Indexed by interface name.
+    // The counters of the quotas and alerts above.
+    QuotaRegistry quotas;
+
+    UidCounters uidCounters;
+    // Whether the kernel has NETLINK_NETFILTER, nfacct and the nfacct match. Checked at startup.
+    bool uidCountersSupported;
+
+    // Owned by the caller. May be null.
+    TetherCounters* const tetherCounters;
+
+    // What bw_penalty_box, bw_happy_box and bw_data_saver currently hold.
+    UidSet naughtyAppUids;
+    UidSet niceAppUids;
+    bool dataSaverEnabled;
 
     // For testing.
     friend class BandwidthControllerTest;
-    static int (*execFunction)(int, char **, int *, bool, bool);
     static FILE *(*popenFunction)(const char *, const char *);
     static int (*iptablesRestoreFunction)(IptablesTarget, const std::string&);
+    static int (*iptablesRestoreSilentlyFunction)(IptablesTarget, const std::string&);
 
-    std::list<int /*appUid*/> restrictAppUidsOnData;
-    std::list<int /*appUid*/> restrictAppUidsOnWlan;
+    UidSet restrictAppUidsOnData;
+    UidSet restrictAppUidsOnWlan;
 };
 
 #endif
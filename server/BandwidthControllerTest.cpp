@@ -16,9 +16,12 @@
  * BandwidthControllerTest.cpp - unit tests for BandwidthController.cpp
  */
 
+#include <chrono>
 #include <string>
 #include <vector>
 
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -26,6 +29,8 @@
 
 #include <gtest/gtest.h>
 
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 
 #include "BandwidthController.h"
@@ -34,9 +39,9 @@
 class BandwidthControllerTest : public IptablesBaseTest {
 public:
     BandwidthControllerTest() {
-        BandwidthController::execFunction = fake_android_fork_exec;
         BandwidthController::popenFunction = fake_popen;
         BandwidthController::iptablesRestoreFunction = fakeExecIptablesRestore;
+        BandwidthController::iptablesRestoreSilentlyFunction = fakeExecIptablesRestore;
     }
     BandwidthController mBw;
 
@@ -52,28 +57,117 @@ public:
     void clearPopenContents() {
         sPopenContents.clear();
     }
+
+    typedef BandwidthController::TetherStats TetherStats;
+    typedef BandwidthController::TetherStatsList TetherStatsList;
+
+    // Not netd's own prefix, so that running the tests doesn't touch its counters.
+    static constexpr const char* kTestCounterPrefix = "natctrl_test";
+
+    static int addForwardChainStats(FILE *fp, TetherStatsList *statsList) {
+        std::string extraProcessingInfo;
+        return BandwidthController::addForwardChainStats(BandwidthController::TetherStats(),
+                                                         *statsList, fp, extraProcessingInfo);
+    }
+
+    static std::string statsLine(const TetherStats& stats) {
+        char *line = stats.getStatsLine();
+        std::string s(line);
+        free(line);
+        return s;
+    }
+
+    static int addTetherCounterStats(const TetherStats& filter,
+                                     const std::vector<TetherCounters::Counter>& counters,
+                                     TetherStatsList *statsList) {
+        std::string extraProcessingInfo;
+        return BandwidthController::addTetherCounterStats(filter, *statsList, counters,
+                                                          extraProcessingInfo);
+    }
+
+    void setQuotaDirectory(const std::string& dir) {
+        mBw.quotas.setDirectory(dir);
+    }
+
+    // Makes every iptables-restore call fail, or succeed again.
+    void setRestoreFails(bool fail) {
+        BandwidthController::iptablesRestoreFunction =
+                fail ? fakeFailingRestore : fakeExecIptablesRestore;
+    }
+
+    // Makes only the IPv6 iptables-restore calls fail, until setRestoreFails(false).
+    void setV6RestoreFails() {
+        BandwidthController::iptablesRestoreFunction = fakeFailingV6Restore;
+    }
+
+    static int fakeFailingRestore(IptablesTarget target, const std::string& commands) {
+        fakeExecIptablesRestore(target, commands);
+        return -1;
+    }
+
+    static int fakeFailingV6Restore(IptablesTarget target, const std::string& commands) {
+        fakeExecIptablesRestore(target, commands);
+        return (target == V6) ? -1 : 0;
+    }
+
+    // Expects one iptables-restore filter table payload per IP family.
+    void expectFilterRestoreCommands(const std::vector<std::string>& rules) {
+        std::string payload = "*filter\n" + android::base::Join(rules, '\n') + "\nCOMMIT\n";
+        expectIptablesRestoreCommands({ { V4, payload }, { V6, payload } });
+    }
 };
 
 TEST_F(BandwidthControllerTest, TestSetupIptablesHooks) {
     mBw.setupIptablesHooks();
-    std::vector<std::string> expected = {
+    // After the flush, it checks that uid counters work by adding one and removing it again.
+    std::string probeAdd =
         "*filter\n"
-        ":bw_INPUT -\n"
-        ":bw_OUTPUT -\n"
-        ":bw_FORWARD -\n"
-        ":bw_happy_box -\n"
-        ":bw_penalty_box -\n"
-        ":bw_data_saver -\n"
-        ":bw_costly_shared -\n"
-        "COMMIT\n"
-        "*raw\n"
-        ":bw_raw_PREROUTING -\n"
-        "COMMIT\n"
-        "*mangle\n"
-        ":bw_mangle_POSTROUTING -\n"
-        "COMMIT\n\x04"
+        "-A bw_uid_INPUT -m owner --uid-owner 65534 -m nfacct --nfacct-name bwu65534__r\n"
+        "-A bw_uid_OUTPUT -m owner --uid-owner 65534 -m nfacct --nfacct-name bwu65534__t\n"
+        "COMMIT\n";
+    std::string probeRemove =
+        "*filter\n"
+        "-D bw_uid_INPUT -m owner --uid-owner 65534 -m nfacct --nfacct-name bwu65534__r\n"
+        "-D bw_uid_OUTPUT -m owner --uid-owner 65534 -m nfacct --nfacct-name bwu65534__t\n"
+        "COMMIT\n";
+    ExpectedIptablesCommands expected = {
+        { V4V6,
+          "*filter\n"
+          ":bw_INPUT -\n"
+          ":bw_OUTPUT -\n"
+          ":bw_FORWARD -\n"
+          ":bw_uid_INPUT -\n"
+          ":bw_uid_OUTPUT -\n"
+          ":bw_happy_box -\n"
+          ":bw_penalty_box -\n"
+          ":bw_data_saver -\n"
+          ":bw_costly_shared -\n"
+          "COMMIT\n"
+          "*raw\n"
+          ":bw_raw_PREROUTING -\n"
+          "COMMIT\n"
+          "*mangle\n"
+          ":bw_mangle_POSTROUTING -\n"
+          "COMMIT\n\x04" },
+        { V4, probeAdd },
+        { V6, probeAdd },
+        { V4, probeRemove },
+        { V6, probeRemove },
     };
     expectIptablesRestoreCommands(expected);
+    EXPECT_EQ(0, mBw.addUidCounter(99998, "lo"));
+    EXPECT_EQ(0, mBw.removeUidCounter(99998, "lo"));
+    sRestoreCmds.clear();
+
+    // If the kernel can't do it, uid counters stay off and touch nothing.
+    setRestoreFails(true);
+    mBw.setupIptablesHooks();
+    setRestoreFails(false);
+    sRestoreCmds.clear();
+    EXPECT_EQ(-1, mBw.addUidCounter(99998, "lo"));
+    std::vector<uint8_t> snapshot;
+    EXPECT_EQ(-1, mBw.getUidStats(0, &snapshot));
+    expectIptablesRestoreCommands(std::vector<std::string>());
 }
 
 TEST_F(BandwidthControllerTest, TestEnableBandwidthControl) {
@@ -83,6 +177,8 @@ TEST_F(BandwidthControllerTest, TestEnableBandwidthControl) {
         ":bw_INPUT -\n"
         ":bw_OUTPUT -\n"
         ":bw_FORWARD -\n"
+        ":bw_uid_INPUT -\n"
+        ":bw_uid_OUTPUT -\n"
         ":bw_happy_box -\n"
         ":bw_penalty_box -\n"
         ":bw_data_saver -\n"
@@ -98,6 +194,8 @@ TEST_F(BandwidthControllerTest, TestEnableBandwidthControl) {
         "*filter\n"
         "-A bw_INPUT -m owner --socket-exists\n"
         "-A bw_OUTPUT -m owner --socket-exists\n"
+        "-A bw_INPUT --jump bw_uid_INPUT\n"
+        "-A bw_OUTPUT --jump bw_uid_OUTPUT\n"
         "-A bw_costly_shared --jump bw_penalty_box\n"
         "-A bw_penalty_box --jump bw_happy_box\n"
         "-A bw_happy_box --jump bw_data_saver\n"
@@ -121,6 +219,8 @@ TEST_F(BandwidthControllerTest, TestDisableBandwidthControl) {
         ":bw_INPUT -\n"
         ":bw_OUTPUT -\n"
         ":bw_FORWARD -\n"
+        ":bw_uid_INPUT -\n"
+        ":bw_uid_OUTPUT -\n"
         ":bw_happy_box -\n"
         ":bw_penalty_box -\n"
         ":bw_data_saver -\n"
@@ -137,16 +237,334 @@ TEST_F(BandwidthControllerTest, TestDisableBandwidthControl) {
 
 TEST_F(BandwidthControllerTest, TestEnableDataSaver) {
     mBw.enableDataSaver(true);
+    expectFilterRestoreCommands({ "-R bw_data_saver 1 --jump REJECT" });
+
+    // Already enabled.
+    EXPECT_EQ(0, mBw.enableDataSaver(true));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+
+    mBw.enableDataSaver(false);
+    expectFilterRestoreCommands({ "-R bw_data_saver 1 --jump RETURN" });
+}
+
+TEST_F(BandwidthControllerTest, TestManipulateSpecialApps) {
+    char uid1[] = "10003";
+    char uid2[] = "10042";
+    char *uids[] = { uid1, uid2 };
+
+    EXPECT_EQ(0, mBw.addNaughtyApps(2, uids));
+    expectFilterRestoreCommands({
+        "-I bw_penalty_box -m owner --uid-owner 10003 --jump REJECT",
+        "-I bw_penalty_box -m owner --uid-owner 10042 --jump REJECT",
+    });
+
+    // Uids that are already there are skipped, and if that's all of them nothing runs at all.
+    EXPECT_EQ(0, mBw.addNaughtyApps(2, uids));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+
+    char uid3[] = "10050";
+    char *moreUids[] = { uid3, uid2, uid3 };
+    EXPECT_EQ(0, mBw.addNaughtyApps(3, moreUids));
+    expectFilterRestoreCommands({
+        "-I bw_penalty_box -m owner --uid-owner 10050 --jump REJECT",
+    });
+
+    // Likewise, only the uids that are there are removed.
+    char *removeUids[] = { uid1, uid3 };
+    EXPECT_EQ(0, mBw.removeNiceApps(2, removeUids));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+    EXPECT_EQ(0, mBw.removeNaughtyApps(2, removeUids));
+    expectFilterRestoreCommands({
+        "-D bw_penalty_box -m owner --uid-owner 10003 --jump REJECT",
+        "-D bw_penalty_box -m owner --uid-owner 10050 --jump REJECT",
+    });
+
+    EXPECT_EQ(0, mBw.addNiceApps(2, removeUids));
+    expectFilterRestoreCommands({
+        "-I bw_happy_box -m owner --uid-owner 10003 --jump RETURN",
+        "-I bw_happy_box -m owner --uid-owner 10050 --jump RETURN",
+    });
+
+    char bad[] = "10003x";
+    char *badUids[] = { uid1, bad };
+    EXPECT_EQ(-1, mBw.addNaughtyApps(2, badUids));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+
+    // Bandwidth control starts with empty boxes.
+    mBw.enableBandwidthControl(true);
+    sRestoreCmds.clear();
+    EXPECT_EQ(0, mBw.removeNaughtyApps(2, uids));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+    EXPECT_EQ(0, mBw.addNiceApps(2, removeUids));
+    expectFilterRestoreCommands({
+        "-I bw_happy_box -m owner --uid-owner 10003 --jump RETURN",
+        "-I bw_happy_box -m owner --uid-owner 10050 --jump RETURN",
+    });
+}
+
+TEST_F(BandwidthControllerTest, TestManipulateSpecialAppsFailure) {
+    char uid1[] = "10003";
+    char uid2[] = "10042";
+    char *uids[] = { uid1, uid2 };
+
+    // A failed add leaves nothing behind, so the same uids are tried again next time.
+    setRestoreFails(true);
+    EXPECT_EQ(-1, mBw.addNaughtyApps(2, uids));
+    sRestoreCmds.clear();
+    setRestoreFails(false);
+    EXPECT_EQ(0, mBw.addNaughtyApps(2, uids));
+    expectFilterRestoreCommands({
+        "-I bw_penalty_box -m owner --uid-owner 10003 --jump REJECT",
+        "-I bw_penalty_box -m owner --uid-owner 10042 --jump REJECT",
+    });
+
+    // If only IPv6 fails, the IPv4 rule is rolled back, and deleted from both families to make
+    // sure. The uid isn't remembered, so it's tried again in full.
+    char uid3[] = "10050";
+    char *moreUids[] = { uid3 };
+    setV6RestoreFails();
+    EXPECT_EQ(-1, mBw.addNaughtyApps(1, moreUids));
+    const std::string insert =
+            "*filter\n-I bw_penalty_box -m owner --uid-owner 10050 --jump REJECT\nCOMMIT\n";
+    const std::string remove =
+            "*filter\n-D bw_penalty_box -m owner --uid-owner 10050 --jump REJECT\nCOMMIT\n";
+    expectIptablesRestoreCommands({
+        { V4, insert }, { V6, insert }, { V4, remove }, { V4, remove }, { V6, remove },
+    });
+    setRestoreFails(false);
+    EXPECT_EQ(0, mBw.addNaughtyApps(1, moreUids));
+    expectFilterRestoreCommands({
+        "-I bw_penalty_box -m owner --uid-owner 10050 --jump REJECT",
+    });
+}
+
+TEST_F(BandwidthControllerTest, TestReplaceSpecialApps) {
+    EXPECT_EQ(0, mBw.replaceNaughtyApps({ 10042, 10003, 10042 }));
     std::vector<std::string> expected = {
-        "-R bw_data_saver 1 --jump REJECT",
+        "*filter\n"
+        ":bw_penalty_box -\n"
+        "-A bw_penalty_box -m owner --uid-owner 10003 --jump REJECT\n"
+        "-A bw_penalty_box -m owner --uid-owner 10042 --jump REJECT\n"
+        "-A bw_penalty_box --jump bw_happy_box\n"
+        "COMMIT\n\x04"
     };
-    expectIptablesCommands(expected);
+    expectIptablesRestoreCommands(expected);
 
-    mBw.enableDataSaver(false);
+    // The same uids again, in any order, don't need iptables.
+    EXPECT_EQ(0, mBw.replaceNaughtyApps({ 10003, 10042 }));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+
+    // Adding and removing carry on from the list that was set.
+    char uid1[] = "10003";
+    char uid2[] = "10042";
+    char *uids[] = { uid1, uid2 };
+    EXPECT_EQ(0, mBw.addNaughtyApps(1, uids));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+    EXPECT_EQ(0, mBw.removeNaughtyApps(1, uids + 1));
+    expectFilterRestoreCommands({
+        "-D bw_penalty_box -m owner --uid-owner 10042 --jump REJECT",
+    });
+
+    EXPECT_EQ(0, mBw.replaceNaughtyApps({}));
     expected = {
-        "-R bw_data_saver 1 --jump RETURN",
+        "*filter\n"
+        ":bw_penalty_box -\n"
+        "-A bw_penalty_box --jump bw_happy_box\n"
+        "COMMIT\n\x04"
+    };
+    expectIptablesRestoreCommands(expected);
+
+    // The system uids stay in the happy box.
+    EXPECT_EQ(0, mBw.replaceNiceApps({ 10050 }));
+    expected = {
+        "*filter\n"
+        ":bw_happy_box -\n"
+        "-I bw_happy_box -m owner --uid-owner 0-9999 --jump RETURN\n"
+        "-A bw_happy_box -m owner --uid-owner 10050 --jump RETURN\n"
+        "-A bw_happy_box --jump bw_data_saver\n"
+        "COMMIT\n\x04"
     };
-    expectIptablesCommands(expected);
+    expectIptablesRestoreCommands(expected);
+
+    // A failed replace is tried again in full.
+    setRestoreFails(true);
+    EXPECT_EQ(-1, mBw.replaceNiceApps({ 10051 }));
+    sRestoreCmds.clear();
+    setRestoreFails(false);
+    EXPECT_EQ(0, mBw.replaceNiceApps({ 10051 }));
+    EXPECT_EQ(1U, sRestoreCmds.size());
+    sRestoreCmds.clear();
+}
+
+TEST_F(BandwidthControllerTest, TestManipulateRestrictApps) {
+    char uid1[] = "10003";
+    char uid2[] = "10042";
+    char *uids[] = { uid1, uid2 };
+
+    // Both directions go in the same batch.
+    EXPECT_EQ(0, mBw.addRestrictAppsOnData(1, uids));
+    expectFilterRestoreCommands({
+        "-I INPUT -i rmnet_data0 -m owner --uid-owner 10003 --jump REJECT",
+        "-I OUTPUT -o rmnet_data0 -m owner --uid-owner 10003 --jump REJECT",
+    });
+
+    EXPECT_EQ(0, mBw.addRestrictAppsOnData(2, uids));
+    expectFilterRestoreCommands({
+        "-I INPUT -i rmnet_data0 -m owner --uid-owner 10042 --jump REJECT",
+        "-I OUTPUT -o rmnet_data0 -m owner --uid-owner 10042 --jump REJECT",
+    });
+
+    // Removing a uid that isn't there is an error, and removes none of the others either.
+    EXPECT_EQ(-1, mBw.removeRestrictAppsOnWlan(2, uids));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+    char uid3[] = "10050";
+    char *someMissing[] = { uid1, uid3 };
+    EXPECT_EQ(-1, mBw.removeRestrictAppsOnData(2, someMissing));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+
+    EXPECT_EQ(0, mBw.removeRestrictAppsOnData(1, uids));
+    expectFilterRestoreCommands({
+        "-D INPUT -i rmnet_data0 -m owner --uid-owner 10003 --jump REJECT",
+        "-D OUTPUT -o rmnet_data0 -m owner --uid-owner 10003 --jump REJECT",
+    });
+}
+
+TEST_F(BandwidthControllerTest, TestSetInterfaceQuota) {
+    // Start from a clean state, with no global alert.
+    mBw.enableBandwidthControl(true);
+    sRestoreCmds.clear();
+
+    // The stale jumps are removed separately, since they are allowed to fail.
+    EXPECT_EQ(0, mBw.setInterfaceQuota("rmnet0", 123456));
+    std::string cleanup =
+            "*filter\n"
+            "-D bw_INPUT -i rmnet0 --jump bw_costly_rmnet0\n"
+            "-D bw_OUTPUT -o rmnet0 --jump bw_costly_rmnet0\n"
+            "-D bw_FORWARD -o rmnet0 --jump bw_costly_rmnet0\n"
+            "COMMIT\n";
+    std::string prep =
+            "*filter\n"
+            ":bw_costly_rmnet0 -\n"
+            "-A bw_costly_rmnet0 -j bw_penalty_box\n"
+            "-I bw_INPUT 1 -i rmnet0 --jump bw_costly_rmnet0\n"
+            "-I bw_OUTPUT 1 -o rmnet0 --jump bw_costly_rmnet0\n"
+            "-A bw_FORWARD -o rmnet0 --jump bw_costly_rmnet0\n"
+            "COMMIT\n";
+    std::string quota =
+            "*filter\n"
+            "-A bw_costly_rmnet0 -m quota2 ! --quota 123456 --name rmnet0 --jump REJECT\n"
+            "COMMIT\n";
+    expectIptablesRestoreCommands({
+        { V4, cleanup }, { V6, cleanup },
+        { V4, prep }, { V6, prep },
+        { V4, quota }, { V6, quota },
+    });
+
+    // Setting the same quota again is a no-op; changing it only writes to /proc.
+    EXPECT_EQ(0, mBw.setInterfaceQuota("rmnet0", 123456));
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+
+    EXPECT_EQ(0, mBw.removeInterfaceQuota("rmnet0"));
+    expectFilterRestoreCommands({
+        "-D bw_INPUT -i rmnet0 --jump bw_costly_rmnet0",
+        "-D bw_OUTPUT -o rmnet0 --jump bw_costly_rmnet0",
+        "-D bw_FORWARD -o rmnet0 --jump bw_costly_rmnet0",
+        "-F bw_costly_rmnet0",
+        "-X bw_costly_rmnet0",
+    });
+}
+
+TEST_F(BandwidthControllerTest, TestGetQuotas) {
+    char dir[] = "/data/local/tmp/bandwidth_controller_test.XXXXXX";
+    ASSERT_NE(nullptr, mkdtemp(dir));
+    const std::string rmnet0 = std::string(dir) + "/rmnet0";
+    const std::string shared = std::string(dir) + "/shared";
+    setQuotaDirectory(dir);
+
+    mBw.enableBandwidthControl(true);
+    EXPECT_EQ(0, mBw.setInterfaceQuota("rmnet0", 123456));
+    EXPECT_EQ(0, mBw.setInterfaceSharedQuota("wlan0", 1000));
+    sRestoreCmds.clear();
+
+    // This is what xt_quota2 would have created for those rules.
+    ASSERT_TRUE(android::base::WriteStringToFile("123400\n", rmnet0));
+    ASSERT_TRUE(android::base::WriteStringToFile("900\n", shared));
+
+    QuotaRegistry::QuotaList quotas;
+    EXPECT_EQ(0, mBw.getQuotas(&quotas));
+    QuotaRegistry::QuotaList expected = { { "rmnet0", 123400 }, { "shared", 900 } };
+    EXPECT_EQ(expected, quotas);
+
+    // Changing a quota writes to the same file.
+    EXPECT_EQ(0, mBw.setInterfaceQuota("rmnet0", 5000));
+    int64_t bytes;
+    EXPECT_EQ(0, mBw.getInterfaceQuota("rmnet0", &bytes));
+    EXPECT_EQ(5000, bytes);
+
+    // A quota that can't be read is left out.
+    ASSERT_EQ(0, unlink(shared.c_str()));
+    mBw.removeInterfaceSharedQuota("wlan0");
+    EXPECT_EQ(0, mBw.setInterfaceSharedQuota("wlan0", 1000));
+    EXPECT_EQ(-1, mBw.getQuotas(&quotas));
+    expected = { { "rmnet0", 5000 } };
+    EXPECT_EQ(expected, quotas);
+    sRestoreCmds.clear();
+
+    unlink(rmnet0.c_str());
+    rmdir(dir);
+}
+
+TEST_F(BandwidthControllerTest, TestUidCounters) {
+    const int32_t uid = 99998;
+    EXPECT_EQ(0, mBw.addUidCounter(uid, "lo"));
+    expectFilterRestoreCommands({
+        "-A bw_uid_INPUT -i lo -m owner --uid-owner 99998 -m nfacct --nfacct-name bwu99998_lo_r",
+        "-A bw_uid_OUTPUT -o lo -m owner --uid-owner 99998 -m nfacct --nfacct-name bwu99998_lo_t",
+    });
+    EXPECT_EQ(0, mBw.addUidCounter(uid, ""));
+    expectFilterRestoreCommands({
+        "-A bw_uid_INPUT -m owner --uid-owner 99998 -m nfacct --nfacct-name bwu99998__r",
+        "-A bw_uid_OUTPUT -m owner --uid-owner 99998 -m nfacct --nfacct-name bwu99998__t",
+    });
+
+    // Adding a counter again changes nothing.
+    EXPECT_EQ(0, mBw.addUidCounter(uid, "lo"));
+    expectIptablesRestoreCommands(std::vector<std::string>());
+
+    EXPECT_EQ(-1, mBw.addUidCounter(-1, "lo"));
+    EXPECT_EQ(-1, mBw.addUidCounter(uid, "lo; reboot"));
+    EXPECT_EQ(-1, mBw.removeUidCounter(uid, "wlan0"));
+
+    // Nothing counts into the objects here, so they stay at zero.
+    std::vector<uint8_t> snapshot;
+    EXPECT_EQ(0, mBw.getUidStats(0, &snapshot));
+    UidCounters::Header header;
+    ASSERT_EQ(sizeof(header) + 2 * sizeof(UidCounters::Entry), snapshot.size());
+    memcpy(&header, snapshot.data(), sizeof(header));
+    EXPECT_EQ(2U, header.count);
+    EXPECT_EQ(0, mBw.getUidStats(header.generation, &snapshot));
+    EXPECT_EQ(sizeof(header), snapshot.size());
+
+    EXPECT_EQ(0, mBw.removeUidCounter(uid, "lo"));
+    expectFilterRestoreCommands({
+        "-D bw_uid_INPUT -i lo -m owner --uid-owner 99998 -m nfacct --nfacct-name bwu99998_lo_r",
+        "-D bw_uid_OUTPUT -o lo -m owner --uid-owner 99998 -m nfacct --nfacct-name bwu99998_lo_t",
+    });
+
+    // A failed add leaves nothing behind.
+    setRestoreFails(true);
+    EXPECT_EQ(-1, mBw.addUidCounter(uid, "lo"));
+    setRestoreFails(false);
+    sRestoreCmds.clear();
+    EXPECT_EQ(0, mBw.getUidStats(0, &snapshot));
+    EXPECT_EQ(sizeof(header) + sizeof(UidCounters::Entry), snapshot.size());
+
+    // Turning bandwidth control off deletes the rest.
+    mBw.disableBandwidthControl();
+    sRestoreCmds.clear();
+    EXPECT_EQ(0, mBw.getUidStats(0, &snapshot));
+    EXPECT_EQ(sizeof(header), snapshot.size());
+    EXPECT_EQ(-1, mBw.removeUidCounter(uid, ""));
 }
 
 std::string kIPv4TetherCounters = android::base::Join(std::vector<std::string> {
@@ -292,3 +710,204 @@ TEST_F(BandwidthControllerTest, TestGetTetherStats) {
     expectNoSocketClientResponse(socketPair[1]);
     clearPopenContents();
 }
+
+TEST_F(BandwidthControllerTest, TestGetTetherStatsList) {
+    std::string err;
+    std::vector<BandwidthController::TetherStats> stats = {
+        BandwidthController::TetherStats("stale0", "stale1", 1, 1, 1, 1),
+    };
+
+    // IPv4 and IPv6 counters are added together, in the order the pairs were first seen.
+    addPopenContents(kIPv4TetherCounters, kIPv6TetherCounters);
+    ASSERT_EQ(0, mBw.getTetherStats(&stats, err));
+    ASSERT_EQ(2U, stats.size());
+    EXPECT_EQ("wlan0", stats[0].intIface);
+    EXPECT_EQ("rmnet0", stats[0].extIface);
+    EXPECT_EQ(10002373, stats[0].rxBytes);
+    EXPECT_EQ(10026, stats[0].rxPackets);
+    EXPECT_EQ(20002002, stats[0].txBytes);
+    EXPECT_EQ(20027, stats[0].txPackets);
+    EXPECT_EQ("bt-pan", stats[1].intIface);
+    EXPECT_EQ("rmnet0", stats[1].extIface);
+    EXPECT_EQ(107471, stats[1].rxBytes);
+    EXPECT_EQ(1040, stats[1].rxPackets);
+    EXPECT_EQ(1708806, stats[1].txBytes);
+    EXPECT_EQ(1450, stats[1].txPackets);
+    clearPopenContents();
+
+    // Same errors as the text version, and the list is left alone.
+    addPopenContents(kIPv4TetherCounters, "");
+    ASSERT_EQ(-1, mBw.getTetherStats(&stats, err));
+    EXPECT_EQ(2U, stats.size());
+    clearPopenContents();
+}
+
+TEST_F(BandwidthControllerTest, TestTetherCounterLongLines) {
+    // Longer than the 256 bytes that a line used to be read in. Its tail must not be parsed as a
+    // rule of its own.
+    std::string longLine = android::base::StringPrintf(
+            "      26     2373 RETURN     all  --  wlan0  rmnet0  0.0.0.0/0            0.0.0.0/0"
+            "%*s", 300, "");
+    longLine += "    9     9 RETURN     all  --  foo0  bar0  0.0.0.0/0            0.0.0.0/0";
+    std::string counters = android::base::Join(std::vector<std::string> {
+        "Chain natctrl_tether_counters (2 references)",
+        "    pkts      bytes target     prot opt in     out     source               destination",
+        longLine,
+        "      27     2002 RETURN     all  --  rmnet0 wlan0   0.0.0.0/0            0.0.0.0/0",
+        "      28     2003 RETURN     all  --  rmnet0",
+        "garbage",
+    }, '\n') + "\n";
+
+    FILE *fp = fmemopen(&counters[0], counters.size(), "r");
+    ASSERT_NE(nullptr, fp);
+    TetherStatsList statsList;
+    EXPECT_EQ(0, addForwardChainStats(fp, &statsList));
+    fclose(fp);
+
+    ASSERT_EQ(1U, statsList.size());
+    EXPECT_EQ("wlan0", statsList[0].intIface);
+    EXPECT_EQ("rmnet0", statsList[0].extIface);
+    EXPECT_EQ(2373, statsList[0].rxBytes);
+    EXPECT_EQ(26, statsList[0].rxPackets);
+    EXPECT_EQ(2002, statsList[0].txBytes);
+    EXPECT_EQ(27, statsList[0].txPackets);
+}
+
+TEST_F(BandwidthControllerTest, TestGetTetherStatsFromNfacct) {
+    // The same counters as kIPv4TetherCounters and kIPv6TetherCounters, which nfacct has already
+    // added together.
+    std::vector<TetherCounters::Counter> counters = {
+        { "wlan0", "rmnet0", 10026, 10002373 },
+        { "rmnet0", "wlan0", 20027, 20002002 },
+        { "bt-pan", "rmnet0", 1040, 107471 },
+        { "rmnet0", "bt-pan", 1450, 1708806 },
+    };
+    TetherStatsList statsList;
+    ASSERT_EQ(0, addTetherCounterStats(TetherStats(), counters, &statsList));
+    ASSERT_EQ(2U, statsList.size());
+    EXPECT_EQ("wlan0 rmnet0 10002373 10026 20002002 20027",
+              statsLine(statsList[0]));
+    EXPECT_EQ("bt-pan rmnet0 107471 1040 1708806 1450",
+              statsLine(statsList[1]));
+
+    // Filtering, and the same errors as for the iptables counters.
+    statsList = TetherStatsList();
+    ASSERT_EQ(0, addTetherCounterStats(TetherStats("bt-pan", "rmnet0", -1, -1, -1, -1),
+                                       counters, &statsList));
+    ASSERT_EQ(1U, statsList.size());
+    EXPECT_EQ("bt-pan", statsList[0].intIface);
+    EXPECT_EQ(-1, addTetherCounterStats(TetherStats(), {}, &statsList));
+    counters.pop_back();
+    EXPECT_EQ(-1, addTetherCounterStats(TetherStats(), counters, &statsList));
+}
+
+TEST_F(BandwidthControllerTest, TestGetTetherStatsReadsNfacct) {
+    TetherCounters counters(kTestCounterPrefix);
+    ASSERT_EQ(0, counters.clear());
+    std::string name;
+    ASSERT_EQ(0, counters.add("wlan0", "rmnet0", &name));
+    ASSERT_EQ(0, counters.add("rmnet0", "wlan0", &name));
+    BandwidthController bw(&counters);
+    std::vector<TetherStats> stats;
+    std::string err;
+
+    // Until NatController enables them, the counters chain is listed.
+    addPopenContents(kIPv4TetherCounters, kIPv6TetherCounters);
+    ASSERT_EQ(0, bw.getTetherStats(&stats, err));
+    EXPECT_EQ(2U, stats.size());
+    clearPopenContents();
+
+    // Then there's nothing to popen().
+    counters.setEnabled(true);
+    ASSERT_EQ(0, bw.getTetherStats(&stats, err));
+    ASSERT_EQ(1U, stats.size());
+    EXPECT_EQ("wlan0 rmnet0 0 0 0 0", statsLine(stats[0]));
+
+    EXPECT_EQ(0, counters.clear());
+}
+
+TEST_F(BandwidthControllerTest, TestTetherCounterNfacctRules) {
+    // Rules that count into nfacct objects too still have iptables counters of their own.
+    std::string counters = android::base::Join(std::vector<std::string> {
+        "Chain natctrl_tether_counters (2 references)",
+        "    pkts      bytes target     prot opt in     out     source               destination",
+        "      26     2373 RETURN     all  --  wlan0  rmnet0  0.0.0.0/0            0.0.0.0/0"
+        "            nfacct-name  natctrl_tether0",
+        "      27     2002 RETURN     all  --  rmnet0 wlan0   0.0.0.0/0            0.0.0.0/0"
+        "            nfacct-name  natctrl_tether1",
+    }, '\n') + "\n";
+
+    FILE *fp = fmemopen(&counters[0], counters.size(), "r");
+    ASSERT_NE(nullptr, fp);
+    TetherStatsList statsList;
+    EXPECT_EQ(0, addForwardChainStats(fp, &statsList));
+    fclose(fp);
+
+    ASSERT_EQ(1U, statsList.size());
+    EXPECT_EQ("wlan0 rmnet0 2373 26 2002 27", statsLine(statsList[0]));
+}
+
+// Compares reading the counters of 64 interface pairs with one nfacct dump to listing the
+// counters chain with one process per IP family. Run with --gtest_also_run_disabled_tests.
+TEST_F(BandwidthControllerTest, DISABLED_TestGetTetherStatsBenchmark) {
+    const int kNumPairs = 64;
+    const int kIterations = 100;
+
+    TetherCounters counters(kTestCounterPrefix);
+    ASSERT_EQ(0, counters.clear());
+    counters.setEnabled(true);
+    BandwidthController bw(&counters);
+
+    std::vector<std::string> lines[2];
+    for (int v : { V4, V6 }) {
+        lines[v] = {
+            "Chain natctrl_tether_counters (4 references)",
+            "    pkts      bytes target     prot opt in     out     source               destination",
+        };
+    }
+    for (int i = 0; i < kNumPairs; i++) {
+        std::string intIface = android::base::StringPrintf("wlan%d", i);
+        const char *dirs[][2] = { { intIface.c_str(), "rmnet0" }, { "rmnet0", intIface.c_str() } };
+        for (const auto& dir : dirs) {
+            std::string name;
+            ASSERT_EQ(0, counters.add(dir[0], dir[1], &name));
+            lines[V4].push_back(android::base::StringPrintf(
+                    "%8d %8d RETURN     all  --  %-6s %-6s  0.0.0.0/0            0.0.0.0/0",
+                    i, i * 100, dir[0], dir[1]));
+            lines[V6].push_back(android::base::StringPrintf(
+                    "%8d %8d RETURN     all      %-6s %-6s  ::/0                 ::/0",
+                    i, i * 100, dir[0], dir[1]));
+        }
+    }
+    std::string output[2];
+    for (int v : { V4, V6 }) {
+        output[v] = android::base::Join(lines[v], '\n') + "\n";
+    }
+
+    using ms = std::chrono::duration<float, std::ratio<1, 1000>>;
+    fprintf(stderr, "Benchmarking %d reads of %d tether counter pairs\n", kIterations, kNumPairs);
+
+    // The fake popen() runs a shell per IP family, as the real one runs iptables.
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        std::vector<TetherStats> stats;
+        std::string err;
+        addPopenContents(output[V4], output[V6]);
+        ASSERT_EQ(0, mBw.getTetherStats(&stats, err));
+        ASSERT_EQ(size_t(kNumPairs), stats.size());
+    }
+    fprintf(stderr, "  popen:   %6.1f ms\n",
+            std::chrono::duration_cast<ms>(std::chrono::steady_clock::now() - start).count());
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < kIterations; i++) {
+        std::vector<TetherStats> stats;
+        std::string err;
+        ASSERT_EQ(0, bw.getTetherStats(&stats, err));
+        ASSERT_EQ(size_t(kNumPairs), stats.size());
+    }
+    fprintf(stderr, "  nfacct:  %6.1f ms\n",
+            std::chrono::duration_cast<ms>(std::chrono::steady_clock::now() - start).count());
+
+    EXPECT_EQ(0, counters.clear());
+}
@@ -1792,6 +1792,8 @@ int CommandListener::NetworkCommand::runCommand(SocketClient* client, int argc,
         if (int ret = gCtls->netCtrl.destroyNetwork(netId)) {
             return operationError(client, "destroyNetwork() failed", ret);
         }
+        // Net IDs are reused, so don't let the next network see this one's cached answers.
+        gCtls->resolverCtrl.getDnsCache()->flush(netId);
         return success(client);
     }
 
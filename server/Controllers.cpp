@@ -19,7 +19,9 @@
 namespace android {
 namespace net {
 
-Controllers::Controllers() : clatdCtrl(&netCtrl) {
+Controllers::Controllers() : natCtrl(&tetherCounters), bandwidthCtrl(&tetherCounters),
+        clatdCtrl(&netCtrl),
+        dnsQueryEngine(resolverCtrl.getDnsCache(), resolverCtrl.getDnsServerStats()) {
     InterfaceController::initializeAll();
 }
 
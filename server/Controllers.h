@@ -19,6 +19,10 @@
 
 #include <sysutils/FrameworkListener.h>
 
+#include "DnsEventReporter.h"
+#include "DnsQueryEngine.h"
+#include "DnsSingleFlight.h"
+#include "DnsWorkerPool.h"
 #include "NetworkController.h"
 #include "TetherController.h"
 #include "NatController.h"
@@ -31,6 +35,7 @@
 #include "FirewallController.h"
 #include "ClatdController.h"
 #include "StrictController.h"
+#include "TetherCounters.h"
 
 namespace android {
 namespace net {
@@ -40,6 +45,7 @@ struct Controllers {
 
     NetworkController netCtrl;
     TetherController tetherCtrl;
+    TetherCounters tetherCounters;  // Kept by natCtrl, and read by bandwidthCtrl.
     NatController natCtrl;
     PppController pppCtrl;
     SoftapController softapCtrl;
@@ -49,6 +55,10 @@ struct Controllers {
     FirewallController firewallCtrl;
     ClatdController clatdCtrl;
     StrictController strictCtrl;
+    DnsWorkerPool dnsWorkerPool;
+    DnsSingleFlight dnsSingleFlight;
+    DnsQueryEngine dnsQueryEngine;
+    DnsEventReporter dnsEventReporter;
 };
 
 extern Controllers* gCtls;
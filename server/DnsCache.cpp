@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DnsCache.h"
+
+#include <ctype.h>
+
+#include <algorithm>
+
+#include "DumpWriter.h"
+
+const size_t DnsCache::DEFAULT_MAX_ENTRIES;
+const uint32_t DnsCache::MAX_TTL;
+const uint32_t DnsCache::MAX_NEGATIVE_TTL;
+
+DnsCache::DnsCache() : DnsCache(DEFAULT_MAX_ENTRIES, std::chrono::steady_clock::now) {
+}
+
+DnsCache::DnsCache(size_t maxEntries, Clock clock) :
+        mMaxEntries(maxEntries > 0 ? maxEntries : 1), mClock(clock) {
+}
+
+DnsCache::Key DnsCache::makeKey(const std::string& name, uint16_t type) {
+    std::string lower(name);
+    if (!lower.empty() && lower.back() == '.') {
+        lower.pop_back();
+    }
+    std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+    return Key(lower, type);
+}
+
+DnsCache::Result DnsCache::lookup(unsigned netId, const std::string& name, uint16_t type,
+                                  Answer* answer) {
+    const TimePoint now = mClock();
+    std::lock_guard<std::mutex> lock(mLock);
+    Network& network = mNetworks[netId];
+    auto found = network.index.find(makeKey(name, type));
+    if (found == network.index.end()) {
+        network.stats.misses++;
+        return MISS;
+    }
+    auto entry = found->second;
+    if (entry->expiry <= now) {
+        network.index.erase(found);
+        network.lru.erase(entry);
+        network.stats.misses++;
+        return MISS;
+    }
+
+    network.lru.splice(network.lru.begin(), network.lru, entry);
+    entry->hits++;
+    network.stats.hits++;
+    if (entry->answer.negative) {
+        network.stats.negativeHits++;
+    }
+    *answer = entry->answer;
+
+    // A name that is looked up more than once is likely to be looked up again.
+    const auto lifetime = entry->expiry - entry->stored;
+    if (entry->hits > 1 && !entry->refreshing && (entry->expiry - now) * 10 <= lifetime) {
+        entry->refreshing = true;
+        network.stats.prefetches++;
+        return HIT_AND_REFRESH;
+    }
+    return HIT;
+}
+
+void DnsCache::put(unsigned netId, const std::string& name, uint16_t type, const Answer& answer,
+                   uint32_t ttlSeconds) {
+    ttlSeconds = std::min(ttlSeconds, answer.negative ? MAX_NEGATIVE_TTL : MAX_TTL);
+    if (ttlSeconds == 0) {
+        return;
+    }
+    const TimePoint now = mClock();
+    const Key key = makeKey(name, type);
+    std::lock_guard<std::mutex> lock(mLock);
+    Network& network = mNetworks[netId];
+
+    auto found = network.index.find(key);
+    if (found != network.index.end()) {
+        // A refresh. The entry keeps its hit count, so it stays popular.
+        auto entry = found->second;
+        entry->answer = answer;
+        entry->stored = now;
+        entry->expiry = now + std::chrono::seconds(ttlSeconds);
+        entry->refreshing = false;
+        network.lru.splice(network.lru.begin(), network.lru, entry);
+        return;
+    }
+
+    if (network.lru.size() >= mMaxEntries) {
+        const Entry& oldest = network.lru.back();
+        if (oldest.expiry > now) {
+            network.stats.evictions++;
+        }
+        network.index.erase(oldest.key);
+        network.lru.pop_back();
+    }
+    network.lru.push_front(Entry{ key, answer, now, now + std::chrono::seconds(ttlSeconds), 0,
+                                  false });
+    network.index[key] = network.lru.begin();
+}
+
+void DnsCache::flush(unsigned netId) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mNetworks.erase(netId);
+}
+
+DnsCache::Stats DnsCache::getStats(unsigned netId) const {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto found = mNetworks.find(netId);
+    if (found == mNetworks.end()) {
+        return Stats{};
+    }
+    Stats stats = found->second.stats;
+    stats.entries = found->second.lru.size();
+    return stats;
+}
+
+void DnsCache::dump(DumpWriter& dw, unsigned netId) const {
+    const Stats stats = getStats(netId);
+    const uint64_t lookups = stats.hits + stats.misses;
+    dw.println("netd DNS cache: %zu/%zu entries, %llu hits (%llu negative), %llu misses, "
+               "hit rate %.1f%%, %llu evictions, %llu prefetches", stats.entries, mMaxEntries,
+               static_cast<unsigned long long>(stats.hits),
+               static_cast<unsigned long long>(stats.negativeHits),
+               static_cast<unsigned long long>(stats.misses),
+               lookups ? 100.0 * stats.hits / lookups : 0.0,
+               static_cast<unsigned long long>(stats.evictions),
+               static_cast<unsigned long long>(stats.prefetches));
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_DNS_CACHE_H
+#define NETD_SERVER_DNS_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+class DumpWriter;
+
+/*
+ * The answers that DnsQueryEngine got, kept for as long as their TTLs allow, separately for each
+ * network.
+ *
+ * A name that doesn't exist, or has no addresses of a type, is cached too, for as long as the SOA
+ * record in the answer says (RFC 2308). An answer with no SOA record isn't cached.
+ *
+ * Each network holds at most a fixed number of answers, and the least recently used one makes way
+ * for a new one. An answer that was used more than once is refreshed shortly before it expires:
+ * the lookup that finds it in its last tenth of its TTL gets it from the cache, and is told to
+ * ask the network again in the background, so popular names never miss.
+ */
+class DnsCache {
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+    typedef std::function<TimePoint()> Clock;
+
+    static const size_t DEFAULT_MAX_ENTRIES = 1000;  // For each network.
+    static const uint32_t MAX_TTL = 24 * 60 * 60;
+    static const uint32_t MAX_NEGATIVE_TTL = 3 * 60 * 60;  // As RFC 2308 recommends.
+
+    struct Answer {
+        bool negative;                   // No such name, or no addresses of this type.
+        std::vector<std::string> addrs;  // 4 or 16 bytes each.
+    };
+
+    enum Result {
+        MISS,
+        HIT,
+        HIT_AND_REFRESH,  // The answer is about to expire; the caller should ask for it again.
+    };
+
+    struct Stats {
+        uint64_t hits;
+        uint64_t negativeHits;  // Included in hits.
+        uint64_t misses;
+        uint64_t evictions;     // Answers removed to make room, before they expired.
+        uint64_t prefetches;    // HIT_AND_REFRESH results.
+        size_t entries;
+    };
+
+    DnsCache();
+    DnsCache(size_t maxEntries, Clock clock);
+
+    // Looks up the answer to the |type| query for |name|, which is compared without regard to
+    // case or a trailing dot.
+    Result lookup(unsigned netId, const std::string& name, uint16_t type, Answer* answer);
+    // Stores |answer| for |ttlSeconds|. A TTL of 0 means the answer can't be cached.
+    void put(unsigned netId, const std::string& name, uint16_t type, const Answer& answer,
+             uint32_t ttlSeconds);
+
+    // Forgets everything about |netId|.
+    void flush(unsigned netId);
+
+    Stats getStats(unsigned netId) const;
+    void dump(DumpWriter& dw, unsigned netId) const;
+
+private:
+    DnsCache(const DnsCache&) = delete;
+    DnsCache& operator=(const DnsCache&) = delete;
+
+    typedef std::pair<std::string, uint16_t> Key;
+
+    struct Entry {
+        Key key;
+        Answer answer;
+        TimePoint stored;
+        TimePoint expiry;
+        unsigned hits;
+        bool refreshing;
+    };
+
+    struct Network {
+        std::list<Entry> lru;  // Most recently used first.
+        std::map<Key, std::list<Entry>::iterator> index;
+        Stats stats;
+    };
+
+    static Key makeKey(const std::string& name, uint16_t type);
+
+    const size_t mMaxEntries;
+    const Clock mClock;
+
+    mutable std::mutex mLock;
+    std::map<unsigned, Network> mNetworks;
+};
+
+#endif  // NETD_SERVER_DNS_CACHE_H
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * DnsCacheTest.cpp - unit tests for DnsCache.cpp
+ */
+
+#include <arpa/nameser.h>
+
+#include <chrono>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "DnsCache.h"
+
+class DnsCacheTest : public ::testing::Test {
+protected:
+    DnsCacheTest() : mNow(std::chrono::steady_clock::now()),
+                     mCache(3, [this] { return mNow; }) {}
+
+    DnsCache::Answer address(const char* addr) {
+        return DnsCache::Answer{ false, { std::string(addr, 4) } };
+    }
+
+    void advance(int seconds) { mNow += std::chrono::seconds(seconds); }
+
+    std::chrono::steady_clock::time_point mNow;
+    DnsCache mCache;
+};
+
+TEST_F(DnsCacheTest, TestHonorsTtl) {
+    DnsCache::Answer answer;
+    EXPECT_EQ(DnsCache::MISS, mCache.lookup(100, "www.example.com", ns_t_a, &answer));
+
+    mCache.put(100, "www.example.com", ns_t_a, address("\xc0\x00\x02\x01"), 60);
+    ASSERT_EQ(DnsCache::HIT, mCache.lookup(100, "www.example.com", ns_t_a, &answer));
+    EXPECT_FALSE(answer.negative);
+    ASSERT_EQ(1U, answer.addrs.size());
+    EXPECT_EQ(std::string("\xc0\x00\x02\x01", 4), answer.addrs[0]);
+
+    // Names are the same regardless of case or a trailing dot; types and networks are not.
+    EXPECT_EQ(DnsCache::HIT, mCache.lookup(100, "WWW.Example.COM.", ns_t_a, &answer));
+    EXPECT_EQ(DnsCache::MISS, mCache.lookup(100, "www.example.com", ns_t_aaaa, &answer));
+    EXPECT_EQ(DnsCache::MISS, mCache.lookup(101, "www.example.com", ns_t_a, &answer));
+
+    advance(60);
+    EXPECT_EQ(DnsCache::MISS, mCache.lookup(100, "www.example.com", ns_t_a, &answer));
+
+    // Answers that can't be cached aren't.
+    mCache.put(100, "www.example.com", ns_t_a, address("\xc0\x00\x02\x01"), 0);
+    EXPECT_EQ(DnsCache::MISS, mCache.lookup(100, "www.example.com", ns_t_a, &answer));
+
+    DnsCache::Stats stats = mCache.getStats(100);
+    EXPECT_EQ(2U, stats.hits);
+    EXPECT_EQ(4U, stats.misses);
+    EXPECT_EQ(0U, stats.entries);
+}
+
+TEST_F(DnsCacheTest, TestNegativeAnswers) {
+    mCache.put(100, "nx.example.com", ns_t_a, DnsCache::Answer{ true, {} }, 300);
+    DnsCache::Answer answer;
+    ASSERT_EQ(DnsCache::HIT, mCache.lookup(100, "nx.example.com", ns_t_a, &answer));
+    EXPECT_TRUE(answer.negative);
+    EXPECT_TRUE(answer.addrs.empty());
+    EXPECT_EQ(1U, mCache.getStats(100).negativeHits);
+
+    // Negative answers last three hours at most.
+    mCache.put(100, "nx.example.com", ns_t_a, DnsCache::Answer{ true, {} }, 86400);
+    advance(DnsCache::MAX_NEGATIVE_TTL);
+    EXPECT_EQ(DnsCache::MISS, mCache.lookup(100, "nx.example.com", ns_t_a, &answer));
+}
+
+TEST_F(DnsCacheTest, TestEvictsLeastRecentlyUsed) {
+    mCache.put(100, "a.example.com", ns_t_a, address("\x01\x01\x01\x01"), 60);
+    mCache.put(100, "b.example.com", ns_t_a, address("\x02\x02\x02\x02"), 60);
+    mCache.put(100, "c.example.com", ns_t_a, address("\x03\x03\x03\x03"), 60);
+    DnsCache::Answer answer;
+    EXPECT_EQ(DnsCache::HIT, mCache.lookup(100, "a.example.com", ns_t_a, &answer));
+
+    // b is now the least recently used.
+    mCache.put(100, "d.example.com", ns_t_a, address("\x04\x04\x04\x04"), 60);
+    EXPECT_EQ(DnsCache::MISS, mCache.lookup(100, "b.example.com", ns_t_a, &answer));
+    EXPECT_EQ(DnsCache::HIT, mCache.lookup(100, "a.example.com", ns_t_a, &answer));
+    EXPECT_EQ(DnsCache::HIT, mCache.lookup(100, "c.example.com", ns_t_a, &answer));
+    EXPECT_EQ(DnsCache::HIT, mCache.lookup(100, "d.example.com", ns_t_a, &answer));
+
+    DnsCache::Stats stats = mCache.getStats(100);
+    EXPECT_EQ(1U, stats.evictions);
+    EXPECT_EQ(3U, stats.entries);
+
+    // Each network has room of its own.
+    mCache.put(101, "e.example.com", ns_t_a, address("\x05\x05\x05\x05"), 60);
+    EXPECT_EQ(3U, mCache.getStats(100).entries);
+    EXPECT_EQ(1U, mCache.getStats(101).entries);
+
+    mCache.flush(100);
+    EXPECT_EQ(0U, mCache.getStats(100).entries);
+    EXPECT_EQ(DnsCache::MISS, mCache.lookup(100, "a.example.com", ns_t_a, &answer));
+    EXPECT_EQ(1U, mCache.getStats(101).entries);
+}
+
+TEST_F(DnsCacheTest, TestRefreshesPopularAnswers) {
+    mCache.put(100, "popular.example.com", ns_t_a, address("\x01\x01\x01\x01"), 100);
+    mCache.put(100, "unpopular.example.com", ns_t_a, address("\x02\x02\x02\x02"), 100);
+    DnsCache::Answer answer;
+    EXPECT_EQ(DnsCache::HIT, mCache.lookup(100, "popular.example.com", ns_t_a, &answer));
+
+    // Not yet in the last tenth of the TTL.
+    advance(89);
+    EXPECT_EQ(DnsCache::HIT, mCache.lookup(100, "popular.example.com", ns_t_a, &answer));
+
+    // Only the first lookup in the last tenth refreshes, and only for a name used before.
+    advance(1);
+    EXPECT_EQ(DnsCache::HIT_AND_REFRESH,
+              mCache.lookup(100, "popular.example.com", ns_t_a, &answer));
+    EXPECT_EQ(DnsCache::HIT, mCache.lookup(100, "popular.example.com", ns_t_a, &answer));
+    EXPECT_EQ(DnsCache::HIT, mCache.lookup(100, "unpopular.example.com", ns_t_a, &answer));
+
+    // The refresh replaces the answer, and the new one can be refreshed in turn.
+    mCache.put(100, "popular.example.com", ns_t_a, address("\x03\x03\x03\x03"), 100);
+    advance(95);
+    ASSERT_EQ(DnsCache::HIT_AND_REFRESH,
+              mCache.lookup(100, "popular.example.com", ns_t_a, &answer));
+    EXPECT_EQ(std::string("\x03\x03\x03\x03", 4), answer.addrs[0]);
+    EXPECT_EQ(2U, mCache.getStats(100).prefetches);
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DnsEventReporter"
+
+#include "DnsEventReporter.h"
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "DumpWriter.h"
+
+namespace {
+
+size_t roundUpToPowerOfTwo(size_t n) {
+    size_t size = 1;
+    while (size < n) {
+        size <<= 1;
+    }
+    return size;
+}
+
+}  // namespace
+
+const size_t DnsEventReporter::DEFAULT_CAPACITY;
+const size_t DnsEventReporter::DEFAULT_BATCH_SIZE;
+const int DnsEventReporter::DEFAULT_FLUSH_INTERVAL_MS;
+
+DnsEventReporter::DnsEventReporter() :
+        DnsEventReporter(property_get_int32("persist.netd.dns_event_buffer", DEFAULT_CAPACITY),
+                         property_get_int32("persist.netd.dns_event_batch", DEFAULT_BATCH_SIZE),
+                         property_get_int32("persist.netd.dns_event_flush_ms",
+                                            DEFAULT_FLUSH_INTERVAL_MS)) {
+}
+
+DnsEventReporter::DnsEventReporter(size_t capacity, size_t batchSize, int flushIntervalMs) :
+        mCapacity(roundUpToPowerOfTwo(capacity > 0 ? capacity : 1)),
+        mBatchSize(batchSize > 0 ? batchSize : 1),
+        mFlushInterval(flushIntervalMs > 0 ? flushIntervalMs : 0),
+        mSlots(new Slot[mCapacity]), mWritePos(0), mReadPos(0), mPending(0), mReported(0),
+        mDropped(0), mSent(0), mBatches(0), mStopping(false) {
+    for (size_t i = 0; i < mCapacity; i++) {
+        mSlots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+    mThread = std::thread(&DnsEventReporter::run, this);
+}
+
+DnsEventReporter::~DnsEventReporter() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStopping = true;
+    }
+    mWakeup.notify_one();
+    mThread.join();
+}
+
+void DnsEventReporter::setSender(Sender sender) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mSender = std::move(sender);
+}
+
+bool DnsEventReporter::report(const Event& event) {
+    if (!push(event)) {
+        mDropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+    mReported.fetch_add(1, std::memory_order_relaxed);
+
+    // Wake the thread for the first event after it went idle, so that it starts the flush timer,
+    // and for every full batch. Nothing else takes the lock on this path.
+    const ssize_t pending = mPending.fetch_add(1) + 1;
+    if (pending == 1 || (pending > 0 && pending % mBatchSize == 0)) {
+        wake();
+    }
+    return true;
+}
+
+bool DnsEventReporter::push(const Event& event) {
+    size_t pos = mWritePos.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &mSlots[pos & (mCapacity - 1)];
+        const size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        const ssize_t diff = static_cast<ssize_t>(sequence - pos);
+        if (diff == 0) {
+            // The slot is free. Claim it, unless another writer got there first.
+            if (mWritePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // The thread hasn't taken the event that was written here a lap ago: we're full.
+            return false;
+        } else {
+            pos = mWritePos.load(std::memory_order_relaxed);
+        }
+    }
+    slot->event = event;
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+bool DnsEventReporter::pop(Event* event) {
+    Slot& slot = mSlots[mReadPos & (mCapacity - 1)];
+    const size_t sequence = slot.sequence.load(std::memory_order_acquire);
+    if (sequence != mReadPos + 1) {
+        // Empty, or a writer has claimed the slot but not finished writing it yet.
+        return false;
+    }
+    *event = slot.event;
+    slot.sequence.store(mReadPos + mCapacity, std::memory_order_release);
+    mReadPos++;
+    return true;
+}
+
+void DnsEventReporter::wake() {
+    // Taking the lock makes sure the thread is either waiting, and gets the notification, or has
+    // yet to check mPending.
+    std::lock_guard<std::mutex> lock(mLock);
+    mWakeup.notify_one();
+}
+
+void DnsEventReporter::run() {
+    std::vector<Event> batch;
+    batch.reserve(mBatchSize);
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        // Sleep until there is an event, then give the batch until the flush interval to fill up.
+        mWakeup.wait(lock, [this] { return mStopping || mPending.load() > 0; });
+        mWakeup.wait_for(lock, mFlushInterval, [this] {
+            return mStopping || mPending.load() >= static_cast<ssize_t>(mBatchSize);
+        });
+        const bool stopping = mStopping;
+        // If the interval is up, send what there is. Otherwise, a batch is full, and any events
+        // after the last full batch wait for the next interval.
+        const bool all = stopping || mPending.load() < static_cast<ssize_t>(mBatchSize);
+        const Sender sender = mSender;
+
+        lock.unlock();
+        flush(sender, all, &batch);
+        lock.lock();
+
+        if (stopping) {
+            return;
+        }
+    }
+}
+
+void DnsEventReporter::flush(const Sender& sender, bool all, std::vector<Event>* batch) {
+    Event event;
+    while (all || mPending.load() >= static_cast<ssize_t>(mBatchSize)) {
+        batch->clear();
+        while (batch->size() < mBatchSize && pop(&event)) {
+            batch->push_back(event);
+        }
+        if (batch->empty()) {
+            return;
+        }
+        mPending.fetch_sub(batch->size());
+        if (sender) {
+            mSent.fetch_add(batch->size(), std::memory_order_relaxed);
+            mBatches.fetch_add(1, std::memory_order_relaxed);
+            sender(*batch);
+        }
+    }
+}
+
+DnsEventReporter::Stats DnsEventReporter::getStats() const {
+    Stats stats;
+    stats.reported = mReported.load(std::memory_order_relaxed);
+    stats.dropped = mDropped.load(std::memory_order_relaxed);
+    stats.sent = mSent.load(std::memory_order_relaxed);
+    stats.batches = mBatches.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void DnsEventReporter::dump(DumpWriter& dw) const {
+    const Stats stats = getStats();
+    dw.println("DNS event reporter: buffer %zu, batches of %zu, flushed after %lld ms", mCapacity,
+               mBatchSize, static_cast<long long>(mFlushInterval.count()));
+    dw.incIndent();
+    dw.println("Reported: %llu, dropped: %llu", static_cast<unsigned long long>(stats.reported),
+               static_cast<unsigned long long>(stats.dropped));
+    dw.println("Sent: %llu in %llu batches", static_cast<unsigned long long>(stats.sent),
+               static_cast<unsigned long long>(stats.batches));
+    dw.decIndent();
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_DNS_EVENT_REPORTER_H
+#define NETD_SERVER_DNS_EVENT_REPORTER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class DumpWriter;
+
+/*
+ * Collects the DNS events that DnsProxyListener logs, and sends them to the DNS event listener in
+ * batches, so that a lookup doesn't wait for a binder call before its thread can take the next one.
+ *
+ * Events go into a fixed-size ring buffer that report() fills without taking a lock. A thread of
+ * our own sends what is in the buffer once a batch is full, or once the oldest event has waited for
+ * the flush interval. If the buffer is full, report() drops the event and counts it.
+ *
+ * The sizes default to the values below, and can be overridden with the
+ * persist.netd.dns_event_buffer, persist.netd.dns_event_batch and
+ * persist.netd.dns_event_flush_ms system properties, which are read at startup.
+ */
+class DnsEventReporter {
+public:
+    struct Event {
+        int32_t netId;
+        int32_t eventType;
+        int32_t returnCode;
+        int32_t latencyMs;
+    };
+
+    // Sends a batch of events, oldest first. Called on the reporter's own thread.
+    typedef std::function<void(const std::vector<Event>& events)> Sender;
+
+    static const size_t DEFAULT_CAPACITY = 1024;
+    static const size_t DEFAULT_BATCH_SIZE = 64;
+    static const int DEFAULT_FLUSH_INTERVAL_MS = 1000;
+
+    struct Stats {
+        uint64_t reported;  // Events that went into the buffer.
+        uint64_t dropped;   // Events dropped because the buffer was full.
+        uint64_t sent;      // Events handed to the sender.
+        uint64_t batches;   // Calls to the sender.
+    };
+
+    // Uses the sizes from the system properties, or the defaults.
+    DnsEventReporter();
+    // |capacity| is rounded up to a power of two.
+    DnsEventReporter(size_t capacity, size_t batchSize, int flushIntervalMs);
+
+    // Sends whatever is still in the buffer, and then stops the thread.
+    ~DnsEventReporter();
+
+    // Sets where events go. Events that are flushed before a sender is set are discarded.
+    void setSender(Sender sender);
+
+    // Queues an event. Never blocks. Returns false if the event was dropped.
+    bool report(const Event& event);
+
+    Stats getStats() const;
+    void dump(DumpWriter& dw) const;
+
+private:
+    DnsEventReporter(const DnsEventReporter&) = delete;
+    DnsEventReporter& operator=(const DnsEventReporter&) = delete;
+
+    // A slot holds an event once its sequence is one past the position it was written at, and is
+    // free for the position after that once its sequence has moved on by the capacity.
+    struct Slot {
+        std::atomic<size_t> sequence;
+        Event event;
+    };
+
+    bool push(const Event& event);
+    bool pop(Event* event);  // Only called on mThread.
+    void run();
+    // Sends full batches while there are any and then, if |all|, whatever is left.
+    void flush(const Sender& sender, bool all, std::vector<Event>* batch);
+    void wake();
+
+    const size_t mCapacity;
+    const size_t mBatchSize;
+    const std::chrono::milliseconds mFlushInterval;
+
+    std::unique_ptr<Slot[]> mSlots;
+    std::atomic<size_t> mWritePos;
+    size_t mReadPos;  // Only used on mThread.
+    // Events pushed but not yet taken by the thread. Can briefly go negative if the thread takes an
+    // event before its writer counts it.
+    std::atomic<ssize_t> mPending;
+
+    std::atomic<uint64_t> mReported;
+    std::atomic<uint64_t> mDropped;
+    std::atomic<uint64_t> mSent;
+    std::atomic<uint64_t> mBatches;
+
+    mutable std::mutex mLock;
+    std::condition_variable mWakeup;
+    Sender mSender;  // Guarded by mLock.
+    bool mStopping;  // Guarded by mLock.
+
+    std::thread mThread;
+};
+
+#endif  // NETD_SERVER_DNS_EVENT_REPORTER_H
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * DnsEventReporterTest.cpp - unit tests for DnsEventReporter.cpp
+ */
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "DnsEventReporter.h"
+
+using Event = DnsEventReporter::Event;
+
+namespace {
+
+const std::chrono::seconds kTimeout(5);
+const int kNever = 60 * 1000;
+
+// Records the batches that a reporter sends, and can hold up the sender until release() is called.
+class Recorder {
+public:
+    DnsEventReporter::Sender sender() {
+        return [this](const std::vector<Event>& events) {
+            std::unique_lock<std::mutex> lock(mLock);
+            mBatches.push_back(events);
+            mChanged.notify_all();
+            mChanged.wait(lock, [this] { return mOpen; });
+        };
+    }
+
+    bool waitForEvents(size_t n) {
+        std::unique_lock<std::mutex> lock(mLock);
+        return mChanged.wait_for(lock, kTimeout, [this, n] { return countLocked() >= n; });
+    }
+
+    void block() {
+        std::lock_guard<std::mutex> lock(mLock);
+        mOpen = false;
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(mLock);
+        mOpen = true;
+        mChanged.notify_all();
+    }
+
+    std::vector<std::vector<Event>> batches() {
+        std::lock_guard<std::mutex> lock(mLock);
+        return mBatches;
+    }
+
+private:
+    size_t countLocked() const {
+        size_t count = 0;
+        for (const auto& batch : mBatches) {
+            count += batch.size();
+        }
+        return count;
+    }
+
+    std::mutex mLock;
+    std::condition_variable mChanged;
+    std::vector<std::vector<Event>> mBatches;
+    bool mOpen = true;
+};
+
+Event makeEvent(int32_t netId, int32_t latencyMs) {
+    return Event{netId, 1, 0, latencyMs};
+}
+
+}  // namespace
+
+TEST(DnsEventReporterTest, TestSendsFullBatches) {
+    Recorder recorder;
+    DnsEventReporter reporter(256, 4, kNever);
+    reporter.setSender(recorder.sender());
+
+    for (int i = 0; i < 8; i++) {
+        EXPECT_TRUE(reporter.report(makeEvent(100, i)));
+    }
+    ASSERT_TRUE(recorder.waitForEvents(8));
+
+    const auto batches = recorder.batches();
+    ASSERT_EQ(2U, batches.size());
+    int latencyMs = 0;
+    for (const auto& batch : batches) {
+        ASSERT_EQ(4U, batch.size());
+        for (const Event& event : batch) {
+            EXPECT_EQ(100, event.netId);
+            EXPECT_EQ(latencyMs++, event.latencyMs);
+        }
+    }
+
+    const DnsEventReporter::Stats stats = reporter.getStats();
+    EXPECT_EQ(8U, stats.reported);
+    EXPECT_EQ(8U, stats.sent);
+    EXPECT_EQ(2U, stats.batches);
+    EXPECT_EQ(0U, stats.dropped);
+}
+
+TEST(DnsEventReporterTest, TestFlushesPartialBatchOnTimer) {
+    Recorder recorder;
+    DnsEventReporter reporter(256, 64, 50);
+    reporter.setSender(recorder.sender());
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 3; i++) {
+        reporter.report(makeEvent(100, i));
+    }
+    ASSERT_TRUE(recorder.waitForEvents(3));
+    EXPECT_GE(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(50));
+
+    const auto batches = recorder.batches();
+    ASSERT_EQ(1U, batches.size());
+    EXPECT_EQ(3U, batches[0].size());
+}
+
+TEST(DnsEventReporterTest, TestFlushesOnDestruction) {
+    Recorder recorder;
+    {
+        DnsEventReporter reporter(256, 64, kNever);
+        reporter.setSender(recorder.sender());
+        reporter.report(makeEvent(100, 1));
+        reporter.report(makeEvent(101, 2));
+    }
+
+    const auto batches = recorder.batches();
+    ASSERT_EQ(1U, batches.size());
+    ASSERT_EQ(2U, batches[0].size());
+    EXPECT_EQ(101, batches[0][1].netId);
+}
+
+TEST(DnsEventReporterTest, TestCountsOverflow) {
+    Recorder recorder;
+    DnsEventReporter reporter(4, 4, kNever);
+    reporter.setSender(recorder.sender());
+
+    // The first batch takes the sender, which holds on to it, so the next four fill the buffer.
+    recorder.block();
+    for (int i = 0; i < 4; i++) {
+        EXPECT_TRUE(reporter.report(makeEvent(100, i)));
+    }
+    ASSERT_TRUE(recorder.waitForEvents(4));
+    for (int i = 4; i < 8; i++) {
+        EXPECT_TRUE(reporter.report(makeEvent(100, i)));
+    }
+    EXPECT_FALSE(reporter.report(makeEvent(100, 8)));
+    EXPECT_FALSE(reporter.report(makeEvent(100, 9)));
+
+    DnsEventReporter::Stats stats = reporter.getStats();
+    EXPECT_EQ(8U, stats.reported);
+    EXPECT_EQ(2U, stats.dropped);
+
+    recorder.release();
+    ASSERT_TRUE(recorder.waitForEvents(8));
+    const auto batches = recorder.batches();
+    ASSERT_EQ(2U, batches.size());
+    EXPECT_EQ(7, batches[1].back().latencyMs);
+}
+
+TEST(DnsEventReporterTest, TestManyWriters) {
+    const int kThreads = 4;
+    const int kEventsPerThread = 1000;
+    Recorder recorder;
+    DnsEventReporter reporter(kThreads * kEventsPerThread, 16, 10);
+    reporter.setSender(recorder.sender());
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < kThreads; t++) {
+        threads.emplace_back([&reporter, t] {
+            for (int i = 0; i < kEventsPerThread; i++) {
+                EXPECT_TRUE(reporter.report(makeEvent(t, i)));
+            }
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    ASSERT_TRUE(recorder.waitForEvents(kThreads * kEventsPerThread));
+
+    // Every event arrives once, and each writer's events arrive in the order it wrote them.
+    std::vector<int> next(kThreads, 0);
+    for (const auto& batch : recorder.batches()) {
+        EXPECT_LE(batch.size(), 16U);
+        for (const Event& event : batch) {
+            ASSERT_LE(0, event.netId);
+            ASSERT_GT(kThreads, event.netId);
+            EXPECT_EQ(next[event.netId]++, event.latencyMs);
+        }
+    }
+    for (int t = 0; t < kThreads; t++) {
+        EXPECT_EQ(kEventsPerThread, next[t]);
+    }
+    EXPECT_EQ(0U, reporter.getStats().dropped);
+}
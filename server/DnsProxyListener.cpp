@@ -23,9 +23,10 @@
 #include <netinet/in.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <string.h>
-#include <pthread.h>
 #include <resolv_netid.h>
 #include <net/if.h>
 
@@ -33,7 +34,12 @@
 #define DBG 0
 #define VDBG 0
 
+#include <algorithm>
 #include <chrono>
+#include <fstream>
+#include <mutex>
+#include <set>
+#include <string>
 
 #include <cutils/log.h>
 #include <binder/IServiceManager.h>
@@ -41,19 +47,191 @@
 #include <sysutils/SocketClient.h>
 
 #include "Fwmark.h"
+#include "DnsEventReporter.h"
 #include "DnsProxyListener.h"
+#include "DnsQueryEngine.h"
+#include "DnsResponseBuffer.h"
+#include "DnsSingleFlight.h"
+#include "DnsWorkerPool.h"
 #include "NetdConstants.h"
 #include "NetworkController.h"
 #include "ResponseCode.h"
+#include "Rfc6724Sort.h"
 #include "android/net/metrics/IDnsEventListener.h"
 #include "QtiDataController.h"
+#include "ResolverController.h"
 
 using android::String16;
 using android::interface_cast;
 using android::net::metrics::IDnsEventListener;
 
-DnsProxyListener::DnsProxyListener(const NetworkController* netCtrl) :
-        FrameworkListener("dnsproxyd"), mNetCtrl(netCtrl) {
+namespace {
+
+// Whether the network that |mark| selects has a route for |family|, which is what bionic checks
+// for AI_ADDRCONFIG. Connecting a UDP socket doesn't send anything.
+bool haveRoute(int family, uint32_t mark) {
+    int s = socket(family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (s == -1) {
+        return false;
+    }
+    if (mark && setsockopt(s, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) == -1) {
+        close(s);
+        return false;
+    }
+    sockaddr_storage ss;
+    memset(&ss, 0, sizeof(ss));
+    socklen_t len;
+    if (family == AF_INET) {
+        sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(&ss);
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(42);
+        sin->sin_addr.s_addr = htonl(0x08080808);
+        len = sizeof(*sin);
+    } else {
+        sockaddr_in6* sin6 = reinterpret_cast<sockaddr_in6*>(&ss);
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(42);
+        sin6->sin6_addr.s6_addr[0] = 0x20;
+        len = sizeof(*sin6);
+    }
+    bool ret = connect(s, reinterpret_cast<const sockaddr*>(&ss), len) == 0;
+    close(s);
+    return ret;
+}
+
+// The names in the hosts file, which bionic's getaddrinfo() looks at before it asks DNS. The file
+// is only read again when it changes.
+class HostsFile {
+public:
+    explicit HostsFile(const char* path) : mPath(path), mLoaded(false) {}
+
+    // Whether |host| is one of the names in the file, without regard to case.
+    bool contains(const char* host) {
+        struct stat st;
+        if (stat(mPath, &st) == -1) {
+            memset(&st, 0, sizeof(st));
+        }
+        std::string name(host);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        std::lock_guard<std::mutex> lock(mLock);
+        if (!mLoaded || st.st_dev != mStat.st_dev || st.st_ino != mStat.st_ino ||
+                st.st_size != mStat.st_size || st.st_mtime != mStat.st_mtime) {
+            load();
+            mStat = st;
+            mLoaded = true;
+        }
+        return mNames.count(name) != 0;
+    }
+
+private:
+    // Every word after the address on each line is a name, up to any comment. Lines whose address
+    // bionic would skip count too, which at worst sends a lookup to bionic that didn't need to go.
+    void load() {
+        mNames.clear();
+        std::ifstream in(mPath);
+        std::string line;
+        while (std::getline(in, line)) {
+            line = line.substr(0, line.find('#'));
+            std::transform(line.begin(), line.end(), line.begin(), ::tolower);
+            size_t start = line.find_first_not_of(" \t");
+            bool address = true;
+            while (start != std::string::npos) {
+                const size_t end = line.find_first_of(" \t", start);
+                if (!address) {
+                    mNames.insert(line.substr(start, end - start));
+                }
+                address = false;
+                start = line.find_first_not_of(" \t", end);
+            }
+        }
+    }
+
+    const char* const mPath;
+    std::mutex mLock;
+    bool mLoaded;
+    struct stat mStat;
+    std::set<std::string> mNames;
+};
+
+HostsFile sHostsFile("/system/etc/hosts");
+
+// Fills in |request| if DnsQueryEngine gives the same answer as bionic for this lookup, once the
+// answer is sorted by RFC 6724: a non-numeric name with a dot in it that isn't in the hosts file,
+// which bionic first looks up as it is in DNS, a numeric service, and hints that ask for a single
+// socket type and nothing beyond AI_ADDRCONFIG.
+bool makeQueryRequest(const char* host, const char* service, const addrinfo* hints,
+                      const android_net_context& netcontext, DnsQueryEngine::Request* request) {
+    if (!host || !strchr(host, '.') || strpbrk(host, ":%") || !hints) {
+        return false;
+    }
+    // Top-level domains are never numeric, but inet_aton() accepts things like "10.1".
+    const char* lastLabel = strrchr(host, '.') + 1;
+    if (!*lastLabel || strspn(lastLabel, "0123456789") == strlen(lastLabel)) {
+        return false;
+    }
+    if (sHostsFile.contains(host)) {
+        return false;
+    }
+    if ((hints->ai_flags & ~AI_ADDRCONFIG) ||
+            (hints->ai_socktype != SOCK_STREAM && hints->ai_socktype != SOCK_DGRAM) ||
+            (hints->ai_family != AF_UNSPEC && hints->ai_family != AF_INET &&
+             hints->ai_family != AF_INET6)) {
+        return false;
+    }
+    unsigned long port = 0;
+    if (service) {
+        char* end;
+        port = strtoul(service, &end, 10);
+        if (!*service || *end || port > 65535) {
+            return false;
+        }
+    }
+
+    request->family = hints->ai_family;
+    if (request->family == AF_UNSPEC && (hints->ai_flags & AI_ADDRCONFIG)) {
+        const bool v4 = haveRoute(AF_INET, netcontext.app_mark);
+        const bool v6 = haveRoute(AF_INET6, netcontext.app_mark);
+        if (!v4 && !v6) {
+            return false;
+        }
+        request->family = (v4 && v6) ? AF_UNSPEC : (v4 ? AF_INET : AF_INET6);
+    }
+    request->name = host;
+    request->socktype = hints->ai_socktype;
+    request->protocol = hints->ai_protocol;
+    request->port = port;
+    request->mark = netcontext.dns_mark;
+    request->netId = netcontext.dns_netid;
+    return true;
+}
+
+// Sends each batch of events to |listener| in a single call.
+DnsEventReporter::Sender makeEventSender(const android::sp<IDnsEventListener>& listener) {
+    return [listener](const std::vector<DnsEventReporter::Event>& events) {
+        std::vector<int32_t> netIds, eventTypes, returnCodes, latenciesMs;
+        netIds.reserve(events.size());
+        eventTypes.reserve(events.size());
+        returnCodes.reserve(events.size());
+        latenciesMs.reserve(events.size());
+        for (const auto& event : events) {
+            netIds.push_back(event.netId);
+            eventTypes.push_back(event.eventType);
+            returnCodes.push_back(event.returnCode);
+            latenciesMs.push_back(event.latencyMs);
+        }
+        listener->onDnsEvents(netIds, eventTypes, returnCodes, latenciesMs);
+    };
+}
+
+}  // namespace
+
+DnsProxyListener::DnsProxyListener(const NetworkController* netCtrl,
+                                   ResolverController* resolverCtrl, DnsWorkerPool* workerPool,
+                                   DnsSingleFlight* singleFlight, DnsQueryEngine* queryEngine,
+                                   DnsEventReporter* eventReporter) :
+        FrameworkListener("dnsproxyd"), mNetCtrl(netCtrl), mResolverCtrl(resolverCtrl),
+        mWorkerPool(workerPool), mSingleFlight(singleFlight), mQueryEngine(queryEngine),
+        mEventReporter(eventReporter) {
     registerCmd(new GetAddrInfoCmd(this));
     registerCmd(new GetHostByAddrCmd(this));
     registerCmd(new GetHostByNameCmd(this));
@@ -61,14 +239,15 @@ DnsProxyListener::DnsProxyListener(const NetworkController* netCtrl) :
 
 DnsProxyListener::GetAddrInfoHandler::GetAddrInfoHandler(
         SocketClient *c, char* host, char* service, struct addrinfo* hints,
-        const struct android_net_context& netcontext,
-        const android::sp<android::net::metrics::IDnsEventListener>& dnsEventListener)
+        const struct android_net_context& netcontext, DnsEventReporter* eventReporter,
+        DnsSingleFlight* singleFlight)
         : mClient(c),
           mHost(host),
           mService(service),
           mHints(hints),
           mNetContext(netcontext),
-          mDnsEventListener(dnsEventListener) {
+          mEventReporter(eventReporter),
+          mSingleFlight(singleFlight) {
 }
 
 DnsProxyListener::GetAddrInfoHandler::~GetAddrInfoHandler() {
@@ -77,22 +256,38 @@ DnsProxyListener::GetAddrInfoHandler::~GetAddrInfoHandler() {
     free(mHints);
 }
 
-void DnsProxyListener::GetAddrInfoHandler::start() {
-    pthread_t thread;
-    pthread_create(&thread, NULL,
-                   DnsProxyListener::GetAddrInfoHandler::threadStart, this);
-    pthread_detach(thread);
+bool DnsProxyListener::GetAddrInfoHandler::start(DnsWorkerPool* workerPool) {
+    return workerPool->enqueue(mClient->getUid(), [this] {
+        run();
+        delete this;
+    });
 }
 
-void* DnsProxyListener::GetAddrInfoHandler::threadStart(void* obj) {
-    GetAddrInfoHandler* handler = reinterpret_cast<GetAddrInfoHandler*>(obj);
-    handler->run();
-    delete handler;
-    pthread_exit(NULL);
-    return NULL;
+bool DnsProxyListener::GetAddrInfoHandler::startQuery(DnsQueryEngine* queryEngine,
+                                                      const std::vector<sockaddr_storage>& servers,
+                                                      int raceDelayMs, DnsWorkerPool* workerPool) {
+    DnsQueryEngine::Request request;
+    if (!makeQueryRequest(mHost, mService, mHints, mNetContext, &request)) {
+        return false;
+    }
+    request.servers = servers;
+    request.raceDelayMs = raceDelayMs;
+    Stopwatch s;
+    return queryEngine->resolve(request, [this, s, workerPool](int rv, addrinfo* result) {
+        // If the name doesn't exist as it is, bionic goes on to try the search domains.
+        if (rv != 0 && rv != EAI_AGAIN && start(workerPool)) {
+            return;
+        }
+        // Bionic sorts what it gets from DNS by the source addresses that the app would use.
+        if (rv == 0) {
+            rfc6724Sort(&result, mNetContext.app_mark, mNetContext.uid);
+        }
+        reply(rv, result, lround(s.timeTaken()));
+        delete this;
+    });
 }
 
-android::sp<IDnsEventListener> DnsProxyListener::getDnsEventListener() {
+DnsEventReporter* DnsProxyListener::getDnsEventReporter() {
     if (mDnsEventListener == nullptr) {
         // Use checkService instead of getService because getService waits for 5 seconds for the
         // service to become available. The DNS resolver inside netd is started much earlier in the
@@ -102,88 +297,14 @@ android::sp<IDnsEventListener> DnsProxyListener::getDnsEventListener() {
                 android::String16("dns_listener"));
         if (b != nullptr) {
             mDnsEventListener = interface_cast<IDnsEventListener>(b);
+            mEventReporter->setSender(makeEventSender(mDnsEventListener));
         }
     }
     // If the DNS listener service is dead, the binder call will just return an error, which should
     // be fine because the only impact is that we can't log DNS events. In any case, this should
     // only happen if the system server is going down, which means it will shortly be taking us down
     // with it.
-    return mDnsEventListener;
-}
-
-static bool sendBE32(SocketClient* c, uint32_t data) {
-    uint32_t be_data = htonl(data);
-    return c->sendData(&be_data, sizeof(be_data)) == 0;
-}
-
-// Sends 4 bytes of big-endian length, followed by the data.
-// Returns true on success.
-static bool sendLenAndData(SocketClient* c, const int len, const void* data) {
-    return sendBE32(c, len) && (len == 0 || c->sendData(data, len) == 0);
-}
-
-// Returns true on success
-static bool sendhostent(SocketClient *c, struct hostent *hp) {
-    bool success = true;
-    int i;
-    if (hp->h_name != NULL) {
-        success &= sendLenAndData(c, strlen(hp->h_name)+1, hp->h_name);
-    } else {
-        success &= sendLenAndData(c, 0, "") == 0;
-    }
-
-    for (i=0; hp->h_aliases[i] != NULL; i++) {
-        success &= sendLenAndData(c, strlen(hp->h_aliases[i])+1, hp->h_aliases[i]);
-    }
-    success &= sendLenAndData(c, 0, ""); // null to indicate we're done
-
-    uint32_t buf = htonl(hp->h_addrtype);
-    success &= c->sendData(&buf, sizeof(buf)) == 0;
-
-    buf = htonl(hp->h_length);
-    success &= c->sendData(&buf, sizeof(buf)) == 0;
-
-    for (i=0; hp->h_addr_list[i] != NULL; i++) {
-        success &= sendLenAndData(c, 16, hp->h_addr_list[i]);
-    }
-    success &= sendLenAndData(c, 0, ""); // null to indicate we're done
-    return success;
-}
-
-static bool sendaddrinfo(SocketClient* c, struct addrinfo* ai) {
-    // struct addrinfo {
-    //      int     ai_flags;       /* AI_PASSIVE, AI_CANONNAME, AI_NUMERICHOST */
-    //      int     ai_family;      /* PF_xxx */
-    //      int     ai_socktype;    /* SOCK_xxx */
-    //      int     ai_protocol;    /* 0 or IPPROTO_xxx for IPv4 and IPv6 */
-    //      socklen_t ai_addrlen;   /* length of ai_addr */
-    //      char    *ai_canonname;  /* canonical name for hostname */
-    //      struct  sockaddr *ai_addr;      /* binary address */
-    //      struct  addrinfo *ai_next;      /* next structure in linked list */
-    // };
-
-    // Write the struct piece by piece because we might be a 64-bit netd
-    // talking to a 32-bit process.
-    bool success =
-            sendBE32(c, ai->ai_flags) &&
-            sendBE32(c, ai->ai_family) &&
-            sendBE32(c, ai->ai_socktype) &&
-            sendBE32(c, ai->ai_protocol);
-    if (!success) {
-        return false;
-    }
-
-    // ai_addrlen and ai_addr.
-    if (!sendLenAndData(c, ai->ai_addrlen, ai->ai_addr)) {
-        return false;
-    }
-
-    // strlen(ai_canonname) and ai_canonname.
-    if (!sendLenAndData(c, ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0, ai->ai_canonname)) {
-        return false;
-    }
-
-    return true;
+    return (mDnsEventListener != nullptr) ? mEventReporter : nullptr;
 }
 
 void DnsProxyListener::GetAddrInfoHandler::run() {
@@ -196,21 +317,25 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
 
     struct addrinfo* result = NULL;
     Stopwatch s;
-    uint32_t rv = android_getaddrinfofornetcontext(mHost, mService, mHints, &mNetContext, &result);
-    const int latencyMs = lround(s.timeTaken());
+    uint32_t rv = mSingleFlight->getaddrinfo(
+            DnsSingleFlight::Key(mHost, mService, mHints, mNetContext),
+            [this](addrinfo** res) {
+                return android_getaddrinfofornetcontext(mHost, mService, mHints, &mNetContext, res);
+            },
+            &result);
+    reply(rv, result, lround(s.timeTaken()));
+}
 
+void DnsProxyListener::GetAddrInfoHandler::reply(uint32_t rv, struct addrinfo* result,
+                                                 int latencyMs) {
     if (rv) {
         // getaddrinfo failed
         mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, &rv, sizeof(rv));
     } else {
-        bool success = !mClient->sendCode(ResponseCode::DnsProxyQueryResult);
-        struct addrinfo* ai = result;
-        while (ai && success) {
-            success = sendBE32(mClient, 1) && sendaddrinfo(mClient, ai);
-            ai = ai->ai_next;
-        }
-        success = success && sendBE32(mClient, 0);
-        if (!success) {
+        DnsResponseBuffer& response = DnsResponseBuffer::forThisThread();
+        response.appendCode(ResponseCode::DnsProxyQueryResult);
+        response.appendAddrInfoList(result);
+        if (!response.send(mClient)) {
             ALOGW("Error writing DNS result to client");
         }
     }
@@ -218,9 +343,9 @@ void DnsProxyListener::GetAddrInfoHandler::run() {
         freeaddrinfo(result);
     }
     mClient->decRef();
-    if (mDnsEventListener != nullptr) {
-        mDnsEventListener->onDnsEvent(mNetContext.dns_netid, IDnsEventListener::EVENT_GETADDRINFO,
-                                      (int32_t) rv, latencyMs);
+    if (mEventReporter != nullptr) {
+        mEventReporter->report({ (int32_t) mNetContext.dns_netid,
+                                 IDnsEventListener::EVENT_GETADDRINFO, (int32_t) rv, latencyMs });
     }
 }
 
@@ -300,8 +425,24 @@ int DnsProxyListener::GetAddrInfoCmd::runCommand(SocketClient *cli,
     cli->incRef();
     DnsProxyListener::GetAddrInfoHandler* handler =
             new DnsProxyListener::GetAddrInfoHandler(cli, name, service, hints, netcontext,
-                                                     mDnsProxyListener->getDnsEventListener());
-    handler->start();
+                                                     mDnsProxyListener->getDnsEventReporter(),
+                                                     mDnsProxyListener->mSingleFlight);
+    std::vector<sockaddr_storage> servers;
+    int raceDelayMs;
+    if (mDnsProxyListener->mQueryEngine->isRunning() &&
+            mDnsProxyListener->mResolverCtrl->getDnsServers(netcontext.dns_netid, &servers,
+                                                            &raceDelayMs) == 0 &&
+            handler->startQuery(mDnsProxyListener->mQueryEngine, servers, raceDelayMs,
+                                mDnsProxyListener->mWorkerPool)) {
+        return 0;
+    }
+    if (!handler->start(mDnsProxyListener->mWorkerPool)) {
+        ALOGW("Too many DNS lookups queued, rejecting getaddrinfo from uid %d", uid);
+        uint32_t rv = EAI_AGAIN;
+        cli->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, &rv, sizeof(rv));
+        delete handler;
+        cli->decRef();
+    }
 
     return 0;
 }
@@ -356,40 +497,37 @@ int DnsProxyListener::GetHostByNameCmd::runCommand(SocketClient *cli,
     cli->incRef();
     DnsProxyListener::GetHostByNameHandler* handler =
             new DnsProxyListener::GetHostByNameHandler(cli, name, af, netId, mark,
-                                                       mDnsProxyListener->getDnsEventListener());
-    handler->start();
+                                                       mDnsProxyListener->getDnsEventReporter());
+    if (!handler->start(mDnsProxyListener->mWorkerPool)) {
+        ALOGW("Too many DNS lookups queued, rejecting gethostbyname from uid %d", uid);
+        cli->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, NULL, 0);
+        delete handler;
+        cli->decRef();
+    }
 
     return 0;
 }
 
 DnsProxyListener::GetHostByNameHandler::GetHostByNameHandler(
         SocketClient* c, char* name, int af, unsigned netId, uint32_t mark,
-        const android::sp<android::net::metrics::IDnsEventListener>& dnsEventListener)
+        DnsEventReporter* eventReporter)
         : mClient(c),
           mName(name),
           mAf(af),
           mNetId(netId),
           mMark(mark),
-          mDnsEventListener(dnsEventListener) {
+          mEventReporter(eventReporter) {
 }
 
 DnsProxyListener::GetHostByNameHandler::~GetHostByNameHandler() {
     free(mName);
 }
 
-void DnsProxyListener::GetHostByNameHandler::start() {
-    pthread_t thread;
-    pthread_create(&thread, NULL,
-            DnsProxyListener::GetHostByNameHandler::threadStart, this);
-    pthread_detach(thread);
-}
-
-void* DnsProxyListener::GetHostByNameHandler::threadStart(void* obj) {
-    GetHostByNameHandler* handler = reinterpret_cast<GetHostByNameHandler*>(obj);
-    handler->run();
-    delete handler;
-    pthread_exit(NULL);
-    return NULL;
+bool DnsProxyListener::GetHostByNameHandler::start(DnsWorkerPool* workerPool) {
+    return workerPool->enqueue(mClient->getUid(), [this] {
+        run();
+        delete this;
+    });
 }
 
 void DnsProxyListener::GetHostByNameHandler::run() {
@@ -410,8 +548,10 @@ void DnsProxyListener::GetHostByNameHandler::run() {
 
     bool success = true;
     if (hp) {
-        success = mClient->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
-        success &= sendhostent(mClient, hp);
+        DnsResponseBuffer& response = DnsResponseBuffer::forThisThread();
+        response.appendCode(ResponseCode::DnsProxyQueryResult);
+        response.appendHostent(hp);
+        success = response.send(mClient);
     } else {
         success = mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, NULL, 0) == 0;
     }
@@ -421,9 +561,9 @@ void DnsProxyListener::GetHostByNameHandler::run() {
     }
     mClient->decRef();
 
-    if (mDnsEventListener != nullptr) {
-        mDnsEventListener->onDnsEvent(mNetId, IDnsEventListener::EVENT_GETHOSTBYNAME,
-                                      h_errno, latencyMs);
+    if (mEventReporter != nullptr) {
+        mEventReporter->report({ (int32_t) mNetId, IDnsEventListener::EVENT_GETHOSTBYNAME,
+                                 h_errno, latencyMs });
     }
 }
 
@@ -485,7 +625,12 @@ int DnsProxyListener::GetHostByAddrCmd::runCommand(SocketClient *cli,
     cli->incRef();
     DnsProxyListener::GetHostByAddrHandler* handler =
             new DnsProxyListener::GetHostByAddrHandler(cli, addr, addrLen, addrFamily, netId, mark);
-    handler->start();
+    if (!handler->start(mDnsProxyListener->mWorkerPool)) {
+        ALOGW("Too many DNS lookups queued, rejecting gethostbyaddr from uid %d", uid);
+        cli->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, NULL, 0);
+        delete handler;
+        cli->decRef();
+    }
 
     return 0;
 }
@@ -508,19 +653,11 @@ DnsProxyListener::GetHostByAddrHandler::~GetHostByAddrHandler() {
     free(mAddress);
 }
 
-void DnsProxyListener::GetHostByAddrHandler::start() {
-    pthread_t thread;
-    pthread_create(&thread, NULL,
-                   DnsProxyListener::GetHostByAddrHandler::threadStart, this);
-    pthread_detach(thread);
-}
-
-void* DnsProxyListener::GetHostByAddrHandler::threadStart(void* obj) {
-    GetHostByAddrHandler* handler = reinterpret_cast<GetHostByAddrHandler*>(obj);
-    handler->run();
-    delete handler;
-    pthread_exit(NULL);
-    return NULL;
+bool DnsProxyListener::GetHostByAddrHandler::start(DnsWorkerPool* workerPool) {
+    return workerPool->enqueue(mClient->getUid(), [this] {
+        run();
+        delete this;
+    });
 }
 
 void DnsProxyListener::GetHostByAddrHandler::run() {
@@ -541,8 +678,10 @@ void DnsProxyListener::GetHostByAddrHandler::run() {
 
     bool success = true;
     if (hp) {
-        success = mClient->sendCode(ResponseCode::DnsProxyQueryResult) == 0;
-        success &= sendhostent(mClient, hp);
+        DnsResponseBuffer& response = DnsResponseBuffer::forThisThread();
+        response.appendCode(ResponseCode::DnsProxyQueryResult);
+        response.appendHostent(hp);
+        success = response.send(mClient);
     } else {
         success = mClient->sendBinaryMsg(ResponseCode::DnsProxyOperationFailed, NULL, 0) == 0;
     }
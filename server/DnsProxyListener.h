@@ -18,28 +18,46 @@
 #define _DNSPROXYLISTENER_H__
 
 #include <resolv_netid.h>  // struct android_net_context
+#include <sys/socket.h>
+
+#include <vector>
+
 #include <binder/IServiceManager.h>
 #include <sysutils/FrameworkListener.h>
 
 #include "android/net/metrics/IDnsEventListener.h"
 #include "NetdCommand.h"
 
+class DnsEventReporter;
+class DnsQueryEngine;
+class DnsSingleFlight;
+class DnsWorkerPool;
 class NetworkController;
+class ResolverController;
 
 class DnsProxyListener : public FrameworkListener {
 public:
-    explicit DnsProxyListener(const NetworkController* netCtrl);
+    DnsProxyListener(const NetworkController* netCtrl, ResolverController* resolverCtrl,
+                     DnsWorkerPool* workerPool, DnsSingleFlight* singleFlight,
+                     DnsQueryEngine* queryEngine, DnsEventReporter* eventReporter);
     virtual ~DnsProxyListener() {}
 
-    // Returns the binder reference to the DNS listener service, attempting to fetch it if we do not
-    // have it already. This method mutates internal state without taking a lock and must only be
-    // called on one thread. This is safe because we only call this in the runCommand methods of our
-    // commands, which are only called by FrameworkListener::onDataAvailable, which is only called
-    // from SocketListener::runListener, which is a single-threaded select loop.
-    android::sp<android::net::metrics::IDnsEventListener> getDnsEventListener();
+    // Returns the reporter that sends DNS events to the DNS listener service, or null if the
+    // service isn't running yet. Attempts to fetch the binder reference to the service if we do not
+    // have it already, and points the reporter at it. This method mutates internal state without
+    // taking a lock and must only be called on one thread. This is safe because we only call this
+    // in the runCommand methods of our commands, which are only called by
+    // FrameworkListener::onDataAvailable, which is only called from SocketListener::runListener,
+    // which is a single-threaded select loop.
+    DnsEventReporter* getDnsEventReporter();
 
 private:
     const NetworkController *mNetCtrl;
+    ResolverController* mResolverCtrl;
+    DnsWorkerPool* mWorkerPool;
+    DnsSingleFlight* mSingleFlight;
+    DnsQueryEngine* mQueryEngine;
+    DnsEventReporter* mEventReporter;
     android::sp<android::net::metrics::IDnsEventListener> mDnsEventListener;
 
     class GetAddrInfoCmd : public NetdCommand {
@@ -59,20 +77,32 @@ private:
                            char* service,
                            struct addrinfo* hints,
                            const struct android_net_context& netcontext,
-                           const android::sp<android::net::metrics::IDnsEventListener>& listener);
+                           DnsEventReporter* eventReporter,
+                           DnsSingleFlight* singleFlight);
         ~GetAddrInfoHandler();
 
-        static void* threadStart(void* handler);
-        void start();
+        // Queues the lookup on |workerPool|, which deletes the handler when it's done. Returns
+        // false if the lookup was rejected, in which case the caller still owns the handler.
+        bool start(DnsWorkerPool* workerPool);
+
+        // Hands the lookup to |queryEngine|, if it's one that the engine answers the same way as
+        // bionic, sorts the answer by RFC 6724 as bionic does, and deletes the handler when it's
+        // done. Lookups that the engine can't answer go on to |workerPool|. Returns false if the
+        // engine didn't take the lookup, in which case the caller still owns the handler.
+        bool startQuery(DnsQueryEngine* queryEngine, const std::vector<sockaddr_storage>& servers,
+                        int raceDelayMs, DnsWorkerPool* workerPool);
 
     private:
         void run();
+        // Sends the result to the client, and frees it.
+        void reply(uint32_t rv, struct addrinfo* result, int latencyMs);
         SocketClient* mClient;  // ref counted
         char* mHost;    // owned
         char* mService; // owned
         struct addrinfo* mHints;  // owned
         struct android_net_context mNetContext;
-        android::sp<android::net::metrics::IDnsEventListener> mDnsEventListener;
+        DnsEventReporter* mEventReporter;  // Null if there is no DNS listener service.
+        DnsSingleFlight* mSingleFlight;
     };
 
     /* ------ gethostbyname ------*/
@@ -92,10 +122,9 @@ private:
                             int af,
                             unsigned netId,
                             uint32_t mark,
-                            const android::sp<android::net::metrics::IDnsEventListener>& listener);
+                            DnsEventReporter* eventReporter);
         ~GetHostByNameHandler();
-        static void* threadStart(void* handler);
-        void start();
+        bool start(DnsWorkerPool* workerPool);  // Same as GetAddrInfoHandler::start().
     private:
         void run();
         SocketClient* mClient; //ref counted
@@ -103,7 +132,7 @@ private:
         int mAf;
         unsigned mNetId;
         uint32_t mMark;
-        android::sp<android::net::metrics::IDnsEventListener> mDnsEventListener;
+        DnsEventReporter* mEventReporter;  // Null if there is no DNS listener service.
     };
 
     /* ------ gethostbyaddr ------*/
@@ -126,8 +155,7 @@ private:
                             uint32_t mark);
         ~GetHostByAddrHandler();
 
-        static void* threadStart(void* handler);
-        void start();
+        bool start(DnsWorkerPool* workerPool);  // Same as GetAddrInfoHandler::start().
 
     private:
         void run();
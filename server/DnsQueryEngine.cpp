@@ -0,0 +1,958 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DnsQueryEngine"
+
+#include "DnsQueryEngine.h"
+
+#include <arpa/nameser.h>
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <future>
+#include <memory>
+
+#include <cutils/log.h>
+#include <resolv_stats.h>
+
+#include "DnsCache.h"
+#include "DnsServerStats.h"
+#include "DumpWriter.h"
+
+namespace {
+
+const size_t kMaxUdpAnswer = 4096;
+const int kMaxEvents = 32;
+const int kMaxNamePointers = 64;
+
+socklen_t sockaddrLen(const sockaddr_storage& ss) {
+    return ss.ss_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+}
+
+uint16_t get16(const uint8_t* p) {
+    return (p[0] << 8) | p[1];
+}
+
+uint32_t get32(const uint8_t* p) {
+    return (static_cast<uint32_t>(get16(p)) << 16) | get16(p + 2);
+}
+
+// A TTL with the top bit set means 0 (RFC 2181).
+uint32_t getTtl(const uint8_t* p) {
+    const uint32_t ttl = get32(p);
+    return (ttl & 0x80000000) ? 0 : ttl;
+}
+
+void put16(uint8_t* p, uint16_t v) {
+    p[0] = v >> 8;
+    p[1] = v & 0xff;
+}
+
+// Advances |*pos| past the domain name that starts there, which may end in a compression pointer.
+bool skipName(const uint8_t* msg, size_t len, size_t* pos) {
+    while (*pos < len) {
+        const uint8_t c = msg[*pos];
+        if (c == 0) {
+            (*pos)++;
+            return true;
+        }
+        if ((c & 0xc0) == 0xc0) {
+            *pos += 2;
+            return *pos <= len;
+        }
+        if (c & 0xc0) {
+            return false;
+        }
+        *pos += 1 + c;
+    }
+    return false;
+}
+
+// Reads the domain name at |pos| into |*name|, in wire format with every letter in lower case, so
+// that names compare without regard to case. Returns false if the name is malformed.
+bool readName(const uint8_t* msg, size_t len, size_t pos, std::string* name) {
+    name->clear();
+    int pointers = 0;
+    while (pos < len) {
+        const uint8_t c = msg[pos];
+        if (c == 0) {
+            name->push_back(0);
+            return true;
+        }
+        if ((c & 0xc0) == 0xc0) {
+            // Bounded, so that a pointer loop ends.
+            if (pos + 1 >= len || ++pointers > kMaxNamePointers) {
+                return false;
+            }
+            pos = ((c & 0x3f) << 8) | msg[pos + 1];
+            continue;
+        }
+        if ((c & 0xc0) || pos + 1 + c > len || name->size() + 1 + c >= NS_MAXCDNAME) {
+            return false;
+        }
+        name->push_back(c);
+        for (size_t i = pos + 1; i <= pos + c; i++) {
+            name->push_back(tolower(msg[i]));
+        }
+        pos += 1 + c;
+    }
+    return false;
+}
+
+// Opens a non-blocking socket that carries |mark|. Returns the socket, or -errno.
+int openSocket(int family, int type, uint32_t mark) {
+    int fd = socket(family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        return -errno;
+    }
+    if (mark && setsockopt(fd, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) == -1) {
+        int ret = -errno;
+        close(fd);
+        return ret;
+    }
+    return fd;
+}
+
+}  // namespace
+
+const int DnsQueryEngine::DEFAULT_TIMEOUT_MS;
+const int DnsQueryEngine::DEFAULT_ATTEMPTS;
+const size_t DnsQueryEngine::MAX_OUTSTANDING;
+
+DnsQueryEngine::Request::Request() :
+        family(AF_UNSPEC), socktype(SOCK_STREAM), protocol(0), port(0), mark(0), netId(0),
+        timeoutMs(DEFAULT_TIMEOUT_MS), attempts(DEFAULT_ATTEMPTS), raceDelayMs(0) {
+}
+
+struct DnsQueryEngine::Query {
+    Lookup* lookup;
+    uint16_t type;
+    std::vector<uint8_t> packet;  // The query, with the id of the current try.
+    int attempt;                  // Tries so far, counting each server of a race.
+    int fd;
+    size_t server;                // The index of the server that |fd| talks to.
+    Clock::time_point sent;       // When the try on |fd| started.
+    int raceFd;                   // The UDP socket of the second server of a race, or -1.
+    size_t raceServer;
+    Clock::time_point raceSent;
+    bool racePending;             // The deadline is when to start racing, rather than a timeout.
+    Clock::time_point timeout;    // When the try times out, if racePending.
+    bool tcp;
+    size_t tcpSent;
+    std::vector<uint8_t> tcpAnswer;
+    bool hasDeadline;
+    std::multimap<Clock::time_point, Query*>::iterator deadline;
+    int rv;
+    std::vector<std::string> addrs;
+};
+
+struct DnsQueryEngine::Lookup {
+    Request request;
+    Callback callback;
+    std::vector<std::unique_ptr<Query>> queries;  // AAAA before A, which is the order of results.
+    int pending;
+    bool refresh;  // Started by the engine to refresh the cache, rather than by resolve().
+};
+
+DnsQueryEngine::DnsQueryEngine(DnsCache* cache, DnsServerStats* serverStats) :
+        mCache(cache), mServerStats(serverStats), mOutstanding(0), mStopping(false),
+        mRunning(false), mCallbacksDone(false), mEpollFd(-1), mEventFd(-1), mLookups(0),
+        mQueries(0), mTimeouts(0), mTcpFallbacks(0), mRefreshes(0), mRaces(0), mRaceWins(0) {
+}
+
+DnsQueryEngine::~DnsQueryEngine() {
+    stop();
+}
+
+int DnsQueryEngine::start() {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mRunning) {
+        return -EBUSY;
+    }
+    mEpollFd = epoll_create1(EPOLL_CLOEXEC);
+    mEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (mEpollFd == -1 || mEventFd == -1 ||
+            epoll_ctl(mEpollFd, EPOLL_CTL_ADD, mEventFd, &event) == -1) {
+        int ret = -errno;
+        ALOGE("Unable to start DNS query engine (%s)", strerror(errno));
+        if (mEpollFd != -1) close(mEpollFd);
+        if (mEventFd != -1) close(mEventFd);
+        mEpollFd = mEventFd = -1;
+        return ret;
+    }
+    mStopping = false;
+    mCallbacksDone = false;
+    mRunning = true;
+    mThread = std::thread([this] { run(); });
+    mCallbackThread = std::thread([this] { runCallbacks(); });
+    return 0;
+}
+
+void DnsQueryEngine::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (!mRunning || mStopping) {
+            return;
+        }
+        mStopping = true;
+    }
+    uint64_t one = 1;
+    write(mEventFd, &one, sizeof(one));
+    mThread.join();
+    // The engine's thread has failed whatever was left, so this runs every callback that's due.
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mCallbacksDone = true;
+    }
+    mCompletionsChanged.notify_one();
+    mCallbackThread.join();
+    close(mEpollFd);
+    close(mEventFd);
+    std::lock_guard<std::mutex> lock(mLock);
+    mEpollFd = mEventFd = -1;
+    mRunning = false;
+}
+
+bool DnsQueryEngine::resolve(const Request& request, Callback callback) {
+    uint8_t packet[NS_PACKETSZ];
+    if (request.servers.empty() || request.attempts < 1 ||
+            !buildQuery(request.name, 0, ns_t_a, packet, sizeof(packet))) {
+        return false;
+    }
+    if (request.family != AF_INET && request.family != AF_INET6 &&
+            request.family != AF_UNSPEC) {
+        return false;
+    }
+
+    std::unique_ptr<Lookup> lookup(new Lookup);
+    lookup->request = request;
+    lookup->callback = std::move(callback);
+    lookup->pending = 0;
+    lookup->refresh = false;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        if (!mRunning || mStopping || mOutstanding >= MAX_OUTSTANDING) {
+            return false;
+        }
+        mOutstanding++;
+        mIncoming.push_back(lookup.release());
+    }
+    uint64_t one = 1;
+    write(mEventFd, &one, sizeof(one));
+    return true;
+}
+
+int DnsQueryEngine::getaddrinfo(const Request& request, addrinfo** result) {
+    *result = nullptr;
+    std::promise<int> done;
+    if (!resolve(request, [&done, result](int rv, addrinfo* ai) {
+            *result = ai;
+            done.set_value(rv);
+        })) {
+        return EAI_AGAIN;
+    }
+    return done.get_future().get();
+}
+
+void DnsQueryEngine::run() {
+    epoll_event events[kMaxEvents];
+    bool stopping = false;
+    while (!stopping) {
+        int n = epoll_wait(mEpollFd, events, kMaxEvents, nextTimeoutMs());
+        if (n == -1 && errno != EINTR) {
+            ALOGE("epoll_wait failed (%s)", strerror(errno));
+        }
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.ptr) {
+                onEvent(static_cast<Query*>(events[i].data.ptr), events[i].events);
+                continue;
+            }
+            uint64_t count;
+            read(mEventFd, &count, sizeof(count));
+            std::vector<Lookup*> incoming;
+            {
+                std::lock_guard<std::mutex> lock(mLock);
+                incoming.swap(mIncoming);
+                stopping = mStopping;
+            }
+            for (Lookup* lookup : incoming) {
+                startLookup(lookup);
+            }
+        }
+        expireQueries();
+        deleteFinishedLookups();
+    }
+
+    // Every query that's in flight has a deadline.
+    while (!mDeadlines.empty()) {
+        finishQuery(mDeadlines.begin()->second, EAI_AGAIN);
+    }
+    deleteFinishedLookups();
+}
+
+void DnsQueryEngine::runCallbacks() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        mCompletionsChanged.wait(lock, [this] { return !mCompletions.empty() || mCallbacksDone; });
+        if (mCompletions.empty()) {
+            return;
+        }
+        Completion completion = std::move(mCompletions.front());
+        mCompletions.pop_front();
+        // The lookup stays outstanding until now, so no more than MAX_OUTSTANDING completions are
+        // ever queued, however slow the callbacks are.
+        mOutstanding--;
+        lock.unlock();
+        completion.callback(completion.rv, completion.result);
+        lock.lock();
+    }
+}
+
+void DnsQueryEngine::startLookup(Lookup* lookup) {
+    const int family = lookup->request.family;
+    std::vector<uint16_t> types;
+    if (family == AF_INET6 || family == AF_UNSPEC) types.push_back(ns_t_aaaa);
+    if (family == AF_INET || family == AF_UNSPEC) types.push_back(ns_t_a);
+
+    for (uint16_t type : types) {
+        std::unique_ptr<Query> query(new Query);
+        query->lookup = lookup;
+        query->type = type;
+        query->packet.resize(NS_PACKETSZ);
+        query->packet.resize(buildQuery(lookup->request.name, 0, type, query->packet.data(),
+                                        query->packet.size()));
+        query->attempt = 0;
+        query->fd = -1;
+        query->server = 0;
+        query->raceFd = -1;
+        query->raceServer = 0;
+        query->racePending = false;
+        query->tcp = false;
+        query->tcpSent = 0;
+        query->hasDeadline = false;
+        query->rv = EAI_AGAIN;
+        lookup->queries.push_back(std::move(query));
+    }
+
+    // Holds the lookup open until every query is sent, in case they all fail right away.
+    lookup->pending = lookup->queries.size() + 1;
+    for (size_t i = 0; i < types.size(); i++) {
+        Query* query = lookup->queries[i].get();
+        if (!lookup->refresh && answerFromCache(query)) {
+            finishQuery(query, query->rv);
+        } else {
+            sendQuery(query);
+        }
+    }
+    if (--lookup->pending == 0) {
+        completeLookup(lookup);
+    }
+}
+
+bool DnsQueryEngine::answerFromCache(Query* query) {
+    const Request& request = query->lookup->request;
+    if (!mCache || !request.netId) {
+        return false;
+    }
+    DnsCache::Answer answer;
+    switch (mCache->lookup(request.netId, request.name, query->type, &answer)) {
+        case DnsCache::MISS:
+            return false;
+        case DnsCache::HIT_AND_REFRESH:
+            startRefresh(query);
+            break;
+        case DnsCache::HIT:
+            break;
+    }
+    query->addrs = answer.addrs;
+    query->rv = answer.negative ? EAI_NODATA : 0;
+    return true;
+}
+
+void DnsQueryEngine::startRefresh(Query* query) {
+    // Nobody waits for the refresh; its only result is the new answer in the cache.
+    Lookup* refresh = new Lookup;
+    refresh->request = query->lookup->request;
+    refresh->request.family = (query->type == ns_t_aaaa) ? AF_INET6 : AF_INET;
+    refresh->pending = 0;
+    refresh->refresh = true;
+    startLookup(refresh);
+}
+
+void DnsQueryEngine::sendQuery(Query* query) {
+    closeSocket(query);
+    const Request& request = query->lookup->request;
+    const int maxAttempts = request.servers.size() * request.attempts;
+    while (query->attempt < maxAttempts) {
+        // Like bionic, try each server in turn before trying any of them again.
+        const size_t server = query->attempt % request.servers.size();
+        query->attempt++;
+        put16(query->packet.data(), arc4random_uniform(65536));
+        query->fd = sendUdp(query, server);
+        if (query->fd != -1) {
+            query->server = server;
+            mQueries++;
+            const Clock::time_point now = Clock::now();
+            query->sent = now;
+            query->timeout = now + std::chrono::milliseconds(request.timeoutMs);
+            if (request.raceDelayMs > 0 && request.raceDelayMs < request.timeoutMs &&
+                    request.servers.size() > 1 && query->attempt < maxAttempts) {
+                query->racePending = true;
+                setDeadline(query, now + std::chrono::milliseconds(request.raceDelayMs));
+            } else {
+                setDeadline(query, query->timeout);
+            }
+            return;
+        }
+    }
+    finishQuery(query, EAI_AGAIN);
+}
+
+void DnsQueryEngine::startRace(Query* query) {
+    query->racePending = false;
+    const Request& request = query->lookup->request;
+    const size_t server = query->attempt % request.servers.size();
+    query->attempt++;
+    query->raceFd = sendUdp(query, server);
+    if (query->raceFd == -1) {
+        setDeadline(query, query->timeout);
+        return;
+    }
+    query->raceServer = server;
+    query->raceSent = Clock::now();
+    mQueries++;
+    mRaces++;
+    // The first server can still answer too, until the second one times out.
+    setDeadline(query, Clock::now() + std::chrono::milliseconds(request.timeoutMs));
+}
+
+int DnsQueryEngine::sendUdp(Query* query, size_t server) {
+    const sockaddr_storage& addr = query->lookup->request.servers[server];
+    int fd = openSocket(addr.ss_family, SOCK_DGRAM, query->lookup->request.mark);
+    if (fd < 0) {
+        ALOGW("Unable to open DNS socket (%s)", strerror(-fd));
+        return -1;
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = query;
+    // Connecting means that the kernel drops answers from anywhere else, and reports ICMP errors.
+    if (connect(fd, reinterpret_cast<const sockaddr*>(&addr), sockaddrLen(addr)) == -1 ||
+            send(fd, query->packet.data(), query->packet.size(), 0) == -1 ||
+            epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        close(fd);
+        return -1;
+    }
+    query->tcp = false;
+    return fd;
+}
+
+bool DnsQueryEngine::startTcp(Query* query, size_t serverIndex) {
+    closeSocket(query);
+    const Request& request = query->lookup->request;
+    const sockaddr_storage& server = request.servers[serverIndex];
+    int fd = openSocket(server.ss_family, SOCK_STREAM, request.mark);
+    if (fd < 0) {
+        ALOGW("Unable to open DNS socket (%s)", strerror(-fd));
+        return false;
+    }
+    epoll_event event = {};
+    event.events = EPOLLOUT;
+    event.data.ptr = query;
+    if ((connect(fd, reinterpret_cast<const sockaddr*>(&server), sockaddrLen(server)) == -1 &&
+            errno != EINPROGRESS) || epoll_ctl(mEpollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        close(fd);
+        return false;
+    }
+    query->fd = fd;
+    query->server = serverIndex;
+    query->sent = Clock::now();
+    query->tcp = true;
+    query->tcpSent = 0;
+    query->tcpAnswer.clear();
+    mTcpFallbacks++;
+    setDeadline(query, Clock::now() + std::chrono::milliseconds(request.timeoutMs));
+    return true;
+}
+
+void DnsQueryEngine::onEvent(Query* query, uint32_t events) {
+    // Both sockets of a race can be ready in the same batch of events, and the first one can
+    // finish the query.
+    if (query->fd == -1 && query->raceFd == -1) {
+        return;
+    }
+    if (query->tcp) {
+        onTcpEvent(query, events);
+    } else {
+        onUdpReadable(query);
+    }
+}
+
+void DnsQueryEngine::onUdpReadable(Query* query) {
+    // While racing, either socket can have the answer.
+    if (query->fd != -1 && readUdp(query, false)) {
+        return;
+    }
+    if (query->raceFd != -1) {
+        readUdp(query, true);
+    }
+}
+
+bool DnsQueryEngine::readUdp(Query* query, bool race) {
+    const int fd = race ? query->raceFd : query->fd;
+    uint8_t answer[kMaxUdpAnswer];
+    while (true) {
+        ssize_t len = recv(fd, answer, sizeof(answer), 0);
+        if (len == -1 && errno == EINTR) {
+            continue;
+        }
+        if (len == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return false;
+        }
+        if (len == -1) {
+            // Most likely ECONNREFUSED, from an ICMP error. No point waiting for the timeout.
+            addSample(query, race, RCODE_INTERNAL_ERROR);
+            failTry(query, race);
+            return true;
+        }
+        // Anything that isn't the answer to this query is ignored, as bionic does.
+        int rcode;
+        bool truncated;
+        uint32_t ttl;
+        query->addrs.clear();
+        if (parseResponse(query->packet.data(), query->packet.size(), answer, len, &rcode,
+                          &truncated, &query->addrs, &ttl)) {
+            onAnswer(query, race, rcode, truncated, ttl);
+            return true;
+        }
+    }
+}
+
+void DnsQueryEngine::onTcpEvent(Query* query, uint32_t events) {
+    if (query->tcpSent < query->packet.size() + 2) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            return;
+        }
+        std::vector<uint8_t> out(2);
+        put16(out.data(), query->packet.size());
+        out.insert(out.end(), query->packet.begin(), query->packet.end());
+        ssize_t sent = send(query->fd, out.data() + query->tcpSent, out.size() - query->tcpSent,
+                            MSG_NOSIGNAL);
+        if (sent == -1 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (sent == -1) {
+            addSample(query, false, RCODE_INTERNAL_ERROR);
+            retry(query);
+            return;
+        }
+        query->tcpSent += sent;
+        if (query->tcpSent == out.size()) {
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.ptr = query;
+            if (epoll_ctl(mEpollFd, EPOLL_CTL_MOD, query->fd, &event) == -1) {
+                addSample(query, false, RCODE_INTERNAL_ERROR);
+                retry(query);
+            }
+        }
+        return;
+    }
+
+    // Reads the two-byte length first, and then exactly that much.
+    std::vector<uint8_t>& answer = query->tcpAnswer;
+    const size_t have = answer.size();
+    const size_t want = (have < 2) ? 2 : 2 + get16(answer.data());
+    answer.resize(want);
+    ssize_t len = recv(query->fd, answer.data() + have, want - have, 0);
+    if (len == -1 && (errno == EAGAIN || errno == EINTR)) {
+        answer.resize(have);
+        return;
+    }
+    if (len <= 0) {
+        addSample(query, false, RCODE_INTERNAL_ERROR);
+        retry(query);
+        return;
+    }
+    answer.resize(have + len);
+    if (answer.size() < want || want == 2) {
+        // Level-triggered, so whatever is left to read wakes us up again.
+        return;
+    }
+
+    int rcode;
+    bool truncated;
+    uint32_t ttl;
+    query->addrs.clear();
+    if (!parseResponse(query->packet.data(), query->packet.size(), answer.data() + 2,
+                       answer.size() - 2, &rcode, &truncated, &query->addrs, &ttl)) {
+        addSample(query, false, RCODE_INTERNAL_ERROR);
+        retry(query);
+    } else {
+        // Nothing to fall back to if the TCP answer is truncated too, so use what there is.
+        onAnswer(query, false, rcode, false, ttl);
+    }
+}
+
+void DnsQueryEngine::onAnswer(Query* query, bool race, int rcode, bool truncated,
+                              uint32_t ttl) {
+    if (truncated) {
+        // The TCP answer is the one that counts for the server's stats.
+        if (!startTcp(query, race ? query->raceServer : query->server)) retry(query);
+        return;
+    }
+    addSample(query, race, rcode);
+    if (rcode != ns_r_noerror && rcode != ns_r_nxdomain) {
+        failTry(query, race);
+        return;
+    }
+    if (race) {
+        mRaceWins++;
+    }
+    const bool negative = query->addrs.empty();
+    const Request& request = query->lookup->request;
+    if (mCache && request.netId) {
+        mCache->put(request.netId, request.name, query->type,
+                    DnsCache::Answer{ negative, query->addrs }, ttl);
+    }
+    finishQuery(query, negative ? EAI_NODATA : 0);
+}
+
+void DnsQueryEngine::addSample(Query* query, bool race, int rcode) {
+    const Request& request = query->lookup->request;
+    if (!mServerStats || !request.netId) {
+        return;
+    }
+    const Clock::duration rtt = Clock::now() - (race ? query->raceSent : query->sent);
+    mServerStats->addSample(request.netId,
+                            request.servers[race ? query->raceServer : query->server], rcode,
+                            std::chrono::duration_cast<std::chrono::milliseconds>(rtt).count());
+}
+
+void DnsQueryEngine::failTry(Query* query, bool race) {
+    // If the other server of a race is still being asked, keep waiting for it.
+    int& fd = race ? query->raceFd : query->fd;
+    const int other = race ? query->fd : query->raceFd;
+    if (other != -1) {
+        close(fd);
+        fd = -1;
+        return;
+    }
+    retry(query);
+}
+
+void DnsQueryEngine::retry(Query* query) {
+    sendQuery(query);
+}
+
+void DnsQueryEngine::finishQuery(Query* query, int rv) {
+    closeSocket(query);
+    if (query->hasDeadline) {
+        mDeadlines.erase(query->deadline);
+        query->hasDeadline = false;
+    }
+    query->rv = rv;
+    Lookup* lookup = query->lookup;
+    if (--lookup->pending == 0) {
+        completeLookup(lookup);
+    }
+}
+
+void DnsQueryEngine::completeLookup(Lookup* lookup) {
+    // Each result is allocated the way getaddrinfo() does, so that freeaddrinfo() can free it.
+    const Request& request = lookup->request;
+    int protocol = request.protocol;
+    if (!protocol) {
+        protocol = (request.socktype == SOCK_DGRAM) ? IPPROTO_UDP : IPPROTO_TCP;
+    }
+    addrinfo* result = nullptr;
+    addrinfo** next = &result;
+    bool retryable = false;
+    for (const auto& q : lookup->queries) {
+        retryable |= (q->rv == EAI_AGAIN);
+        for (const std::string& addr : q->addrs) {
+            const bool v6 = (addr.size() == 16);
+            const socklen_t len = v6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+            addrinfo* ai = static_cast<addrinfo*>(calloc(1, sizeof(addrinfo) + len));
+            if (!ai) {
+                break;
+            }
+            ai->ai_family = v6 ? AF_INET6 : AF_INET;
+            ai->ai_socktype = request.socktype;
+            ai->ai_protocol = protocol;
+            ai->ai_addrlen = len;
+            ai->ai_addr = reinterpret_cast<sockaddr*>(ai + 1);
+            if (v6) {
+                sockaddr_in6* sin6 = reinterpret_cast<sockaddr_in6*>(ai->ai_addr);
+                sin6->sin6_family = AF_INET6;
+                sin6->sin6_port = htons(request.port);
+                memcpy(&sin6->sin6_addr, addr.data(), 16);
+            } else {
+                sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(ai->ai_addr);
+                sin->sin_family = AF_INET;
+                sin->sin_port = htons(request.port);
+                memcpy(&sin->sin_addr, addr.data(), 4);
+            }
+            *next = ai;
+            next = &ai->ai_next;
+        }
+    }
+    const int lookupRv = result ? 0 : (retryable ? EAI_AGAIN : EAI_NODATA);
+
+    if (lookup->refresh) {
+        if (result) freeaddrinfo(result);
+        mRefreshes++;
+        mFinished.push_back(lookup);
+        return;
+    }
+    mLookups++;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mCompletions.push_back(Completion{ std::move(lookup->callback), lookupRv, result });
+    }
+    mCompletionsChanged.notify_one();
+    mFinished.push_back(lookup);
+}
+
+void DnsQueryEngine::deleteFinishedLookups() {
+    // Events later in a batch can still point at the queries of a lookup that completed earlier in
+    // it, so lookups are only deleted once the whole batch is handled.
+    for (Lookup* lookup : mFinished) {
+        delete lookup;
+    }
+    mFinished.clear();
+}
+
+void DnsQueryEngine::closeSocket(Query* query) {
+    // Closing a socket also takes it out of the epoll set.
+    if (query->fd != -1) {
+        close(query->fd);
+        query->fd = -1;
+    }
+    if (query->raceFd != -1) {
+        close(query->raceFd);
+        query->raceFd = -1;
+    }
+    query->racePending = false;
+}
+
+void DnsQueryEngine::setDeadline(Query* query, Clock::time_point deadline) {
+    if (query->hasDeadline) {
+        mDeadlines.erase(query->deadline);
+    }
+    query->deadline = mDeadlines.emplace(deadline, query);
+    query->hasDeadline = true;
+}
+
+int DnsQueryEngine::nextTimeoutMs() const {
+    if (mDeadlines.empty()) {
+        return -1;
+    }
+    auto wait = mDeadlines.begin()->first - Clock::now();
+    if (wait <= Clock::duration::zero()) {
+        return 0;
+    }
+    // Round up, so as not to wake up just before the deadline.
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+            wait + std::chrono::milliseconds(1) - Clock::duration(1)).count();
+}
+
+void DnsQueryEngine::expireQueries() {
+    const Clock::time_point now = Clock::now();
+    while (!mDeadlines.empty() && mDeadlines.begin()->first <= now) {
+        Query* query = mDeadlines.begin()->second;
+        mDeadlines.erase(mDeadlines.begin());
+        query->hasDeadline = false;
+        if (query->racePending) {
+            startRace(query);
+            continue;
+        }
+        mTimeouts++;
+        // Whichever servers of a race are still being asked have both timed out.
+        if (query->fd != -1) addSample(query, false, RCODE_TIMEOUT);
+        if (query->raceFd != -1) addSample(query, true, RCODE_TIMEOUT);
+        retry(query);
+    }
+}
+
+size_t DnsQueryEngine::buildQuery(const std::string& name, uint16_t id, uint16_t type,
+                                  uint8_t* buf, size_t len) {
+    std::string labels = name;
+    if (!labels.empty() && labels.back() == '.') {
+        labels.pop_back();
+    }
+    // The header, the name with a length before each label and a 0 at the end, type and class.
+    const size_t nameLen = labels.size() + 2;
+    const size_t total = NS_HFIXEDSZ + nameLen + NS_QFIXEDSZ;
+    if (labels.empty() || nameLen > NS_MAXCDNAME || total > len) {
+        return 0;
+    }
+
+    memset(buf, 0, NS_HFIXEDSZ);
+    put16(buf, id);
+    buf[2] = 0x01;  // RD
+    put16(buf + 4, 1);  // QDCOUNT
+
+    uint8_t* p = buf + NS_HFIXEDSZ;
+    size_t start = 0;
+    while (start <= labels.size()) {
+        size_t end = labels.find('.', start);
+        if (end == std::string::npos) end = labels.size();
+        const size_t labelLen = end - start;
+        if (labelLen == 0 || labelLen > NS_MAXLABEL) {
+            return 0;
+        }
+        *p++ = labelLen;
+        memcpy(p, labels.data() + start, labelLen);
+        p += labelLen;
+        start = end + 1;
+    }
+    *p++ = 0;
+    put16(p, type);
+    put16(p + 2, ns_c_in);
+    return total;
+}
+
+bool DnsQueryEngine::parseResponse(const uint8_t* query, size_t queryLen, const uint8_t* msg,
+                                   size_t len, int* rcode, bool* truncated,
+                                   std::vector<std::string>* addrs, uint32_t* ttl) {
+    if (queryLen < NS_HFIXEDSZ + NS_QFIXEDSZ || len < NS_HFIXEDSZ) {
+        return false;
+    }
+    // The same id, a response to a standard query, and the same single question. Names compare
+    // without regard to case.
+    const size_t questionLen = queryLen - NS_HFIXEDSZ;
+    if (get16(msg) != get16(query) || !(msg[2] & 0x80) || (msg[2] & 0x78) != 0 ||
+            get16(msg + 4) != 1 || len < NS_HFIXEDSZ + questionLen) {
+        return false;
+    }
+    for (size_t i = NS_HFIXEDSZ; i < queryLen; i++) {
+        if (tolower(msg[i]) != tolower(query[i])) {
+            return false;
+        }
+    }
+
+    *truncated = (msg[2] & 0x02) != 0;
+    *rcode = msg[3] & 0x0f;
+    *ttl = 0;
+    const uint16_t type = get16(query + queryLen - NS_QFIXEDSZ);
+    const size_t addrLen = (type == ns_t_aaaa) ? 16 : 4;
+
+    // Any CNAMEs come first, in order, each one moving on from the name that the one before it led
+    // to. Only the addresses of the name at the end of that chain count, and the answer lasts as
+    // long as every record in the chain does. Anything else in the answer section is ignored, so
+    // that a server can't slip in addresses for names that weren't asked about.
+    std::string target;
+    readName(msg, len, NS_HFIXEDSZ, &target);
+    std::string owner;
+    const size_t found = addrs->size();
+    uint32_t answerTtl = UINT32_MAX;
+    size_t pos = NS_HFIXEDSZ + questionLen;
+    for (int i = get16(msg + 6); i > 0; i--) {
+        if (!readName(msg, len, pos, &owner) || !skipName(msg, len, &pos) ||
+                pos + NS_RRFIXEDSZ > len) {
+            // A truncated answer can end anywhere; otherwise, treat it as a bad server.
+            if (!*truncated) *rcode = ns_r_formerr;
+            return true;
+        }
+        const uint16_t rrType = get16(msg + pos);
+        const uint16_t rrClass = get16(msg + pos + 2);
+        const uint32_t rrTtl = getTtl(msg + pos + 4);
+        const uint16_t rdLen = get16(msg + pos + 8);
+        pos += NS_RRFIXEDSZ;
+        if (pos + rdLen > len) {
+            if (!*truncated) *rcode = ns_r_formerr;
+            return true;
+        }
+        if (rrClass == ns_c_in && owner == target) {
+            if (rrType == ns_t_cname) {
+                if (!readName(msg, len, pos, &target)) {
+                    if (!*truncated) *rcode = ns_r_formerr;
+                    return true;
+                }
+                answerTtl = std::min(answerTtl, rrTtl);
+            } else if (rrType == type && rdLen == addrLen) {
+                addrs->emplace_back(reinterpret_cast<const char*>(msg + pos), rdLen);
+                answerTtl = std::min(answerTtl, rrTtl);
+            }
+        }
+        pos += rdLen;
+    }
+    if (addrs->size() > found) {
+        *ttl = answerTtl;
+        return true;
+    }
+
+    // No addresses: the SOA record says how long that lasts (RFC 2308 section 5).
+    for (int i = get16(msg + 8); i > 0; i--) {
+        if (!skipName(msg, len, &pos) || pos + NS_RRFIXEDSZ > len) {
+            break;
+        }
+        const uint16_t rrType = get16(msg + pos);
+        const uint32_t rrTtl = getTtl(msg + pos + 4);
+        const uint16_t rdLen = get16(msg + pos + 8);
+        pos += NS_RRFIXEDSZ;
+        if (pos + rdLen > len) {
+            break;
+        }
+        // The SOA MINIMUM field is the last 4 bytes of the record.
+        if (rrType == ns_t_soa && rdLen >= 2 + 5 * 4) {
+            *ttl = std::min(rrTtl, get32(msg + pos + rdLen - 4));
+            break;
+        }
+        pos += rdLen;
+    }
+    return true;
+}
+
+DnsQueryEngine::Stats DnsQueryEngine::getStats() const {
+    Stats stats;
+    stats.lookups = mLookups;
+    stats.queries = mQueries;
+    stats.timeouts = mTimeouts;
+    stats.tcpFallbacks = mTcpFallbacks;
+    stats.refreshes = mRefreshes;
+    stats.races = mRaces;
+    stats.raceWins = mRaceWins;
+    std::lock_guard<std::mutex> lock(mLock);
+    stats.outstanding = mOutstanding;
+    return stats;
+}
+
+void DnsQueryEngine::dump(DumpWriter& dw) const {
+    const Stats stats = getStats();
+    dw.println("DNS query engine: %s, %llu lookups, %llu queries, %llu timeouts, "
+               "%llu TCP fallbacks, %llu cache refreshes, %llu races (%llu won by the second "
+               "server), %zu outstanding",
+               mRunning ? "running" : "stopped",
+               static_cast<unsigned long long>(stats.lookups),
+               static_cast<unsigned long long>(stats.queries),
+               static_cast<unsigned long long>(stats.timeouts),
+               static_cast<unsigned long long>(stats.tcpFallbacks),
+               static_cast<unsigned long long>(stats.refreshes),
+               static_cast<unsigned long long>(stats.races),
+               static_cast<unsigned long long>(stats.raceWins), stats.outstanding);
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_DNS_QUERY_ENGINE_H
+#define NETD_SERVER_DNS_QUERY_ENGINE_H
+
+#include <netdb.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class DnsCache;
+class DnsServerStats;
+class DumpWriter;
+
+/*
+ * Resolves host names to addresses without tying up a thread per lookup.
+ *
+ * A single thread runs an epoll loop over non-blocking sockets, one per outstanding DNS query, so
+ * any number of lookups can wait for the network at the same time. An AF_UNSPEC lookup sends its A
+ * and AAAA queries in parallel. The engine handles timeouts and retries itself: a query that times
+ * out, or that gets SERVFAIL or a similar error, moves on to the next server, and an answer that
+ * is truncated is asked again over TCP. A lookup can also race the servers: if the first one
+ * hasn't answered within a short delay, the same query goes to the next one as well, and the first
+ * good answer from either is the one that counts. Every socket carries the fwmark of the lookup,
+ * so queries go out on the same network that bionic's resolver would use.
+ *
+ * Given a DnsCache, the engine answers from it whatever it can, stores every answer that it gets
+ * in it, and refreshes the popular answers that the cache says are about to expire. A lookup whose
+ * answers are all in the cache doesn't send anything.
+ *
+ * This only does the DNS part of a getaddrinfo() of a fully-qualified name: it doesn't read the
+ * hosts file or use the search domains, and it returns the addresses in the order of the answers,
+ * AAAA before A. DnsProxyListener doesn't hand it names that are in the hosts file, leaves the
+ * search domains to bionic when a name isn't found, and sorts the addresses by RFC 6724 the way
+ * bionic does before it replies.
+ */
+class DnsQueryEngine {
+public:
+    static const int DEFAULT_TIMEOUT_MS = 5000;  // The same as bionic's RES_TIMEOUT.
+    static const int DEFAULT_ATTEMPTS = 2;       // Tries per server, the same as RES_DFLRETRY.
+    static const size_t MAX_OUTSTANDING = 256;   // Each lookup holds up to two sockets.
+
+    struct Request {
+        std::string name;       // A host name; a trailing dot is optional.
+        int family;             // AF_INET, AF_INET6 or AF_UNSPEC.
+        int socktype;           // SOCK_STREAM or SOCK_DGRAM.
+        int protocol;           // 0 for the usual protocol of |socktype|.
+        uint16_t port;          // Host byte order.
+        uint32_t mark;          // The fwmark for the queries, or 0 for none.
+        std::vector<sockaddr_storage> servers;
+        unsigned netId;         // Whose cache and server stats to use, or 0 for none.
+        int timeoutMs;          // For each try.
+        int attempts;           // For each server.
+        int raceDelayMs;        // How long to wait for a server before also asking the next one,
+                                // or 0 to ask one at a time. Racing uses up tries faster.
+
+        Request();
+    };
+
+    // Called with the getaddrinfo() return value and, if that is 0, the addresses. The callee owns
+    // |result|, and must free it with freeaddrinfo(). Callbacks run one at a time on a thread of
+    // their own, so one that blocks, say on a write to a slow client, only delays the callbacks
+    // after it, and never the queries.
+    typedef std::function<void(int rv, addrinfo* result)> Callback;
+
+    struct Stats {
+        uint64_t lookups;       // Lookups that completed.
+        uint64_t queries;       // DNS queries sent, including retries.
+        uint64_t timeouts;      // Tries that got no answer in time.
+        uint64_t tcpFallbacks;  // Truncated answers that were asked again over TCP.
+        uint64_t refreshes;     // Background refreshes of cached answers that completed.
+        uint64_t races;         // Queries sent to a second server because the first was slow.
+        uint64_t raceWins;      // Answers that came from the second server of a race.
+        size_t outstanding;     // Lookups waiting now.
+    };
+
+    // |cache| may be null, in which case nothing is cached. |serverStats|, if not null, gets the
+    // RTT and rcode of every try, or its timeout, for the server that it went to.
+    DnsQueryEngine(DnsCache* cache, DnsServerStats* serverStats);
+    ~DnsQueryEngine();
+
+    // Starts the engine's threads. Returns 0 on success or a negative errno.
+    int start();
+    // Fails every outstanding lookup with EAI_AGAIN, runs the callbacks that are still waiting, and
+    // stops the threads.
+    void stop();
+    bool isRunning() const { return mRunning; }
+
+    // Starts resolving |request|, and calls |callback| when done. Returns false, without calling
+    // |callback|, if the engine isn't running or already has MAX_OUTSTANDING lookups.
+    bool resolve(const Request& request, Callback callback);
+
+    // Resolves |request| and waits for the result. Returns the same as getaddrinfo().
+    int getaddrinfo(const Request& request, addrinfo** result);
+
+    Stats getStats() const;
+    void dump(DumpWriter& dw) const;
+
+    // Builds a recursive query for |name| into |buf|. Returns the length of the query, or 0 if
+    // |name| isn't a valid domain name or doesn't fit.
+    static size_t buildQuery(const std::string& name, uint16_t id, uint16_t type, uint8_t* buf,
+                             size_t len);
+
+    // Checks that |msg| is the answer to the query in |query|. If so, sets |*rcode| and
+    // |*truncated|, appends to |*addrs| the addresses in the answer section that are of the type
+    // of the query and belong to the name in the question, or to the name that the CNAMEs before
+    // them lead it to, each 4 or 16 bytes long, and returns true. Records of any other name are
+    // ignored. |*ttl| is how long the answer can be cached: the lowest TTL of those CNAMEs and
+    // addresses or, if there are no addresses, the negative caching TTL of the SOA record in the
+    // authority section. It is 0 if there is no such TTL.
+    static bool parseResponse(const uint8_t* query, size_t queryLen, const uint8_t* msg,
+                              size_t len, int* rcode, bool* truncated,
+                              std::vector<std::string>* addrs, uint32_t* ttl);
+
+private:
+    DnsQueryEngine(const DnsQueryEngine&) = delete;
+    DnsQueryEngine& operator=(const DnsQueryEngine&) = delete;
+
+    typedef std::chrono::steady_clock Clock;
+    struct Lookup;
+    struct Query;
+
+    struct Completion {
+        Callback callback;
+        int rv;
+        addrinfo* result;
+    };
+
+    void run();
+    void runCallbacks();
+    void startLookup(Lookup* lookup);
+    bool answerFromCache(Query* query);
+    void startRefresh(Query* query);
+    void sendQuery(Query* query);
+    void startRace(Query* query);
+    int sendUdp(Query* query, size_t server);
+    bool startTcp(Query* query, size_t server);
+    void onEvent(Query* query, uint32_t events);
+    void onUdpReadable(Query* query);
+    bool readUdp(Query* query, bool race);
+    void onTcpEvent(Query* query, uint32_t events);
+    void onAnswer(Query* query, bool race, int rcode, bool truncated, uint32_t ttl);
+    void addSample(Query* query, bool race, int rcode);
+    void failTry(Query* query, bool race);
+    void retry(Query* query);
+    void finishQuery(Query* query, int rv);
+    void completeLookup(Lookup* lookup);
+    void deleteFinishedLookups();
+    void closeSocket(Query* query);
+    void setDeadline(Query* query, Clock::time_point deadline);
+    int nextTimeoutMs() const;
+    void expireQueries();
+
+    DnsCache* const mCache;
+    DnsServerStats* const mServerStats;
+
+    mutable std::mutex mLock;
+    std::vector<Lookup*> mIncoming;  // Lookups that the loop hasn't started yet.
+    size_t mOutstanding;             // Lookups whose callbacks haven't started yet.
+    bool mStopping;
+    std::atomic<bool> mRunning;
+    std::deque<Completion> mCompletions;  // Lookups that are done, waiting for their callbacks.
+    std::condition_variable mCompletionsChanged;
+    bool mCallbacksDone;  // No more completions are coming.
+
+    int mEpollFd;
+    int mEventFd;  // Wakes up the loop when there are new lookups, or when it's time to stop.
+    std::thread mThread;
+    std::thread mCallbackThread;
+
+    // Only used on the engine's thread.
+    std::multimap<Clock::time_point, Query*> mDeadlines;
+    std::vector<Lookup*> mFinished;  // Completed lookups, to delete once the events are handled.
+
+    std::atomic<uint64_t> mLookups;
+    std::atomic<uint64_t> mQueries;
+    std::atomic<uint64_t> mTimeouts;
+    std::atomic<uint64_t> mTcpFallbacks;
+    std::atomic<uint64_t> mRefreshes;
+    std::atomic<uint64_t> mRaces;
+    std::atomic<uint64_t> mRaceWins;
+};
+
+#endif  // NETD_SERVER_DNS_QUERY_ENGINE_H
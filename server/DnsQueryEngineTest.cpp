@@ -0,0 +1,678 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * DnsQueryEngineTest.cpp - unit tests for DnsQueryEngine.cpp
+ */
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "DnsCache.h"
+#include "DnsServerStats.h"
+#include "DnsQueryEngine.h"
+#include "dns_responder.h"
+
+namespace {
+
+const char kServerAddress[] = "127.0.0.3";
+const char kServerService[] = "10053";
+
+sockaddr_storage makeServer(const char* addr, uint16_t port) {
+    sockaddr_storage ss;
+    memset(&ss, 0, sizeof(ss));
+    sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(&ss);
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(port);
+    inet_pton(AF_INET, addr, &sin->sin_addr);
+    return ss;
+}
+
+DnsQueryEngine::Request makeRequest(const std::string& name, int family) {
+    DnsQueryEngine::Request request;
+    request.name = name;
+    request.family = family;
+    request.port = 443;
+    request.servers.push_back(makeServer(kServerAddress, atoi(kServerService)));
+    return request;
+}
+
+std::vector<std::string> addressesOf(const addrinfo* ai) {
+    std::vector<std::string> addresses;
+    for (; ai; ai = ai->ai_next) {
+        char buf[INET6_ADDRSTRLEN];
+        const void* addr = (ai->ai_family == AF_INET6) ?
+                static_cast<const void*>(&reinterpret_cast<sockaddr_in6*>(ai->ai_addr)->sin6_addr) :
+                static_cast<const void*>(&reinterpret_cast<sockaddr_in*>(ai->ai_addr)->sin_addr);
+        addresses.push_back(inet_ntop(ai->ai_family, addr, buf, sizeof(buf)));
+    }
+    return addresses;
+}
+
+size_t countQueries(const test::DNSResponder& dns, const char* name, ns_type type) {
+    size_t count = 0;
+    for (const auto& query : dns.queries()) {
+        if (query.first == name && query.second == type) count++;
+    }
+    return count;
+}
+
+// A UDP socket that never answers.
+class BlackHole {
+public:
+    BlackHole() : mFd(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) {
+        sockaddr_storage ss = makeServer("127.0.0.1", 0);
+        bind(mFd, reinterpret_cast<sockaddr*>(&ss), sizeof(sockaddr_in));
+        socklen_t len = sizeof(mAddress);
+        getsockname(mFd, reinterpret_cast<sockaddr*>(&mAddress), &len);
+    }
+    ~BlackHole() { close(mFd); }
+    const sockaddr_storage& address() const { return mAddress; }
+
+private:
+    int mFd;
+    sockaddr_storage mAddress;
+};
+
+// Answers every query over UDP with an empty, truncated response, and over TCP with 192.0.2.1.
+class TruncatingServer {
+public:
+    TruncatingServer() :
+            mUdp(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)),
+            mTcp(socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) {
+        sockaddr_storage ss = makeServer("127.0.0.1", 0);
+        bind(mTcp, reinterpret_cast<sockaddr*>(&ss), sizeof(sockaddr_in));
+        socklen_t len = sizeof(mAddress);
+        getsockname(mTcp, reinterpret_cast<sockaddr*>(&mAddress), &len);
+        bind(mUdp, reinterpret_cast<sockaddr*>(&mAddress), sizeof(sockaddr_in));
+        listen(mTcp, 1);
+        mThread = std::thread([this] { run(); });
+    }
+    ~TruncatingServer() {
+        shutdown(mTcp, SHUT_RDWR);
+        mThread.join();
+        close(mUdp);
+        close(mTcp);
+    }
+    const sockaddr_storage& address() const { return mAddress; }
+
+private:
+    void run() {
+        uint8_t query[512];
+        sockaddr_storage from;
+        socklen_t fromLen = sizeof(from);
+        ssize_t len = recvfrom(mUdp, query, sizeof(query), 0, reinterpret_cast<sockaddr*>(&from),
+                               &fromLen);
+        ASSERT_GT(len, NS_HFIXEDSZ);
+        query[2] |= 0x82;  // QR, TC
+        sendto(mUdp, query, len, 0, reinterpret_cast<sockaddr*>(&from), fromLen);
+
+        int s = accept(mTcp, nullptr, nullptr);
+        ASSERT_NE(-1, s);
+        uint8_t lenBytes[2];
+        ASSERT_EQ(2, read(s, lenBytes, 2));
+        len = (lenBytes[0] << 8) | lenBytes[1];
+        ASSERT_EQ(len, read(s, query, len));
+
+        std::vector<uint8_t> answer(2);
+        answer.insert(answer.end(), query, query + len);
+        answer[2 + 2] |= 0x80;  // QR
+        answer[2 + 7] = 1;      // ANCOUNT
+        const uint8_t record[] = { 0xc0, 0x0c, 0, ns_t_a, 0, ns_c_in, 0, 0, 0, 5, 0, 4,
+                                   192, 0, 2, 1 };
+        answer.insert(answer.end(), record, record + sizeof(record));
+        answer[0] = (answer.size() - 2) >> 8;
+        answer[1] = (answer.size() - 2) & 0xff;
+        EXPECT_EQ(static_cast<ssize_t>(answer.size()), write(s, answer.data(), answer.size()));
+        close(s);
+    }
+
+    int mUdp;
+    int mTcp;
+    sockaddr_storage mAddress;
+    std::thread mThread;
+};
+
+// A UDP server that answers with 192.0.2.1, but only when told to.
+class ManualServer {
+public:
+    ManualServer() : mFd(socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)), mLen(0) {
+        sockaddr_storage ss = makeServer("127.0.0.1", 0);
+        bind(mFd, reinterpret_cast<sockaddr*>(&ss), sizeof(sockaddr_in));
+        socklen_t len = sizeof(mAddress);
+        getsockname(mFd, reinterpret_cast<sockaddr*>(&mAddress), &len);
+        timeval timeout = { 5, 0 };
+        setsockopt(mFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    }
+    ~ManualServer() { close(mFd); }
+    const sockaddr_storage& address() const { return mAddress; }
+
+    // Waits for a query. Returns false if none comes.
+    bool receive() {
+        mFromLen = sizeof(mFrom);
+        mLen = recvfrom(mFd, mQuery, sizeof(mQuery), 0, reinterpret_cast<sockaddr*>(&mFrom),
+                        &mFromLen);
+        return mLen > NS_HFIXEDSZ;
+    }
+
+    // Answers the query that receive() got.
+    void answer() {
+        std::vector<uint8_t> answer(mQuery, mQuery + mLen);
+        answer[2] |= 0x80;  // QR
+        answer[7] = 1;      // ANCOUNT
+        const uint8_t record[] = { 0xc0, 0x0c, 0, ns_t_a, 0, ns_c_in, 0, 0, 0, 5, 0, 4,
+                                   192, 0, 2, 1 };
+        answer.insert(answer.end(), record, record + sizeof(record));
+        sendto(mFd, answer.data(), answer.size(), 0, reinterpret_cast<sockaddr*>(&mFrom),
+               mFromLen);
+    }
+
+private:
+    int mFd;
+    sockaddr_storage mAddress;
+    uint8_t mQuery[512];
+    ssize_t mLen;
+    sockaddr_storage mFrom;
+    socklen_t mFromLen;
+};
+
+}  // namespace
+
+class DnsQueryEngineTest : public ::testing::Test {
+protected:
+    DnsQueryEngineTest() :
+            mDns(kServerAddress, kServerService, 250, ns_rcode::ns_r_servfail, 1.0),
+            mStart(std::chrono::steady_clock::now()), mElapsedMs(0), mClockCalls(0),
+            mCache(DnsCache::DEFAULT_MAX_ENTRIES, [this] {
+                mClockCalls++;
+                std::lock_guard<std::mutex> guard(mClockLock);
+                return mStart + std::chrono::milliseconds(mElapsedMs);
+            }),
+            mEngine(&mCache, &mServerStats) {
+        mDns.addMapping("www.example.com.", ns_type::ns_t_a, "192.0.2.1");
+        mDns.addMapping("www.example.com.", ns_type::ns_t_aaaa, "2001:db8::1");
+    }
+
+    void SetUp() override {
+        ASSERT_TRUE(mDns.startServer());
+        ASSERT_EQ(0, mEngine.start());
+    }
+
+    void TearDown() override {
+        mEngine.stop();
+        mDns.stopServer();
+    }
+
+    test::DNSResponder mDns;
+    // The cache's idea of the time.
+    const std::chrono::steady_clock::time_point mStart;
+    std::atomic<int> mElapsedMs;
+    // Holding this stops the engine the next time it looks at the cache.
+    std::mutex mClockLock;
+    std::atomic<int> mClockCalls;
+    DnsCache mCache;
+    DnsServerStats mServerStats;
+    DnsQueryEngine mEngine;
+};
+
+TEST_F(DnsQueryEngineTest, TestBuildQuery) {
+    uint8_t buf[NS_PACKETSZ];
+    const uint8_t expected[] = {
+        0x12, 0x34, 0x01, 0x00, 0, 1, 0, 0, 0, 0, 0, 0,
+        3, 'w', 'w', 'w', 7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+        0, ns_t_aaaa, 0, ns_c_in,
+    };
+    ASSERT_EQ(sizeof(expected),
+              DnsQueryEngine::buildQuery("www.example.com", 0x1234, ns_t_aaaa, buf, sizeof(buf)));
+    EXPECT_EQ(0, memcmp(expected, buf, sizeof(expected)));
+    // A trailing dot makes no difference.
+    EXPECT_EQ(sizeof(expected),
+              DnsQueryEngine::buildQuery("www.example.com.", 0x1234, ns_t_aaaa, buf, sizeof(buf)));
+
+    EXPECT_EQ(0U, DnsQueryEngine::buildQuery("", 1, ns_t_a, buf, sizeof(buf)));
+    EXPECT_EQ(0U, DnsQueryEngine::buildQuery("www..example.com", 1, ns_t_a, buf, sizeof(buf)));
+    EXPECT_EQ(0U, DnsQueryEngine::buildQuery(std::string(64, 'a') + ".com", 1, ns_t_a, buf,
+                                             sizeof(buf)));
+    EXPECT_EQ(0U, DnsQueryEngine::buildQuery("www.example.com", 1, ns_t_a, buf, 20));
+}
+
+TEST_F(DnsQueryEngineTest, TestParseResponse) {
+    uint8_t query[NS_PACKETSZ];
+    const size_t queryLen = DnsQueryEngine::buildQuery("www.example.com", 0x1234, ns_t_a, query,
+                                                       sizeof(query));
+    ASSERT_NE(0U, queryLen);
+
+    // A CNAME to a compressed name, then two addresses, and one of the wrong type.
+    std::vector<uint8_t> response(query, query + queryLen);
+    response[2] |= 0x80;
+    response[7] = 4;
+    response[14] = 'W';  // The case of the name doesn't matter.
+    const uint8_t answers[] = {
+        0xc0, 0x0c, 0, ns_t_cname, 0, ns_c_in, 0, 0, 0, 5, 0, 6, 3, 'c', 'd', 'n', 0xc0, 0x10,
+        0xc0, 0x2d, 0, ns_t_a, 0, ns_c_in, 0, 0, 0, 5, 0, 4, 192, 0, 2, 1,
+        0xc0, 0x2d, 0, ns_t_a, 0, ns_c_in, 0, 0, 0, 5, 0, 4, 192, 0, 2, 2,
+        0xc0, 0x2d, 0, ns_t_txt, 0, ns_c_in, 0, 0, 0, 5, 0, 4, 'a', 'b', 'c', 'd',
+    };
+    response.insert(response.end(), answers, answers + sizeof(answers));
+
+    int rcode = -1;
+    bool truncated = true;
+    uint32_t ttl = 0;
+    std::vector<std::string> addrs;
+    ASSERT_TRUE(DnsQueryEngine::parseResponse(query, queryLen, response.data(), response.size(),
+                                              &rcode, &truncated, &addrs, &ttl));
+    EXPECT_EQ(ns_r_noerror, rcode);
+    EXPECT_FALSE(truncated);
+    EXPECT_EQ(5U, ttl);
+    ASSERT_EQ(2U, addrs.size());
+    EXPECT_EQ(std::string("\xc0\x00\x02\x01", 4), addrs[0]);
+    EXPECT_EQ(std::string("\xc0\x00\x02\x02", 4), addrs[1]);
+
+    // Addresses of names that the question doesn't lead to are ignored, and so is their TTL: one
+    // of example.com, and one of the question's own name, which the CNAME has moved on from.
+    std::vector<uint8_t> injected = response;
+    injected[7] = 6;
+    const uint8_t others[] = {
+        0xc0, 0x10, 0, ns_t_a, 0, ns_c_in, 0, 0, 0, 1, 0, 4, 198, 51, 100, 1,
+        0xc0, 0x0c, 0, ns_t_a, 0, ns_c_in, 0, 0, 0, 1, 0, 4, 198, 51, 100, 2,
+    };
+    injected.insert(injected.end(), others, others + sizeof(others));
+    addrs.clear();
+    ASSERT_TRUE(DnsQueryEngine::parseResponse(query, queryLen, injected.data(), injected.size(),
+                                              &rcode, &truncated, &addrs, &ttl));
+    EXPECT_EQ(ns_r_noerror, rcode);
+    EXPECT_EQ(5U, ttl);
+    EXPECT_EQ(2U, addrs.size());
+
+    // Nor do those of cdn.example.com, if the CNAME to it is of some other name.
+    injected = response;
+    injected[queryLen + 1] = 0x10;
+    addrs.clear();
+    ASSERT_TRUE(DnsQueryEngine::parseResponse(query, queryLen, injected.data(), injected.size(),
+                                              &rcode, &truncated, &addrs, &ttl));
+    EXPECT_EQ(ns_r_noerror, rcode);
+    EXPECT_TRUE(addrs.empty());
+
+    // Anything cut short is an error, unless it's marked as truncated.
+    addrs.clear();
+    ASSERT_TRUE(DnsQueryEngine::parseResponse(query, queryLen, response.data(),
+                                              response.size() - 20, &rcode, &truncated, &addrs,
+                                              &ttl));
+    EXPECT_EQ(ns_r_formerr, rcode);
+
+    // Answers to other queries are not answers at all.
+    std::vector<uint8_t> other = response;
+    other[1] ^= 1;
+    EXPECT_FALSE(DnsQueryEngine::parseResponse(query, queryLen, other.data(), other.size(),
+                                               &rcode, &truncated, &addrs, &ttl));
+    other = response;
+    other[15] = 'x';
+    EXPECT_FALSE(DnsQueryEngine::parseResponse(query, queryLen, other.data(), other.size(),
+                                               &rcode, &truncated, &addrs, &ttl));
+    other = response;
+    other[2] &= ~0x80;
+    EXPECT_FALSE(DnsQueryEngine::parseResponse(query, queryLen, other.data(), other.size(),
+                                               &rcode, &truncated, &addrs, &ttl));
+}
+
+TEST_F(DnsQueryEngineTest, TestNegativeTtl) {
+    uint8_t query[NS_PACKETSZ];
+    const size_t queryLen = DnsQueryEngine::buildQuery("nx.example.com", 0x1234, ns_t_a, query,
+                                                       sizeof(query));
+    ASSERT_NE(0U, queryLen);
+
+    // NXDOMAIN, with the SOA of example.com: TTL 3600, MINIMUM 300.
+    std::vector<uint8_t> response(query, query + queryLen);
+    response[2] |= 0x80;
+    response[3] = ns_r_nxdomain;
+    response[9] = 1;  // NSCOUNT
+    const uint8_t soa[] = {
+        0xc0, 0x0f, 0, ns_t_soa, 0, ns_c_in, 0, 0, 0x0e, 0x10, 0, 28,
+        1, 'a', 0xc0, 0x0f, 1, 'b', 0xc0, 0x0f,
+        0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0, 4, 0, 0, 0x01, 0x2c,
+    };
+    response.insert(response.end(), soa, soa + sizeof(soa));
+
+    int rcode = -1;
+    bool truncated = true;
+    uint32_t ttl = 0;
+    std::vector<std::string> addrs;
+    ASSERT_TRUE(DnsQueryEngine::parseResponse(query, queryLen, response.data(), response.size(),
+                                              &rcode, &truncated, &addrs, &ttl));
+    EXPECT_EQ(ns_r_nxdomain, rcode);
+    EXPECT_TRUE(addrs.empty());
+    EXPECT_EQ(300U, ttl);
+
+    // Without an SOA, there's no saying how long the answer lasts.
+    response.resize(queryLen);
+    response[9] = 0;
+    ASSERT_TRUE(DnsQueryEngine::parseResponse(query, queryLen, response.data(), response.size(),
+                                              &rcode, &truncated, &addrs, &ttl));
+    EXPECT_EQ(0U, ttl);
+}
+
+TEST_F(DnsQueryEngineTest, TestResolvesBothFamilies) {
+    addrinfo* result = nullptr;
+    ASSERT_EQ(0, mEngine.getaddrinfo(makeRequest("www.example.com", AF_UNSPEC), &result));
+    EXPECT_EQ(std::vector<std::string>({ "2001:db8::1", "192.0.2.1" }), addressesOf(result));
+    for (const addrinfo* ai = result; ai; ai = ai->ai_next) {
+        EXPECT_EQ(SOCK_STREAM, ai->ai_socktype);
+        EXPECT_EQ(IPPROTO_TCP, ai->ai_protocol);
+        EXPECT_EQ(443, ntohs(reinterpret_cast<sockaddr_in*>(ai->ai_addr)->sin_port));
+    }
+    freeaddrinfo(result);
+    EXPECT_EQ(1U, countQueries(mDns, "www.example.com.", ns_type::ns_t_a));
+    EXPECT_EQ(1U, countQueries(mDns, "www.example.com.", ns_type::ns_t_aaaa));
+
+    mDns.clearQueries();
+    ASSERT_EQ(0, mEngine.getaddrinfo(makeRequest("www.example.com.", AF_INET), &result));
+    EXPECT_EQ(std::vector<std::string>({ "192.0.2.1" }), addressesOf(result));
+    freeaddrinfo(result);
+    EXPECT_EQ(0U, countQueries(mDns, "www.example.com.", ns_type::ns_t_aaaa));
+
+    EXPECT_EQ(EAI_NODATA, mEngine.getaddrinfo(makeRequest("nx.example.com", AF_UNSPEC), &result));
+    EXPECT_EQ(nullptr, result);
+}
+
+TEST_F(DnsQueryEngineTest, TestQueriesInParallel) {
+    // Both queries wait out a timeout on the first server at the same time, rather than in turn.
+    BlackHole blackHole;
+    DnsQueryEngine::Request request = makeRequest("www.example.com", AF_UNSPEC);
+    request.servers.insert(request.servers.begin(), blackHole.address());
+    request.timeoutMs = 300;
+
+    auto start = std::chrono::steady_clock::now();
+    addrinfo* result = nullptr;
+    ASSERT_EQ(0, mEngine.getaddrinfo(request, &result));
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(2U, addressesOf(result).size());
+    freeaddrinfo(result);
+    EXPECT_GE(elapsed, std::chrono::milliseconds(300));
+    EXPECT_LT(elapsed, std::chrono::milliseconds(550));
+
+    DnsQueryEngine::Stats stats = mEngine.getStats();
+    EXPECT_EQ(2U, stats.timeouts);
+    EXPECT_EQ(4U, stats.queries);
+}
+
+TEST_F(DnsQueryEngineTest, TestRacesSlowServer) {
+    // The first server never answers, so after the race delay both queries go to the second one
+    // too, and the lookup doesn't wait out the timeout.
+    BlackHole blackHole;
+    DnsQueryEngine::Request request = makeRequest("www.example.com", AF_UNSPEC);
+    request.servers.insert(request.servers.begin(), blackHole.address());
+    request.raceDelayMs = 100;
+
+    auto start = std::chrono::steady_clock::now();
+    addrinfo* result = nullptr;
+    ASSERT_EQ(0, mEngine.getaddrinfo(request, &result));
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_EQ(2U, addressesOf(result).size());
+    freeaddrinfo(result);
+    EXPECT_GE(elapsed, std::chrono::milliseconds(100));
+    EXPECT_LT(elapsed, std::chrono::milliseconds(1000));
+
+    DnsQueryEngine::Stats stats = mEngine.getStats();
+    EXPECT_EQ(2U, stats.races);
+    EXPECT_EQ(2U, stats.raceWins);
+    EXPECT_EQ(0U, stats.timeouts);
+    EXPECT_EQ(4U, stats.queries);
+
+    // A server that answers in time isn't raced.
+    request.servers = { request.servers[1], blackHole.address() };
+    ASSERT_EQ(0, mEngine.getaddrinfo(request, &result));
+    freeaddrinfo(result);
+    stats = mEngine.getStats();
+    EXPECT_EQ(2U, stats.races);
+    EXPECT_EQ(6U, stats.queries);
+
+    // If the second server fails, the first one still gets its full timeout.
+    mDns.setResponseProbability(0.0);
+    request = makeRequest("www.example.com", AF_INET);
+    request.servers.insert(request.servers.begin(), blackHole.address());
+    request.raceDelayMs = 50;
+    request.timeoutMs = 300;
+    request.attempts = 1;
+    start = std::chrono::steady_clock::now();
+    EXPECT_EQ(EAI_AGAIN, mEngine.getaddrinfo(request, &result));
+    elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_GE(elapsed, std::chrono::milliseconds(300));
+    EXPECT_EQ(1U, mEngine.getStats().timeouts);
+}
+
+TEST_F(DnsQueryEngineTest, TestRaceAnswersTogether) {
+    // Both servers of a race answer while the engine is busy, so it reads both answers in the same
+    // batch of events. The first completes the lookup, and the second must not touch it.
+    ManualServer first;
+    ManualServer second;
+    DnsQueryEngine::Request request = makeRequest("www.example.com", AF_INET);
+    request.servers = { first.address(), second.address() };
+    request.raceDelayMs = 50;
+
+    std::mutex lock;
+    std::condition_variable cv;
+    bool done = false;
+    int rv = -1;
+    std::vector<std::string> addresses;
+    ASSERT_TRUE(mEngine.resolve(request, [&](int error, addrinfo* result) {
+        std::lock_guard<std::mutex> guard(lock);
+        rv = error;
+        addresses = addressesOf(result);
+        if (result) freeaddrinfo(result);
+        done = true;
+        cv.notify_one();
+    }));
+    ASSERT_TRUE(first.receive());
+    ASSERT_TRUE(second.receive());
+
+    // A lookup that uses the cache keeps the engine waiting for the clock until both answers are
+    // in.
+    std::unique_lock<std::mutex> clock(mClockLock);
+    const int clockCalls = mClockCalls;
+    DnsQueryEngine::Request cached = makeRequest("www.example.com", AF_INET);
+    cached.netId = 100;
+    ASSERT_TRUE(mEngine.resolve(cached, [](int, addrinfo* result) {
+        if (result) freeaddrinfo(result);
+    }));
+    for (int i = 0; i < 1000 && mClockCalls == clockCalls; i++) {
+        usleep(1000);
+    }
+    EXPECT_NE(clockCalls, mClockCalls);
+    first.answer();
+    second.answer();
+    clock.unlock();
+
+    std::unique_lock<std::mutex> guard(lock);
+    ASSERT_TRUE(cv.wait_for(guard, std::chrono::seconds(5), [&] { return done; }));
+    EXPECT_EQ(0, rv);
+    EXPECT_EQ(std::vector<std::string>({ "192.0.2.1" }), addresses);
+    EXPECT_EQ(1U, mEngine.getStats().races);
+}
+
+TEST_F(DnsQueryEngineTest, TestRetriesAndGivesUp) {
+    // SERVFAIL moves on to the next try right away.
+    mDns.setResponseProbability(0.0);
+    DnsQueryEngine::Request request = makeRequest("www.example.com", AF_INET);
+    request.attempts = 3;
+    addrinfo* result = nullptr;
+    EXPECT_EQ(EAI_AGAIN, mEngine.getaddrinfo(request, &result));
+    EXPECT_EQ(3U, countQueries(mDns, "www.example.com.", ns_type::ns_t_a));
+    EXPECT_EQ(0U, mEngine.getStats().timeouts);
+
+    // And so does silence, once the timeout passes.
+    BlackHole blackHole;
+    request.servers = { blackHole.address() };
+    request.timeoutMs = 50;
+    request.attempts = 2;
+    EXPECT_EQ(EAI_AGAIN, mEngine.getaddrinfo(request, &result));
+    EXPECT_EQ(2U, mEngine.getStats().timeouts);
+}
+
+TEST_F(DnsQueryEngineTest, TestRecordsServerStats) {
+    BlackHole blackHole;
+    DnsQueryEngine::Request request = makeRequest("www.example.com", AF_INET);
+    request.servers.insert(request.servers.begin(), blackHole.address());
+    request.netId = 100;
+    request.timeoutMs = 50;
+    request.attempts = 1;
+    addrinfo* result = nullptr;
+    ASSERT_EQ(0, mEngine.getaddrinfo(request, &result));
+    freeaddrinfo(result);
+
+    // Each try counts against the server that it went to.
+    __res_stats stats[2] = {};
+    mServerStats.merge(100, request.servers.data(), 2, 64, stats);
+    ASSERT_EQ(1, stats[0].sample_count);
+    EXPECT_EQ(RCODE_TIMEOUT, stats[0].samples[0].rcode);
+    EXPECT_LE(50, stats[0].samples[0].rtt);
+    ASSERT_EQ(1, stats[1].sample_count);
+    EXPECT_EQ(ns_r_noerror, stats[1].samples[0].rcode);
+
+    // SERVFAIL is a sample too, after the server's earlier answer. The AAAA query isn't cached.
+    mDns.setResponseProbability(0.0);
+    request = makeRequest("www.example.com", AF_INET6);
+    request.netId = 100;
+    EXPECT_EQ(EAI_AGAIN, mEngine.getaddrinfo(request, &result));
+    __res_stats servfail = {};
+    mServerStats.merge(100, request.servers.data(), 1, 64, &servfail);
+    ASSERT_EQ(3, servfail.sample_count);
+    EXPECT_EQ(ns_r_servfail, servfail.samples[1].rcode);
+    EXPECT_EQ(ns_r_servfail, servfail.samples[2].rcode);
+
+    // Lookups without a network have nowhere to record anything.
+    request.netId = 0;
+    EXPECT_EQ(EAI_AGAIN, mEngine.getaddrinfo(request, &result));
+    __res_stats none = {};
+    mServerStats.merge(0, request.servers.data(), 1, 64, &none);
+    EXPECT_EQ(0, none.sample_count);
+}
+
+TEST_F(DnsQueryEngineTest, TestFallsBackToTcp) {
+    TruncatingServer server;
+    DnsQueryEngine::Request request = makeRequest("www.example.com", AF_INET);
+    request.servers = { server.address() };
+    addrinfo* result = nullptr;
+    ASSERT_EQ(0, mEngine.getaddrinfo(request, &result));
+    EXPECT_EQ(std::vector<std::string>({ "192.0.2.1" }), addressesOf(result));
+    freeaddrinfo(result);
+    EXPECT_EQ(1U, mEngine.getStats().tcpFallbacks);
+}
+
+TEST_F(DnsQueryEngineTest, TestManyOutstandingLookups) {
+    const int kLookups = 200;
+    // DNSResponder doesn't expect its mappings to change while it's running.
+    mDns.stopServer();
+    for (int i = 0; i < kLookups; i++) {
+        mDns.addMapping(("host" + std::to_string(i) + ".example.com.").c_str(),
+                        ns_type::ns_t_a, "192.0.2.1");
+    }
+    ASSERT_TRUE(mDns.startServer());
+
+    std::mutex lock;
+    std::condition_variable cv;
+    int done = 0;
+    int succeeded = 0;
+    for (int i = 0; i < kLookups; i++) {
+        ASSERT_TRUE(mEngine.resolve(
+                makeRequest("host" + std::to_string(i) + ".example.com", AF_INET),
+                [&](int rv, addrinfo* result) {
+                    std::lock_guard<std::mutex> guard(lock);
+                    done++;
+                    if (rv == 0 && addressesOf(result).size() == 1) succeeded++;
+                    if (result) freeaddrinfo(result);
+                    cv.notify_one();
+                }));
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    ASSERT_TRUE(cv.wait_for(guard, std::chrono::seconds(10), [&] { return done == kLookups; }));
+    EXPECT_EQ(kLookups, succeeded);
+    EXPECT_EQ(0U, mEngine.getStats().outstanding);
+}
+
+TEST_F(DnsQueryEngineTest, TestStopFailsOutstandingLookups) {
+    BlackHole blackHole;
+    DnsQueryEngine::Request request = makeRequest("www.example.com", AF_UNSPEC);
+    request.servers = { blackHole.address() };
+    int rv = 0;
+    ASSERT_TRUE(mEngine.resolve(request, [&rv](int error, addrinfo*) { rv = error; }));
+    mEngine.stop();
+    EXPECT_EQ(EAI_AGAIN, rv);
+    EXPECT_FALSE(mEngine.resolve(request, [](int, addrinfo*) {}));
+}
+
+TEST_F(DnsQueryEngineTest, TestAnswersFromCache) {
+    DnsQueryEngine::Request request = makeRequest("www.example.com", AF_UNSPEC);
+    request.netId = 100;
+    addrinfo* result = nullptr;
+    for (int i = 0; i < 3; i++) {
+        ASSERT_EQ(0, mEngine.getaddrinfo(request, &result));
+        EXPECT_EQ(std::vector<std::string>({ "2001:db8::1", "192.0.2.1" }), addressesOf(result));
+        freeaddrinfo(result);
+    }
+    EXPECT_EQ(1U, countQueries(mDns, "www.example.com.", ns_type::ns_t_a));
+    EXPECT_EQ(1U, countQueries(mDns, "www.example.com.", ns_type::ns_t_aaaa));
+    EXPECT_EQ(2U, mEngine.getStats().queries);
+
+    // Other networks have caches of their own.
+    request.netId = 101;
+    ASSERT_EQ(0, mEngine.getaddrinfo(request, &result));
+    freeaddrinfo(result);
+    EXPECT_EQ(2U, countQueries(mDns, "www.example.com.", ns_type::ns_t_a));
+
+    // The responder's answers last 5 seconds. Just before they expire, the lookup still comes from
+    // the cache, but refreshes it in the background, so the lookup after expiry is a hit too.
+    request.netId = 100;
+    mElapsedMs += 4700;
+    ASSERT_EQ(0, mEngine.getaddrinfo(request, &result));
+    freeaddrinfo(result);
+    for (int i = 0; i < 100 && mEngine.getStats().refreshes < 2; i++) {
+        usleep(10 * 1000);
+    }
+    EXPECT_EQ(2U, mEngine.getStats().refreshes);
+    EXPECT_EQ(3U, countQueries(mDns, "www.example.com.", ns_type::ns_t_a));
+
+    mElapsedMs += 2000;
+    ASSERT_EQ(0, mEngine.getaddrinfo(request, &result));
+    freeaddrinfo(result);
+    EXPECT_EQ(3U, countQueries(mDns, "www.example.com.", ns_type::ns_t_a));
+    EXPECT_EQ(2U, mCache.getStats(100).misses);
+
+    // Names that don't exist aren't cached without an SOA, which the responder doesn't send.
+    request.name = "nx.example.com";
+    EXPECT_EQ(EAI_NODATA, mEngine.getaddrinfo(request, &result));
+    EXPECT_EQ(EAI_NODATA, mEngine.getaddrinfo(request, &result));
+    EXPECT_EQ(2U, countQueries(mDns, "nx.example.com.", ns_type::ns_t_a));
+
+    mCache.flush(100);
+    request.name = "www.example.com";
+    ASSERT_EQ(0, mEngine.getaddrinfo(request, &result));
+    freeaddrinfo(result);
+    EXPECT_EQ(4U, countQueries(mDns, "www.example.com.", ns_type::ns_t_a));
+}
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DnsResponseBuffer.h"
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include <sysutils/SocketClient.h>
+
+namespace {
+
+// A buffer that grew this large for an unusually big answer is freed rather than kept around for
+// the life of the thread.
+const size_t kMaxRetainedCapacity = 16 * 1024;
+
+}  // namespace
+
+DnsResponseBuffer& DnsResponseBuffer::forThisThread() {
+    static thread_local DnsResponseBuffer buffer;
+    buffer.clear();
+    return buffer;
+}
+
+void DnsResponseBuffer::clear() {
+    if (mData.capacity() > kMaxRetainedCapacity) {
+        std::vector<uint8_t>().swap(mData);
+    } else {
+        mData.clear();
+    }
+}
+
+void DnsResponseBuffer::appendCode(int code) {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&code);
+    mData.insert(mData.end(), bytes, bytes + sizeof(code));
+}
+
+void DnsResponseBuffer::appendBE32(uint32_t data) {
+    uint32_t be_data = htonl(data);
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&be_data);
+    mData.insert(mData.end(), bytes, bytes + sizeof(be_data));
+}
+
+void DnsResponseBuffer::appendLenAndData(uint32_t len, const void* data) {
+    appendBE32(len);
+    if (len) {
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        mData.insert(mData.end(), bytes, bytes + len);
+    }
+}
+
+void DnsResponseBuffer::appendAddrInfo(const addrinfo* ai) {
+    // struct addrinfo {
+    //      int     ai_flags;       /* AI_PASSIVE, AI_CANONNAME, AI_NUMERICHOST */
+    //      int     ai_family;      /* PF_xxx */
+    //      int     ai_socktype;    /* SOCK_xxx */
+    //      int     ai_protocol;    /* 0 or IPPROTO_xxx for IPv4 and IPv6 */
+    //      socklen_t ai_addrlen;   /* length of ai_addr */
+    //      char    *ai_canonname;  /* canonical name for hostname */
+    //      struct  sockaddr *ai_addr;      /* binary address */
+    //      struct  addrinfo *ai_next;      /* next structure in linked list */
+    // };
+
+    // Write the struct piece by piece because we might be a 64-bit netd
+    // talking to a 32-bit process.
+    appendBE32(ai->ai_flags);
+    appendBE32(ai->ai_family);
+    appendBE32(ai->ai_socktype);
+    appendBE32(ai->ai_protocol);
+
+    // ai_addrlen and ai_addr.
+    appendLenAndData(ai->ai_addrlen, ai->ai_addr);
+
+    // strlen(ai_canonname) and ai_canonname.
+    appendLenAndData(ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0, ai->ai_canonname);
+}
+
+void DnsResponseBuffer::appendAddrInfoList(const addrinfo* ai) {
+    for (; ai; ai = ai->ai_next) {
+        appendBE32(1);
+        appendAddrInfo(ai);
+    }
+    appendBE32(0);
+}
+
+void DnsResponseBuffer::appendHostent(const hostent* hp) {
+    if (hp->h_name != NULL) {
+        appendLenAndData(strlen(hp->h_name) + 1, hp->h_name);
+    } else {
+        appendLenAndData(0, "");
+    }
+
+    for (int i = 0; hp->h_aliases[i] != NULL; i++) {
+        appendLenAndData(strlen(hp->h_aliases[i]) + 1, hp->h_aliases[i]);
+    }
+    appendLenAndData(0, ""); // null to indicate we're done
+
+    appendBE32(hp->h_addrtype);
+    appendBE32(hp->h_length);
+
+    // Always 16 bytes per address, which is what the client reads.
+    for (int i = 0; hp->h_addr_list[i] != NULL; i++) {
+        appendLenAndData(16, hp->h_addr_list[i]);
+    }
+    appendLenAndData(0, ""); // null to indicate we're done
+}
+
+bool DnsResponseBuffer::send(SocketClient* c) const {
+    return c->sendData(mData.data(), mData.size()) == 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_DNS_RESPONSE_BUFFER_H
+#define NETD_SERVER_DNS_RESPONSE_BUFFER_H
+
+#include <netdb.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+class SocketClient;
+
+/*
+ * Builds a complete DnsProxyListener response in memory, so that it goes to the client in one
+ * write instead of one per field.
+ *
+ * The wire format is the one that bionic's resolver proxy reads: a native int response code,
+ * followed by big-endian 32-bit fields and length-prefixed data. Every field has a fixed size, so
+ * 32- and 64-bit clients read the same bytes.
+ */
+class DnsResponseBuffer {
+public:
+    DnsResponseBuffer() {}
+
+    // Returns a buffer that belongs to the calling thread, emptied, so that each DNS worker
+    // allocates it only once.
+    static DnsResponseBuffer& forThisThread();
+
+    void clear();
+
+    // The same bytes as SocketClient::sendCode().
+    void appendCode(int code);
+    void appendBE32(uint32_t data);
+    // 4 bytes of big-endian length, followed by the data.
+    void appendLenAndData(uint32_t len, const void* data);
+
+    // Every entry in |ai|, each preceded by a 1, and then a 0.
+    void appendAddrInfoList(const addrinfo* ai);
+    void appendHostent(const hostent* hp);
+
+    const uint8_t* data() const { return mData.data(); }
+    size_t size() const { return mData.size(); }
+
+    // Sends the contents in a single write. Returns true on success.
+    bool send(SocketClient* c) const;
+
+private:
+    DnsResponseBuffer(const DnsResponseBuffer&) = delete;
+    DnsResponseBuffer& operator=(const DnsResponseBuffer&) = delete;
+
+    void appendAddrInfo(const addrinfo* ai);
+
+    std::vector<uint8_t> mData;
+};
+
+#endif  // NETD_SERVER_DNS_RESPONSE_BUFFER_H
@@ -0,0 +1,321 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * DnsResponseBufferTest.cpp - unit tests for DnsResponseBuffer.cpp
+ */
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <sysutils/SocketClient.h>
+
+#include "DnsResponseBuffer.h"
+
+namespace {
+
+const int kQueryResultCode = 222;  // ResponseCode::DnsProxyQueryResult
+
+// Sends a response the way DnsProxyListener used to: one sendData() per field. Counts the calls,
+// each of which is a write syscall.
+class PiecewiseSender {
+public:
+    explicit PiecewiseSender(SocketClient* c) : mClient(c), mWrites(0) {}
+
+    void sendCode(int code) { send(&code, sizeof(code)); }
+
+    void sendBE32(uint32_t data) {
+        uint32_t be_data = htonl(data);
+        send(&be_data, sizeof(be_data));
+    }
+
+    void sendLenAndData(uint32_t len, const void* data) {
+        sendBE32(len);
+        if (len) send(data, len);
+    }
+
+    void sendAddrInfoList(const addrinfo* ai) {
+        for (; ai; ai = ai->ai_next) {
+            sendBE32(1);
+            sendBE32(ai->ai_flags);
+            sendBE32(ai->ai_family);
+            sendBE32(ai->ai_socktype);
+            sendBE32(ai->ai_protocol);
+            sendLenAndData(ai->ai_addrlen, ai->ai_addr);
+            sendLenAndData(ai->ai_canonname ? strlen(ai->ai_canonname) + 1 : 0, ai->ai_canonname);
+        }
+        sendBE32(0);
+    }
+
+    int writes() const { return mWrites; }
+
+private:
+    void send(const void* data, int len) {
+        mClient->sendData(data, len);
+        mWrites++;
+    }
+
+    SocketClient* mClient;
+    int mWrites;
+};
+
+// A list of |count| IPv6 addresses, the first of which has a canonical name.
+class AddrInfoList {
+public:
+    explicit AddrInfoList(int count) : mEntries(count), mAddrs(count) {
+        for (int i = 0; i < count; i++) {
+            addrinfo& ai = mEntries[i];
+            memset(&ai, 0, sizeof(ai));
+            sockaddr_in6& sin6 = mAddrs[i];
+            memset(&sin6, 0, sizeof(sin6));
+            sin6.sin6_family = AF_INET6;
+            sin6.sin6_port = htons(443);
+            inet_pton(AF_INET6, "2001:db8::1", &sin6.sin6_addr);
+            sin6.sin6_addr.s6_addr[15] = i;
+            ai.ai_flags = AI_CANONNAME;
+            ai.ai_family = AF_INET6;
+            ai.ai_socktype = SOCK_STREAM;
+            ai.ai_protocol = IPPROTO_TCP;
+            ai.ai_addrlen = sizeof(sin6);
+            ai.ai_addr = reinterpret_cast<sockaddr*>(&sin6);
+            ai.ai_next = (i + 1 < count) ? &mEntries[i + 1] : NULL;
+        }
+        mEntries[0].ai_canonname = const_cast<char*>("www.example.com");
+    }
+
+    const addrinfo* get() const { return mEntries.data(); }
+
+private:
+    std::vector<addrinfo> mEntries;
+    std::vector<sockaddr_in6> mAddrs;
+};
+
+// Reads everything written to |fd| until it is shut down. On a SOCK_SEQPACKET socket, each read
+// returns what one write sent, so reads() is the number of writes.
+class Drain {
+public:
+    explicit Drain(int fd) : mFd(fd), mReads(0), mThread([this] { run(); }) {}
+    ~Drain() { finish(); }
+
+    // Waits for the writer to shut down its end, and returns everything read.
+    std::string finish() {
+        if (mThread.joinable()) mThread.join();
+        return mBytes;
+    }
+
+    int reads() {
+        finish();
+        return mReads;
+    }
+
+private:
+    void run() {
+        char buf[4096];
+        ssize_t len;
+        while ((len = read(mFd, buf, sizeof(buf))) > 0) {
+            mBytes.append(buf, len);
+            mReads++;
+        }
+    }
+
+    int mFd;
+    int mReads;
+    std::string mBytes;
+    std::thread mThread;
+};
+
+}  // namespace
+
+TEST(DnsResponseBufferTest, TestAddrInfoWireFormat) {
+    AddrInfoList list(2);
+    DnsResponseBuffer& buffer = DnsResponseBuffer::forThisThread();
+    buffer.appendCode(kQueryResultCode);
+    buffer.appendAddrInfoList(list.get());
+
+    std::string expected(reinterpret_cast<const char*>(&kQueryResultCode), sizeof(int));
+    auto be32 = [&expected](uint32_t v) {
+        v = htonl(v);
+        expected.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    };
+    for (const addrinfo* ai = list.get(); ai; ai = ai->ai_next) {
+        be32(1);
+        be32(AI_CANONNAME);
+        be32(AF_INET6);
+        be32(SOCK_STREAM);
+        be32(IPPROTO_TCP);
+        be32(sizeof(sockaddr_in6));
+        expected.append(reinterpret_cast<const char*>(ai->ai_addr), sizeof(sockaddr_in6));
+        if (ai->ai_canonname) {
+            be32(strlen("www.example.com") + 1);
+            expected.append("www.example.com", strlen("www.example.com") + 1);
+        } else {
+            be32(0);
+        }
+    }
+    be32(0);
+
+    EXPECT_EQ(expected, std::string(reinterpret_cast<const char*>(buffer.data()), buffer.size()));
+}
+
+TEST(DnsResponseBufferTest, TestHostentWireFormat) {
+    char name[] = "www.example.com";
+    char alias[] = "example.com";
+    char* aliases[] = { alias, NULL };
+    char addr[16] = { char(192), 0, 2, 1 };
+    char* addrs[] = { addr, NULL };
+    hostent hp;
+    hp.h_name = name;
+    hp.h_aliases = aliases;
+    hp.h_addrtype = AF_INET;
+    hp.h_length = 4;
+    hp.h_addr_list = addrs;
+
+    DnsResponseBuffer& buffer = DnsResponseBuffer::forThisThread();
+    buffer.appendHostent(&hp);
+
+    std::string expected;
+    auto be32 = [&expected](uint32_t v) {
+        v = htonl(v);
+        expected.append(reinterpret_cast<const char*>(&v), sizeof(v));
+    };
+    be32(sizeof(name));
+    expected.append(name, sizeof(name));
+    be32(sizeof(alias));
+    expected.append(alias, sizeof(alias));
+    be32(0);
+    be32(AF_INET);
+    be32(4);
+    be32(16);
+    expected.append(addr, sizeof(addr));
+    be32(0);
+
+    EXPECT_EQ(expected, std::string(reinterpret_cast<const char*>(buffer.data()), buffer.size()));
+}
+
+TEST(DnsResponseBufferTest, TestSameBytesOnTheWire) {
+    AddrInfoList list(10);
+    std::string piecewise, buffered;
+    for (bool useBuffer : { false, true }) {
+        int fds[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+        {
+            Drain drain(fds[1]);
+            SocketClient client(fds[0], false);
+            if (useBuffer) {
+                DnsResponseBuffer& buffer = DnsResponseBuffer::forThisThread();
+                buffer.appendCode(kQueryResultCode);
+                buffer.appendAddrInfoList(list.get());
+                EXPECT_TRUE(buffer.send(&client));
+            } else {
+                PiecewiseSender sender(&client);
+                sender.sendCode(kQueryResultCode);
+                sender.sendAddrInfoList(list.get());
+            }
+            shutdown(fds[0], SHUT_WR);
+            (useBuffer ? buffered : piecewise) = drain.finish();
+        }
+        close(fds[0]);
+        close(fds[1]);
+    }
+    EXPECT_FALSE(piecewise.empty());
+    EXPECT_EQ(piecewise, buffered);
+}
+
+TEST(DnsResponseBufferTest, TestOneWritePerResponse) {
+    const int kAddresses = 10;
+    AddrInfoList list(kAddresses);
+    for (bool useBuffer : { false, true }) {
+        int fds[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds));
+        int writes;
+        {
+            Drain drain(fds[1]);
+            SocketClient client(fds[0], false);
+            if (useBuffer) {
+                DnsResponseBuffer& buffer = DnsResponseBuffer::forThisThread();
+                buffer.appendCode(kQueryResultCode);
+                buffer.appendAddrInfoList(list.get());
+                EXPECT_TRUE(buffer.send(&client));
+            } else {
+                PiecewiseSender sender(&client);
+                sender.sendCode(kQueryResultCode);
+                sender.sendAddrInfoList(list.get());
+            }
+            shutdown(fds[0], SHUT_WR);
+            writes = drain.reads();
+        }
+        close(fds[0]);
+        close(fds[1]);
+        // The code, eight writes per address, the canonical name and the terminator, or one write.
+        EXPECT_EQ(useBuffer ? 1 : 2 + kAddresses * 8 + 1, writes);
+    }
+}
+
+// Compares the latency of buffered and piecewise responses. It only prints timings, so it only
+// runs when asked for, with --gtest_also_run_disabled_tests.
+TEST(DnsResponseBufferTest, DISABLED_TestSerializationBenchmark) {
+    const int kAddresses = 10;
+    const int kLookups = 2000;
+    AddrInfoList list(kAddresses);
+
+    for (bool useBuffer : { false, true }) {
+        int fds[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds));
+        std::vector<float> latencies;
+        latencies.reserve(kLookups);
+        int writes = 0;
+        {
+            Drain drain(fds[1]);
+            SocketClient client(fds[0], false);
+            for (int i = 0; i < kLookups; i++) {
+                auto start = std::chrono::steady_clock::now();
+                if (useBuffer) {
+                    DnsResponseBuffer& buffer = DnsResponseBuffer::forThisThread();
+                    buffer.appendCode(kQueryResultCode);
+                    buffer.appendAddrInfoList(list.get());
+                    buffer.send(&client);
+                    writes++;
+                } else {
+                    PiecewiseSender sender(&client);
+                    sender.sendCode(kQueryResultCode);
+                    sender.sendAddrInfoList(list.get());
+                    writes += sender.writes();
+                }
+                latencies.push_back(std::chrono::duration<float, std::micro>(
+                        std::chrono::steady_clock::now() - start).count());
+            }
+            shutdown(fds[0], SHUT_WR);
+        }
+        close(fds[0]);
+        close(fds[1]);
+
+        std::sort(latencies.begin(), latencies.end());
+        fprintf(stderr, "  %-10s %d addresses: %5.1f writes/lookup, p50 %6.1f us, p99 %6.1f us\n",
+                useBuffer ? "buffered" : "piecewise", kAddresses, float(writes) / kLookups,
+                latencies[kLookups / 2], latencies[kLookups * 99 / 100]);
+    }
+}
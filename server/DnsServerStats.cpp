@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DnsServerStats.h"
+
+#include <netinet/in.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace {
+
+// Compares the family, address and port, which is all that bionic keeps of a server.
+bool sameServer(const sockaddr_storage& a, const sockaddr_storage& b) {
+    if (a.ss_family != b.ss_family) {
+        return false;
+    }
+    if (a.ss_family == AF_INET) {
+        const sockaddr_in& a4 = reinterpret_cast<const sockaddr_in&>(a);
+        const sockaddr_in& b4 = reinterpret_cast<const sockaddr_in&>(b);
+        return a4.sin_port == b4.sin_port && a4.sin_addr.s_addr == b4.sin_addr.s_addr;
+    }
+    if (a.ss_family == AF_INET6) {
+        const sockaddr_in6& a6 = reinterpret_cast<const sockaddr_in6&>(a);
+        const sockaddr_in6& b6 = reinterpret_cast<const sockaddr_in6&>(b);
+        return a6.sin6_port == b6.sin6_port && a6.sin6_scope_id == b6.sin6_scope_id &&
+                memcmp(&a6.sin6_addr, &b6.sin6_addr, sizeof(a6.sin6_addr)) == 0;
+    }
+    return false;
+}
+
+}  // namespace
+
+void DnsServerStats::addSample(unsigned netId, const sockaddr_storage& server, int rcode,
+                               int rttMs) {
+    __res_sample sample;
+    sample.at = time(nullptr);
+    sample.rtt = std::min<int>(std::max(rttMs, 0), std::numeric_limits<uint16_t>::max());
+    sample.rcode = rcode;
+
+    std::lock_guard<std::mutex> lock(mLock);
+    std::vector<Server>& servers = mNetworks[netId];
+    auto found = std::find_if(servers.begin(), servers.end(),
+            [&server](const Server& s) { return sameServer(s.addr, server); });
+    if (found == servers.end()) {
+        servers.push_back(Server{ server, {} });
+        found = servers.end() - 1;
+    }
+    found->samples.push_back(sample);
+    if (found->samples.size() > MAXNSSAMPLES) {
+        found->samples.pop_front();
+    }
+}
+
+void DnsServerStats::merge(unsigned netId, const sockaddr_storage* servers, int count,
+                           int maxSamples, __res_stats* stats) const {
+    const size_t limit = (maxSamples > 0 && maxSamples < MAXNSSAMPLES) ?
+            maxSamples : MAXNSSAMPLES;
+    std::lock_guard<std::mutex> lock(mLock);
+    auto network = mNetworks.find(netId);
+    if (network == mNetworks.end()) {
+        return;
+    }
+    for (int i = 0; i < count; i++) {
+        auto found = std::find_if(network->second.begin(), network->second.end(),
+                [&](const Server& s) { return sameServer(s.addr, servers[i]); });
+        if (found == network->second.end() || found->samples.empty()) {
+            continue;
+        }
+        // Bionic's samples are a ring of |maxSamples|, whose oldest is at sample_next once it's
+        // full.
+        __res_stats& cur = stats[i];
+        std::vector<__res_sample> samples;
+        const int first = (cur.sample_count >= static_cast<int>(limit)) ? cur.sample_next : 0;
+        for (int j = 0; j < cur.sample_count; j++) {
+            samples.push_back(cur.samples[(first + j) % cur.sample_count]);
+        }
+        samples.insert(samples.end(), found->samples.begin(), found->samples.end());
+        std::stable_sort(samples.begin(), samples.end(),
+                [](const __res_sample& a, const __res_sample& b) { return a.at < b.at; });
+        if (samples.size() > limit) {
+            samples.erase(samples.begin(), samples.end() - limit);
+        }
+        std::copy(samples.begin(), samples.end(), cur.samples);
+        cur.sample_count = samples.size();
+        cur.sample_next = samples.size() % limit;
+    }
+}
+
+void DnsServerStats::clear(unsigned netId) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mNetworks.erase(netId);
+}
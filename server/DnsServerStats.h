@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_DNS_SERVER_STATS_H
+#define NETD_SERVER_DNS_SERVER_STATS_H
+
+#include <sys/socket.h>
+
+#include <deque>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include <resolv_params.h>
+#include <resolv_stats.h>
+
+/*
+ * The outcome of each query that DnsQueryEngine sent, kept for each network and server.
+ *
+ * Bionic keeps the same samples for the queries that its own resolver sends, but doesn't let netd
+ * add to them. So the engine's samples are kept here, and merged into bionic's stats whenever
+ * those are read, before bionic's functions decide from them which servers are usable and how
+ * fast they are.
+ */
+class DnsServerStats {
+public:
+    // Records the answer, timeout or error of a query sent to |server|. |rcode| is the rcode of
+    // the answer, or RCODE_TIMEOUT or RCODE_INTERNAL_ERROR.
+    void addSample(unsigned netId, const sockaddr_storage& server, int rcode, int rttMs);
+
+    // Adds the samples of each of the |count| |servers| to |stats|, which bionic filled in for
+    // them, keeping the newest |maxSamples| of each, in the order they were taken.
+    void merge(unsigned netId, const sockaddr_storage* servers, int count, int maxSamples,
+               __res_stats* stats) const;
+
+    // Forgets the samples of |netId|, as bionic does when the servers change.
+    void clear(unsigned netId);
+
+private:
+    struct Server {
+        sockaddr_storage addr;
+        std::deque<__res_sample> samples;  // Oldest first, at most MAXNSSAMPLES.
+    };
+
+    mutable std::mutex mLock;
+    std::map<unsigned, std::vector<Server>> mNetworks;
+};
+
+#endif  // NETD_SERVER_DNS_SERVER_STATS_H
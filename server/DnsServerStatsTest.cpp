@@ -0,0 +1,118 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * DnsServerStatsTest.cpp - unit tests for DnsServerStats.cpp
+ */
+
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <time.h>
+
+#include <gtest/gtest.h>
+
+#include "DnsServerStats.h"
+
+namespace {
+
+sockaddr_storage makeServer(const char* addr) {
+    sockaddr_storage ss;
+    memset(&ss, 0, sizeof(ss));
+    sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(&ss);
+    sin->sin_family = AF_INET;
+    sin->sin_port = htons(53);
+    inet_pton(AF_INET, addr, &sin->sin_addr);
+    return ss;
+}
+
+__res_sample makeSample(time_t at, int rcode, int rtt) {
+    __res_sample sample;
+    sample.at = at;
+    sample.rtt = rtt;
+    sample.rcode = rcode;
+    return sample;
+}
+
+}  // namespace
+
+TEST(DnsServerStatsTest, TestMergesIntoBionicStats) {
+    DnsServerStats stats;
+    const sockaddr_storage servers[2] = { makeServer("192.0.2.1"), makeServer("192.0.2.2") };
+    stats.addSample(100, servers[1], ns_r_noerror, 20);
+    stats.addSample(100, servers[1], RCODE_TIMEOUT, 5000);
+    stats.addSample(101, servers[0], ns_r_servfail, 30);
+
+    // Bionic's samples are older, so the engine's come after them.
+    __res_stats bionic[2] = {};
+    bionic[1].samples[0] = makeSample(1, ns_r_nxdomain, 40);
+    bionic[1].sample_count = 1;
+    bionic[1].sample_next = 1;
+    stats.merge(100, servers, 2, 64, bionic);
+
+    EXPECT_EQ(0, bionic[0].sample_count);
+    ASSERT_EQ(3, bionic[1].sample_count);
+    EXPECT_EQ(3, bionic[1].sample_next);
+    EXPECT_EQ(ns_r_nxdomain, bionic[1].samples[0].rcode);
+    EXPECT_EQ(ns_r_noerror, bionic[1].samples[1].rcode);
+    EXPECT_EQ(20, bionic[1].samples[1].rtt);
+    EXPECT_EQ(RCODE_TIMEOUT, bionic[1].samples[2].rcode);
+    EXPECT_EQ(5000, bionic[1].samples[2].rtt);
+
+    // Other networks and other servers don't count.
+    __res_stats other[2] = {};
+    const sockaddr_storage unknown = makeServer("192.0.2.3");
+    stats.merge(100, &unknown, 1, 64, other);
+    EXPECT_EQ(0, other[0].sample_count);
+
+    stats.clear(100);
+    stats.merge(100, servers, 2, 64, other);
+    EXPECT_EQ(0, other[1].sample_count);
+}
+
+TEST(DnsServerStatsTest, TestKeepsNewestSamples) {
+    DnsServerStats stats;
+    const sockaddr_storage server = makeServer("192.0.2.1");
+    for (int i = 0; i < 3; i++) {
+        stats.addSample(100, server, ns_r_noerror, 10 + i);
+    }
+
+    // A full ring of 4, whose oldest sample is at sample_next.
+    __res_stats bionic = {};
+    for (int i = 0; i < 4; i++) {
+        bionic.samples[(i + 2) % 4] = makeSample(i + 1, ns_r_servfail, i);
+    }
+    bionic.sample_count = 4;
+    bionic.sample_next = 2;
+    stats.merge(100, &server, 1, 4, &bionic);
+
+    ASSERT_EQ(4, bionic.sample_count);
+    EXPECT_EQ(0, bionic.sample_next);
+    EXPECT_EQ(ns_r_servfail, bionic.samples[0].rcode);
+    EXPECT_EQ(3, bionic.samples[0].rtt);
+    for (int i = 1; i < 4; i++) {
+        EXPECT_EQ(ns_r_noerror, bionic.samples[i].rcode);
+        EXPECT_EQ(10 + i - 1, bionic.samples[i].rtt);
+    }
+
+    // The engine keeps no more than bionic could.
+    for (int i = 0; i < 2 * MAXNSSAMPLES; i++) {
+        stats.addSample(100, server, ns_r_noerror, i);
+    }
+    __res_stats empty = {};
+    stats.merge(100, &server, 1, 0, &empty);
+    EXPECT_EQ(MAXNSSAMPLES, empty.sample_count);
+    EXPECT_EQ(2 * MAXNSSAMPLES - 1, empty.samples[MAXNSSAMPLES - 1].rtt);
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "DnsSingleFlight.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <tuple>
+
+#include <resolv_netid.h>
+
+#include "DumpWriter.h"
+
+DnsSingleFlight::Key::Key(const char* host, const char* service, const addrinfo* hints,
+                          const android_net_context& netcontext) :
+        appNetId(netcontext.app_netid), appMark(netcontext.app_mark),
+        dnsNetId(netcontext.dns_netid), dnsMark(netcontext.dns_mark),
+        hasHost(host != NULL), host(host ? host : ""),
+        hasService(service != NULL), service(service ? service : ""),
+        hasHints(hints != NULL), flags(hints ? hints->ai_flags : 0),
+        family(hints ? hints->ai_family : 0), socktype(hints ? hints->ai_socktype : 0),
+        protocol(hints ? hints->ai_protocol : 0) {
+}
+
+bool DnsSingleFlight::Key::operator<(const Key& other) const {
+    return std::tie(appNetId, appMark, dnsNetId, dnsMark, hasHost, host, hasService, service,
+                    hasHints, flags, family, socktype, protocol) <
+           std::tie(other.appNetId, other.appMark, other.dnsNetId, other.dnsMark, other.hasHost,
+                    other.host, other.hasService, other.service, other.hasHints, other.flags,
+                    other.family, other.socktype, other.protocol);
+}
+
+DnsSingleFlight::Flight::~Flight() {
+    if (result) {
+        freeaddrinfo(result);
+    }
+}
+
+DnsSingleFlight::DnsSingleFlight() : mLookups(0), mLeaders(0) {
+}
+
+// Allocates each entry the way getaddrinfo() does: the address in the same block as the addrinfo,
+// and the canonical name separately.
+addrinfo* DnsSingleFlight::copyAddrInfo(const addrinfo* ai) {
+    addrinfo* head = NULL;
+    addrinfo** next = &head;
+    for (; ai; ai = ai->ai_next) {
+        addrinfo* copy = static_cast<addrinfo*>(calloc(1, sizeof(addrinfo) + ai->ai_addrlen));
+        if (!copy) {
+            break;
+        }
+        *copy = *ai;
+        copy->ai_next = NULL;
+        copy->ai_canonname = NULL;
+        copy->ai_addr = NULL;
+        *next = copy;
+        next = &copy->ai_next;
+        if (ai->ai_addr) {
+            copy->ai_addr = reinterpret_cast<sockaddr*>(copy + 1);
+            memcpy(copy->ai_addr, ai->ai_addr, ai->ai_addrlen);
+        }
+        if (ai->ai_canonname && !(copy->ai_canonname = strdup(ai->ai_canonname))) {
+            break;
+        }
+    }
+    if (ai) {
+        if (head) {
+            freeaddrinfo(head);
+        }
+        return NULL;
+    }
+    return head;
+}
+
+int DnsSingleFlight::getaddrinfo(const Key& key, const Lookup& lookup, addrinfo** result) {
+    *result = NULL;
+    std::unique_lock<std::mutex> lock(mLock);
+    mLookups++;
+
+    std::shared_ptr<Flight> flight;
+    auto existing = mFlights.find(key);
+    if (existing != mFlights.end()) {
+        flight = existing->second;
+        flight->followers++;
+        flight->finished.wait(lock, [&flight] { return flight->done; });
+    } else {
+        mLeaders++;
+        flight = std::make_shared<Flight>();
+        auto inserted = mFlights.emplace(key, flight).first;
+        lock.unlock();
+
+        addrinfo* leaderResult = NULL;
+        int rv = lookup(&leaderResult);
+
+        lock.lock();
+        mFlights.erase(inserted);
+        flight->done = true;
+        flight->rv = rv;
+        if (flight->followers == 0) {
+            // The common case: nobody to share with, so there's nothing to copy.
+            *result = leaderResult;
+            return rv;
+        }
+        flight->result = leaderResult;
+        flight->finished.notify_all();
+    }
+    lock.unlock();
+
+    // The result doesn't change once the flight is done, and |flight| keeps it alive.
+    if (flight->result && !(*result = copyAddrInfo(flight->result))) {
+        return EAI_MEMORY;
+    }
+    return flight->rv;
+}
+
+DnsSingleFlight::Stats DnsSingleFlight::getStats() const {
+    std::lock_guard<std::mutex> lock(mLock);
+    Stats stats;
+    stats.lookups = mLookups;
+    stats.leaders = mLeaders;
+    stats.inFlight = mFlights.size();
+    return stats;
+}
+
+void DnsSingleFlight::dump(DumpWriter& dw) const {
+    const Stats stats = getStats();
+    dw.println("getaddrinfo single-flight: %llu lookups, %llu sent upstream, fan-in %.2f, "
+               "%zu in flight", static_cast<unsigned long long>(stats.lookups),
+               static_cast<unsigned long long>(stats.leaders),
+               stats.leaders ? static_cast<double>(stats.lookups) / stats.leaders : 1.0,
+               stats.inFlight);
+}
@@ -0,0 +1,108 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_DNS_SINGLE_FLIGHT_H
+#define NETD_SERVER_DNS_SINGLE_FLIGHT_H
+
+#include <netdb.h>
+#include <stdint.h>
+
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+struct android_net_context;
+class DumpWriter;
+
+/*
+ * Makes identical getaddrinfo() lookups that are in progress at the same time share one lookup.
+ * The first caller (the leader) does the lookup, and the others (followers) wait for it and get a
+ * copy of its result. This stops a burst of lookups for the same name, e.g., from the threads of
+ * an app that is starting up, from all going to the upstream server while the cache is cold.
+ *
+ * Lookups are identical if they have the same networks, marks, host, service and hints. The uid is
+ * not part of the key, so the upstream query of a shared lookup is attributed to the leader's uid.
+ */
+class DnsSingleFlight {
+public:
+    struct Key {
+        unsigned appNetId;
+        uint32_t appMark;
+        unsigned dnsNetId;
+        uint32_t dnsMark;
+        bool hasHost;
+        std::string host;
+        bool hasService;
+        std::string service;
+        bool hasHints;
+        int flags;
+        int family;
+        int socktype;
+        int protocol;
+
+        // |host|, |service| and |hints| may be NULL.
+        Key(const char* host, const char* service, const addrinfo* hints,
+            const android_net_context& netcontext);
+
+        bool operator<(const Key& other) const;
+    };
+
+    struct Stats {
+        uint64_t lookups;   // All calls to getaddrinfo().
+        uint64_t leaders;   // Calls that did the lookup themselves.
+        size_t inFlight;    // Lookups in progress now.
+    };
+
+    typedef std::function<int(addrinfo**)> Lookup;
+
+    DnsSingleFlight();
+
+    // Calls |lookup|, unless an identical lookup is already in progress, in which case it waits for
+    // that one to finish and copies its result. Either way, returns the getaddrinfo() error code,
+    // and sets |*result| to a list that the caller must free with freeaddrinfo().
+    int getaddrinfo(const Key& key, const Lookup& lookup, addrinfo** result);
+
+    Stats getStats() const;
+    void dump(DumpWriter& dw) const;
+
+    // Returns a copy of |ai| that can be freed with freeaddrinfo(), or NULL if out of memory.
+    static addrinfo* copyAddrInfo(const addrinfo* ai);
+
+private:
+    DnsSingleFlight(const DnsSingleFlight&) = delete;
+    DnsSingleFlight& operator=(const DnsSingleFlight&) = delete;
+
+    struct Flight {
+        Flight() : done(false), rv(0), result(NULL), followers(0) {}
+        ~Flight();
+
+        bool done;
+        int rv;
+        addrinfo* result;  // Owned, once done, if there are followers.
+        int followers;
+        std::condition_variable finished;
+    };
+
+    mutable std::mutex mLock;
+    std::map<Key, std::shared_ptr<Flight>> mFlights;  // Guarded by mLock.
+    uint64_t mLookups;
+    uint64_t mLeaders;
+};
+
+#endif  // NETD_SERVER_DNS_SINGLE_FLIGHT_H
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * DnsSingleFlightTest.cpp - unit tests for DnsSingleFlight.cpp
+ */
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <resolv_netid.h>
+
+#include "DnsSingleFlight.h"
+
+namespace {
+
+android_net_context makeNetContext(unsigned netId) {
+    android_net_context netcontext;
+    memset(&netcontext, 0, sizeof(netcontext));
+    netcontext.app_netid = netId;
+    netcontext.dns_netid = netId;
+    return netcontext;
+}
+
+// A real result with an address and a canonical name, from a numeric lookup.
+int numericLookup(const char* host, addrinfo** result) {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_flags = AI_NUMERICHOST | AI_CANONNAME;
+    hints.ai_socktype = SOCK_STREAM;
+    return ::getaddrinfo(host, "80", &hints, result);
+}
+
+std::string addressOf(const addrinfo* ai) {
+    char buf[INET6_ADDRSTRLEN];
+    const sockaddr_in* sin = reinterpret_cast<const sockaddr_in*>(ai->ai_addr);
+    return inet_ntop(AF_INET, &sin->sin_addr, buf, sizeof(buf));
+}
+
+}  // namespace
+
+TEST(DnsSingleFlightTest, TestCopyAddrInfo) {
+    addrinfo* original = NULL;
+    ASSERT_EQ(0, numericLookup("192.0.2.1", &original));
+    addrinfo* copy = DnsSingleFlight::copyAddrInfo(original);
+    ASSERT_NE(nullptr, copy);
+    EXPECT_NE(original, copy);
+    EXPECT_NE(original->ai_addr, copy->ai_addr);
+    EXPECT_EQ(original->ai_family, copy->ai_family);
+    EXPECT_EQ(original->ai_socktype, copy->ai_socktype);
+    EXPECT_EQ(original->ai_addrlen, copy->ai_addrlen);
+    EXPECT_EQ(0, memcmp(original->ai_addr, copy->ai_addr, original->ai_addrlen));
+    EXPECT_STREQ(original->ai_canonname, copy->ai_canonname);
+    EXPECT_EQ(nullptr, copy->ai_next);
+    freeaddrinfo(copy);
+    freeaddrinfo(original);
+
+    EXPECT_EQ(nullptr, DnsSingleFlight::copyAddrInfo(NULL));
+}
+
+TEST(DnsSingleFlightTest, TestCoalescesConcurrentLookups) {
+    const int kThreads = 8;
+    DnsSingleFlight singleFlight;
+    const DnsSingleFlight::Key key("www.example.com", NULL, NULL, makeNetContext(100));
+    std::atomic<int> lookups(0);
+
+    // The leader doesn't finish until everyone else is waiting for it.
+    auto slowLookup = [&](addrinfo** result) {
+        lookups++;
+        while (singleFlight.getStats().lookups < kThreads) {
+            std::this_thread::yield();
+        }
+        return numericLookup("192.0.2.1", result);
+    };
+
+    std::vector<addrinfo*> results(kThreads);
+    std::vector<int> errors(kThreads);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kThreads; i++) {
+        threads.emplace_back([&, i] {
+            errors[i] = singleFlight.getaddrinfo(key, slowLookup, &results[i]);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    EXPECT_EQ(1, lookups.load());
+    for (int i = 0; i < kThreads; i++) {
+        EXPECT_EQ(0, errors[i]);
+        ASSERT_NE(nullptr, results[i]);
+        EXPECT_EQ("192.0.2.1", addressOf(results[i]));
+        // Everyone gets a list of their own.
+        for (int j = 0; j < i; j++) {
+            EXPECT_NE(results[j], results[i]);
+        }
+        freeaddrinfo(results[i]);
+    }
+
+    DnsSingleFlight::Stats stats = singleFlight.getStats();
+    EXPECT_EQ(static_cast<uint64_t>(kThreads), stats.lookups);
+    EXPECT_EQ(1U, stats.leaders);
+    EXPECT_EQ(0U, stats.inFlight);
+}
+
+TEST(DnsSingleFlightTest, TestSharesErrors) {
+    DnsSingleFlight singleFlight;
+    const DnsSingleFlight::Key key("nonexistent.example", NULL, NULL, makeNetContext(100));
+    auto failingLookup = [&](addrinfo**) {
+        while (singleFlight.getStats().lookups < 2) {
+            std::this_thread::yield();
+        }
+        return EAI_NODATA;
+    };
+    addrinfo* result1 = NULL;
+    addrinfo* result2 = NULL;
+    int error1 = 0;
+    std::thread follower([&] { error1 = singleFlight.getaddrinfo(key, failingLookup, &result1); });
+    int error2 = singleFlight.getaddrinfo(key, failingLookup, &result2);
+    follower.join();
+    EXPECT_EQ(EAI_NODATA, error1);
+    EXPECT_EQ(EAI_NODATA, error2);
+    EXPECT_EQ(nullptr, result1);
+    EXPECT_EQ(nullptr, result2);
+    EXPECT_EQ(1U, singleFlight.getStats().leaders);
+}
+
+TEST(DnsSingleFlightTest, TestKeys) {
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    const android_net_context net100 = makeNetContext(100);
+
+    const DnsSingleFlight::Key key("example.com", NULL, NULL, net100);
+    EXPECT_FALSE(key < DnsSingleFlight::Key("example.com", NULL, NULL, net100));
+    EXPECT_FALSE(DnsSingleFlight::Key("example.com", NULL, NULL, net100) < key);
+
+    // Anything that can change the answer makes a different key.
+    std::vector<DnsSingleFlight::Key> others = {
+        DnsSingleFlight::Key("example.com", NULL, NULL, makeNetContext(101)),
+        DnsSingleFlight::Key("example.org", NULL, NULL, net100),
+        DnsSingleFlight::Key("example.com", "", NULL, net100),
+        DnsSingleFlight::Key("example.com", NULL, &hints, net100),
+        DnsSingleFlight::Key(NULL, NULL, NULL, net100),
+    };
+    hints.ai_family = AF_INET6;
+    others.push_back(DnsSingleFlight::Key("example.com", NULL, &hints, net100));
+    android_net_context marked = net100;
+    marked.dns_mark = 0x10064;
+    others.push_back(DnsSingleFlight::Key("example.com", NULL, NULL, marked));
+
+    for (const auto& other : others) {
+        EXPECT_TRUE(key < other || other < key);
+    }
+}
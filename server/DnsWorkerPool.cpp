@@ -0,0 +1,177 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "DnsWorkerPool"
+
+#include "DnsWorkerPool.h"
+
+#include <algorithm>
+
+#include <cutils/log.h>
+#include <cutils/properties.h>
+
+#include "DumpWriter.h"
+
+namespace {
+
+typedef std::chrono::duration<float, std::milli> ms;
+
+int32_t getPositiveProperty(const char* name, int32_t defaultValue) {
+    int32_t value = property_get_int32(name, defaultValue);
+    return value > 0 ? value : defaultValue;
+}
+
+}  // namespace
+
+const int DnsWorkerPool::DEFAULT_NUM_WORKERS;
+const size_t DnsWorkerPool::DEFAULT_MAX_QUEUED;
+const size_t DnsWorkerPool::DEFAULT_MAX_QUEUED_PER_UID;
+
+DnsWorkerPool::DnsWorkerPool() :
+        DnsWorkerPool(getPositiveProperty("persist.netd.dns_workers", DEFAULT_NUM_WORKERS),
+                      getPositiveProperty("persist.netd.dns_queue_depth", DEFAULT_MAX_QUEUED),
+                      getPositiveProperty("persist.netd.dns_queue_depth_per_uid",
+                                          DEFAULT_MAX_QUEUED_PER_UID)) {
+}
+
+DnsWorkerPool::DnsWorkerPool(int numWorkers, size_t maxQueued, size_t maxQueuedPerUid) :
+        mMaxQueued(maxQueued), mMaxQueuedPerUid(maxQueuedPerUid),
+        mMaxRunningPerUid(numWorkers > 1 ? numWorkers / 2 : 1), mQueued(0), mStopping(false),
+        mPeakQueued(0), mStarted(0), mRejected(0), mTotalWait(0), mMaxWait(0) {
+    start(numWorkers > 0 ? numWorkers : 1);
+}
+
+DnsWorkerPool::~DnsWorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mStopping = true;
+    }
+    mNotEmpty.notify_all();
+    for (auto& worker : mWorkers) {
+        worker.join();
+    }
+}
+
+void DnsWorkerPool::start(int numWorkers) {
+    mWorkers.reserve(numWorkers);
+    for (int i = 0; i < numWorkers; i++) {
+        mWorkers.emplace_back(&DnsWorkerPool::runWorker, this);
+    }
+}
+
+bool DnsWorkerPool::enqueue(uid_t uid, Task task) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto queue = mQueues.find(uid);
+    const size_t queuedForUid = (queue == mQueues.end()) ? 0 : queue->second.size();
+    if (mStopping || mQueued >= mMaxQueued || queuedForUid >= mMaxQueuedPerUid) {
+        mRejected++;
+        return false;
+    }
+    if (queue == mQueues.end()) {
+        queue = mQueues.emplace(uid, std::deque<Entry>()).first;
+        mTurns.push_back(uid);
+    }
+    queue->second.push_back(Entry{std::move(task), std::chrono::steady_clock::now()});
+    mQueued++;
+    mPeakQueued = std::max(mPeakQueued, mQueued);
+    mNotEmpty.notify_one();
+    return true;
+}
+
+std::deque<uid_t>::iterator DnsWorkerPool::findTurnLocked() {
+    return std::find_if(mTurns.begin(), mTurns.end(), [this](uid_t uid) {
+        auto running = mRunning.find(uid);
+        return running == mRunning.end() || running->second < mMaxRunningPerUid;
+    });
+}
+
+void DnsWorkerPool::runWorker() {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        auto turn = findTurnLocked();
+        while (turn == mTurns.end() && !mStopping) {
+            mNotEmpty.wait(lock);
+            turn = findTurnLocked();
+        }
+        if (turn == mTurns.end()) {
+            // Stopping. Whatever is still queued belongs to uids at their limit, and the workers
+            // running their lookups will pick it up when they're done.
+            return;
+        }
+
+        // Take the oldest lookup of the first uid in line that is below its limit, and send that
+        // uid to the back of the line if it has more.
+        const uid_t uid = *turn;
+        mTurns.erase(turn);
+        auto queue = mQueues.find(uid);
+        Entry entry = std::move(queue->second.front());
+        queue->second.pop_front();
+        if (queue->second.empty()) {
+            mQueues.erase(queue);
+        } else {
+            mTurns.push_back(uid);
+        }
+        mQueued--;
+        mRunning[uid]++;
+
+        const auto wait = std::chrono::steady_clock::now() - entry.enqueued;
+        mStarted++;
+        mTotalWait += wait;
+        mMaxWait = std::max(mMaxWait, wait);
+
+        lock.unlock();
+        entry.task();
+        entry.task = nullptr;  // Release whatever the task holds before waiting for the next one.
+        lock.lock();
+
+        auto running = mRunning.find(uid);
+        if (--running->second == 0) {
+            mRunning.erase(running);
+        }
+        if (mQueues.count(uid)) {
+            // The uid may have been skipped while it was at its limit.
+            mNotEmpty.notify_one();
+        }
+    }
+}
+
+DnsWorkerPool::Stats DnsWorkerPool::getStats() const {
+    std::lock_guard<std::mutex> lock(mLock);
+    Stats stats;
+    stats.queued = mQueued;
+    stats.peakQueued = mPeakQueued;
+    stats.queuedUids = mQueues.size();
+    stats.runningUids = mRunning.size();
+    stats.started = mStarted;
+    stats.rejected = mRejected;
+    stats.avgWaitMs = mStarted ? std::chrono::duration_cast<ms>(mTotalWait).count() / mStarted : 0;
+    stats.maxWaitMs = std::chrono::duration_cast<ms>(mMaxWait).count();
+    return stats;
+}
+
+void DnsWorkerPool::dump(DumpWriter& dw) const {
+    const Stats stats = getStats();
+    dw.println("DNS worker pool: %zu workers (%d per uid), queue depth %zu (%zu per uid)",
+               mWorkers.size(), mMaxRunningPerUid, mMaxQueued, mMaxQueuedPerUid);
+    dw.incIndent();
+    dw.println("Queued: %zu lookups from %zu uids, peak %zu", stats.queued, stats.queuedUids,
+               stats.peakQueued);
+    dw.println("Running: lookups from %zu uids", stats.runningUids);
+    dw.println("Started: %llu, rejected: %llu", static_cast<unsigned long long>(stats.started),
+               static_cast<unsigned long long>(stats.rejected));
+    dw.println("Queue wait: avg %.2f ms, max %.2f ms", stats.avgWaitMs, stats.maxWaitMs);
+    dw.decIndent();
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_DNS_WORKER_POOL_H
+#define NETD_SERVER_DNS_WORKER_POOL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class DumpWriter;
+
+/*
+ * A fixed set of threads that run the DNS lookups requested through DnsProxyListener, instead of
+ * a new thread per lookup.
+ *
+ * Lookups wait in a bounded queue. Each uid has a queue of its own, and the workers serve the uids
+ * that have lookups waiting in turn, so an app that sends a burst of lookups delays its own
+ * lookups rather than everyone else's. A lookup that would make the total queue, or its uid's
+ * queue, longer than allowed is rejected, and the caller must fail it right away.
+ *
+ * No uid gets more than half of the workers at once, so lookups that hang until they time out
+ * can't tie up the whole pool either. A uid that has reached that limit is skipped until one of
+ * its lookups finishes.
+ *
+ * The sizes default to the values below, and can be overridden with the persist.netd.dns_workers,
+ * persist.netd.dns_queue_depth and persist.netd.dns_queue_depth_per_uid system properties, which
+ * are read at startup. Values that are not positive are ignored.
+ */
+class DnsWorkerPool {
+public:
+    typedef std::function<void()> Task;
+
+    static const int DEFAULT_NUM_WORKERS = 32;
+    static const size_t DEFAULT_MAX_QUEUED = 512;
+    static const size_t DEFAULT_MAX_QUEUED_PER_UID = 64;
+
+    struct Stats {
+        size_t queued;         // Lookups waiting now.
+        size_t peakQueued;     // The most lookups that were ever waiting at once.
+        size_t queuedUids;     // The number of uids that have lookups waiting now.
+        size_t runningUids;    // The number of uids that have lookups running now.
+        uint64_t started;      // Lookups that a worker has picked up.
+        uint64_t rejected;     // Lookups rejected because a queue was full.
+        float avgWaitMs;       // The average time between enqueue() and a worker picking it up.
+        float maxWaitMs;
+    };
+
+    // Uses the sizes from the system properties, or the defaults.
+    DnsWorkerPool();
+    DnsWorkerPool(int numWorkers, size_t maxQueued, size_t maxQueuedPerUid);
+
+    // Runs the lookups that are still queued, and then stops the workers.
+    ~DnsWorkerPool();
+
+    // Queues |task| to run on a worker on behalf of |uid|. Returns false, without taking |task|, if
+    // there is no room for it.
+    bool enqueue(uid_t uid, Task task);
+
+    Stats getStats() const;
+    void dump(DumpWriter& dw) const;
+
+private:
+    DnsWorkerPool(const DnsWorkerPool&) = delete;
+    DnsWorkerPool& operator=(const DnsWorkerPool&) = delete;
+
+    struct Entry {
+        Task task;
+        std::chrono::steady_clock::time_point enqueued;
+    };
+
+    void start(int numWorkers);
+    void runWorker();
+    // Returns the position in mTurns of the first uid that may start another lookup, or
+    // mTurns.end() if there is none.
+    std::deque<uid_t>::iterator findTurnLocked();
+
+    const size_t mMaxQueued;
+    const size_t mMaxQueuedPerUid;
+    const int mMaxRunningPerUid;
+
+    mutable std::mutex mLock;
+    std::condition_variable mNotEmpty;
+    std::map<uid_t, std::deque<Entry>> mQueues;  // Only uids that have lookups waiting.
+    std::deque<uid_t> mTurns;  // The uids in mQueues, in the order the workers serve them.
+    std::map<uid_t, int> mRunning;  // Only uids that have lookups running.
+    size_t mQueued;
+    bool mStopping;
+
+    size_t mPeakQueued;
+    uint64_t mStarted;
+    uint64_t mRejected;
+    std::chrono::steady_clock::duration mTotalWait;
+    std::chrono::steady_clock::duration mMaxWait;
+
+    std::vector<std::thread> mWorkers;
+};
+
+#endif  // NETD_SERVER_DNS_WORKER_POOL_H
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * DnsWorkerPoolTest.cpp - unit tests for DnsWorkerPool.cpp
+ */
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "DnsWorkerPool.h"
+
+namespace {
+
+// Holds up the workers that run block() until release() is called.
+class Gate {
+public:
+    void block() {
+        std::unique_lock<std::mutex> lock(mLock);
+        mBlocked++;
+        mChanged.notify_all();
+        mChanged.wait(lock, [this] { return mOpen; });
+    }
+
+    void waitForBlocked(int n) {
+        std::unique_lock<std::mutex> lock(mLock);
+        mChanged.wait(lock, [this, n] { return mBlocked >= n; });
+    }
+
+    void release() {
+        std::lock_guard<std::mutex> lock(mLock);
+        mOpen = true;
+        mChanged.notify_all();
+    }
+
+private:
+    std::mutex mLock;
+    std::condition_variable mChanged;
+    int mBlocked = 0;
+    bool mOpen = false;
+};
+
+}  // namespace
+
+TEST(DnsWorkerPoolTest, TestRunsEverything) {
+    std::atomic<int> done(0);
+    {
+        DnsWorkerPool pool(4, 1000, 1000);
+        for (int i = 0; i < 1000; i++) {
+            EXPECT_TRUE(pool.enqueue(10000 + i % 7, [&done] { done++; }));
+        }
+    }
+    // The destructor runs whatever was still queued.
+    EXPECT_EQ(1000, done.load());
+}
+
+TEST(DnsWorkerPoolTest, TestRejectsWhenFull) {
+    Gate gate;
+    DnsWorkerPool pool(1, 3, 2);
+    ASSERT_TRUE(pool.enqueue(10000, [&gate] { gate.block(); }));
+    gate.waitForBlocked(1);
+
+    // The worker is busy, so everything else waits in the queue.
+    EXPECT_TRUE(pool.enqueue(10001, [] {}));
+    EXPECT_TRUE(pool.enqueue(10001, [] {}));
+    EXPECT_FALSE(pool.enqueue(10001, [] {}));  // Over the per-uid limit.
+    EXPECT_TRUE(pool.enqueue(10002, [] {}));
+    EXPECT_FALSE(pool.enqueue(10003, [] {}));  // Over the total limit.
+
+    DnsWorkerPool::Stats stats = pool.getStats();
+    EXPECT_EQ(3U, stats.queued);
+    EXPECT_EQ(2U, stats.queuedUids);
+    EXPECT_EQ(2U, stats.rejected);
+    EXPECT_EQ(1U, stats.started);
+    gate.release();
+}
+
+TEST(DnsWorkerPoolTest, TestTakesTurnsBetweenUids) {
+    Gate gate;
+    std::mutex lock;
+    std::vector<uid_t> order;
+    {
+        DnsWorkerPool pool(1, 100, 100);
+        ASSERT_TRUE(pool.enqueue(0, [&gate] { gate.block(); }));
+        gate.waitForBlocked(1);
+
+        // A burst from one app, and then one lookup each from two others.
+        auto record = [&lock, &order](uid_t uid) {
+            return [&lock, &order, uid] {
+                std::lock_guard<std::mutex> guard(lock);
+                order.push_back(uid);
+            };
+        };
+        for (int i = 0; i < 4; i++) {
+            ASSERT_TRUE(pool.enqueue(10001, record(10001)));
+        }
+        ASSERT_TRUE(pool.enqueue(10002, record(10002)));
+        ASSERT_TRUE(pool.enqueue(10003, record(10003)));
+        gate.release();
+    }
+
+    // The other apps don't wait for the whole burst.
+    std::vector<uid_t> expected = { 10001, 10002, 10003, 10001, 10001, 10001 };
+    EXPECT_EQ(expected, order);
+}
+
+TEST(DnsWorkerPoolTest, TestLimitsRunningLookupsPerUid) {
+    Gate gate;
+    std::atomic<int> done(0);
+    {
+        // Four workers, so at most two per uid.
+        DnsWorkerPool pool(4, 100, 100);
+        auto blockThenCount = [&gate, &done] {
+            gate.block();
+            done++;
+        };
+        for (int i = 0; i < 3; i++) {
+            ASSERT_TRUE(pool.enqueue(10001, blockThenCount));
+        }
+        gate.waitForBlocked(2);
+
+        // The third lookup of the first uid waits, even though workers are free, and another uid's
+        // lookup goes ahead of it.
+        ASSERT_TRUE(pool.enqueue(10002, blockThenCount));
+        gate.waitForBlocked(3);
+        DnsWorkerPool::Stats stats = pool.getStats();
+        EXPECT_EQ(3U, stats.started);
+        EXPECT_EQ(1U, stats.queued);
+        EXPECT_EQ(2U, stats.runningUids);
+
+        gate.release();
+    }
+    // The skipped lookup still runs once the uid is below its limit.
+    EXPECT_EQ(4, done.load());
+}
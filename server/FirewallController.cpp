@@ -27,12 +27,13 @@
 
 #include "NetdConstants.h"
 #include "FirewallController.h"
+#include "IptablesTransaction.h"
 
 using android::base::StringAppendF;
 
-auto FirewallController::execIptables = ::execIptables;
 auto FirewallController::execIptablesSilently = ::execIptablesSilently;
 auto FirewallController::execIptablesRestore = ::execIptablesRestore;
+auto FirewallController::execIptablesRestoreSilently = ::execIptablesRestoreSilently;
 
 const char* FirewallController::TABLE = "filter";
 
@@ -56,6 +57,15 @@ const char* FirewallController::ICMPV6_TYPES[] = {
     "redirect",
 };
 
+namespace {
+
+// Adding rules is all-or-nothing. Removing them is best-effort, since some may already be gone.
+int applyRules(IptablesTransaction* t, const char* op) {
+    return strcmp(op, "-D") ? t->commit() : t->commitBestEffort();
+}
+
+}  // namespace
+
 FirewallController::FirewallController(void) {
     // If no rules are set, it's in BLACKLIST mode
     mFirewallType = BLACKLIST;
@@ -76,36 +86,39 @@ int FirewallController::setupIptablesHooks(void) {
     return res;
 }
 
+void FirewallController::addFlushRules(IptablesTransaction* t) {
+    t->addf(V4V6, TABLE, "-F %s", LOCAL_INPUT);
+    t->addf(V4V6, TABLE, "-F %s", LOCAL_OUTPUT);
+    t->addf(V4V6, TABLE, "-F %s", LOCAL_FORWARD);
+}
+
 int FirewallController::enableFirewall(FirewallType ftype) {
     int res = 0;
     if (mFirewallType != ftype) {
         // flush any existing rules
-        disableFirewall();
+        IptablesTransaction t(execIptablesRestore, execIptablesRestoreSilently);
+        addFlushRules(&t);
 
         if (ftype == WHITELIST) {
             // create default rule to drop all traffic
-            res |= execIptables(V4V6, "-A", LOCAL_INPUT, "-j", "DROP", NULL);
-            res |= execIptables(V4V6, "-A", LOCAL_OUTPUT, "-j", "REJECT", NULL);
-            res |= execIptables(V4V6, "-A", LOCAL_FORWARD, "-j", "REJECT", NULL);
+            t.addf(V4V6, TABLE, "-A %s -j DROP", LOCAL_INPUT);
+            t.addf(V4V6, TABLE, "-A %s -j REJECT", LOCAL_OUTPUT);
+            t.addf(V4V6, TABLE, "-A %s -j REJECT", LOCAL_FORWARD);
         }
+        res = t.commit();
 
-        // Set this after calling disableFirewall(), since it defaults to WHITELIST there
         mFirewallType = ftype;
     }
     return res;
 }
 
 int FirewallController::disableFirewall(void) {
-    int res = 0;
-
     mFirewallType = WHITELIST;
 
     // flush any existing rules
-    res |= execIptables(V4V6, "-F", LOCAL_INPUT, NULL);
-    res |= execIptables(V4V6, "-F", LOCAL_OUTPUT, NULL);
-    res |= execIptables(V4V6, "-F", LOCAL_FORWARD, NULL);
-
-    return res;
+    IptablesTransaction t(execIptablesRestore, execIptablesRestoreSilently);
+    addFlushRules(&t);
+    return t.commit();
 }
 
 int FirewallController::enableChildChains(ChildChain chain, bool enable) {
@@ -125,14 +138,11 @@ int FirewallController::enableChildChains(ChildChain chain, bool enable) {
             return res;
     }
 
-    if (enable) {
-        res |= attachChain(name, LOCAL_INPUT);
-        res |= attachChain(name, LOCAL_OUTPUT);
-    } else {
-        res |= detachChain(name, LOCAL_INPUT);
-        res |= detachChain(name, LOCAL_OUTPUT);
-    }
-    return res;
+    const char* op = enable ? "-A" : "-D";
+    IptablesTransaction t(execIptablesRestore, execIptablesRestoreSilently);
+    t.addf(V4V6, TABLE, "%s %s -j %s", op, LOCAL_INPUT, name);
+    t.addf(V4V6, TABLE, "%s %s -j %s", op, LOCAL_OUTPUT, name);
+    return applyRules(&t, op);
 }
 
 int FirewallController::isFirewallEnabled(void) {
@@ -158,10 +168,10 @@ int FirewallController::setInterfaceRule(const char* iface, FirewallRule rule) {
         op = "-D";
     }
 
-    int res = 0;
-    res |= execIptables(V4V6, op, LOCAL_INPUT, "-i", iface, "-j", "RETURN", NULL);
-    res |= execIptables(V4V6, op, LOCAL_OUTPUT, "-o", iface, "-j", "RETURN", NULL);
-    return res;
+    IptablesTransaction t(execIptablesRestore, execIptablesRestoreSilently);
+    t.addf(V4V6, TABLE, "%s %s -i %s -j RETURN", op, LOCAL_INPUT, iface);
+    t.addf(V4V6, TABLE, "%s %s -o %s -j RETURN", op, LOCAL_OUTPUT, iface);
+    return applyRules(&t, op);
 }
 
 int FirewallController::setEgressSourceRule(const char* addr, FirewallRule rule) {
@@ -182,10 +192,10 @@ int FirewallController::setEgressSourceRule(const char* addr, FirewallRule rule)
         op = "-D";
     }
 
-    int res = 0;
-    res |= execIptables(target, op, LOCAL_INPUT, "-d", addr, "-j", "RETURN", NULL);
-    res |= execIptables(target, op, LOCAL_OUTPUT, "-s", addr, "-j", "RETURN", NULL);
-    return res;
+    IptablesTransaction t(execIptablesRestore, execIptablesRestoreSilently);
+    t.addf(target, TABLE, "%s %s -d %s -j RETURN", op, LOCAL_INPUT, addr);
+    t.addf(target, TABLE, "%s %s -s %s -j RETURN", op, LOCAL_OUTPUT, addr);
+    return applyRules(&t, op);
 }
 
 int FirewallController::setEgressDestRule(const char* addr, int protocol, int port,
@@ -200,12 +210,6 @@ int FirewallController::setEgressDestRule(const char* addr, int protocol, int po
         target = V6;
     }
 
-    char protocolStr[16];
-    sprintf(protocolStr, "%d", protocol);
-
-    char portStr[16];
-    sprintf(portStr, "%d", port);
-
     const char* op;
     if (rule == ALLOW) {
         op = "-I";
@@ -213,12 +217,12 @@ int FirewallController::setEgressDestRule(const char* addr, int protocol, int po
         op = "-D";
     }
 
-    int res = 0;
-    res |= execIptables(target, op, LOCAL_INPUT, "-s", addr, "-p", protocolStr,
-            "--sport", portStr, "-j", "RETURN", NULL);
-    res |= execIptables(target, op, LOCAL_OUTPUT, "-d", addr, "-p", protocolStr,
-            "--dport", portStr, "-j", "RETURN", NULL);
-    return res;
+    IptablesTransaction t(execIptablesRestore, execIptablesRestoreSilently);
+    t.addf(target, TABLE, "%s %s -s %s -p %d --sport %d -j RETURN",
+           op, LOCAL_INPUT, addr, protocol, port);
+    t.addf(target, TABLE, "%s %s -d %s -p %d --dport %d -j RETURN",
+           op, LOCAL_OUTPUT, addr, protocol, port);
+    return applyRules(&t, op);
 }
 
 FirewallType FirewallController::getFirewallType(ChildChain chain) {
@@ -237,9 +241,6 @@ FirewallType FirewallController::getFirewallType(ChildChain chain) {
 }
 
 int FirewallController::setUidRule(ChildChain chain, int uid, FirewallRule rule) {
-    char uidStr[16];
-    sprintf(uidStr, "%d", uid);
-
     const char* op;
     const char* target;
     FirewallType firewallType = getFirewallType(chain);
@@ -253,39 +254,30 @@ int FirewallController::setUidRule(ChildChain chain, int uid, FirewallRule rule)
         op = (rule == DENY)? "-A" : "-D";
     }
 
-    int res = 0;
+    std::vector<const char*> chains;
     switch(chain) {
         case DOZABLE:
-            res |= execIptables(V4V6, op, LOCAL_DOZABLE, "-m", "owner", "--uid-owner",
-                    uidStr, "-j", target, NULL);
+            chains = { LOCAL_DOZABLE };
             break;
         case STANDBY:
-            res |= execIptables(V4V6, op, LOCAL_STANDBY, "-m", "owner", "--uid-owner",
-                    uidStr, "-j", target, NULL);
+            chains = { LOCAL_STANDBY };
             break;
         case POWERSAVE:
-            res |= execIptables(V4V6, op, LOCAL_POWERSAVE, "-m", "owner", "--uid-owner",
-                    uidStr, "-j", target, NULL);
+            chains = { LOCAL_POWERSAVE };
             break;
         case NONE:
-            res |= execIptables(V4V6, op, LOCAL_INPUT, "-m", "owner", "--uid-owner", uidStr,
-                    "-j", target, NULL);
-            res |= execIptables(V4V6, op, LOCAL_OUTPUT, "-m", "owner", "--uid-owner", uidStr,
-                    "-j", target, NULL);
+            chains = { LOCAL_INPUT, LOCAL_OUTPUT };
             break;
         default:
             ALOGW("Unknown child chain: %d", chain);
             break;
     }
-    return res;
-}
 
-int FirewallController::attachChain(const char* childChain, const char* parentChain) {
-    return execIptables(V4V6, "-t", TABLE, "-A", parentChain, "-j", childChain, NULL);
-}
-
-int FirewallController::detachChain(const char* childChain, const char* parentChain) {
-    return execIptables(V4V6, "-t", TABLE, "-D", parentChain, "-j", childChain, NULL);
+    IptablesTransaction t(execIptablesRestore, execIptablesRestoreSilently);
+    for (const char* name : chains) {
+        t.addf(V4V6, TABLE, "%s %s -m owner --uid-owner %d -j %s", op, name, uid, target);
+    }
+    return applyRules(&t, op);
 }
 
 int FirewallController::createChain(const char* childChain,
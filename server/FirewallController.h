@@ -24,6 +24,8 @@
 
 #include "NetdConstants.h"
 
+class IptablesTransaction;
+
 enum FirewallRule { DENY, ALLOW };
 
 // WHITELIST means the firewall denies all by default, uids must be explicitly ALLOWed
@@ -85,14 +87,13 @@ protected:
     friend class FirewallControllerTest;
     std::string makeUidRules(IptablesTarget target, const char *name, bool isWhitelist,
                              const std::vector<int32_t>& uids);
-    static int (*execIptables)(IptablesTarget target, ...);
     static int (*execIptablesSilently)(IptablesTarget target, ...);
     static int (*execIptablesRestore)(IptablesTarget target, const std::string& commands);
+    static int (*execIptablesRestoreSilently)(IptablesTarget target, const std::string& commands);
 
 private:
     FirewallType mFirewallType;
-    int attachChain(const char*, const char*);
-    int detachChain(const char*, const char*);
+    void addFlushRules(IptablesTransaction* t);
     int createChain(const char*, const char*, FirewallType);
     FirewallType getFirewallType(ChildChain);
 };
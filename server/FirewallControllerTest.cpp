@@ -31,9 +31,9 @@
 class FirewallControllerTest : public IptablesBaseTest {
 protected:
     FirewallControllerTest() {
-        FirewallController::execIptables = fakeExecIptables;
         FirewallController::execIptablesSilently = fakeExecIptables;
         FirewallController::execIptablesRestore = fakeExecIptablesRestore;
+        FirewallController::execIptablesRestoreSilently = fakeExecIptablesRestore;
     }
     FirewallController mFw;
 
@@ -110,31 +110,84 @@ TEST_F(FirewallControllerTest, TestCreateBlacklistChain) {
 }
 
 TEST_F(FirewallControllerTest, TestSetStandbyRule) {
-    ExpectedIptablesCommands expected = {
-        { V4V6, "-D fw_standby -m owner --uid-owner 12345 -j DROP" }
-    };
+    std::string expected =
+            "*filter\n"
+            "-D fw_standby -m owner --uid-owner 12345 -j DROP\n"
+            "COMMIT\n";
     mFw.setUidRule(STANDBY, 12345, ALLOW);
-    expectIptablesCommands(expected);
+    expectIptablesRestoreCommands({ { V4, expected }, { V6, expected } });
 
-    expected = {
-        { V4V6, "-A fw_standby -m owner --uid-owner 12345 -j DROP" }
-    };
+    expected =
+            "*filter\n"
+            "-A fw_standby -m owner --uid-owner 12345 -j DROP\n"
+            "COMMIT\n";
     mFw.setUidRule(STANDBY, 12345, DENY);
-    expectIptablesCommands(expected);
+    expectIptablesRestoreCommands({ { V4, expected }, { V6, expected } });
 }
 
 TEST_F(FirewallControllerTest, TestSetDozeRule) {
-    ExpectedIptablesCommands expected = {
-        { V4V6, "-I fw_dozable -m owner --uid-owner 54321 -j RETURN" }
-    };
+    std::string expected =
+            "*filter\n"
+            "-I fw_dozable -m owner --uid-owner 54321 -j RETURN\n"
+            "COMMIT\n";
     mFw.setUidRule(DOZABLE, 54321, ALLOW);
-    expectIptablesCommands(expected);
+    expectIptablesRestoreCommands({ { V4, expected }, { V6, expected } });
 
-    expected = {
-        { V4V6, "-D fw_dozable -m owner --uid-owner 54321 -j RETURN" }
-    };
+    expected =
+            "*filter\n"
+            "-D fw_dozable -m owner --uid-owner 54321 -j RETURN\n"
+            "COMMIT\n";
     mFw.setUidRule(DOZABLE, 54321, DENY);
-    expectIptablesCommands(expected);
+    expectIptablesRestoreCommands({ { V4, expected }, { V6, expected } });
+}
+
+TEST_F(FirewallControllerTest, TestEnableFirewall) {
+    std::string expected =
+            "*filter\n"
+            "-F fw_INPUT\n"
+            "-F fw_OUTPUT\n"
+            "-F fw_FORWARD\n"
+            "-A fw_INPUT -j DROP\n"
+            "-A fw_OUTPUT -j REJECT\n"
+            "-A fw_FORWARD -j REJECT\n"
+            "COMMIT\n";
+    EXPECT_EQ(0, mFw.enableFirewall(WHITELIST));
+    expectIptablesRestoreCommands({ { V4, expected }, { V6, expected } });
+
+    expected =
+            "*filter\n"
+            "-I fw_INPUT -i wlan0 -j RETURN\n"
+            "-I fw_OUTPUT -o wlan0 -j RETURN\n"
+            "COMMIT\n";
+    EXPECT_EQ(0, mFw.setInterfaceRule("wlan0", ALLOW));
+    expectIptablesRestoreCommands({ { V4, expected }, { V6, expected } });
+
+    expected =
+            "*filter\n"
+            "-F fw_INPUT\n"
+            "-F fw_OUTPUT\n"
+            "-F fw_FORWARD\n"
+            "COMMIT\n";
+    EXPECT_EQ(0, mFw.disableFirewall());
+    expectIptablesRestoreCommands({ { V4, expected }, { V6, expected } });
+}
+
+TEST_F(FirewallControllerTest, TestEnableChildChains) {
+    std::string expected =
+            "*filter\n"
+            "-A fw_INPUT -j fw_dozable\n"
+            "-A fw_OUTPUT -j fw_dozable\n"
+            "COMMIT\n";
+    EXPECT_EQ(0, mFw.enableChildChains(DOZABLE, true));
+    expectIptablesRestoreCommands({ { V4, expected }, { V6, expected } });
+
+    expected =
+            "*filter\n"
+            "-D fw_INPUT -j fw_powersave\n"
+            "-D fw_OUTPUT -j fw_powersave\n"
+            "COMMIT\n";
+    EXPECT_EQ(0, mFw.enableChildChains(POWERSAVE, false));
+    expectIptablesRestoreCommands({ { V4, expected }, { V6, expected } });
 }
 
 TEST_F(FirewallControllerTest, TestReplaceWhitelistUidRule) {
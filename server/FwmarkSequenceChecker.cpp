@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "FwmarkSequenceChecker.h"
+
+#include <errno.h>
+
+#include "FwmarkCommand.h"
+
+FwmarkSequenceChecker::FwmarkSequenceChecker(size_t maxClients) : mMaxClients(maxClients) {
+}
+
+int FwmarkSequenceChecker::check(SocketClient* client, const FwmarkRequest& request,
+                                 time_t now) {
+    auto it = mClients.find(client);
+    const uint32_t lastSeq = (it == mClients.end()) ? 0 : it->second.lastSeq;
+    // Unsigned arithmetic, so an |ack| ahead of |seq| counts as a huge number of unread responses.
+    if (request.seq != lastSeq + 1 || request.seq - request.ack > FwmarkRequest::MAX_IN_FLIGHT) {
+        return -EPROTO;
+    }
+    if (it == mClients.end()) {
+        if (mClients.size() >= mMaxClients) {
+            return -EUSERS;
+        }
+        it = mClients.insert(std::make_pair(client, State())).first;
+    }
+    it->second.lastSeq = request.seq;
+    it->second.lastRequest = now;
+    return 0;
+}
+
+void FwmarkSequenceChecker::forget(SocketClient* client) {
+    mClients.erase(client);
+}
+
+std::vector<SocketClient*> FwmarkSequenceChecker::getIdleClients(time_t since) const {
+    std::vector<SocketClient*> idle;
+    for (const auto& client : mClients) {
+        if (client.second.lastRequest < since) {
+            idle.push_back(client.first);
+        }
+    }
+    return idle;
+}
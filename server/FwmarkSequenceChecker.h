@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_FWMARK_SEQUENCE_CHECKER_H
+#define NETD_SERVER_FWMARK_SEQUENCE_CHECKER_H
+
+#include <map>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+struct FwmarkRequest;
+class SocketClient;
+
+// Enforces the |seq| and |ack| rules of FwmarkRequest on each persistent connection to the fwmark
+// server, and limits the number of persistent connections.
+//
+// Not thread-safe. FwmarkServer only uses it from its listener thread.
+class FwmarkSequenceChecker {
+public:
+    explicit FwmarkSequenceChecker(size_t maxClients);
+
+    // Returns 0 if |request| is the next one that |client| may send, -EPROTO if its |seq| is not
+    // one more than that of the client's previous request, or its |ack| leaves more than
+    // FwmarkRequest::MAX_IN_FLIGHT responses unread, or -EUSERS if it would open a persistent
+    // connection past the limit. |now| is the time of the request, in seconds.
+    int check(SocketClient* client, const FwmarkRequest& request, time_t now);
+
+    // Forgets |client|, whose connection is being closed.
+    void forget(SocketClient* client);
+
+    // Returns the clients that haven't sent a request since |since|.
+    std::vector<SocketClient*> getIdleClients(time_t since) const;
+
+private:
+    struct State {
+        uint32_t lastSeq;  // The |seq| of the last request received.
+        time_t lastRequest;  // When it was received.
+    };
+
+    const size_t mMaxClients;
+    std::map<SocketClient*, State> mClients;
+};
+
+#endif  // NETD_SERVER_FWMARK_SEQUENCE_CHECKER_H
@@ -0,0 +1,110 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * FwmarkSequenceCheckerTest.cpp - unit tests for FwmarkSequenceChecker.cpp
+ */
+
+#include <errno.h>
+
+#include <gtest/gtest.h>
+
+#include <sysutils/SocketClient.h>
+
+#include "FwmarkCommand.h"
+#include "FwmarkSequenceChecker.h"
+
+class FwmarkSequenceCheckerTest : public ::testing::Test {
+protected:
+    FwmarkSequenceCheckerTest() :
+            mClient1(-1, false), mClient2(-1, false), mClient3(-1, false), mChecker(2) {}
+
+    int check(SocketClient* client, uint32_t seq, uint32_t ack, time_t now = 0) {
+        FwmarkRequest request = {};
+        request.version = FwmarkRequest::VERSION;
+        request.seq = seq;
+        request.ack = ack;
+        return mChecker.check(client, request, now);
+    }
+
+    // The checker only looks at the address, so these don't need real connections.
+    SocketClient mClient1;
+    SocketClient mClient2;
+    SocketClient mClient3;
+    FwmarkSequenceChecker mChecker;  // Takes at most two clients.
+};
+
+TEST_F(FwmarkSequenceCheckerTest, TestSeqMustIncreaseByOne) {
+    EXPECT_EQ(-EPROTO, check(&mClient1, 0, 0));
+    EXPECT_EQ(-EPROTO, check(&mClient1, 2, 0));
+    EXPECT_EQ(0, check(&mClient1, 1, 0));
+    EXPECT_EQ(0, check(&mClient1, 2, 1));
+    // Replayed and skipped requests.
+    EXPECT_EQ(-EPROTO, check(&mClient1, 2, 1));
+    EXPECT_EQ(-EPROTO, check(&mClient1, 4, 2));
+    EXPECT_EQ(0, check(&mClient1, 3, 2));
+}
+
+TEST_F(FwmarkSequenceCheckerTest, TestAckBoundsRequestsInFlight) {
+    const uint32_t max = FwmarkRequest::MAX_IN_FLIGHT;
+    for (uint32_t seq = 1; seq <= max; ++seq) {
+        EXPECT_EQ(0, check(&mClient1, seq, 0)) << seq;
+    }
+    // One more without reading a response would leave MAX_IN_FLIGHT + 1 unread.
+    EXPECT_EQ(-EPROTO, check(&mClient1, max + 1, 0));
+    EXPECT_EQ(0, check(&mClient1, max + 1, 1));
+
+    // A client can't claim to have read responses that haven't been sent yet.
+    EXPECT_EQ(0, check(&mClient2, 1, 0));
+    EXPECT_EQ(-EPROTO, check(&mClient2, 2, 3));
+}
+
+TEST_F(FwmarkSequenceCheckerTest, TestConnectionsAreIndependent) {
+    EXPECT_EQ(0, check(&mClient1, 1, 0));
+    EXPECT_EQ(0, check(&mClient1, 2, 1));
+    EXPECT_EQ(0, check(&mClient2, 1, 0));
+    EXPECT_EQ(-EPROTO, check(&mClient2, 3, 1));
+    EXPECT_EQ(0, check(&mClient1, 3, 2));
+
+    // A new connection that gets the address of a closed one starts over.
+    mChecker.forget(&mClient1);
+    EXPECT_EQ(-EPROTO, check(&mClient1, 4, 3));
+    EXPECT_EQ(0, check(&mClient1, 1, 0));
+}
+
+TEST_F(FwmarkSequenceCheckerTest, TestLimitsClients) {
+    EXPECT_EQ(0, check(&mClient1, 1, 0));
+    EXPECT_EQ(0, check(&mClient2, 1, 0));
+    EXPECT_EQ(-EUSERS, check(&mClient3, 1, 0));
+    // Refusing a client doesn't count it, and the others carry on.
+    EXPECT_EQ(-EUSERS, check(&mClient3, 1, 0));
+    EXPECT_EQ(0, check(&mClient1, 2, 1));
+
+    mChecker.forget(&mClient2);
+    EXPECT_EQ(0, check(&mClient3, 1, 0));
+}
+
+TEST_F(FwmarkSequenceCheckerTest, TestFindsIdleClients) {
+    EXPECT_EQ(0, check(&mClient1, 1, 0, 100));
+    EXPECT_EQ(0, check(&mClient2, 1, 0, 110));
+    EXPECT_TRUE(mChecker.getIdleClients(100).empty());
+    EXPECT_EQ(std::vector<SocketClient*>({ &mClient1 }), mChecker.getIdleClients(105));
+
+    // A request makes a client busy again.
+    EXPECT_EQ(0, check(&mClient1, 2, 1, 120));
+    EXPECT_EQ(std::vector<SocketClient*>({ &mClient2 }), mChecker.getIdleClients(115));
+
+    mChecker.forget(&mClient2);
+    EXPECT_TRUE(mChecker.getIdleClients(115).empty());
+}
@@ -22,35 +22,118 @@
 #include "resolv_netid.h"
 
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
+namespace {
+
+// Each persistent connection holds a file descriptor in netd, so there can only be so many.
+const size_t kMaxPersistentClients = 128;
+const time_t kIdleTimeoutSec = 60;
+const time_t kIdleCheckIntervalSec = 10;
+
+time_t monotonicSeconds() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+// Sends |response| without blocking, along with |fd| as ancillary data if it's not -1.
+bool sendResponse(SocketClient* client, const FwmarkResponse& response, int fd) {
+    iovec iov;
+    iov.iov_base = const_cast<FwmarkResponse*>(&response);
+    iov.iov_len = sizeof(response);
+
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+
+    union {
+        cmsghdr cmh;
+        char cmsg[CMSG_SPACE(sizeof(fd))];
+    } cmsgu;
+
+    if (fd != -1) {
+        memset(cmsgu.cmsg, 0, sizeof(cmsgu.cmsg));
+        message.msg_control = cmsgu.cmsg;
+        message.msg_controllen = sizeof(cmsgu.cmsg);
+
+        cmsghdr* const cmsgh = CMSG_FIRSTHDR(&message);
+        cmsgh->cmsg_len = CMSG_LEN(sizeof(fd));
+        cmsgh->cmsg_level = SOL_SOCKET;
+        cmsgh->cmsg_type = SCM_RIGHTS;
+        memcpy(CMSG_DATA(cmsgh), &fd, sizeof(fd));
+    }
+
+    return TEMP_FAILURE_RETRY(sendmsg(client->getSocket(), &message,
+                                      MSG_DONTWAIT | MSG_NOSIGNAL)) == sizeof(response);
+}
+
+}  // namespace
+
 FwmarkServer::FwmarkServer(NetworkController* networkController) :
-        SocketListener("fwmarkd", true), mNetworkController(networkController) {
+        SocketListener("fwmarkd", true), mNetworkController(networkController),
+        mSequenceChecker(kMaxPersistentClients), mNextIdleCheck(0) {
 }
 
 bool FwmarkServer::onDataAvailable(SocketClient* client) {
+    FwmarkRequest request;
     int socketFd = -1;
-    int error = processClient(client, &socketFd);
+    int responseFd = -1;
+    const time_t now = monotonicSeconds();
+    int error = receiveRequest(client, &request, &socketFd, now);
+    // Keep persistent connections open, unless the client broke the protocol or there are too
+    // many of them.
+    bool keepOpen = (request.version != 0 && error == 0);
+    if (error == 0) {
+        error = processClient(client, request.command, socketFd, &responseFd);
+    }
     if (socketFd >= 0) {
         close(socketFd);
     }
 
-    // Always send a response even if there were connection errors or read errors, so that we don't
-    // inadvertently cause the client to hang (which always waits for a response).
-    client->sendData(&error, sizeof(error));
+    if (request.version == 0) {
+        if (responseFd != -1) {
+            // There's no way to send a file descriptor with a bare int response.
+            error = -EOPNOTSUPP;
+        }
+
+        // Always send a response even if there were connection errors or read errors, so that we
+        // don't inadvertently cause the client to hang (which always waits for a response).
+        client->sendData(&error, sizeof(error));
 
-    // Always close the client connection (by returning false). This prevents a DoS attack where
-    // the client issues multiple commands on the same connection, never reading the responses,
-    // causing its receive buffer to fill up, and thus causing our client->sendData() to block.
-    return false;
+        // Always close the client connection (by returning false). This prevents a DoS attack
+        // where the client issues multiple commands on the same connection, never reading the
+        // responses, causing its receive buffer to fill up, and thus causing our
+        // client->sendData() to block.
+        keepOpen = false;
+    } else {
+        // Persistent connections are protected from the same attack by never blocking on the
+        // response. A client that keeps at most MAX_IN_FLIGHT responses outstanding, as the
+        // protocol requires, never fills its receive buffer. One that doesn't is disconnected.
+        // A refused request gets a |seq| of 0, which tells the client to send its commands on
+        // connections of their own instead.
+        FwmarkResponse response = { error == -EUSERS ? 0 : request.seq, error };
+        if (!sendResponse(client, response, responseFd)) {
+            keepOpen = false;
+        }
+    }
+
+    if (!keepOpen) {
+        mSequenceChecker.forget(client);
+    }
+    closeIdleClients(now);
+    return keepOpen;
 }
 
-int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
-    FwmarkCommand command;
+int FwmarkServer::receiveRequest(SocketClient* client, FwmarkRequest* request, int* socketFd,
+                                 time_t now) {
+    memset(request, 0, sizeof(*request));
 
     iovec iov;
-    iov.iov_base = &command;
-    iov.iov_len = sizeof(command);
+    iov.iov_base = request;
+    iov.iov_len = sizeof(*request);
 
     msghdr message;
     memset(&message, 0, sizeof(message));
@@ -68,13 +151,51 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
 
     int messageLength = TEMP_FAILURE_RETRY(recvmsg(client->getSocket(), &message, 0));
     if (messageLength <= 0) {
-        return -errno;
+        // Including when closeIdleClients() shut the connection down.
+        return messageLength == 0 ? -ECONNRESET : -errno;
+    }
+
+    cmsghdr* const cmsgh = CMSG_FIRSTHDR(&message);
+    if (cmsgh && cmsgh->cmsg_level == SOL_SOCKET && cmsgh->cmsg_type == SCM_RIGHTS &&
+        cmsgh->cmsg_len == CMSG_LEN(sizeof(*socketFd))) {
+        memcpy(socketFd, CMSG_DATA(cmsgh), sizeof(*socketFd));
+    }
+
+    if (messageLength == sizeof(request->command)) {
+        // A bare FwmarkCommand. It was read into the start of |request|, so move it into place.
+        FwmarkCommand command;
+        memcpy(&command, request, sizeof(command));
+        memset(request, 0, sizeof(*request));
+        request->command = command;
+        return 0;
     }
 
-    if (messageLength != sizeof(command)) {
+    if (messageLength != sizeof(*request) || request->version == 0) {
+        request->version = 0;
         return -EBADMSG;
     }
+    if (request->version != FwmarkRequest::VERSION) {
+        return -EPROTONOSUPPORT;
+    }
+
+    return mSequenceChecker.check(client, *request, now);
+}
+
+void FwmarkServer::closeIdleClients(time_t now) {
+    if (now < mNextIdleCheck) {
+        return;
+    }
+    mNextIdleCheck = now + kIdleCheckIntervalSec;
+    for (SocketClient* client : mSequenceChecker.getIdleClients(now - kIdleTimeoutSec)) {
+        // The listener thread then finds the connection closed, and releases the client. The
+        // client sees it closed too, and reconnects when it next has a command to send.
+        shutdown(client->getSocket(), SHUT_RDWR);
+        mSequenceChecker.forget(client);
+    }
+}
 
+int FwmarkServer::processClient(SocketClient* client, const FwmarkCommand& command,
+                                int socketFd, int* responseFd) {
     Permission permission = mNetworkController->getPermissionForUser(client->getUid());
 
     if (command.cmdId == FwmarkCommand::QUERY_USER_ACCESS) {
@@ -84,19 +205,18 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
         return mNetworkController->checkUserNetworkAccess(command.uid, command.netId);
     }
 
-    cmsghdr* const cmsgh = CMSG_FIRSTHDR(&message);
-    if (cmsgh && cmsgh->cmsg_level == SOL_SOCKET && cmsgh->cmsg_type == SCM_RIGHTS &&
-        cmsgh->cmsg_len == CMSG_LEN(sizeof(*socketFd))) {
-        memcpy(socketFd, CMSG_DATA(cmsgh), sizeof(*socketFd));
+    if (command.cmdId == FwmarkCommand::GET_GENERATION) {
+        *responseFd = mNetworkController->getGenerationFd();
+        return *responseFd == -1 ? -ENOENT : 0;
     }
 
-    if (*socketFd < 0) {
+    if (socketFd < 0) {
         return -EBADF;
     }
 
     Fwmark fwmark;
     socklen_t fwmarkLen = sizeof(fwmark.intValue);
-    if (getsockopt(*socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue, &fwmarkLen) == -1) {
+    if (getsockopt(socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue, &fwmarkLen) == -1) {
         return -errno;
     }
 
@@ -204,7 +324,7 @@ int FwmarkServer::processClient(SocketClient* client, int* socketFd) {
 
     fwmark.permission = permission;
 
-    if (setsockopt(*socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue,
+    if (setsockopt(socketFd, SOL_SOCKET, SO_MARK, &fwmark.intValue,
                    sizeof(fwmark.intValue)) == -1) {
         return -errno;
     }
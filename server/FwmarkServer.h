@@ -17,8 +17,14 @@
 #ifndef NETD_SERVER_FWMARK_SERVER_H
 #define NETD_SERVER_FWMARK_SERVER_H
 
+#include <time.h>
+
 #include "sysutils/SocketListener.h"
 
+#include "FwmarkSequenceChecker.h"
+
+struct FwmarkCommand;
+struct FwmarkRequest;
 class NetworkController;
 
 class FwmarkServer : public SocketListener {
@@ -29,10 +35,24 @@ private:
     // Overridden from SocketListener:
     bool onDataAvailable(SocketClient* client);
 
-    // Returns 0 on success or a negative errno value on failure.
-    int processClient(SocketClient* client, int* socketFd);
+    // Reads one command, either a bare FwmarkCommand or a FwmarkRequest on a persistent
+    // connection, into |request|. |request->version| is left at zero for a bare FwmarkCommand.
+    // Returns 0 on success or a negative errno value if the client sent something invalid.
+    int receiveRequest(SocketClient* client, FwmarkRequest* request, int* socketFd, time_t now);
+
+    // Closes the persistent connections that have been idle for too long, unless it did so
+    // recently.
+    void closeIdleClients(time_t now);
+
+    // Returns 0 on success or a negative errno value on failure. Sets |*responseFd| if the command
+    // returns a file descriptor to the client. It remains owned by the server.
+    int processClient(SocketClient* client, const FwmarkCommand& command, int socketFd,
+                      int* responseFd);
 
     NetworkController* const mNetworkController;
+
+    FwmarkSequenceChecker mSequenceChecker;
+    time_t mNextIdleCheck;
 };
 
 #endif  // NETD_SERVER_FWMARK_SERVER_H
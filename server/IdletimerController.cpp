@@ -111,6 +111,7 @@
 #include <logwrap/logwrap.h>
 
 #include "IdletimerController.h"
+#include "IptablesTransaction.h"
 #include "NetdConstants.h"
 
 const char* IdletimerController::LOCAL_RAW_PREROUTING = "idletimer_raw_PREROUTING";
@@ -121,61 +122,15 @@ IdletimerController::IdletimerController() {
 
 IdletimerController::~IdletimerController() {
 }
-/* return 0 or non-zero */
-int IdletimerController::runIpxtablesCmd(int argc, const char **argv) {
-    int resIpv4, resIpv6;
-
-    // Running for IPv4
-    argv[0] = IPTABLES_PATH;
-    resIpv4 = android_fork_execvp(argc, (char **)argv, NULL, false, false);
-
-    // Running for IPv6
-    argv[0] = IP6TABLES_PATH;
-    resIpv6 = android_fork_execvp(argc, (char **)argv, NULL, false, false);
-
-#if !LOG_NDEBUG
-    std::string full_cmd = argv[0];
-    argc--; argv++;
-    for (; argc; argc--, argv++) {
-        full_cmd += " ";
-        full_cmd += argv[0];
-    }
-    ALOGV("runCmd(%s) res_ipv4=%d, res_ipv6=%d", full_cmd.c_str(), resIpv4, resIpv6);
-#endif
-
-    return (resIpv4 == 0 && resIpv6 == 0) ? 0 : -1;
-}
-
 bool IdletimerController::setupIptablesHooks() {
     return true;
 }
 
 int IdletimerController::setDefaults() {
-  int res;
-  const char *cmd1[] = {
-      NULL, // To be filled inside runIpxtablesCmd
-      "-w",
-      "-t",
-      "raw",
-      "-F",
-      LOCAL_RAW_PREROUTING
-  };
-  res = runIpxtablesCmd(ARRAY_SIZE(cmd1), cmd1);
-
-  if (res)
-    return res;
-
-  const char *cmd2[] = {
-      NULL, // To be filled inside runIpxtablesCmd
-      "-w",
-      "-t",
-      "mangle",
-      "-F",
-      LOCAL_MANGLE_POSTROUTING
-  };
-  res = runIpxtablesCmd(ARRAY_SIZE(cmd2), cmd2);
-
-  return res;
+  IptablesTransaction t;
+  t.addf(V4V6, "raw", "-F %s", LOCAL_RAW_PREROUTING);
+  t.addf(V4V6, "mangle", "-F %s", LOCAL_MANGLE_POSTROUTING);
+  return t.commit();
 }
 
 int IdletimerController::enableIdletimerControl() {
@@ -191,60 +146,24 @@ int IdletimerController::disableIdletimerControl() {
 int IdletimerController::modifyInterfaceIdletimer(IptOp op, const char *iface,
                                                   uint32_t timeout,
                                                   const char *classLabel) {
-  int res;
-  char timeout_str[11]; //enough to store any 32-bit unsigned decimal
-
   if (!isIfaceName(iface)) {
     errno = ENOENT;
     return -1;
   }
 
-  snprintf(timeout_str, sizeof(timeout_str), "%u", timeout);
-
-  const char *cmd1[] = {
-      NULL, // To be filled inside runIpxtablesCmd
-      "-w",
-      "-t",
-      "raw",
-      (op == IptOpAdd) ? "-A" : "-D",
-      LOCAL_RAW_PREROUTING,
-      "-i",
-      iface,
-      "-j",
-      "IDLETIMER",
-      "--timeout",
-      timeout_str,
-      "--label",
-      classLabel,
-      "--send_nl_msg",
-      "1"
-  };
-  res = runIpxtablesCmd(ARRAY_SIZE(cmd1), cmd1);
-
-  if (res)
-    return res;
-
-  const char *cmd2[] = {
-      NULL, // To be filled inside runIpxtablesCmd
-      "-w",
-      "-t",
-      "mangle",
-      (op == IptOpAdd) ? "-A" : "-D",
-      LOCAL_MANGLE_POSTROUTING,
-      "-o",
-      iface,
-      "-j",
-      "IDLETIMER",
-      "--timeout",
-      timeout_str,
-      "--label",
-      classLabel,
-      "--send_nl_msg",
-      "1"
-  };
-  res = runIpxtablesCmd(ARRAY_SIZE(cmd2), cmd2);
+  // The label becomes part of an iptables-restore line, so it must be a single word.
+  if (!*classLabel || strpbrk(classLabel, " \t\r\n\"'")) {
+    errno = EINVAL;
+    return -1;
+  }
 
-  return res;
+  const char *opFlag = (op == IptOpAdd) ? "-A" : "-D";
+  IptablesTransaction t;
+  t.addf(V4V6, "raw", "%s %s -i %s -j IDLETIMER --timeout %u --label %s --send_nl_msg 1",
+         opFlag, LOCAL_RAW_PREROUTING, iface, timeout, classLabel);
+  t.addf(V4V6, "mangle", "%s %s -o %s -j IDLETIMER --timeout %u --label %s --send_nl_msg 1",
+         opFlag, LOCAL_MANGLE_POSTROUTING, iface, timeout, classLabel);
+  return t.commit();
 }
 
 int IdletimerController::addInterfaceIdletimer(const char *iface,
@@ -0,0 +1,402 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <chrono>
+
+#define LOG_TAG "IptablesRestoreController"
+#include <cutils/log.h>
+#include <logwrap/logwrap.h>
+
+#include "IptablesRestoreController.h"
+
+namespace {
+
+const char PING[] = "#PING\n";
+const size_t PING_LEN = sizeof(PING) - 1;
+
+const char * const IPTABLES_RESTORE_PATH = "/system/bin/iptables-restore";
+const char * const IP6TABLES_RESTORE_PATH = "/system/bin/ip6tables-restore";
+
+// Arguments that make iptables print something instead of changing rules. These can't be run in
+// iptables-restore, because their output would be mixed with our acknowledgements.
+const char * const NON_RESTORABLE_ARGS[] = {
+    "-L", "--list", "-S", "--list-rules", "-C", "--check", "-h", "--help", "-V", "--version",
+};
+
+bool isRestorable(const char* arg) {
+    for (size_t i = 0; i < ARRAY_SIZE(NON_RESTORABLE_ARGS); i++) {
+        if (!strcmp(arg, NON_RESTORABLE_ARGS[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// iptables-restore splits lines on whitespace, but keeps double-quoted strings together.
+void appendQuotedArg(std::string* line, const char* arg) {
+    if (!line->empty()) {
+        *line += ' ';
+    }
+    if (*arg && !strpbrk(arg, " \t\"")) {
+        *line += arg;
+        return;
+    }
+    *line += '"';
+    for (const char* c = arg; *c; c++) {
+        if (*c == '"') {
+            *line += '\\';
+        }
+        *line += *c;
+    }
+    *line += '"';
+}
+
+bool targetIncludes(IptablesTarget target, int family) {
+    return target == V4V6 || target == family;
+}
+
+}  // namespace
+
+const int IptablesRestoreController::kAckTimeoutMs = 5000;
+const int IptablesRestoreController::kProbeTimeoutMs = 1000;
+
+IptablesRestoreController::IptablesProcess::~IptablesProcess() {
+    close(stdIn);
+    close(stdOut);
+    close(stdErr);
+}
+
+IptablesRestoreController::IptablesRestoreController()
+        : mIptablesRestorePath(IPTABLES_RESTORE_PATH),
+          mIp6tablesRestorePath(IP6TABLES_RESTORE_PATH) {
+}
+
+IptablesRestoreController::~IptablesRestoreController() {
+    for (Family& family : mFamilies) {
+        stopProcess(&family);
+    }
+}
+
+const char* IptablesRestoreController::pathFor(IptablesTarget target) const {
+    return (target == V4) ? mIptablesRestorePath : mIp6tablesRestorePath;
+}
+
+std::unique_ptr<IptablesRestoreController::IptablesProcess>
+IptablesRestoreController::forkAndExec(const char* path) {
+    int stdInPipe[2], stdOutPipe[2], stdErrPipe[2];
+
+    if (pipe2(stdInPipe, O_CLOEXEC) == -1) {
+        ALOGE("pipe2() failed: %s", strerror(errno));
+        return nullptr;
+    }
+    if (pipe2(stdOutPipe, O_CLOEXEC) == -1) {
+        ALOGE("pipe2() failed: %s", strerror(errno));
+        close(stdInPipe[0]);
+        close(stdInPipe[1]);
+        return nullptr;
+    }
+    if (pipe2(stdErrPipe, O_CLOEXEC) == -1) {
+        ALOGE("pipe2() failed: %s", strerror(errno));
+        close(stdInPipe[0]);
+        close(stdInPipe[1]);
+        close(stdOutPipe[0]);
+        close(stdOutPipe[1]);
+        return nullptr;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // dup2() clears O_CLOEXEC on the new descriptors, so the child keeps only these.
+        if (dup2(stdInPipe[0], 0) == -1 ||
+            dup2(stdOutPipe[1], 1) == -1 ||
+            dup2(stdErrPipe[1], 2) == -1) {
+            _exit(1);
+        }
+        execl(path, path,
+              "--noflush",  // Don't flush the whole table.
+              "-w",         // Wait instead of failing if the lock is held.
+              "-v",         // Echo comments, which we use for acknowledgements.
+              (char *) nullptr);
+        _exit(1);
+    }
+
+    close(stdInPipe[0]);
+    close(stdOutPipe[1]);
+    close(stdErrPipe[1]);
+
+    if (pid == -1) {
+        ALOGE("fork() failed: %s", strerror(errno));
+        close(stdInPipe[1]);
+        close(stdOutPipe[0]);
+        close(stdErrPipe[0]);
+        return nullptr;
+    }
+
+    return std::unique_ptr<IptablesProcess>(
+            new IptablesProcess(pid, stdInPipe[1], stdOutPipe[0], stdErrPipe[0]));
+}
+
+void IptablesRestoreController::stopProcess(Family* family) {
+    if (!family->process) {
+        return;
+    }
+    pid_t pid = family->process->pid;
+    family->process.reset();  // Closes stdin, which makes an idle process exit.
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+    if (family->state == RUNNING) {
+        family->state = NOT_STARTED;
+    }
+}
+
+bool IptablesRestoreController::ensureRunning(Family* family, const char* path) {
+    if (family->state == UNSUPPORTED) {
+        return false;
+    }
+
+    if (family->process) {
+        // Reap the process if it died since the last transaction, e.g., if it was killed.
+        int status = 0;
+        if (waitpid(family->process->pid, &status, WNOHANG) == 0) {
+            return true;
+        }
+        ALOGW("%s exited unexpectedly with status %d", path, status);
+        family->process.reset();
+        family->state = NOT_STARTED;
+    }
+
+    family->process = forkAndExec(path);
+    if (!family->process) {
+        return false;
+    }
+    family->state = RUNNING;
+
+    if (!sendCommands(family, PING) || waitForAck(family, kProbeTimeoutMs, true) != 0) {
+        ALOGW("%s does not acknowledge commands, falling back to one process per call", path);
+        stopProcess(family);
+        family->state = UNSUPPORTED;
+        return false;
+    }
+
+    return true;
+}
+
+bool IptablesRestoreController::sendCommands(Family* family, const std::string& commands) {
+    const char* data = commands.data();
+    size_t remaining = commands.size();
+    while (remaining > 0) {
+        ssize_t written = TEMP_FAILURE_RETRY(write(family->process->stdIn, data, remaining));
+        if (written == -1) {
+            // EPIPE if the process died. SIGPIPE is blocked in netd.
+            ALOGE("Failed to write to iptables-restore: %s", strerror(errno));
+            return false;
+        }
+        data += written;
+        remaining -= written;
+    }
+    return true;
+}
+
+int IptablesRestoreController::waitForAck(Family* family, int timeoutMs, bool silent) {
+    IptablesProcess* process = family->process.get();
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    bool exited = false;
+    char buf[1024];
+
+    while (!exited) {
+        size_t pingPos = process->outputBuf.find(PING);
+        if (pingPos != std::string::npos) {
+            process->outputBuf.erase(0, pingPos + PING_LEN);
+            process->errorBuf.clear();
+            return 0;
+        }
+
+        int remainingMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now()).count();
+        if (remainingMs <= 0) {
+            if (!silent) {
+                ALOGE("Timed out after %d ms waiting for iptables-restore pid %d", timeoutMs,
+                      process->pid);
+            }
+            stopProcess(family);
+            return -1;
+        }
+
+        pollfd fds[] = {
+            { process->stdOut, POLLIN, 0 },
+            { process->stdErr, POLLIN, 0 },
+        };
+        if (TEMP_FAILURE_RETRY(poll(fds, ARRAY_SIZE(fds), remainingMs)) == -1) {
+            ALOGE("poll() failed: %s", strerror(errno));
+            stopProcess(family);
+            return -1;
+        }
+
+        // EOF on either pipe means the process exited, e.g., because a line failed, or closed
+        // the pipe. Either way it's a failure, and a pipe that hung up stays readable, so polling
+        // it again would spin until the deadline.
+        if (fds[1].revents) {
+            ssize_t bytes = TEMP_FAILURE_RETRY(read(process->stdErr, buf, sizeof(buf)));
+            if (bytes > 0) {
+                process->errorBuf.append(buf, bytes);
+            } else {
+                exited = true;
+            }
+        }
+        if (fds[0].revents) {
+            ssize_t bytes = TEMP_FAILURE_RETRY(read(process->stdOut, buf, sizeof(buf)));
+            if (bytes > 0) {
+                process->outputBuf.append(buf, bytes);
+            } else {
+                exited = true;
+            }
+        }
+    }
+
+    // Make sure the process is gone, so that reading its stderr until EOF can't block. What it
+    // wrote before exiting is still in the pipe.
+    kill(process->pid, SIGKILL);
+    waitpid(process->pid, nullptr, 0);
+    ssize_t bytes;
+    while ((bytes = TEMP_FAILURE_RETRY(read(process->stdErr, buf, sizeof(buf)))) > 0) {
+        process->errorBuf.append(buf, bytes);
+    }
+    if (!silent) {
+        ALOGE("iptables-restore pid %d failed: %s", process->pid, process->errorBuf.c_str());
+    }
+    family->process.reset();
+    family->state = NOT_STARTED;
+    return -1;
+}
+
+int IptablesRestoreController::executeOnce(const char* path, const std::string& commands,
+                                           bool silent) {
+    const char *argv[] = {
+        path,
+        "--noflush",  // Don't flush the whole table.
+        "-w",         // Wait instead of failing if the lock is held.
+    };
+    AndroidForkExecvpOption opt[1] = {
+        {
+            .opt_type = FORK_EXECVP_OPTION_INPUT,
+            .opt_input.input = reinterpret_cast<const uint8_t*>(commands.c_str()),
+            .opt_input.input_len = commands.size(),
+        }
+    };
+
+    int status = 0;
+    int res = android_fork_execvp_ext(
+            ARRAY_SIZE(argv), (char**)argv, &status, false /* ignore_int_quit */, LOG_NONE,
+            false /* abbreviated */, NULL /* file_path */, opt, ARRAY_SIZE(opt));
+    if (res || status) {
+        if (!silent) {
+            ALOGE("%s failed with res=%d, status=%d", argv[0], res, status);
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+int IptablesRestoreController::execute(IptablesTarget target, const std::string& commands,
+                                       bool silent) {
+    std::lock_guard<std::mutex> lock(mLock);
+
+    // Callers terminate one-shot input with an EOT. In a stream it would corrupt the next line.
+    std::string transaction = commands;
+    while (!transaction.empty() && transaction.back() == '\x04') {
+        transaction.pop_back();
+    }
+    if (!transaction.empty() && transaction.back() != '\n') {
+        transaction += '\n';
+    }
+    transaction += PING;
+
+    int res = 0;
+    bool sent[ARRAY_SIZE(mFamilies)] = { false, false };
+
+    // Hand the transaction to both processes before waiting, so IPv4 and IPv6 run in parallel.
+    for (int v : { V4, V6 }) {
+        if (!targetIncludes(target, v)) continue;
+        Family* family = &mFamilies[v];
+        const char* path = pathFor(static_cast<IptablesTarget>(v));
+        if (!ensureRunning(family, path)) {
+            if (family->state == UNSUPPORTED) {
+                res |= executeOnce(path, commands, silent);
+            } else {
+                res = -1;
+            }
+            continue;
+        }
+        if (!sendCommands(family, transaction)) {
+            stopProcess(family);
+            res = -1;
+            continue;
+        }
+        sent[v] = true;
+    }
+
+    for (int v : { V4, V6 }) {
+        if (sent[v]) {
+            res |= waitForAck(&mFamilies[v], kAckTimeoutMs, silent);
+        }
+    }
+
+    return res;
+}
+
+bool IptablesRestoreController::commandToRestoreFormat(const std::vector<const char*>& args,
+                                                       std::string* out) {
+    const char* table = "filter";
+    std::string line;
+
+    for (size_t i = 0; i < args.size(); i++) {
+        const char* arg = args[i];
+        if (!strcmp(arg, "-w") || !strcmp(arg, "--wait")) {
+            continue;
+        }
+        if (!strcmp(arg, "-t") || !strcmp(arg, "--table")) {
+            if (++i == args.size()) {
+                return false;
+            }
+            table = args[i];
+            continue;
+        }
+        if (!isRestorable(arg)) {
+            return false;
+        }
+        appendQuotedArg(&line, arg);
+    }
+
+    if (line.empty()) {
+        return false;
+    }
+
+    *out = "*";
+    *out += table;
+    *out += "\n";
+    *out += line;
+    *out += "\nCOMMIT\n";
+    return true;
+}
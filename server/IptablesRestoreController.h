@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPTABLES_RESTORE_CONTROLLER_H
+#define _IPTABLES_RESTORE_CONTROLLER_H
+
+#include <sys/types.h>
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "NetdConstants.h"
+
+/*
+ * Keeps one long-lived iptables-restore and one ip6tables-restore process running and feeds them
+ * COMMIT-delimited transactions over a pipe, instead of forking a new iptables binary for every
+ * rule.
+ *
+ * Acknowledgements: the processes run with --verbose, in which mode iptables-restore echoes every
+ * comment line back on stdout once all preceding lines have been processed. After each
+ * transaction we send a "#PING" comment and wait for it to come back. If a line fails,
+ * iptables-restore prints an error on stderr and exits; we reap it, report the failure, and start
+ * a new process on the next call.
+ *
+ * This requires an iptables-restore that flushes stdout after echoing a comment. Each new process
+ * is probed with a ping before use; if the binary does not answer, the controller permanently
+ * falls back to running one iptables-restore per call, exactly as before.
+ */
+class IptablesRestoreController {
+public:
+    IptablesRestoreController();
+    virtual ~IptablesRestoreController();
+
+    // Applies |commands|, which must be in iptables-restore format with every table terminated by
+    // COMMIT, to the IPv4 and/or IPv6 tables. Returns 0 on success. If |silent| is true, failures
+    // are not logged.
+    int execute(IptablesTarget target, const std::string& commands, bool silent);
+
+    // Translates an iptables argument list without the binary name (e.g., { "-t", "nat", "-A",
+    // "foo", "-j", "bar" }) into a one-rule iptables-restore transaction. Returns false if the
+    // command cannot be expressed in iptables-restore format (e.g., it lists rules).
+    static bool commandToRestoreFormat(const std::vector<const char*>& args, std::string* out);
+
+    // How long to wait for a transaction to be acknowledged before giving up on the process.
+    static const int kAckTimeoutMs;
+    // How long a newly started process has to answer the initial ping.
+    static const int kProbeTimeoutMs;
+
+protected:
+    friend class IptablesRestoreControllerTest;
+
+    struct IptablesProcess {
+        IptablesProcess(pid_t pid, int stdIn, int stdOut, int stdErr)
+            : pid(pid), stdIn(stdIn), stdOut(stdOut), stdErr(stdErr) {}
+        ~IptablesProcess();
+
+        const pid_t pid;
+        const int stdIn;
+        const int stdOut;
+        const int stdErr;
+        std::string outputBuf;
+        std::string errorBuf;
+    };
+
+    enum ProcessState { NOT_STARTED, RUNNING, UNSUPPORTED };
+
+    // Binaries to run. Overridden in tests.
+    const char* mIptablesRestorePath;
+    const char* mIp6tablesRestorePath;
+
+private:
+    struct Family {
+        Family() : state(NOT_STARTED) {}
+        ProcessState state;
+        std::unique_ptr<IptablesProcess> process;
+    };
+
+    std::unique_ptr<IptablesProcess> forkAndExec(const char* path);
+    bool ensureRunning(Family* family, const char* path);
+    bool sendCommands(Family* family, const std::string& commands);
+    int waitForAck(Family* family, int timeoutMs, bool silent);
+    void stopProcess(Family* family);
+    int executeOnce(const char* path, const std::string& commands, bool silent);
+    const char* pathFor(IptablesTarget target) const;
+
+    std::mutex mLock;
+    Family mFamilies[2];  // Indexed by V4 and V6.
+};
+
+#endif  // _IPTABLES_RESTORE_CONTROLLER_H
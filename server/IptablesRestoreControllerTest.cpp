@@ -0,0 +1,127 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * IptablesRestoreControllerTest.cpp - unit tests for IptablesRestoreController.cpp
+ */
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include <android-base/file.h>
+#include <android-base/stringprintf.h>
+
+#include "IptablesRestoreController.h"
+#include "NetdConstants.h"
+
+using android::base::StringPrintf;
+
+class IptablesRestoreControllerTest : public ::testing::Test {
+protected:
+    IptablesRestoreController mCtrl;
+
+    std::string toRestoreFormat(const std::vector<const char*>& args) {
+        std::string out;
+        if (!IptablesRestoreController::commandToRestoreFormat(args, &out)) {
+            return "<invalid>";
+        }
+        return out;
+    }
+
+    pid_t getPid(IptablesTarget target) {
+        const auto& process = mCtrl.mFamilies[target].process;
+        return process ? process->pid : 0;
+    }
+
+    void setRestorePath(const char* path) {
+        mCtrl.mIptablesRestorePath = path;
+        mCtrl.mIp6tablesRestorePath = path;
+    }
+};
+
+TEST_F(IptablesRestoreControllerTest, TestCommandToRestoreFormat) {
+    EXPECT_EQ("*filter\n-A fw_INPUT -j DROP\nCOMMIT\n",
+              toRestoreFormat({ "-A", "fw_INPUT", "-j", "DROP" }));
+    EXPECT_EQ("*nat\n-A natctrl_nat_POSTROUTING -o rmnet0 -j MASQUERADE\nCOMMIT\n",
+              toRestoreFormat({ "-w", "-t", "nat", "-A", "natctrl_nat_POSTROUTING",
+                                "-o", "rmnet0", "-j", "MASQUERADE" }));
+    EXPECT_EQ("*filter\n-A foo -m u32 --u32 \"0>>22&0x3C@ 12>>26&0x3C@ 0&0x0=0x0\" -j bar\n"
+              "COMMIT\n",
+              toRestoreFormat({ "-A", "foo", "-m", "u32", "--u32",
+                                "0>>22&0x3C@ 12>>26&0x3C@ 0&0x0=0x0", "-j", "bar" }));
+    EXPECT_EQ("*filter\n-A foo -m comment --comment \"say \\\"hi\\\"\"\nCOMMIT\n",
+              toRestoreFormat({ "-A", "foo", "-m", "comment", "--comment", "say \"hi\"" }));
+
+    EXPECT_EQ("<invalid>", toRestoreFormat({}));
+    EXPECT_EQ("<invalid>", toRestoreFormat({ "-w" }));
+    EXPECT_EQ("<invalid>", toRestoreFormat({ "-t", "nat" }));
+    EXPECT_EQ("<invalid>", toRestoreFormat({ "-A", "foo", "-t" }));
+    EXPECT_EQ("<invalid>", toRestoreFormat({ "-n", "-v", "-x", "-L", "natctrl_tether_counters" }));
+    EXPECT_EQ("<invalid>", toRestoreFormat({ "-S" }));
+    EXPECT_EQ("<invalid>", toRestoreFormat({ "-C", "foo", "-j", "RETURN" }));
+}
+
+TEST_F(IptablesRestoreControllerTest, TestExecute) {
+    const std::string chain = StringPrintf("netd_unit_test_%u", getpid());
+    const std::string create = StringPrintf("*filter\n:%s -\nCOMMIT\n", chain.c_str());
+    const std::string destroy = StringPrintf("*filter\n:%s -\n-X %s\nCOMMIT\n",
+                                             chain.c_str(), chain.c_str());
+
+    EXPECT_EQ(0, mCtrl.execute(V4V6, create, false));
+
+    // The processes stay around between transactions.
+    pid_t pid4 = getPid(V4);
+    pid_t pid6 = getPid(V6);
+    EXPECT_EQ(0, mCtrl.execute(V4V6, StringPrintf("*filter\n-A %s -j RETURN\nCOMMIT\n\x04",
+                                                  chain.c_str()), false));
+    EXPECT_EQ(pid4, getPid(V4));
+    EXPECT_EQ(pid6, getPid(V6));
+
+    // A failing line fails the whole transaction, and a new process picks up the next one.
+    EXPECT_NE(0, mCtrl.execute(V4, StringPrintf("*filter\n-A %s -j nonexistent_chain\nCOMMIT\n",
+                                                chain.c_str()), true));
+    EXPECT_EQ(0, mCtrl.execute(V4V6, destroy, false));
+    EXPECT_EQ(pid6, getPid(V6));
+
+    // Deleting a chain that no longer exists fails.
+    EXPECT_NE(0, mCtrl.execute(V4V6, StringPrintf("*filter\n-X %s\nCOMMIT\n", chain.c_str()),
+                               true));
+}
+
+TEST_F(IptablesRestoreControllerTest, TestProcessClosesStderr) {
+    // A process that closes stderr but keeps stdout open never answers. Its stderr then polls
+    // readable with nothing to read, which must fail the probe at once instead of spinning until
+    // the timeout.
+    const std::string path = StringPrintf("/data/local/tmp/fake_iptables_restore_%u", getpid());
+    // When run once per call instead, it fails as soon as its input ends.
+    ASSERT_TRUE(android::base::WriteStringToFile(
+            "#!/system/bin/sh\nexec 2>&-\ncat > /dev/null\nexit 1\n", path));
+    ASSERT_EQ(0, chmod(path.c_str(), 0700));
+    setRestorePath(path.c_str());
+
+    const auto start = std::chrono::steady_clock::now();
+    EXPECT_NE(0, mCtrl.execute(V4, "*filter\nCOMMIT\n", true));
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    EXPECT_GT(IptablesRestoreController::kProbeTimeoutMs / 2, elapsed);
+    EXPECT_EQ(0, getPid(V4));
+
+    unlink(path.c_str());
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <ctype.h>
+#include <stdarg.h>
+
+#define LOG_TAG "IptablesTransaction"
+#include <cutils/log.h>
+
+#include <android-base/stringprintf.h>
+
+#include "IptablesTransaction.h"
+
+using android::base::StringAppendV;
+
+namespace {
+
+const char* familyName(IptablesTarget target) {
+    return target == V4 ? "IPv4" : "IPv6";
+}
+
+std::string makePayload(const std::string& table, const std::vector<std::string>& rules) {
+    std::string payload = "*" + table + "\n";
+    for (const auto& rule : rules) {
+        payload += rule;
+        payload += "\n";
+    }
+    payload += "COMMIT\n";
+    return payload;
+}
+
+bool isNumber(const std::string& s) {
+    if (s.empty()) return false;
+    for (char c : s) {
+        if (!isdigit(c)) return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+IptablesTransaction::IptablesTransaction(RestoreFunction restoreFunction,
+                                         RestoreFunction quietRestoreFunction)
+    : mRestoreFunction(restoreFunction),
+      mQuietRestoreFunction(quietRestoreFunction ? quietRestoreFunction : restoreFunction) {
+}
+
+IptablesTransaction::Table* IptablesTransaction::getTable(const char* name) {
+    for (auto& table : mTables) {
+        if (table.name == name) return &table;
+    }
+    mTables.emplace_back(name);
+    return &mTables.back();
+}
+
+void IptablesTransaction::add(IptablesTarget target, const char* table, const std::string& rule) {
+    Table* t = getTable(table);
+    if (target == V4 || target == V4V6) t->rules[V4].push_back(rule);
+    if (target == V6 || target == V4V6) t->rules[V6].push_back(rule);
+}
+
+void IptablesTransaction::addf(IptablesTarget target, const char* table, const char* fmt, ...) {
+    std::string rule;
+    va_list ap;
+    va_start(ap, fmt);
+    StringAppendV(&rule, fmt, ap);
+    va_end(ap);
+    add(target, table, rule);
+}
+
+std::string IptablesTransaction::inverseRule(const std::string& rule) {
+    size_t opEnd = rule.find(' ');
+    if (opEnd == std::string::npos) return "";
+    const std::string op = rule.substr(0, opEnd);
+
+    size_t chainStart = rule.find_first_not_of(' ', opEnd);
+    if (chainStart == std::string::npos) return "";
+    size_t chainEnd = rule.find(' ', chainStart);
+    const std::string chain = rule.substr(chainStart, chainEnd - chainStart);
+
+    if (op == "-N" || op == "--new-chain") {
+        return "-X " + chain;
+    }
+
+    if (op != "-A" && op != "--append" && op != "-I" && op != "--insert") return "";
+    if (chainEnd == std::string::npos) return "";
+    size_t specStart = rule.find_first_not_of(' ', chainEnd);
+    if (specStart == std::string::npos) return "";
+
+    // Inserts may have a rule number, which must not be passed to -D.
+    if (op == "-I" || op == "--insert") {
+        size_t numEnd = rule.find(' ', specStart);
+        if (isNumber(rule.substr(specStart, numEnd - specStart))) {
+            if (numEnd == std::string::npos) return "";
+            specStart = rule.find_first_not_of(' ', numEnd);
+            if (specStart == std::string::npos) return "";
+        }
+    }
+
+    return "-D " + chain + " " + rule.substr(specStart);
+}
+
+void IptablesTransaction::rollback(
+        const std::vector<std::pair<IptablesTarget, const Table*>>& committed) {
+    for (auto it = committed.rbegin(); it != committed.rend(); ++it) {
+        const IptablesTarget target = it->first;
+        const Table* table = it->second;
+        const auto& rules = table->rules[target];
+
+        std::vector<std::string> undo;
+        for (auto rule = rules.rbegin(); rule != rules.rend(); ++rule) {
+            std::string inverse = inverseRule(*rule);
+            if (!inverse.empty()) {
+                undo.push_back(inverse);
+            } else {
+                ALOGW("Cannot roll back \"%s\" in %s %s table", rule->c_str(),
+                      familyName(target), table->name.c_str());
+            }
+        }
+        if (undo.empty() || mRestoreFunction(target, makePayload(table->name, undo)) == 0) {
+            continue;
+        }
+
+        // Something else changed the rules in the meantime. Undo as much as we still can.
+        ALOGE("Failed to roll back %s %s table, undoing rules one by one",
+              familyName(target), table->name.c_str());
+        for (const auto& inverse : undo) {
+            mRestoreFunction(target, makePayload(table->name, { inverse }));
+        }
+    }
+}
+
+int IptablesTransaction::apply(bool bestEffort) {
+    std::vector<Table> tables;
+    tables.swap(mTables);
+
+    const RestoreFunction restore = bestEffort ? mQuietRestoreFunction : mRestoreFunction;
+    int ret = 0;
+    std::vector<std::pair<IptablesTarget, const Table*>> committed;
+    for (const auto& table : tables) {
+        for (IptablesTarget target : { V4, V6 }) {
+            const auto& rules = table.rules[target];
+            if (rules.empty()) continue;
+            int res = restore(target, makePayload(table.name, rules));
+            if (res == 0) {
+                committed.push_back(std::make_pair(target, &table));
+                continue;
+            }
+
+            if (!bestEffort) {
+                ALOGE("Failed to apply %zu rules to %s %s table",
+                      rules.size(), familyName(target), table.name.c_str());
+                rollback(committed);
+                return res;
+            }
+            // Typically rules that were already deleted, which is what the caller wants anyway.
+            for (const auto& rule : rules) {
+                if (restore(target, makePayload(table.name, { rule }))) {
+                    ALOGD("Ignoring failed \"%s\" in %s %s table", rule.c_str(),
+                          familyName(target), table.name.c_str());
+                }
+            }
+            ret = res;
+        }
+    }
+    return ret;
+}
+
+int IptablesTransaction::commit() {
+    return apply(false);
+}
+
+int IptablesTransaction::commitBestEffort() {
+    return apply(true);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _IPTABLES_TRANSACTION_H
+#define _IPTABLES_TRANSACTION_H
+
+#include <string>
+#include <vector>
+
+#include "NetdConstants.h"
+
+/*
+ * Collects iptables rules from a controller and applies them with one iptables-restore payload
+ * per table and IP family, instead of one iptables invocation per rule.
+ *
+ * Rules are written in iptables-restore syntax without the table, e.g.:
+ *
+ *   IptablesTransaction t(execIptablesRestore);
+ *   t.add(V4V6, "filter", "-A fw_INPUT -i wlan0 -j RETURN");
+ *   t.add(V4, "nat", "-A natctrl_nat_POSTROUTING -o rmnet0 -j MASQUERADE");
+ *   int res = t.commit();
+ *
+ * Each payload is committed atomically by the kernel. If one fails, the appends, inserts and
+ * chain creations (-A, -I, -N) that earlier payloads of the same transaction committed are undone.
+ * Nothing else can be inverted: deletes, replaces, flushes and chain declarations (-D, -R, -F, -X,
+ * ":chain -", which flushes an existing chain) stay applied. So a transaction is only
+ * all-or-nothing if it fits in one payload, or if its earlier payloads only add rules.
+ */
+class IptablesTransaction {
+public:
+    typedef int (*RestoreFunction)(IptablesTarget target, const std::string& commands);
+
+    // commitBestEffort() runs quietRestoreFunction, if set, since its failures are expected.
+    explicit IptablesTransaction(RestoreFunction restoreFunction = execIptablesRestore,
+                                 RestoreFunction quietRestoreFunction = nullptr);
+
+    // Appends |rule| to the rules for |table| in the IPv4 and/or IPv6 tables.
+    void add(IptablesTarget target, const char* table, const std::string& rule);
+    // printf-style version of add().
+    void addf(IptablesTarget target, const char* table, const char* fmt, ...)
+            __attribute__((__format__(printf, 4, 5)));
+
+    bool empty() const { return mTables.empty(); }
+
+    // Applies all rules added so far, and clears the transaction. Returns 0 on success.
+    int commit();
+
+    // Like commit(), but does not roll anything back. If a table fails, its rules are applied one
+    // at a time instead, and the ones that fail are only logged at debug level. Meant for removing
+    // rules some of which may already be gone. Returns 0 if every table applied cleanly.
+    int commitBestEffort();
+
+    // Returns the rule that undoes |rule|, or an empty string if |rule| can't be undone.
+    static std::string inverseRule(const std::string& rule);
+
+private:
+    struct Table {
+        explicit Table(const char* name) : name(name) {}
+        std::string name;
+        std::vector<std::string> rules[2];  // Indexed by V4 and V6.
+    };
+
+    Table* getTable(const char* name);
+    int apply(bool bestEffort);
+    void rollback(const std::vector<std::pair<IptablesTarget, const Table*>>& committed);
+
+    const RestoreFunction mRestoreFunction;
+    const RestoreFunction mQuietRestoreFunction;
+    std::vector<Table> mTables;  // In order of first use.
+};
+
+#endif  // _IPTABLES_TRANSACTION_H
@@ -0,0 +1,183 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * IptablesTransactionTest.cpp - unit tests for IptablesTransaction.cpp
+ */
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "IptablesBaseTest.h"
+#include "IptablesTransaction.h"
+
+class IptablesTransactionTest : public IptablesBaseTest {
+protected:
+    IptablesTransactionTest() {
+        sCalls = 0;
+        sFailingCalls.clear();
+    }
+
+    // Indices of the restore calls that fakeFailingRestore fails.
+    static std::set<int> sFailingCalls;
+    static int sCalls;
+
+    static int fakeFailingRestore(IptablesTarget target, const std::string& commands) {
+        fakeExecIptablesRestore(target, commands);
+        return sFailingCalls.count(sCalls++) ? -1 : 0;
+    }
+};
+
+std::set<int> IptablesTransactionTest::sFailingCalls = {};
+int IptablesTransactionTest::sCalls = 0;
+
+TEST_F(IptablesTransactionTest, TestEmpty) {
+    IptablesTransaction t(fakeExecIptablesRestore);
+    EXPECT_TRUE(t.empty());
+    EXPECT_EQ(0, t.commit());
+    expectIptablesRestoreCommands(ExpectedIptablesCommands{});
+}
+
+TEST_F(IptablesTransactionTest, TestOnePayloadPerTableAndFamily) {
+    IptablesTransaction t(fakeExecIptablesRestore);
+    t.add(V4V6, "filter", ":natctrl_FORWARD -");
+    t.add(V4, "nat", "-A natctrl_nat_POSTROUTING -o rmnet0 -j MASQUERADE");
+    t.addf(V4V6, "filter", "-A natctrl_FORWARD -i %s -j DROP", "wlan0");
+    t.add(V6, "raw", "-A natctrl_raw_PREROUTING -i wlan0 -m rpfilter --invert -j DROP");
+    EXPECT_FALSE(t.empty());
+    EXPECT_EQ(0, t.commit());
+    EXPECT_TRUE(t.empty());
+
+    const std::string filter =
+            "*filter\n"
+            ":natctrl_FORWARD -\n"
+            "-A natctrl_FORWARD -i wlan0 -j DROP\n"
+            "COMMIT\n";
+    expectIptablesRestoreCommands({
+        { V4, filter },
+        { V6, filter },
+        { V4, "*nat\n-A natctrl_nat_POSTROUTING -o rmnet0 -j MASQUERADE\nCOMMIT\n" },
+        { V6, "*raw\n-A natctrl_raw_PREROUTING -i wlan0 -m rpfilter --invert -j DROP\n"
+              "COMMIT\n" },
+    });
+}
+
+TEST_F(IptablesTransactionTest, TestRollback) {
+    IptablesTransaction t(fakeFailingRestore);
+    t.add(V4, "filter", "-N bw_costly_rmnet0");
+    t.add(V4, "filter", "-A bw_costly_rmnet0 -j bw_penalty_box");
+    t.add(V4, "filter", "-D bw_INPUT -i rmnet0 --jump bw_costly_rmnet0");
+    t.add(V4, "filter", "-I bw_INPUT 1 -i rmnet0 --jump bw_costly_rmnet0");
+    t.add(V4, "mangle", "-A bw_mangle_POSTROUTING -o rmnet0 -j bw_costly_rmnet0");
+
+    sFailingCalls = { 1 };
+    EXPECT_NE(0, t.commit());
+
+    // The filter table was committed, so everything that can be undone is undone in reverse.
+    expectIptablesRestoreCommands({
+        { V4, "*filter\n"
+              "-N bw_costly_rmnet0\n"
+              "-A bw_costly_rmnet0 -j bw_penalty_box\n"
+              "-D bw_INPUT -i rmnet0 --jump bw_costly_rmnet0\n"
+              "-I bw_INPUT 1 -i rmnet0 --jump bw_costly_rmnet0\n"
+              "COMMIT\n" },
+        { V4, "*mangle\n-A bw_mangle_POSTROUTING -o rmnet0 -j bw_costly_rmnet0\nCOMMIT\n" },
+        { V4, "*filter\n"
+              "-D bw_INPUT -i rmnet0 --jump bw_costly_rmnet0\n"
+              "-D bw_costly_rmnet0 -j bw_penalty_box\n"
+              "-X bw_costly_rmnet0\n"
+              "COMMIT\n" },
+    });
+}
+
+TEST_F(IptablesTransactionTest, TestRollbackOneByOne) {
+    IptablesTransaction t(fakeFailingRestore);
+    t.add(V4V6, "filter", "-A fw_INPUT -i wlan0 -j RETURN");
+    t.add(V4V6, "filter", "-A fw_OUTPUT -o wlan0 -j RETURN");
+
+    // IPv4 succeeds, IPv6 fails, and so does the attempt to undo IPv4 in one go.
+    sFailingCalls = { 1, 2 };
+    EXPECT_NE(0, t.commit());
+
+    const std::string rules =
+            "*filter\n"
+            "-A fw_INPUT -i wlan0 -j RETURN\n"
+            "-A fw_OUTPUT -o wlan0 -j RETURN\n"
+            "COMMIT\n";
+    expectIptablesRestoreCommands({
+        { V4, rules },
+        { V6, rules },
+        { V4, "*filter\n-D fw_OUTPUT -o wlan0 -j RETURN\n-D fw_INPUT -i wlan0 -j RETURN\n"
+              "COMMIT\n" },
+        { V4, "*filter\n-D fw_OUTPUT -o wlan0 -j RETURN\nCOMMIT\n" },
+        { V4, "*filter\n-D fw_INPUT -i wlan0 -j RETURN\nCOMMIT\n" },
+    });
+}
+
+TEST_F(IptablesTransactionTest, TestCommitBestEffort) {
+    IptablesTransaction t(fakeFailingRestore);
+    t.add(V4, "filter", "-D fw_INPUT -i wlan0 -j RETURN");
+    t.add(V4, "filter", "-D fw_OUTPUT -o wlan0 -j RETURN");
+    t.add(V6, "raw", "-D natctrl_raw_PREROUTING -i wlan0 -j DROP");
+
+    // The first rule is already gone. Nothing is rolled back, and the other tables still apply.
+    sFailingCalls = { 0, 1 };
+    EXPECT_NE(0, t.commitBestEffort());
+
+    expectIptablesRestoreCommands({
+        { V4, "*filter\n-D fw_INPUT -i wlan0 -j RETURN\n-D fw_OUTPUT -o wlan0 -j RETURN\n"
+              "COMMIT\n" },
+        { V4, "*filter\n-D fw_INPUT -i wlan0 -j RETURN\nCOMMIT\n" },
+        { V4, "*filter\n-D fw_OUTPUT -o wlan0 -j RETURN\nCOMMIT\n" },
+        { V6, "*raw\n-D natctrl_raw_PREROUTING -i wlan0 -j DROP\nCOMMIT\n" },
+    });
+}
+
+TEST_F(IptablesTransactionTest, TestCommitBestEffortIsQuiet) {
+    auto loudRestore = [](IptablesTarget, const std::string& commands) {
+        ADD_FAILURE() << "Best-effort commit used the loud restore function for " << commands;
+        return -1;
+    };
+    IptablesTransaction t(loudRestore, fakeFailingRestore);
+    t.add(V4, "filter", "-D fw_INPUT -i wlan0 -j RETURN");
+
+    sFailingCalls = { 0, 1 };
+    EXPECT_NE(0, t.commitBestEffort());
+    expectIptablesRestoreCommands({
+        { V4, "*filter\n-D fw_INPUT -i wlan0 -j RETURN\nCOMMIT\n" },
+        { V4, "*filter\n-D fw_INPUT -i wlan0 -j RETURN\nCOMMIT\n" },
+    });
+}
+
+TEST_F(IptablesTransactionTest, TestInverseRule) {
+    EXPECT_EQ("-D foo -i wlan0 -j RETURN",
+              IptablesTransaction::inverseRule("-A foo -i wlan0 -j RETURN"));
+    EXPECT_EQ("-D foo -j bar", IptablesTransaction::inverseRule("--append foo -j bar"));
+    EXPECT_EQ("-D foo -j bar", IptablesTransaction::inverseRule("-I foo -j bar"));
+    EXPECT_EQ("-D foo -j bar", IptablesTransaction::inverseRule("-I foo 1 -j bar"));
+    EXPECT_EQ("-D foo -m u32 --u32 \"0>>22&0x3C@ 12>>26&0x3C@ 0&0x0=0x0\" -j bar",
+              IptablesTransaction::inverseRule(
+                      "-I foo 2 -m u32 --u32 \"0>>22&0x3C@ 12>>26&0x3C@ 0&0x0=0x0\" -j bar"));
+    EXPECT_EQ("-X foo", IptablesTransaction::inverseRule("-N foo"));
+
+    EXPECT_EQ("", IptablesTransaction::inverseRule("-D foo -j bar"));
+    EXPECT_EQ("", IptablesTransaction::inverseRule("-F foo"));
+    EXPECT_EQ("", IptablesTransaction::inverseRule(":foo -"));
+    EXPECT_EQ("", IptablesTransaction::inverseRule("-A foo"));
+    EXPECT_EQ("", IptablesTransaction::inverseRule("-I foo 1"));
+    EXPECT_EQ("", IptablesTransaction::inverseRule(""));
+}
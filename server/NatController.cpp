@@ -31,9 +31,15 @@
 #include <cutils/log.h>
 #include <logwrap/logwrap.h>
 
+#include <android-base/stringprintf.h>
+
+#include "IptablesTransaction.h"
 #include "NatController.h"
 #include "NetdConstants.h"
 #include "RouteController.h"
+#include "TetherCounters.h"
+
+using android::base::StringPrintf;
 
 const char* NatController::LOCAL_FORWARD = "natctrl_FORWARD";
 const char* NatController::LOCAL_MANGLE_FORWARD = "natctrl_mangle_FORWARD";
@@ -41,104 +47,99 @@ const char* NatController::LOCAL_NAT_POSTROUTING = "natctrl_nat_POSTROUTING";
 const char* NatController::LOCAL_RAW_PREROUTING = "natctrl_raw_PREROUTING";
 const char* NatController::LOCAL_TETHER_COUNTERS_CHAIN = "natctrl_tether_counters";
 
-auto NatController::execFunction = android_fork_execvp;
+auto NatController::execIptablesRestore = ::execIptablesRestore;
+auto NatController::execIptablesRestoreSilently = ::execIptablesRestoreSilently;
 
-NatController::NatController() {
+NatController::NatController(TetherCounters* tetherCounters) : mTetherCounters(tetherCounters) {
 }
 
 NatController::~NatController() {
 }
 
-struct CommandsAndArgs {
-    /* The array size doesn't really matter as the compiler will barf if too many initializers are specified. */
-    const char *cmd[32];
-    bool checkRes;
-};
-
-int NatController::runCmd(int argc, const char **argv) {
-    int res;
-
-    res = execFunction(argc, (char **)argv, NULL, false, false);
+int NatController::setupIptablesHooks() {
+    IptablesTransaction t(execIptablesRestore);
 
-#if !LOG_NDEBUG
-    std::string full_cmd = argv[0];
-    argc--; argv++;
     /*
-     * HACK: Sometimes runCmd() is called with a ridcously large value (32)
-     * and it works because the argv[] contains a NULL after the last
-     * true argv. So here we use the NULL argv[] to terminate when the argc
-     * is horribly wrong, and argc for the normal cases.
+     * This is for tethering counters.
+     * This chain is reached via --goto, and then RETURNS.
+     * Declaring it creates it if needed, and flushes it otherwise.
      */
-    for (; argc && argv[0]; argc--, argv++) {
-        full_cmd += " ";
-        full_cmd += argv[0];
-    }
-    ALOGV("runCmd(%s) res=%d", full_cmd.c_str(), res);
-#endif
-    return res;
-}
+    t.addf(V4V6, "filter", ":%s -", LOCAL_TETHER_COUNTERS_CHAIN);
+    addDefaultRules(&t);
 
-int NatController::setupIptablesHooks() {
-    int res;
-    res = setDefaults();
-    if (res < 0) {
-        return res;
+    if (t.commit()) {
+        return -1;
     }
+    natCount = 0;
 
-    struct CommandsAndArgs defaultCommands[] = {
-        /*
-         * This is for tethering counters.
-         * This chain is reached via --goto, and then RETURNS.
-         */
-        {{IPTABLES_PATH, "-w", "-F", LOCAL_TETHER_COUNTERS_CHAIN,}, 0},
-        {{IP6TABLES_PATH, "-w", "-F", LOCAL_TETHER_COUNTERS_CHAIN,}, 0},
-        {{IPTABLES_PATH, "-w", "-X", LOCAL_TETHER_COUNTERS_CHAIN,}, 0},
-        {{IP6TABLES_PATH, "-w", "-X", LOCAL_TETHER_COUNTERS_CHAIN,}, 0},
-        {{IPTABLES_PATH, "-w", "-N", LOCAL_TETHER_COUNTERS_CHAIN,}, 1},
-        {{IP6TABLES_PATH, "-w", "-N", LOCAL_TETHER_COUNTERS_CHAIN,}, 1},
+    /* No rule counts into the tether counters any more, so they can all go. */
+    if (mTetherCounters) {
+        probeTetherCounters();
+    }
 
-        /*
-         * Second chain is used to limit downstream mss to the upstream pmtu
-         * so we don't end up fragmenting every large packet tethered devices
-         * send.  Note this feature requires kernel support with flag
-         * CONFIG_NETFILTER_XT_TARGET_TCPMSS=y, which not all builds will have,
-         * so the final rule is allowed to fail.
-         * Bug 17629786 asks to make the failure more obvious, or even fatal
-         * so that all builds eventually gain the performance improvement.
-         */
-        {{IPTABLES_PATH, "-w", "-t", "mangle", "-A", LOCAL_MANGLE_FORWARD, "-p", "tcp",
-                "--tcp-flags", "SYN", "SYN", "-j", "TCPMSS", "--clamp-mss-to-pmtu"}, 0},
-    };
-    for (unsigned int cmdNum = 0; cmdNum < ARRAY_SIZE(defaultCommands); cmdNum++) {
-        if (runCmd(ARRAY_SIZE(defaultCommands[cmdNum].cmd), defaultCommands[cmdNum].cmd) &&
-            defaultCommands[cmdNum].checkRes) {
-                return -1;
-        }
+    /*
+     * Second chain is used to limit downstream mss to the upstream pmtu
+     * so we don't end up fragmenting every large packet tethered devices
+     * send.  Note this feature requires kernel support with flag
+     * CONFIG_NETFILTER_XT_TARGET_TCPMSS=y, which not all builds will have,
+     * so the final rule is allowed to fail.
+     * Bug 17629786 asks to make the failure more obvious, or even fatal
+     * so that all builds eventually gain the performance improvement.
+     */
+    IptablesTransaction mss(execIptablesRestore);
+    mss.addf(V4, "mangle", "-A %s -p tcp --tcp-flags SYN SYN -j TCPMSS --clamp-mss-to-pmtu",
+             LOCAL_MANGLE_FORWARD);
+    if (mss.commit()) {
+        ALOGW("Could not add TCPMSS rule, tethered traffic may be fragmented");
     }
+
     ifacePairList.clear();
 
     return 0;
 }
 
-int NatController::setDefaults() {
+void NatController::probeTetherCounters() {
     /*
-     * The following only works because:
-     *  - the defaultsCommands[].cmd array is padded with NULL, and
-     *  - the 1st argc of runCmd() will just be the max for the CommandsAndArgs[].cmd, and
-     *  - internally it will be memcopied to an array and terminated with a NULL.
+     * Nothing is tethered yet, so nothing reaches the tether counters chain, and the probe rule
+     * never sees a packet.
      */
-    struct CommandsAndArgs defaultCommands[] = {
-        {{IPTABLES_PATH, "-w", "-F", LOCAL_FORWARD,}, 1},
-        {{IP6TABLES_PATH, "-w", "-F", LOCAL_FORWARD,}, 1},
-        {{IPTABLES_PATH, "-w", "-A", LOCAL_FORWARD, "-j", "DROP"}, 1},
-        {{IPTABLES_PATH, "-w", "-t", "nat", "-F", LOCAL_NAT_POSTROUTING}, 1},
-        {{IP6TABLES_PATH, "-w", "-t", "raw", "-F", LOCAL_RAW_PREROUTING}, 1},
-    };
-    for (unsigned int cmdNum = 0; cmdNum < ARRAY_SIZE(defaultCommands); cmdNum++) {
-        if (runCmd(ARRAY_SIZE(defaultCommands[cmdNum].cmd), defaultCommands[cmdNum].cmd) &&
-            defaultCommands[cmdNum].checkRes) {
-                return -1;
-        }
+    mTetherCounters->setEnabled(false);
+    std::string name;
+    if (mTetherCounters->clear() || mTetherCounters->add("probe", "probe", &name)) {
+        ALOGW("Kernel lacks nfacct, tethering stats are read from iptables");
+        return;
+    }
+
+    IptablesTransaction add(execIptablesRestoreSilently);
+    add.addf(V4V6, "filter", "-A %s -m nfacct --nfacct-name %s -j RETURN",
+             LOCAL_TETHER_COUNTERS_CHAIN, name.c_str());
+    bool supported = !add.commit();
+    if (supported) {
+        IptablesTransaction remove(execIptablesRestore);
+        remove.addf(V4V6, "filter", "-D %s -m nfacct --nfacct-name %s -j RETURN",
+                    LOCAL_TETHER_COUNTERS_CHAIN, name.c_str());
+        // Left in place, the probe rule would keep the real ones from counting anything.
+        supported = !remove.commit();
+    } else {
+        ALOGW("Kernel lacks the nfacct match, tethering stats are read from iptables");
+    }
+
+    mTetherCounters->clear();
+    mTetherCounters->setEnabled(supported);
+}
+
+void NatController::addDefaultRules(IptablesTransaction* t) {
+    t->addf(V4V6, "filter", "-F %s", LOCAL_FORWARD);
+    t->addf(V4, "filter", "-A %s -j DROP", LOCAL_FORWARD);
+    t->addf(V4, "nat", "-F %s", LOCAL_NAT_POSTROUTING);
+    t->addf(V6, "raw", "-F %s", LOCAL_RAW_PREROUTING);
+}
+
+int NatController::setDefaults() {
+    IptablesTransaction t(execIptablesRestore);
+    addDefaultRules(&t);
+    if (t.commit()) {
+        return -1;
     }
 
     natCount = 0;
@@ -161,70 +162,52 @@ int NatController::enableNat(const char* intIface, const char* extIface) {
         return -1;
     }
 
+    IptablesTransaction t(execIptablesRestore);
+
     // add this if we are the first added nat
     if (natCount == 0) {
-        const char *v4Cmd[] = {
-                IPTABLES_PATH,
-                "-w",
-                "-t",
-                "nat",
-                "-A",
-                LOCAL_NAT_POSTROUTING,
-                "-o",
-                extIface,
-                "-j",
-                "MASQUERADE"
-        };
+        t.addf(V4, "nat", "-A %s -o %s -j MASQUERADE", LOCAL_NAT_POSTROUTING, extIface);
 
         /*
          * IPv6 tethering doesn't need the state-based conntrack rules, so
          * it unconditionally jumps to the tether counters chain all the time.
          */
-        const char *v6Cmd[] = {IP6TABLES_PATH, "-w", "-A", LOCAL_FORWARD,
-                               "-g", LOCAL_TETHER_COUNTERS_CHAIN};
-
-        if (runCmd(ARRAY_SIZE(v4Cmd), v4Cmd) || runCmd(ARRAY_SIZE(v6Cmd), v6Cmd)) {
-            ALOGE("Error setting postroute rule: iface=%s", extIface);
-            // unwind what's been done, but don't care about success - what more could we do?
-            setDefaults();
-            return -1;
-        }
+        t.addf(V6, "filter", "-A %s -g %s", LOCAL_FORWARD, LOCAL_TETHER_COUNTERS_CHAIN);
     }
 
-    if (setForwardRules(true, intIface, extIface) != 0) {
-        ALOGE("Error setting forward rules");
-        if (natCount == 0) {
-            setDefaults();
-        }
+    addForwardRules(&t, "-A", intIface, extIface);
+    std::vector<std::string> newPairs;
+    if (addTetherCountingRules(&t, intIface, extIface, &newPairs)) {
         errno = ENODEV;
         return -1;
     }
 
-    /* Always make sure the drop rule is at the end */
-    const char *cmd1[] = {
-            IPTABLES_PATH,
-            "-w",
-            "-D",
-            LOCAL_FORWARD,
-            "-j",
-            "DROP"
-    };
-    runCmd(ARRAY_SIZE(cmd1), cmd1);
-    const char *cmd2[] = {
-            IPTABLES_PATH,
-            "-w",
-            "-A",
-            LOCAL_FORWARD,
-            "-j",
-            "DROP"
-    };
-    runCmd(ARRAY_SIZE(cmd2), cmd2);
+    // Either all of the above is applied, or none of it is.
+    if (t.commit()) {
+        ALOGE("Error setting forward rules: %s -> %s", intIface, extIface);
+        errno = ENODEV;
+        return -1;
+    }
+    for (const auto& pair : newPairs) {
+        ifacePairList.push_front(pair);
+    }
+
+    /*
+     * Always make sure the drop rule is at the end. This is not part of the transaction above
+     * because deleting a rule can't be rolled back.
+     */
+    IptablesTransaction drop(execIptablesRestore);
+    drop.addf(V4, "filter", "-D %s -j DROP", LOCAL_FORWARD);
+    drop.addf(V4, "filter", "-A %s -j DROP", LOCAL_FORWARD);
+    if (drop.commit()) {
+        ALOGE("Error moving %s drop rule to the end", LOCAL_FORWARD);
+    }
 
     natCount++;
     return 0;
 }
 
-bool NatController::checkTetherCountingRuleExist(const char *pair_name) {
+bool NatController::checkTetherCountingRuleExist(const std::string& pair_name) {
     std::list<std::string>::iterator it;
 
     for (it = ifacePairList.begin(); it != ifacePairList.end(); it++) {
@@ -236,168 +219,48 @@ bool NatController::checkTetherCountingRuleExist(const char *pair_name) {
     return false;
 }
 
-int NatController::setTetherCountingRules(bool add, const char *intIface, const char *extIface) {
-
+int NatController::addTetherCountingRules(IptablesTransaction* t, const char *intIface,
+                                          const char *extIface,
+                                          std::vector<std::string>* newPairs) {
     /* We only ever add tethering quota rules so that they stick. */
-    if (!add) {
-        return 0;
-    }
-    char *pair_name;
-    asprintf(&pair_name, "%s_%s", intIface, extIface);
-
-    if (checkTetherCountingRuleExist(pair_name)) {
-        free(pair_name);
-        return 0;
-    }
-    const char *cmd2b[] = {
-        IPTABLES_PATH,
-        "-w", "-A", LOCAL_TETHER_COUNTERS_CHAIN, "-i", intIface, "-o", extIface, "-j", "RETURN"
-    };
-
-    const char *cmd2c[] = {
-        IP6TABLES_PATH,
-        "-w", "-A", LOCAL_TETHER_COUNTERS_CHAIN, "-i", intIface, "-o", extIface, "-j", "RETURN"
-    };
-
-    if (runCmd(ARRAY_SIZE(cmd2b), cmd2b) || runCmd(ARRAY_SIZE(cmd2c), cmd2c)) {
-        free(pair_name);
-        return -1;
-    }
-    ifacePairList.push_front(pair_name);
-    free(pair_name);
-
-    asprintf(&pair_name, "%s_%s", extIface, intIface);
-    if (checkTetherCountingRuleExist(pair_name)) {
-        free(pair_name);
-        return 0;
-    }
-
-    const char *cmd3b[] = {
-        IPTABLES_PATH,
-        "-w", "-A", LOCAL_TETHER_COUNTERS_CHAIN, "-i", extIface, "-o", intIface, "-j", "RETURN"
-    };
-
-    const char *cmd3c[] = {
-        IP6TABLES_PATH,
-        "-w", "-A", LOCAL_TETHER_COUNTERS_CHAIN, "-i", extIface, "-o", intIface, "-j", "RETURN"
-    };
-
-    if (runCmd(ARRAY_SIZE(cmd3b), cmd3b) || runCmd(ARRAY_SIZE(cmd3c), cmd3c)) {
-        // unwind what's been done, but don't care about success - what more could we do?
-        free(pair_name);
-        return -1;
+    const char* directions[][2] = { { intIface, extIface }, { extIface, intIface } };
+    for (const auto& dir : directions) {
+        std::string pair_name = StringPrintf("%s_%s", dir[0], dir[1]);
+        if (checkTetherCountingRuleExist(pair_name)) {
+            continue;
+        }
+        /* The IPv4 and IPv6 rules count into the same nfacct object. */
+        std::string nfacct;
+        if (mTetherCounters && mTetherCounters->isEnabled()) {
+            std::string name;
+            if (mTetherCounters->add(dir[0], dir[1], &name)) {
+                return -1;
+            }
+            nfacct = " -m nfacct --nfacct-name " + name;
+        }
+        t->addf(V4V6, "filter", "-A %s -i %s -o %s%s -j RETURN",
+                LOCAL_TETHER_COUNTERS_CHAIN, dir[0], dir[1], nfacct.c_str());
+        newPairs->push_back(pair_name);
     }
-    ifacePairList.push_front(pair_name);
-    free(pair_name);
     return 0;
 }
 
-int NatController::setForwardRules(bool add, const char *intIface, const char *extIface) {
-    const char *cmd1[] = {
-            IPTABLES_PATH,
-            "-w",
-            add ? "-A" : "-D",
-            LOCAL_FORWARD,
-            "-i",
-            extIface,
-            "-o",
-            intIface,
-            "-m",
-            "state",
-            "--state",
-            "ESTABLISHED,RELATED",
-            "-g",
-            LOCAL_TETHER_COUNTERS_CHAIN
-    };
-    int rc = 0;
-
-    if (runCmd(ARRAY_SIZE(cmd1), cmd1) && add) {
-        return -1;
-    }
-
-    const char *cmd2[] = {
-            IPTABLES_PATH,
-            "-w",
-            add ? "-A" : "-D",
-            LOCAL_FORWARD,
-            "-i",
-            intIface,
-            "-o",
-            extIface,
-            "-m",
-            "state",
-            "--state",
-            "INVALID",
-            "-j",
-            "DROP"
-    };
-
-    const char *cmd3[] = {
-            IPTABLES_PATH,
-            "-w",
-            add ? "-A" : "-D",
-            LOCAL_FORWARD,
-            "-i",
-            intIface,
-            "-o",
-            extIface,
-            "-g",
-            LOCAL_TETHER_COUNTERS_CHAIN
-    };
-
-    const char *cmd4[] = {
-            IP6TABLES_PATH,
-            "-w",
-            "-t",
-            "raw",
-            add ? "-A" : "-D",
-            LOCAL_RAW_PREROUTING,
-            "-i",
-            intIface,
-            "-m",
-            "rpfilter",
-            "--invert",
-            "!",
-            "-s",
-            "fe80::/64",
-            "-j",
-            "DROP"
-    };
-
-    if (runCmd(ARRAY_SIZE(cmd2), cmd2) && add) {
-        // bail on error, but only if adding
-        rc = -1;
-        goto err_invalid_drop;
-    }
-
-    if (runCmd(ARRAY_SIZE(cmd3), cmd3) && add) {
-        // unwind what's been done, but don't care about success - what more could we do?
-        rc = -1;
-        goto err_return;
-    }
-
-    if (runCmd(ARRAY_SIZE(cmd4), cmd4) && add) {
-        rc = -1;
-        goto err_rpfilter;
-    }
-
-    if (setTetherCountingRules(add, intIface, extIface) && add) {
-        rc = -1;
-        goto err_return;
-    }
-
-    return 0;
+void NatController::addForwardRules(IptablesTransaction* t, const char* op,
+                                    const char *intIface, const char *extIface) {
+    t->addf(V4, "filter", "%s %s -i %s -o %s -m state --state ESTABLISHED,RELATED -g %s",
+            op, LOCAL_FORWARD, extIface, intIface, LOCAL_TETHER_COUNTERS_CHAIN);
+    t->addf(V4, "filter", "%s %s -i %s -o %s -m state --state INVALID -j DROP",
+            op, LOCAL_FORWARD, intIface, extIface);
+    t->addf(V4, "filter", "%s %s -i %s -o %s -g %s",
+            op, LOCAL_FORWARD, intIface, extIface, LOCAL_TETHER_COUNTERS_CHAIN);
+    t->addf(V6, "raw", "%s %s -i %s -m rpfilter --invert ! -s fe80::/64 -j DROP",
+            op, LOCAL_RAW_PREROUTING, intIface);
+}
 
-err_rpfilter:
-    cmd3[2] = "-D";
-    runCmd(ARRAY_SIZE(cmd3), cmd3);
-err_return:
-    cmd2[2] = "-D";
-    runCmd(ARRAY_SIZE(cmd2), cmd2);
-err_invalid_drop:
-    cmd1[2] = "-D";
-    runCmd(ARRAY_SIZE(cmd1), cmd1);
-    return rc;
+void NatController::removeForwardRules(const char *intIface, const char *extIface) {
+    IptablesTransaction t(execIptablesRestore, execIptablesRestoreSilently);
+    addForwardRules(&t, "-D", intIface, extIface);
+    t.commitBestEffort();
 }
 
 int NatController::disableNat(const char* intIface, const char* extIface) {
@@ -406,7 +269,7 @@ int NatController::disableNat(const char* intIface, const char* extIface) {
         return -1;
     }
 
-    setForwardRules(false, intIface, extIface);
+    removeForwardRules(intIface, extIface);
     if (--natCount <= 0) {
         // handle decrement to 0 case (do reset to defaults) and erroneous dec below 0
         setDefaults();
@@ -17,13 +17,19 @@
 #ifndef _NAT_CONTROLLER_H
 #define _NAT_CONTROLLER_H
 
-#include <linux/in.h>
 #include <list>
 #include <string>
+#include <vector>
+
+#include "NetdConstants.h"
+
+class IptablesTransaction;
+class TetherCounters;
 
 class NatController {
 public:
-    NatController();
+    // Counts tethered traffic into |tetherCounters| too, if it is not null and the kernel can.
+    explicit NatController(TetherCounters* tetherCounters = nullptr);
     virtual ~NatController();
 
     int enableNat(const char* intIface, const char* extIface);
@@ -41,17 +47,26 @@ public:
 
 private:
     int natCount;
+    TetherCounters* const mTetherCounters;
 
-    bool checkTetherCountingRuleExist(const char *pair_name);
+    bool checkTetherCountingRuleExist(const std::string& pair_name);
 
+    // Enables mTetherCounters if the kernel has nfacct and its iptables match.
+    void probeTetherCounters();
     int setDefaults();
-    int runCmd(int argc, const char **argv);
-    int setForwardRules(bool set, const char *intIface, const char *extIface);
-    int setTetherCountingRules(bool add, const char *intIface, const char *extIface);
+    void addDefaultRules(IptablesTransaction* t);
+    void addForwardRules(IptablesTransaction* t, const char* op,
+                         const char *intIface, const char *extIface);
+    void removeForwardRules(const char *intIface, const char *extIface);
+    // Adds the counting rules of the interface pairs that don't have them yet to |t|, and returns
+    // the pairs in |*newPairs|. Returns 0, or -1 if their counters can't be created.
+    int addTetherCountingRules(IptablesTransaction* t, const char *intIface,
+                               const char *extIface, std::vector<std::string>* newPairs);
 
     // For testing.
     friend class NatControllerTest;
-    static int (*execFunction)(int, char **, int *, bool, bool);
+    static int (*execIptablesRestore)(IptablesTarget target, const std::string& commands);
+    static int (*execIptablesRestoreSilently)(IptablesTarget target, const std::string& commands);
 };
 
 #endif
@@ -31,13 +31,15 @@
 
 #include "NatController.h"
 #include "IptablesBaseTest.h"
+#include "TetherCounters.h"
 
 using android::base::StringPrintf;
 
 class NatControllerTest : public IptablesBaseTest {
 public:
     NatControllerTest() {
-        NatController::execFunction = fake_android_fork_exec;
+        NatController::execIptablesRestore = fakeExecIptablesRestore;
+        NatController::execIptablesRestoreSilently = fakeExecIptablesRestore;
     }
 
 protected:
@@ -48,102 +50,211 @@ protected:
     }
 
     const ExpectedIptablesCommands FLUSH_COMMANDS = {
-        { V4V6, "-F natctrl_FORWARD" },
-        { V4,   "-A natctrl_FORWARD -j DROP" },
-        { V4,   "-t nat -F natctrl_nat_POSTROUTING" },
-        { V6,   "-t raw -F natctrl_raw_PREROUTING" },
+        { V4, "*filter\n"
+              "-F natctrl_FORWARD\n"
+              "-A natctrl_FORWARD -j DROP\n"
+              "COMMIT\n" },
+        { V6, "*filter\n"
+              "-F natctrl_FORWARD\n"
+              "COMMIT\n" },
+        { V4, "*nat\n"
+              "-F natctrl_nat_POSTROUTING\n"
+              "COMMIT\n" },
+        { V6, "*raw\n"
+              "-F natctrl_raw_PREROUTING\n"
+              "COMMIT\n" },
     };
 
     const ExpectedIptablesCommands SETUP_COMMANDS = {
-        { V4V6, "-F natctrl_FORWARD" },
-        { V4,   "-A natctrl_FORWARD -j DROP" },
-        { V4,   "-t nat -F natctrl_nat_POSTROUTING" },
-        { V6,   "-t raw -F natctrl_raw_PREROUTING" },
-        { V4V6, "-F natctrl_tether_counters" },
-        { V4V6, "-X natctrl_tether_counters" },
-        { V4V6, "-N natctrl_tether_counters" },
-        { V4,   "-t mangle -A natctrl_mangle_FORWARD -p tcp --tcp-flags SYN SYN "
-                "-j TCPMSS --clamp-mss-to-pmtu" },
+        { V4, "*filter\n"
+              ":natctrl_tether_counters -\n"
+              "-F natctrl_FORWARD\n"
+              "-A natctrl_FORWARD -j DROP\n"
+              "COMMIT\n" },
+        { V6, "*filter\n"
+              ":natctrl_tether_counters -\n"
+              "-F natctrl_FORWARD\n"
+              "COMMIT\n" },
+        { V4, "*nat\n"
+              "-F natctrl_nat_POSTROUTING\n"
+              "COMMIT\n" },
+        { V6, "*raw\n"
+              "-F natctrl_raw_PREROUTING\n"
+              "COMMIT\n" },
+        { V4, "*mangle\n"
+              "-A natctrl_mangle_FORWARD -p tcp --tcp-flags SYN SYN "
+                  "-j TCPMSS --clamp-mss-to-pmtu\n"
+              "COMMIT\n" },
     };
 
     const ExpectedIptablesCommands TWIDDLE_COMMANDS = {
-        { V4, "-D natctrl_FORWARD -j DROP" },
-        { V4, "-A natctrl_FORWARD -j DROP" },
+        { V4, "*filter\n"
+              "-D natctrl_FORWARD -j DROP\n"
+              "-A natctrl_FORWARD -j DROP\n"
+              "COMMIT\n" },
     };
 
-    ExpectedIptablesCommands firstNatCommands(const char *extIf) {
+    std::string forwardRules(const char *op, const char *intIf, const char *extIf) {
+        return StringPrintf(
+                "%s natctrl_FORWARD -i %s -o %s -m state --state ESTABLISHED,RELATED"
+                " -g natctrl_tether_counters\n"
+                "%s natctrl_FORWARD -i %s -o %s -m state --state INVALID -j DROP\n"
+                "%s natctrl_FORWARD -i %s -o %s -g natctrl_tether_counters\n",
+                op, extIf, intIf, op, intIf, extIf, op, intIf, extIf);
+    }
+
+    std::string rpfilterRule(const char *op, const char *intIf) {
+        return StringPrintf("%s natctrl_raw_PREROUTING -i %s -m rpfilter --invert"
+                            " ! -s fe80::/64 -j DROP\n", op, intIf);
+    }
+
+    std::string countingRules(const char *intIf, const char *extIf) {
+        return StringPrintf("-A natctrl_tether_counters -i %s -o %s -j RETURN\n"
+                            "-A natctrl_tether_counters -i %s -o %s -j RETURN\n",
+                            intIf, extIf, extIf, intIf);
+    }
+
+    static int fakeFailingRestore(IptablesTarget target, const std::string& commands) {
+        fakeExecIptablesRestore(target, commands);
+        return -1;
+    }
+
+    // Makes the iptables-restore calls whose failures are expected fail.
+    void setSilentRestoreFails() {
+        NatController::execIptablesRestoreSilently = fakeFailingRestore;
+    }
+
+    ExpectedIptablesCommands startFirstNatCommands(const char *intIf, const char *extIf) {
         return {
-            { V4, StringPrintf("-t nat -A natctrl_nat_POSTROUTING -o %s -j MASQUERADE", extIf) },
-            { V6, "-A natctrl_FORWARD -g natctrl_tether_counters" },
+            { V4, StringPrintf("*nat\n"
+                               "-A natctrl_nat_POSTROUTING -o %s -j MASQUERADE\n"
+                               "COMMIT\n", extIf) },
+            { V4, "*filter\n" + forwardRules("-A", intIf, extIf) +
+                  countingRules(intIf, extIf) + "COMMIT\n" },
+            { V6, "*filter\n"
+                  "-A natctrl_FORWARD -g natctrl_tether_counters\n" +
+                  countingRules(intIf, extIf) + "COMMIT\n" },
+            { V6, "*raw\n" + rpfilterRule("-A", intIf) + "COMMIT\n" },
         };
     }
 
-    ExpectedIptablesCommands startNatCommands(const char *intIf, const char *extIf) {
+    ExpectedIptablesCommands startOtherNatCommands(const char *intIf, const char *extIf) {
         return {
-            { V4,   StringPrintf("-A natctrl_FORWARD -i %s -o %s -m state --state"
-                                 " ESTABLISHED,RELATED -g natctrl_tether_counters", extIf, intIf) },
-            { V4,   StringPrintf("-A natctrl_FORWARD -i %s -o %s -m state --state INVALID -j DROP",
-                                 intIf, extIf) },
-            { V4,   StringPrintf("-A natctrl_FORWARD -i %s -o %s -g natctrl_tether_counters",
-                                 intIf, extIf) },
-            { V6,   StringPrintf("-t raw -A natctrl_raw_PREROUTING -i %s -m rpfilter --invert"
-                                 " ! -s fe80::/64 -j DROP", intIf) },
-            { V4V6, StringPrintf("-A natctrl_tether_counters -i %s -o %s -j RETURN",
-                                 intIf, extIf) },
-            { V4V6, StringPrintf("-A natctrl_tether_counters -i %s -o %s -j RETURN",
-                                 extIf, intIf) },
+            { V4, "*filter\n" + forwardRules("-A", intIf, extIf) +
+                  countingRules(intIf, extIf) + "COMMIT\n" },
+            { V6, "*filter\n" + countingRules(intIf, extIf) + "COMMIT\n" },
+            { V6, "*raw\n" + rpfilterRule("-A", intIf) + "COMMIT\n" },
         };
     }
 
     ExpectedIptablesCommands stopNatCommands(const char *intIf, const char *extIf) {
         return {
-            { V4, StringPrintf("-D natctrl_FORWARD -i %s -o %s -m state --state"
-                               " ESTABLISHED,RELATED -g natctrl_tether_counters", extIf, intIf) },
-            { V4, StringPrintf("-D natctrl_FORWARD -i %s -o %s -m state --state INVALID -j DROP",
-                               intIf, extIf) },
-            { V4, StringPrintf("-D natctrl_FORWARD -i %s -o %s -g natctrl_tether_counters",
-                               intIf, extIf) },
-            { V6, StringPrintf("-t raw -D natctrl_raw_PREROUTING -i %s -m rpfilter --invert"
-                               " ! -s fe80::/64 -j DROP", intIf) },
+            { V4, "*filter\n" + forwardRules("-D", intIf, extIf) + "COMMIT\n" },
+            { V6, "*raw\n" + rpfilterRule("-D", intIf) + "COMMIT\n" },
         };
     }
+
+    static ExpectedIptablesCommands concat(const std::vector<ExpectedIptablesCommands>& snippets) {
+        ExpectedIptablesCommands expected;
+        for (const auto& snippet : snippets) {
+            expected.insert(expected.end(), snippet.begin(), snippet.end());
+        }
+        return expected;
+    }
 };
 
 TEST_F(NatControllerTest, TestSetupIptablesHooks) {
-    mNatCtrl.setupIptablesHooks();
-    expectIptablesCommands(SETUP_COMMANDS);
+    EXPECT_EQ(0, mNatCtrl.setupIptablesHooks());
+    expectIptablesRestoreCommands(SETUP_COMMANDS);
 }
 
 TEST_F(NatControllerTest, TestSetDefaults) {
-    setDefaults();
-    expectIptablesCommands(FLUSH_COMMANDS);
+    EXPECT_EQ(0, setDefaults());
+    expectIptablesRestoreCommands(FLUSH_COMMANDS);
 }
 
 TEST_F(NatControllerTest, TestAddAndRemoveNat) {
+    ASSERT_EQ(0, setDefaults());
+    expectIptablesRestoreCommands(FLUSH_COMMANDS);
 
-    std::vector<ExpectedIptablesCommands> startFirstNat = {
-        firstNatCommands("rmnet0"),
-        startNatCommands("wlan0", "rmnet0"),
+    EXPECT_EQ(0, mNatCtrl.enableNat("wlan0", "rmnet0"));
+    expectIptablesRestoreCommands(concat({
+        startFirstNatCommands("wlan0", "rmnet0"),
         TWIDDLE_COMMANDS,
-    };
-    mNatCtrl.enableNat("wlan0", "rmnet0");
-    expectIptablesCommands(startFirstNat);
+    }));
 
-    std::vector<ExpectedIptablesCommands> startOtherNat = {
-         startNatCommands("usb0", "rmnet0"),
-         TWIDDLE_COMMANDS,
-    };
-    mNatCtrl.enableNat("usb0", "rmnet0");
-    expectIptablesCommands(startOtherNat);
+    EXPECT_EQ(0, mNatCtrl.enableNat("usb0", "rmnet0"));
+    expectIptablesRestoreCommands(concat({
+        startOtherNatCommands("usb0", "rmnet0"),
+        TWIDDLE_COMMANDS,
+    }));
 
-    ExpectedIptablesCommands stopOtherNat = stopNatCommands("wlan0", "rmnet0");
-    mNatCtrl.disableNat("wlan0", "rmnet0");
-    expectIptablesCommands(stopOtherNat);
+    EXPECT_EQ(0, mNatCtrl.disableNat("wlan0", "rmnet0"));
+    expectIptablesRestoreCommands(stopNatCommands("wlan0", "rmnet0"));
 
-    std::vector<ExpectedIptablesCommands> stopLastNat = {
+    EXPECT_EQ(0, mNatCtrl.disableNat("usb0", "rmnet0"));
+    expectIptablesRestoreCommands(concat({
         stopNatCommands("usb0", "rmnet0"),
         FLUSH_COMMANDS,
-    };
-    mNatCtrl.disableNat("usb0", "rmnet0");
-    expectIptablesCommands(stopLastNat);
+    }));
+}
+
+TEST_F(NatControllerTest, TestTetherCountersUseNfacct) {
+    // Not netd's own prefix, so that running the tests doesn't touch its counters.
+    TetherCounters counters("natctrl_test");
+    NatController natCtrl(&counters);
+
+    // After the flush, it checks that the nfacct match works by adding a rule and removing it.
+    EXPECT_EQ(0, natCtrl.setupIptablesHooks());
+    const std::string probe = "natctrl_tether_counters -m nfacct --nfacct-name natctrl_test0"
+                              " -j RETURN\n";
+    ExpectedIptablesCommands expected = SETUP_COMMANDS;
+    expected.insert(expected.end() - 1, {
+        { V4, "*filter\n-A " + probe + "COMMIT\n" },
+        { V6, "*filter\n-A " + probe + "COMMIT\n" },
+        { V4, "*filter\n-D " + probe + "COMMIT\n" },
+        { V6, "*filter\n-D " + probe + "COMMIT\n" },
+    });
+    expectIptablesRestoreCommands(expected);
+    ASSERT_TRUE(counters.isEnabled());
+
+    // The rules of both IP families count into the same objects.
+    EXPECT_EQ(0, natCtrl.enableNat("wlan0", "rmnet0"));
+    const std::string rules =
+            "-A natctrl_tether_counters -i wlan0 -o rmnet0 -m nfacct --nfacct-name natctrl_test0"
+            " -j RETURN\n"
+            "-A natctrl_tether_counters -i rmnet0 -o wlan0 -m nfacct --nfacct-name natctrl_test1"
+            " -j RETURN\n";
+    expectIptablesRestoreCommands(concat({
+        {
+            { V4, "*nat\n"
+                  "-A natctrl_nat_POSTROUTING -o rmnet0 -j MASQUERADE\n"
+                  "COMMIT\n" },
+            { V4, "*filter\n" + forwardRules("-A", "wlan0", "rmnet0") + rules + "COMMIT\n" },
+            { V6, "*filter\n"
+                  "-A natctrl_FORWARD -g natctrl_tether_counters\n" + rules + "COMMIT\n" },
+            { V6, "*raw\n" + rpfilterRule("-A", "wlan0") + "COMMIT\n" },
+        },
+        TWIDDLE_COMMANDS,
+    }));
+    std::vector<TetherCounters::Counter> values;
+    ASSERT_EQ(0, counters.read(&values));
+    ASSERT_EQ(2U, values.size());
+    EXPECT_EQ("wlan0", values[0].inIface);
+    EXPECT_EQ("rmnet0", values[1].inIface);
+
+    // Without the nfacct match, the rules only have their iptables counters.
+    setSilentRestoreFails();
+    EXPECT_EQ(0, natCtrl.setupIptablesHooks());
+    EXPECT_FALSE(counters.isEnabled());
+    ASSERT_EQ(0, counters.read(&values));
+    EXPECT_TRUE(values.empty());
+    sRestoreCmds.clear();
+    EXPECT_EQ(0, natCtrl.enableNat("wlan0", "rmnet0"));
+    expectIptablesRestoreCommands(concat({
+        startFirstNatCommands("wlan0", "rmnet0"),
+        TWIDDLE_COMMANDS,
+    }));
+
+    EXPECT_EQ(0, counters.clear());
 }
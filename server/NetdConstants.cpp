@@ -24,18 +24,19 @@
 #include <string.h>
 #include <sys/wait.h>
 
+#include <vector>
+
 #define LOG_TAG "Netd"
 
 #include <cutils/log.h>
 #include <logwrap/logwrap.h>
 
+#include "IptablesRestoreController.h"
 #include "NetdConstants.h"
 
 const char * const OEM_SCRIPT_PATH = "/system/bin/oem-iptables-init.sh";
 const char * const IPTABLES_PATH = "/system/bin/iptables";
 const char * const IP6TABLES_PATH = "/system/bin/ip6tables";
-const char * const IPTABLES_RESTORE_PATH = "/system/bin/iptables-restore";
-const char * const IP6TABLES_RESTORE_PATH = "/system/bin/ip6tables-restore";
 const char * const TC_PATH = "/system/bin/tc";
 const char * const IP_PATH = "/system/bin/ip";
 const char * const ADD = "add";
@@ -70,35 +71,39 @@ static int execIptablesCommand(int argc, const char *argv[], bool silent) {
     return WEXITSTATUS(status);
 }
 
+static IptablesRestoreController& iptablesRestoreCtrl() {
+    static IptablesRestoreController sController;
+    return sController;
+}
+
 static int execIptables(IptablesTarget target, bool silent, va_list args) {
     /* Read arguments from incoming va_list; we expect the list to be NULL terminated. */
-    std::list<const char*> argsList;
-    argsList.push_back(NULL);
+    std::vector<const char*> argsList;
     const char* arg;
-
-    // Wait to avoid failure due to another process holding the lock
-    argsList.push_back("-w");
-
-    do {
-        arg = va_arg(args, const char *);
+    while ((arg = va_arg(args, const char *)) != NULL) {
         argsList.push_back(arg);
-    } while (arg);
+    }
 
-    int i = 0;
-    const char* argv[argsList.size()];
-    std::list<const char*>::iterator it;
-    for (it = argsList.begin(); it != argsList.end(); it++, i++) {
-        argv[i] = *it;
+    // Rule changes go to the persistent iptables-restore processes. Only commands that print
+    // something, which no caller currently issues, still pay for a fork and exec.
+    std::string commands;
+    if (IptablesRestoreController::commandToRestoreFormat(argsList, &commands)) {
+        return iptablesRestoreCtrl().execute(target, commands, silent);
     }
 
+    // Wait to avoid failure due to another process holding the lock
+    argsList.insert(argsList.begin(), "-w");
+    argsList.insert(argsList.begin(), NULL);
+    argsList.push_back(NULL);
+
     int res = 0;
     if (target == V4 || target == V4V6) {
-        argv[0] = IPTABLES_PATH;
-        res |= execIptablesCommand(argsList.size(), argv, silent);
+        argsList[0] = IPTABLES_PATH;
+        res |= execIptablesCommand(argsList.size(), argsList.data(), silent);
     }
     if (target == V6 || target == V4V6) {
-        argv[0] = IP6TABLES_PATH;
-        res |= execIptablesCommand(argsList.size(), argv, silent);
+        argsList[0] = IP6TABLES_PATH;
+        res |= execIptablesCommand(argsList.size(), argsList.data(), silent);
     }
     return res;
 }
@@ -119,41 +124,12 @@ int execIptablesSilently(IptablesTarget target, ...) {
     return res;
 }
 
-static int execIptablesRestoreCommand(const char *cmd, const std::string& commands) {
-    const char *argv[] = {
-        cmd,
-        "--noflush",  // Don't flush the whole table.
-        "-w",         // Wait instead of failing if the lock is held.
-    };
-    AndroidForkExecvpOption opt[1] = {
-        {
-            .opt_type = FORK_EXECVP_OPTION_INPUT,
-            .opt_input.input = reinterpret_cast<const uint8_t*>(commands.c_str()),
-            .opt_input.input_len = commands.size(),
-        }
-    };
-
-    int status = 0;
-    int res = android_fork_execvp_ext(
-            ARRAY_SIZE(argv), (char**)argv, &status, false /* ignore_int_quit */, LOG_NONE,
-            false /* abbreviated */, NULL /* file_path */, opt, ARRAY_SIZE(opt));
-    if (res || status) {
-        ALOGE("%s failed with res=%d, status=%d", argv[0], res, status);
-        return -1;
-    }
-
-    return 0;
+int execIptablesRestore(IptablesTarget target, const std::string& commands) {
+    return iptablesRestoreCtrl().execute(target, commands, false);
 }
 
-int execIptablesRestore(IptablesTarget target, const std::string& commands) {
-    int res = 0;
-    if (target == V4 || target == V4V6) {
-        res |= execIptablesRestoreCommand(IPTABLES_RESTORE_PATH, commands);
-    }
-    if (target == V6 || target == V4V6) {
-        res |= execIptablesRestoreCommand(IP6TABLES_RESTORE_PATH, commands);
-    }
-    return res;
+int execIptablesRestoreSilently(IptablesTarget target, const std::string& commands) {
+    return iptablesRestoreCtrl().execute(target, commands, true);
 }
 
 /*
@@ -99,6 +99,11 @@ status_t NetdNativeService::dump(int fd, const Vector<String16> & /* args */) {
     dw.blankline();
     gCtls->netCtrl.dump(dw);
     dw.blankline();
+    gCtls->dnsWorkerPool.dump(dw);
+    gCtls->dnsSingleFlight.dump(dw);
+    gCtls->dnsQueryEngine.dump(dw);
+    gCtls->dnsEventReporter.dump(dw);
+    dw.blankline();
 
     return NO_ERROR;
 }
@@ -128,6 +133,58 @@ binder::Status NetdNativeService::bandwidthEnableDataSaver(bool enable, bool *re
     return binder::Status::ok();
 }
 
+binder::Status NetdNativeService::bandwidthReplaceNaughtyApps(const std::vector<int32_t>& uids,
+        bool *ret) {
+    NETD_LOCKING_RPC(CONNECTIVITY_INTERNAL, gCtls->bandwidthCtrl.lock);
+
+    int err = gCtls->bandwidthCtrl.replaceNaughtyApps(uids);
+    *ret = (err == 0);
+    return binder::Status::ok();
+}
+
+binder::Status NetdNativeService::bandwidthReplaceNiceApps(const std::vector<int32_t>& uids,
+        bool *ret) {
+    NETD_LOCKING_RPC(CONNECTIVITY_INTERNAL, gCtls->bandwidthCtrl.lock);
+
+    int err = gCtls->bandwidthCtrl.replaceNiceApps(uids);
+    *ret = (err == 0);
+    return binder::Status::ok();
+}
+
+binder::Status NetdNativeService::bandwidthAddUidCounter(int32_t uid, const std::string& ifName,
+        bool *ret) {
+    NETD_LOCKING_RPC(CONNECTIVITY_INTERNAL, gCtls->bandwidthCtrl.lock);
+
+    int err = gCtls->bandwidthCtrl.addUidCounter(uid, ifName);
+    *ret = (err == 0);
+    return binder::Status::ok();
+}
+
+binder::Status NetdNativeService::bandwidthRemoveUidCounter(int32_t uid, const std::string& ifName,
+        bool *ret) {
+    NETD_LOCKING_RPC(CONNECTIVITY_INTERNAL, gCtls->bandwidthCtrl.lock);
+
+    int err = gCtls->bandwidthCtrl.removeUidCounter(uid, ifName);
+    *ret = (err == 0);
+    return binder::Status::ok();
+}
+
+binder::Status NetdNativeService::bandwidthGetUidStats(int64_t sinceGeneration,
+        std::vector<uint8_t>* stats) {
+    // Reading the counters updates what the next delta is relative to, so this is a writer too.
+    NETD_LOCKING_RPC(CONNECTIVITY_INTERNAL, gCtls->bandwidthCtrl.lock);
+
+    if (sinceGeneration < 0) {
+        return binder::Status::fromServiceSpecificError(EINVAL,
+                String8("Negative generation"));
+    }
+    if (gCtls->bandwidthCtrl.getUidStats(sinceGeneration, stats)) {
+        return binder::Status::fromServiceSpecificError(EIO,
+                String8("Could not read uid counters"));
+    }
+    return binder::Status::ok();
+}
+
 binder::Status NetdNativeService::networkRejectNonSecureVpn(bool add,
         const std::vector<UidRange>& uidRangeArray) {
     // TODO: elsewhere RouteController is only used from the tethering and network controllers, so
@@ -191,11 +248,14 @@ binder::Status NetdNativeService::setResolverConfiguration(int32_t netId,
 
 binder::Status NetdNativeService::getResolverInfo(int32_t netId,
         std::vector<std::string>* servers, std::vector<std::string>* domains,
-        std::vector<int32_t>* params, std::vector<int32_t>* stats) {
-    // This function intentionally does not lock within Netd, as Bionic is thread-safe.
+        std::vector<int32_t>* params, std::vector<ResolverStats>* stats,
+        std::vector<int32_t>* cacheStats) {
+    // This function intentionally does not lock within Netd, as Bionic and DnsCache are
+    // thread-safe.
     ENFORCE_PERMISSION(CONNECTIVITY_INTERNAL);
 
-    int err = gCtls->resolverCtrl.getResolverInfo(netId, servers, domains, params, stats);
+    int err = gCtls->resolverCtrl.getResolverInfo(netId, servers, domains, params, stats,
+            cacheStats);
     if (err != 0) {
         return binder::Status::fromServiceSpecificError(-err,
                 String8::format("ResolverController error: %s", strerror(-err)));
@@ -210,6 +270,37 @@ binder::Status NetdNativeService::tetherApplyDnsInterfaces(bool *ret) {
     return binder::Status::ok();
 }
 
+binder::Status NetdNativeService::tetherGetStats(std::vector<TetherStatsParcel>* stats) {
+    ENFORCE_PERMISSION(CONNECTIVITY_INTERNAL);
+
+    stats->clear();
+    {
+        // Like the "bandwidth gettetherstats" command, don't look for counters of pairs that
+        // NatController never set up.
+        android::RWLock::AutoRLock _lock(gBigNetdLock);
+        if (gCtls->natCtrl.ifacePairList.empty()) {
+            return binder::Status::ok();
+        }
+    }
+
+    std::vector<BandwidthController::TetherStats> tetherStats;
+    std::string extraProcessingInfo;
+    {
+        android::RWLock::AutoWLock _lock(gCtls->bandwidthCtrl.lock);
+        if (gCtls->bandwidthCtrl.getTetherStats(&tetherStats, extraProcessingInfo)) {
+            return binder::Status::fromServiceSpecificError(EIO,
+                    String8("Failed to get tethering stats"));
+        }
+    }
+
+    stats->reserve(tetherStats.size());
+    for (auto& s : tetherStats) {
+        stats->emplace_back(std::move(s.intIface), std::move(s.extIface), s.rxBytes, s.rxPackets,
+                            s.txBytes, s.txPackets);
+    }
+    return binder::Status::ok();
+}
+
 binder::Status NetdNativeService::interfaceAddAddress(const std::string &ifName,
         const std::string &addrString, int prefixLength) {
     ENFORCE_PERMISSION(CONNECTIVITY_INTERNAL);
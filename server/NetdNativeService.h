@@ -22,6 +22,8 @@
 #include <binder/BinderService.h>
 
 #include "android/net/BnNetd.h"
+#include "android/net/ResolverStats.h"
+#include "android/net/TetherStatsParcel.h"
 #include "android/net/UidRange.h"
 
 namespace android {
@@ -38,6 +40,15 @@ class NetdNativeService : public BinderService<NetdNativeService>, public BnNetd
             const String16& chainName, bool isWhitelist,
             const std::vector<int32_t>& uids, bool *ret) override;
     binder::Status bandwidthEnableDataSaver(bool enable, bool *ret) override;
+    binder::Status bandwidthReplaceNaughtyApps(const std::vector<int32_t>& uids, bool *ret)
+            override;
+    binder::Status bandwidthReplaceNiceApps(const std::vector<int32_t>& uids, bool *ret) override;
+    binder::Status bandwidthAddUidCounter(int32_t uid, const std::string& ifName, bool *ret)
+            override;
+    binder::Status bandwidthRemoveUidCounter(int32_t uid, const std::string& ifName, bool *ret)
+            override;
+    binder::Status bandwidthGetUidStats(int64_t sinceGeneration, std::vector<uint8_t>* stats)
+            override;
     binder::Status networkRejectNonSecureVpn(bool enable, const std::vector<UidRange>& uids)
             override;
     binder::Status socketDestroy(const std::vector<UidRange>& uids,
@@ -46,10 +57,11 @@ class NetdNativeService : public BinderService<NetdNativeService>, public BnNetd
             const std::vector<std::string>& domains, const std::vector<int32_t>& params) override;
     binder::Status getResolverInfo(int32_t netId, std::vector<std::string>* servers,
             std::vector<std::string>* domains, std::vector<int32_t>* params,
-            std::vector<int32_t>* stats) override;
+            std::vector<ResolverStats>* stats, std::vector<int32_t>* cacheStats) override;
 
     // Tethering-related commands.
     binder::Status tetherApplyDnsInterfaces(bool *ret) override;
+    binder::Status tetherGetStats(std::vector<TetherStatsParcel>* stats) override;
 
     binder::Status interfaceAddAddress(const std::string &ifName,
             const std::string &addrString, int prefixLength) override;
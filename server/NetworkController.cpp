@@ -29,9 +29,22 @@
 //     2. Only CommandListener calls these non-const methods. The others call only const methods.
 //     3. CommandListener only processes one command at a time. I.e., it's serialized.
 // Thus, no other mutation can occur in between the two statements above.
+//
+// The const methods that make routing decisions run on every connect() and DNS lookup, and do not
+// take the lock at all. Instead, they read an immutable Snapshot of the state, which writers
+// rebuild and publish through an RcuSnapshot when they release the write lock. This way, a stream
+// of readers can never starve a writer such as setDefaultNetwork(), and readers never wait for a
+// writer. The Snapshot holds copies rather than Network pointers, since a reader may still be
+// using an old Snapshot after destroyNetwork() has deleted the Network.
 
 #include "NetworkController.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
 #define LOG_TAG "Netd"
 #include "log/log.h"
 
@@ -42,6 +55,7 @@
 #include "DummyNetwork.h"
 #include "DumpWriter.h"
 #include "Fwmark.h"
+#include "FwmarkCommand.h"
 #include "LocalNetwork.h"
 #include "PhysicalNetwork.h"
 #include "RouteController.h"
@@ -53,6 +67,12 @@ namespace {
 const unsigned MIN_NET_ID = 100;
 const unsigned MAX_NET_ID = 65535;
 
+// On tmpfs, so that it doesn't outlive a reboot, but does outlive a restart of netd. init creates
+// the directory (see netd.rc), so that it can be labeled for SELinux: netd needs to create, read
+// and write the file, and clients need to read and map the file descriptor that fwmarkd sends
+// them, which they never open by name.
+const char GENERATION_FILE[] = "/dev/fwmarkd/generation";
+
 }  // namespace
 
 const unsigned NetworkController::MIN_OEM_ID   =  1;
@@ -136,18 +156,29 @@ int NetworkController::DelegateImpl::modifyFallthrough(const std::string& physic
 
 NetworkController::NetworkController() :
         mDelegateImpl(new NetworkController::DelegateImpl(this)), mDefaultNetId(NETID_UNSET),
-        mProtectableUsers({AID_VPN}) {
+        mProtectableUsers({AID_VPN}), mSnapshot(new Snapshot()), mGeneration(NULL),
+        mGenerationFd(-1) {
+    openGenerationFile();
     mNetworks[LOCAL_NET_ID] = new LocalNetwork(LOCAL_NET_ID);
     mNetworks[DUMMY_NET_ID] = new DummyNetwork(DUMMY_NET_ID);
+    publishSnapshotLocked();
+}
+
+NetworkController::ScopedWriteLock::ScopedWriteLock(NetworkController* networkController) :
+        mNetworkController(networkController), mLock(networkController->mRWLock) {
+}
+
+NetworkController::ScopedWriteLock::~ScopedWriteLock() {
+    mNetworkController->publishSnapshotLocked();
 }
 
 unsigned NetworkController::getDefaultNetwork() const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    return mDefaultNetId;
+    RcuSnapshot<Snapshot>::Reader snapshot(mSnapshot);
+    return snapshot->defaultNetId;
 }
 
 int NetworkController::setDefaultNetwork(unsigned netId) {
-    android::RWLock::AutoWLock lock(mRWLock);
+    ScopedWriteLock lock(this);
 
     if (netId == mDefaultNetId) {
         return 0;
@@ -184,11 +215,11 @@ int NetworkController::setDefaultNetwork(unsigned netId) {
 }
 
 uint32_t NetworkController::getNetworkForDns(unsigned* netId, uid_t uid) const {
-    android::RWLock::AutoRLock lock(mRWLock);
+    RcuSnapshot<Snapshot>::Reader snapshot(mSnapshot);
     Fwmark fwmark;
     fwmark.protectedFromVpn = true;
     fwmark.permission = PERMISSION_SYSTEM;
-    if (checkUserNetworkAccessLocked(uid, *netId) == 0) {
+    if (snapshot->checkUserNetworkAccess(uid, *netId) == 0) {
         // If a non-zero NetId was explicitly specified, and the user has permission for that
         // network, use that network's DNS servers. Do not fall through to the default network even
         // if the explicitly selected network is a split tunnel VPN: the explicitlySelected bit
@@ -198,22 +229,21 @@ uint32_t NetworkController::getNetworkForDns(unsigned* netId, uid_t uid) const {
         // If the network is a VPN and it doesn't have DNS servers, use the default network's DNS
         // servers (through the default network). Otherwise, the query is guaranteed to fail.
         // http://b/29498052
-        Network *network = getNetworkLocked(*netId);
-        if (network && network->getType() == Network::VIRTUAL &&
-                !static_cast<VirtualNetwork *>(network)->getHasDns()) {
-            *netId = mDefaultNetId;
+        const Snapshot::NetworkInfo* network = snapshot->getNetwork(*netId);
+        if (network && network->type == Network::VIRTUAL && !network->hasDns) {
+            *netId = snapshot->defaultNetId;
         }
     } else {
         // If the user is subject to a VPN and the VPN provides DNS servers, use those servers
         // (possibly falling through to the default network if the VPN doesn't provide a route to
         // them). Otherwise, use the default network's DNS servers.
-        VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid);
-        if (virtualNetwork && virtualNetwork->getHasDns()) {
-            *netId = virtualNetwork->getNetId();
+        const Snapshot::NetworkInfo* virtualNetwork = snapshot->getVirtualNetworkForUser(uid);
+        if (virtualNetwork && virtualNetwork->hasDns) {
+            *netId = virtualNetwork->netId;
         } else {
             // TODO: return an error instead of silently doing the DNS lookup on the wrong network.
             // http://b/27560555
-            *netId = mDefaultNetId;
+            *netId = snapshot->defaultNetId;
         }
     }
     fwmark.netId = *netId;
@@ -223,11 +253,11 @@ uint32_t NetworkController::getNetworkForDns(unsigned* netId, uid_t uid) const {
 // Returns the NetId that a given UID would use if no network is explicitly selected. Specifically,
 // the VPN that applies to the UID if any; otherwise, the default network.
 unsigned NetworkController::getNetworkForUser(uid_t uid) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    if (VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid)) {
-        return virtualNetwork->getNetId();
+    RcuSnapshot<Snapshot>::Reader snapshot(mSnapshot);
+    if (const Snapshot::NetworkInfo* virtualNetwork = snapshot->getVirtualNetworkForUser(uid)) {
+        return virtualNetwork->netId;
     }
-    return mDefaultNetId;
+    return snapshot->defaultNetId;
 }
 
 // Returns the NetId that will be set when a socket connect()s. This is the bypassable VPN that
@@ -245,12 +275,12 @@ unsigned NetworkController::getNetworkForUser(uid_t uid) const {
 // the fallthrough rules also go away), the socket that used to fallthrough to the default network
 // will stop working.
 unsigned NetworkController::getNetworkForConnect(uid_t uid) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid);
-    if (virtualNetwork && !virtualNetwork->isSecure()) {
-        return virtualNetwork->getNetId();
+    RcuSnapshot<Snapshot>::Reader snapshot(mSnapshot);
+    const Snapshot::NetworkInfo* virtualNetwork = snapshot->getVirtualNetworkForUser(uid);
+    if (virtualNetwork && !virtualNetwork->secure) {
+        return virtualNetwork->netId;
     }
-    return mDefaultNetId;
+    return snapshot->defaultNetId;
 }
 
 void NetworkController::getNetworkContext(
@@ -306,9 +336,9 @@ unsigned NetworkController::getNetworkForInterface(const char* interface) const
 }
 
 bool NetworkController::isVirtualNetwork(unsigned netId) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    Network* network = getNetworkLocked(netId);
-    return network && network->getType() == Network::VIRTUAL;
+    RcuSnapshot<Snapshot>::Reader snapshot(mSnapshot);
+    const Snapshot::NetworkInfo* network = snapshot->getNetwork(netId);
+    return network && network->type == Network::VIRTUAL;
 }
 
 int NetworkController::createPhysicalNetwork(unsigned netId, Permission permission) {
@@ -330,7 +360,7 @@ int NetworkController::createPhysicalNetwork(unsigned netId, Permission permissi
         return ret;
     }
 
-    android::RWLock::AutoWLock lock(mRWLock);
+    ScopedWriteLock lock(this);
     mNetworks[netId] = physicalNetwork;
     return 0;
 }
@@ -346,7 +376,7 @@ int NetworkController::createVirtualNetwork(unsigned netId, bool hasDns, bool se
         return -EEXIST;
     }
 
-    android::RWLock::AutoWLock lock(mRWLock);
+    ScopedWriteLock lock(this);
     if (int ret = modifyFallthroughLocked(netId, true)) {
         return ret;
     }
@@ -366,7 +396,7 @@ int NetworkController::destroyNetwork(unsigned netId) {
 
     // TODO: ioctl(SIOCKILLADDR, ...) to kill all sockets on the old network.
 
-    android::RWLock::AutoWLock lock(mRWLock);
+    ScopedWriteLock lock(this);
     Network* network = getNetworkLocked(netId);
 
     // If we fail to destroy a network, things will get stuck badly. Therefore, unlike most of the
@@ -390,6 +420,11 @@ int NetworkController::destroyNetwork(unsigned netId) {
         }
     }
     mNetworks.erase(netId);
+    if (network->getType() == Network::VIRTUAL) {
+        VirtualNetwork* virtualNetwork = static_cast<VirtualNetwork*>(network);
+        mVpnUidIndex.remove(virtualNetwork, virtualNetwork->getUidRanges(),
+                            getVirtualNetworksLocked());
+    }
     delete network;
     _resolv_delete_cache_for_net(netId);
     return ret;
@@ -407,7 +442,7 @@ int NetworkController::addInterfaceToNetwork(unsigned netId, const char* interfa
         return -EBUSY;
     }
 
-    android::RWLock::AutoWLock lock(mRWLock);
+    ScopedWriteLock lock(this);
     return getNetworkLocked(netId)->addInterface(interface);
 }
 
@@ -417,31 +452,31 @@ int NetworkController::removeInterfaceFromNetwork(unsigned netId, const char* in
         return -ENONET;
     }
 
-    android::RWLock::AutoWLock lock(mRWLock);
+    ScopedWriteLock lock(this);
     return getNetworkLocked(netId)->removeInterface(interface);
 }
 
 Permission NetworkController::getPermissionForUser(uid_t uid) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    return getPermissionForUserLocked(uid);
+    RcuSnapshot<Snapshot>::Reader snapshot(mSnapshot);
+    return snapshot->getPermissionForUser(uid);
 }
 
 void NetworkController::setPermissionForUsers(Permission permission,
                                               const std::vector<uid_t>& uids) {
-    android::RWLock::AutoWLock lock(mRWLock);
+    ScopedWriteLock lock(this);
     for (uid_t uid : uids) {
         mUsers[uid] = permission;
     }
 }
 
 int NetworkController::checkUserNetworkAccess(uid_t uid, unsigned netId) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    return checkUserNetworkAccessLocked(uid, netId);
+    RcuSnapshot<Snapshot>::Reader snapshot(mSnapshot);
+    return snapshot->checkUserNetworkAccess(uid, netId);
 }
 
 int NetworkController::setPermissionForNetworks(Permission permission,
                                                 const std::vector<unsigned>& netIds) {
-    android::RWLock::AutoWLock lock(mRWLock);
+    ScopedWriteLock lock(this);
     for (unsigned netId : netIds) {
         Network* network = getNetworkLocked(netId);
         if (!network) {
@@ -461,7 +496,7 @@ int NetworkController::setPermissionForNetworks(Permission permission,
 }
 
 int NetworkController::addUsersToNetwork(unsigned netId, const UidRanges& uidRanges) {
-    android::RWLock::AutoWLock lock(mRWLock);
+    ScopedWriteLock lock(this);
     Network* network = getNetworkLocked(netId);
     if (!network) {
         ALOGE("no such netId %u", netId);
@@ -471,14 +506,16 @@ int NetworkController::addUsersToNetwork(unsigned netId, const UidRanges& uidRan
         ALOGE("cannot add users to non-virtual network with netId %u", netId);
         return -EINVAL;
     }
-    if (int ret = static_cast<VirtualNetwork*>(network)->addUsers(uidRanges, mProtectableUsers)) {
+    VirtualNetwork* virtualNetwork = static_cast<VirtualNetwork*>(network);
+    if (int ret = virtualNetwork->addUsers(uidRanges, mProtectableUsers)) {
         return ret;
     }
+    mVpnUidIndex.add(virtualNetwork, uidRanges);
     return 0;
 }
 
 int NetworkController::removeUsersFromNetwork(unsigned netId, const UidRanges& uidRanges) {
-    android::RWLock::AutoWLock lock(mRWLock);
+    ScopedWriteLock lock(this);
     Network* network = getNetworkLocked(netId);
     if (!network) {
         ALOGE("no such netId %u", netId);
@@ -488,10 +525,11 @@ int NetworkController::removeUsersFromNetwork(unsigned netId, const UidRanges& u
         ALOGE("cannot remove users from non-virtual network with netId %u", netId);
         return -EINVAL;
     }
-    if (int ret = static_cast<VirtualNetwork*>(network)->removeUsers(uidRanges,
-                                                                     mProtectableUsers)) {
+    VirtualNetwork* virtualNetwork = static_cast<VirtualNetwork*>(network);
+    if (int ret = virtualNetwork->removeUsers(uidRanges, mProtectableUsers)) {
         return ret;
     }
+    mVpnUidIndex.remove(virtualNetwork, uidRanges, getVirtualNetworksLocked());
     return 0;
 }
 
@@ -506,18 +544,17 @@ int NetworkController::removeRoute(unsigned netId, const char* interface, const
 }
 
 bool NetworkController::canProtect(uid_t uid) const {
-    android::RWLock::AutoRLock lock(mRWLock);
-    return ((getPermissionForUserLocked(uid) & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) ||
-           mProtectableUsers.find(uid) != mProtectableUsers.end();
+    RcuSnapshot<Snapshot>::Reader snapshot(mSnapshot);
+    return snapshot->canProtect(uid);
 }
 
 void NetworkController::allowProtect(const std::vector<uid_t>& uids) {
-    android::RWLock::AutoWLock lock(mRWLock);
+    ScopedWriteLock lock(this);
     mProtectableUsers.insert(uids.begin(), uids.end());
 }
 
 void NetworkController::denyProtect(const std::vector<uid_t>& uids) {
-    android::RWLock::AutoWLock lock(mRWLock);
+    ScopedWriteLock lock(this);
     for (uid_t uid : uids) {
         mProtectableUsers.erase(uid);
     }
@@ -564,28 +601,111 @@ Network* NetworkController::getNetworkLocked(unsigned netId) const {
     return iter == mNetworks.end() ? NULL : iter->second;
 }
 
-VirtualNetwork* NetworkController::getVirtualNetworkForUserLocked(uid_t uid) const {
+void NetworkController::publishSnapshotLocked() {
+    Snapshot* snapshot = new Snapshot();
+    snapshot->defaultNetId = mDefaultNetId;
     for (const auto& entry : mNetworks) {
-        if (entry.second->getType() == Network::VIRTUAL) {
+        Snapshot::NetworkInfo& info = snapshot->networks[entry.first];
+        info.netId = entry.first;
+        info.type = entry.second->getType();
+        info.permission = PERMISSION_NONE;
+        info.hasDns = false;
+        info.secure = false;
+        if (info.type == Network::PHYSICAL) {
+            info.permission = static_cast<PhysicalNetwork*>(entry.second)->getPermission();
+        } else if (info.type == Network::VIRTUAL) {
             VirtualNetwork* virtualNetwork = static_cast<VirtualNetwork*>(entry.second);
-            if (virtualNetwork->appliesToUser(uid)) {
-                return virtualNetwork;
-            }
+            info.hasDns = virtualNetwork->getHasDns();
+            info.secure = virtualNetwork->isSecure();
+            info.uidRanges = virtualNetwork->getUidRanges();
+        }
+    }
+    for (const auto& entry : mVpnUidIndex.getEntries()) {
+        const Snapshot::NetworkInfo* info = &snapshot->networks[entry.second.network->getNetId()];
+        snapshot->vpnUidIndex.emplace_hint(snapshot->vpnUidIndex.end(), entry.first,
+                                           Snapshot::UidRangeEntry{entry.second.end, info});
+    }
+    snapshot->users = mUsers;
+    snapshot->protectableUsers = mProtectableUsers;
+    mSnapshot.publish(snapshot);
+
+    // Only after the snapshot is visible. Otherwise, a client that sees the new generation could
+    // still get an answer from the old snapshot, and cache it under the new generation.
+    if (mGeneration && mGeneration->generation.fetch_add(1) + 1 == 0) {
+        mGeneration->generation.fetch_add(1);
+    }
+}
+
+void NetworkController::openGenerationFile() {
+    // Clients only ever get a read-only file descriptor from fwmarkd, so nobody else needs to open
+    // the file.
+    int fd = open(GENERATION_FILE, O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0600);
+    if (fd == -1) {
+        ALOGE("cannot open %s (%s)", GENERATION_FILE, strerror(errno));
+        return;
+    }
+    if (ftruncate(fd, sizeof(FwmarkGeneration)) == -1) {
+        ALOGE("cannot resize %s (%s)", GENERATION_FILE, strerror(errno));
+        close(fd);
+        return;
+    }
+    void* page = mmap(NULL, sizeof(FwmarkGeneration), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+        ALOGE("cannot map %s (%s)", GENERATION_FILE, strerror(errno));
+        return;
+    }
+    mGenerationFd = open(GENERATION_FILE, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (mGenerationFd == -1) {
+        ALOGE("cannot reopen %s (%s)", GENERATION_FILE, strerror(errno));
+        munmap(page, sizeof(FwmarkGeneration));
+        return;
+    }
+    // A new file reads as zero, which is not a valid generation. Publishing the first snapshot
+    // makes it nonzero.
+    mGeneration = static_cast<FwmarkGeneration*>(page);
+}
+
+int NetworkController::getGenerationFd() const {
+    return mGenerationFd;
+}
+
+std::vector<VirtualNetwork*> NetworkController::getVirtualNetworksLocked() const {
+    std::vector<VirtualNetwork*> virtualNetworks;
+    for (const auto& entry : mNetworks) {
+        if (entry.second->getType() == Network::VIRTUAL) {
+            virtualNetworks.push_back(static_cast<VirtualNetwork*>(entry.second));
         }
     }
-    return NULL;
+    return virtualNetworks;
+}
+
+const NetworkController::Snapshot::NetworkInfo*
+NetworkController::Snapshot::getNetwork(unsigned netId) const {
+    auto iter = networks.find(netId);
+    return iter == networks.end() ? NULL : &iter->second;
 }
 
-Permission NetworkController::getPermissionForUserLocked(uid_t uid) const {
-    auto iter = mUsers.find(uid);
-    if (iter != mUsers.end()) {
+const NetworkController::Snapshot::NetworkInfo*
+NetworkController::Snapshot::getVirtualNetworkForUser(uid_t uid) const {
+    auto iter = vpnUidIndex.upper_bound(uid);
+    if (iter == vpnUidIndex.begin()) {
+        return NULL;
+    }
+    --iter;
+    return uid <= iter->second.end ? iter->second.network : NULL;
+}
+
+Permission NetworkController::Snapshot::getPermissionForUser(uid_t uid) const {
+    auto iter = users.find(uid);
+    if (iter != users.end()) {
         return iter->second;
     }
     return uid < FIRST_APPLICATION_UID ? PERMISSION_SYSTEM : PERMISSION_NONE;
 }
 
-int NetworkController::checkUserNetworkAccessLocked(uid_t uid, unsigned netId) const {
-    Network* network = getNetworkLocked(netId);
+int NetworkController::Snapshot::checkUserNetworkAccess(uid_t uid, unsigned netId) const {
+    const NetworkInfo* network = getNetwork(netId);
     if (!network) {
         return -ENONET;
     }
@@ -595,22 +715,27 @@ int NetworkController::checkUserNetworkAccessLocked(uid_t uid, unsigned netId) c
     if (uid == INVALID_UID) {
         return -EREMOTEIO;
     }
-    Permission userPermission = getPermissionForUserLocked(uid);
+    Permission userPermission = getPermissionForUser(uid);
     if ((userPermission & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) {
         return 0;
     }
-    if (network->getType() == Network::VIRTUAL) {
-        return static_cast<VirtualNetwork*>(network)->appliesToUser(uid) ? 0 : -EPERM;
+    if (network->type == Network::VIRTUAL) {
+        return network->uidRanges.hasUid(uid) ? 0 : -EPERM;
     }
-    VirtualNetwork* virtualNetwork = getVirtualNetworkForUserLocked(uid);
-    if (virtualNetwork && virtualNetwork->isSecure() &&
-            mProtectableUsers.find(uid) == mProtectableUsers.end()) {
+    const NetworkInfo* virtualNetwork = getVirtualNetworkForUser(uid);
+    if (virtualNetwork && virtualNetwork->secure &&
+            protectableUsers.find(uid) == protectableUsers.end()) {
         return -EPERM;
     }
-    Permission networkPermission = static_cast<PhysicalNetwork*>(network)->getPermission();
+    Permission networkPermission = network->permission;
     return ((userPermission & networkPermission) == networkPermission) ? 0 : -EACCES;
 }
 
+bool NetworkController::Snapshot::canProtect(uid_t uid) const {
+    return ((getPermissionForUser(uid) & PERMISSION_SYSTEM) == PERMISSION_SYSTEM) ||
+           protectableUsers.find(uid) != protectableUsers.end();
+}
+
 int NetworkController::modifyRoute(unsigned netId, const char* interface, const char* destination,
                                    const char* nexthop, bool add, bool legacy, uid_t uid) {
     if (!isValidNetwork(netId)) {
@@ -18,7 +18,11 @@
 #define NETD_SERVER_NETWORK_CONTROLLER_H
 
 #include "NetdConstants.h"
+#include "Network.h"
 #include "Permission.h"
+#include "RcuSnapshot.h"
+#include "UidRanges.h"
+#include "VpnUidIndex.h"
 
 #include "utils/RWLock.h"
 
@@ -29,9 +33,8 @@
 #include <vector>
 
 class DumpWriter;
-class Network;
-class UidRanges;
 class VirtualNetwork;
+struct FwmarkGeneration;
 
 /*
  * Keeps track of default, per-pid, and per-uid-range network selection, as
@@ -91,14 +94,61 @@ public:
     void allowProtect(const std::vector<uid_t>& uids);
     void denyProtect(const std::vector<uid_t>& uids);
 
+    // Returns a read-only file descriptor for a file that holds a FwmarkGeneration, which is
+    // incremented whenever a snapshot is published, or -1 if it couldn't be created. The caller
+    // must not close it.
+    int getGenerationFd() const;
+
     void dump(DumpWriter& dw);
 
 private:
+    // An immutable copy of the state that routing decisions need. Readers get it from mSnapshot
+    // without taking mRWLock, and writers replace it whenever they change that state.
+    struct Snapshot {
+        struct NetworkInfo {
+            unsigned netId;
+            Network::Type type;
+            Permission permission;  // Only for physical networks.
+            bool hasDns;            // Only for VPNs.
+            bool secure;            // Only for VPNs.
+            UidRanges uidRanges;    // Only for VPNs.
+        };
+
+        struct UidRangeEntry {
+            uid_t end;
+            const NetworkInfo* network;  // Points into |networks|.
+        };
+
+        const NetworkInfo* getNetwork(unsigned netId) const;
+        const NetworkInfo* getVirtualNetworkForUser(uid_t uid) const;
+        Permission getPermissionForUser(uid_t uid) const;
+        int checkUserNetworkAccess(uid_t uid, unsigned netId) const;
+        bool canProtect(uid_t uid) const;
+
+        unsigned defaultNetId;
+        std::map<unsigned, NetworkInfo> networks;  // Map keys are NetIds.
+        std::map<uid_t, UidRangeEntry> vpnUidIndex;  // Same as mVpnUidIndex.
+        std::map<uid_t, Permission> users;
+        std::set<uid_t> protectableUsers;
+    };
+
+    // Holds mRWLock for writing, and publishes a new snapshot of the state when it goes out of
+    // scope. All methods that change the state in Snapshot must use this instead of AutoWLock.
+    class ScopedWriteLock {
+    public:
+        explicit ScopedWriteLock(NetworkController* networkController);
+        ~ScopedWriteLock();
+
+    private:
+        NetworkController* const mNetworkController;
+        android::RWLock::AutoWLock mLock;
+    };
+
     bool isValidNetwork(unsigned netId) const;
     Network* getNetworkLocked(unsigned netId) const;
-    VirtualNetwork* getVirtualNetworkForUserLocked(uid_t uid) const;
-    Permission getPermissionForUserLocked(uid_t uid) const;
-    int checkUserNetworkAccessLocked(uid_t uid, unsigned netId) const;
+    void publishSnapshotLocked();
+    void openGenerationFile();
+    std::vector<VirtualNetwork*> getVirtualNetworksLocked() const;
 
     int modifyRoute(unsigned netId, const char* interface, const char* destination,
                     const char* nexthop, bool add, bool legacy, uid_t uid) WARN_UNUSED_RESULT;
@@ -107,12 +157,22 @@ private:
     class DelegateImpl;
     DelegateImpl* const mDelegateImpl;
 
-    // mRWLock guards all accesses to mDefaultNetId, mNetworks, mUsers and mProtectableUsers.
+    // mRWLock guards all accesses to mDefaultNetId, mNetworks, mVpnUidIndex, mUsers and
+    // mProtectableUsers.
     mutable android::RWLock mRWLock;
     unsigned mDefaultNetId;
     std::map<unsigned, Network*> mNetworks;  // Map keys are NetIds.
+    VpnUidIndex mVpnUidIndex;
     std::map<uid_t, Permission> mUsers;
     std::set<uid_t> mProtectableUsers;
+
+    RcuSnapshot<Snapshot> mSnapshot;
+
+    // Mapped from a file at a fixed path rather than from anonymous memory, so that if netd
+    // restarts, it carries on from the previous generation and clients of the old netd see the
+    // change.
+    FwmarkGeneration* mGeneration;
+    int mGenerationFd;
 };
 
 #endif  // NETD_SERVER_NETWORK_CONTROLLER_H
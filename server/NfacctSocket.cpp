@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "NfacctSocket.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_acct.h>
+
+namespace {
+
+// The largest datagram the kernel sends for a dump.
+const size_t BUFFER_SIZE = 32768;
+
+// Requests per write. The acks of a batch must fit into the socket's receive buffer.
+const size_t MAX_REQUEST_BATCH = 64;
+
+struct NfacctRequest {
+    nlmsghdr nlh;
+    nfgenmsg nfh;
+    nlattr nla;
+    char name[NFACCT_NAME_MAX];
+} __attribute__((__packed__));
+
+}  // namespace
+
+NfacctSocket::NfacctSocket() : mSock(-1), mSeq(0) {
+}
+
+NfacctSocket::~NfacctSocket() {
+    closeSocket();
+}
+
+int NfacctSocket::create(const std::vector<std::string>& names) {
+    return sendRequests(NFNL_MSG_ACCT_NEW, NLM_F_CREATE | NLM_F_REPLACE, names);
+}
+
+int NfacctSocket::remove(const std::vector<std::string>& names) {
+    return sendRequests(NFNL_MSG_ACCT_DEL, 0, names);
+}
+
+int NfacctSocket::openSocket() {
+    if (mSock != -1) {
+        return 0;
+    }
+    int sock = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_NETFILTER);
+    if (sock == -1) {
+        return -errno;
+    }
+    sockaddr_nl nl = { .nl_family = AF_NETLINK };
+    if (connect(sock, reinterpret_cast<sockaddr *>(&nl), sizeof(nl)) == -1) {
+        int err = errno;
+        close(sock);
+        return -err;
+    }
+    mSock = sock;
+    mBuffer.resize(BUFFER_SIZE);
+    return 0;
+}
+
+void NfacctSocket::closeSocket() {
+    if (mSock != -1) {
+        close(mSock);
+        mSock = -1;
+    }
+}
+
+int NfacctSocket::sendRequests(uint16_t type, uint16_t flags,
+                              const std::vector<std::string>& names) {
+    int res = openSocket();
+    if (res) {
+        return res;
+    }
+
+    int firstError = 0;
+    std::vector<NfacctRequest> requests;
+    for (size_t start = 0; start < names.size(); start += MAX_REQUEST_BATCH) {
+        const size_t count = std::min(MAX_REQUEST_BATCH, names.size() - start);
+        const uint32_t firstSeq = mSeq + 1;
+        requests.assign(count, NfacctRequest());
+        for (size_t i = 0; i < count; i++) {
+            NfacctRequest& request = requests[i];
+            const std::string& name = names[start + i];
+            if (name.size() >= NFACCT_NAME_MAX) {
+                return -ENAMETOOLONG;
+            }
+            request.nlh.nlmsg_len = sizeof(request);
+            request.nlh.nlmsg_type = (NFNL_SUBSYS_ACCT << 8) | type;
+            request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+            request.nlh.nlmsg_seq = ++mSeq;
+            request.nfh.nfgen_family = AF_UNSPEC;
+            request.nfh.version = NFNETLINK_V0;
+            request.nla.nla_type = NFACCT_NAME;
+            // The whole name buffer, so that the request has no bytes after its last attribute.
+            request.nla.nla_len = sizeof(request.nla) + sizeof(request.name);
+            memcpy(request.name, name.c_str(), name.size() + 1);
+        }
+        const ssize_t len = count * sizeof(NfacctRequest);
+        if (write(mSock, requests.data(), len) != len) {
+            const int err = errno;
+            closeSocket();
+            return -err;
+        }
+
+        // Every request gets an ack, in order. Anything else is left over from a request that
+        // failed before all its replies were read, and is skipped.
+        size_t acks = 0;
+        while (acks < count) {
+            ssize_t bytesRead = recv(mSock, mBuffer.data(), mBuffer.size(), 0);
+            if (bytesRead < 0) {
+                const int err = errno;
+                closeSocket();
+                return -err;
+            }
+            for (nlmsghdr *nlh = reinterpret_cast<nlmsghdr *>(mBuffer.data());
+                    NLMSG_OK(nlh, bytesRead); nlh = NLMSG_NEXT(nlh, bytesRead)) {
+                if (nlh->nlmsg_type != NLMSG_ERROR || nlh->nlmsg_seq - firstSeq >= count) {
+                    continue;
+                }
+                const nlmsgerr *err = reinterpret_cast<const nlmsgerr *>(NLMSG_DATA(nlh));
+                if (err->error && !firstError) {
+                    firstError = err->error;
+                }
+                acks++;
+            }
+        }
+    }
+    return firstError;
+}
+
+int NfacctSocket::dump(const DumpCallback& callback) {
+    int res = openSocket();
+    if (res) {
+        return res;
+    }
+
+    struct {
+        nlmsghdr nlh;
+        nfgenmsg nfh;
+    } __attribute__((__packed__)) request = {};
+    request.nlh.nlmsg_len = sizeof(request);
+    request.nlh.nlmsg_type = (NFNL_SUBSYS_ACCT << 8) | NFNL_MSG_ACCT_GET;
+    request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.nlh.nlmsg_seq = ++mSeq;
+    request.nfh.nfgen_family = AF_UNSPEC;
+    request.nfh.version = NFNETLINK_V0;
+    if (write(mSock, &request, sizeof(request)) != sizeof(request)) {
+        const int err = errno;
+        closeSocket();
+        return -err;
+    }
+
+    while (true) {
+        ssize_t bytesRead = recv(mSock, mBuffer.data(), mBuffer.size(), 0);
+        if (bytesRead < 0) {
+            // The rest of the dump may still come. A new socket won't get it.
+            const int err = errno;
+            closeSocket();
+            return -err;
+        }
+        for (nlmsghdr *nlh = reinterpret_cast<nlmsghdr *>(mBuffer.data());
+                NLMSG_OK(nlh, bytesRead); nlh = NLMSG_NEXT(nlh, bytesRead)) {
+            if (nlh->nlmsg_seq != request.nlh.nlmsg_seq) {
+                continue;
+            }
+            if (nlh->nlmsg_type == NLMSG_DONE) {
+                return 0;
+            }
+            if (nlh->nlmsg_type == NLMSG_ERROR) {
+                return reinterpret_cast<const nlmsgerr *>(NLMSG_DATA(nlh))->error;
+            }
+            if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(nfgenmsg))) {
+                continue;
+            }
+
+            const char *name = nullptr;
+            uint64_t packets = 0, bytes = 0;
+            const char *attrs = reinterpret_cast<const char *>(NLMSG_DATA(nlh)) +
+                                NLMSG_ALIGN(sizeof(nfgenmsg));
+            ssize_t remaining = nlh->nlmsg_len - NLMSG_LENGTH(sizeof(nfgenmsg));
+            while (remaining >= (ssize_t) sizeof(nlattr)) {
+                const nlattr *nla = reinterpret_cast<const nlattr *>(attrs);
+                if (nla->nla_len < sizeof(nlattr) || nla->nla_len > remaining) break;
+                const char *data = attrs + NLA_HDRLEN;
+                const size_t dataLen = nla->nla_len - NLA_HDRLEN;
+                switch (nla->nla_type & NLA_TYPE_MASK) {
+                    case NFACCT_NAME:
+                        if (dataLen > 0 && memchr(data, '\0', dataLen)) name = data;
+                        break;
+                    case NFACCT_PKTS:
+                    case NFACCT_BYTES:
+                        if (dataLen == sizeof(uint64_t)) {
+                            uint64_t value;
+                            memcpy(&value, data, sizeof(value));
+                            // nfacct counters are big-endian.
+                            ((nla->nla_type & NLA_TYPE_MASK) == NFACCT_PKTS ? packets : bytes) =
+                                    be64toh(value);
+                        }
+                        break;
+                }
+                remaining -= NLA_ALIGN(nla->nla_len);
+                attrs += NLA_ALIGN(nla->nla_len);
+            }
+            if (name) {
+                callback(name, packets, bytes);
+            }
+        }
+    }
+}
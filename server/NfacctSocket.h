@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_NFACCT_SOCKET_H
+#define NETD_SERVER_NFACCT_SOCKET_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+class UidCountersTest;
+
+/*
+ * Creates, deletes and dumps nfacct objects over NETLINK_NETFILTER. Objects are created and
+ * deleted in batches, with one write per batch, and dumped with their counters as binary
+ * attributes.
+ *
+ * Not thread-safe.
+ */
+class NfacctSocket {
+public:
+    // Called with the name, packets and bytes of each nfacct object in a dump.
+    typedef std::function<void(const char *name, uint64_t packets, uint64_t bytes)> DumpCallback;
+
+    NfacctSocket();
+    ~NfacctSocket();
+
+    // Creates the objects called |names|, or resets those that exist. Returns the first error.
+    int create(const std::vector<std::string>& names);
+    // Deletes the objects called |names|. Returns the first error, e.g. -EBUSY if a rule still
+    // uses one, or -ENOENT if one doesn't exist.
+    int remove(const std::vector<std::string>& names);
+    // Reads all nfacct objects. Returns 0 or a negative errno.
+    int dump(const DumpCallback& callback);
+
+private:
+    friend class UidCountersTest;
+
+    NfacctSocket(const NfacctSocket&) = delete;
+    NfacctSocket& operator=(const NfacctSocket&) = delete;
+
+    int openSocket();
+    // Closes the socket after an error, since it may still hold replies to earlier requests.
+    void closeSocket();
+    // Sends one request per name, with a single write, and reads the acks. Returns the first error.
+    int sendRequests(uint16_t type, uint16_t flags, const std::vector<std::string>& names);
+
+    int mSock;
+    uint32_t mSeq;
+    std::vector<char> mBuffer;
+};
+
+#endif  // NETD_SERVER_NFACCT_SOCKET_H
@@ -0,0 +1,161 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "QuotaRegistry"
+
+#include "QuotaRegistry.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define __STDC_FORMAT_MACROS 1
+#include <inttypes.h>
+
+#include <cutils/log.h>
+
+const char QuotaRegistry::DEFAULT_DIRECTORY[] = "/proc/net/xt_quota";
+
+QuotaRegistry::QuotaRegistry(const std::string& directory) : mDirectory(directory) {
+}
+
+QuotaRegistry::~QuotaRegistry() {
+    forgetAll();
+}
+
+int QuotaRegistry::get(const std::string& name, int64_t *bytes) {
+    int fd = getFd(name);
+    if (fd < 0) {
+        return fd;
+    }
+    int res = read(fd, bytes);
+    if (res) {
+        forget(name);
+        if ((fd = getFd(name)) < 0) {
+            return fd;
+        }
+        res = read(fd, bytes);
+    }
+    if (res) {
+        ALOGE("Reading quota %s failed (%s)", name.c_str(), strerror(-res));
+    }
+    return res;
+}
+
+int QuotaRegistry::set(const std::string& name, int64_t bytes) {
+    int fd = getFd(name);
+    if (fd < 0) {
+        return fd;
+    }
+    int res = write(fd, bytes);
+    if (res) {
+        forget(name);
+        if ((fd = getFd(name)) < 0) {
+            return fd;
+        }
+        res = write(fd, bytes);
+    }
+    if (res) {
+        ALOGE("Updating quota %s failed (%s)", name.c_str(), strerror(-res));
+    }
+    return res;
+}
+
+int QuotaRegistry::getAll(const std::vector<std::string>& names, QuotaList *quotas) {
+    int firstError = 0;
+    quotas->reserve(quotas->size() + names.size());
+    for (const auto& name : names) {
+        int64_t bytes;
+        int res = get(name, &bytes);
+        if (res) {
+            if (!firstError) firstError = res;
+            continue;
+        }
+        quotas->emplace_back(name, bytes);
+    }
+    return firstError;
+}
+
+void QuotaRegistry::forget(const std::string& name) {
+    auto it = mFds.find(name);
+    if (it == mFds.end()) {
+        return;
+    }
+    close(it->second);
+    mFds.erase(it);
+}
+
+void QuotaRegistry::forgetAll() {
+    for (const auto& it : mFds) {
+        close(it.second);
+    }
+    mFds.clear();
+}
+
+void QuotaRegistry::setDirectory(const std::string& directory) {
+    forgetAll();
+    mDirectory = directory;
+}
+
+int QuotaRegistry::getFd(const std::string& name) {
+    auto it = mFds.find(name);
+    if (it != mFds.end()) {
+        return it->second;
+    }
+
+    // Quota names end up in a path.
+    if (name.empty() || name[0] == '.' || name.find('/') != std::string::npos) {
+        ALOGE("Invalid quota name \"%s\"", name.c_str());
+        return -EINVAL;
+    }
+    const std::string path = mDirectory + "/" + name;
+    int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        int err = errno;
+        ALOGE("Opening quota %s failed (%s)", name.c_str(), strerror(err));
+        return -err;
+    }
+    mFds[name] = fd;
+    return fd;
+}
+
+int QuotaRegistry::read(int fd, int64_t *bytes) {
+    ssize_t len = pread(fd, mBuffer, sizeof(mBuffer) - 1, 0);
+    if (len < 0) {
+        return -errno;
+    }
+    mBuffer[len] = '\0';
+    char *end;
+    errno = 0;
+    long long value = strtoll(mBuffer, &end, 10);
+    if (end == mBuffer || (*end != '\n' && *end != '\0') || errno) {
+        return -EINVAL;
+    }
+    *bytes = value;
+    return 0;
+}
+
+int QuotaRegistry::write(int fd, int64_t bytes) {
+    int len = snprintf(mBuffer, sizeof(mBuffer), "%" PRId64 "\n", bytes);
+    ssize_t written = pwrite(fd, mBuffer, len, 0);
+    if (written < 0) {
+        return -errno;
+    }
+    return (written == len) ? 0 : -EIO;
+}
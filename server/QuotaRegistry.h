@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_QUOTA_REGISTRY_H
+#define NETD_SERVER_QUOTA_REGISTRY_H
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/*
+ * Reads and writes the xt_quota2 counters in /proc/net/xt_quota/<name>.
+ *
+ * The file of each quota is opened the first time it is used and then kept open, and values are
+ * read with pread() into one buffer, so polling a quota costs one system call. A quota's file goes
+ * away with the last rule that uses it, so callers must forget() a quota when they delete it. If
+ * a read or write fails anyway, the file is opened again once, in case the quota was recreated.
+ *
+ * Not thread-safe. BandwidthController only uses it under its lock.
+ */
+class QuotaRegistry {
+public:
+    typedef std::vector<std::pair<std::string, int64_t>> QuotaList;
+
+    static const char DEFAULT_DIRECTORY[];
+
+    explicit QuotaRegistry(const std::string& directory = DEFAULT_DIRECTORY);
+    ~QuotaRegistry();
+
+    // Reads the bytes left in quota |name|. Returns 0 or a negative errno.
+    int get(const std::string& name, int64_t *bytes);
+    // Sets the bytes left in quota |name|. Returns 0 or a negative errno.
+    int set(const std::string& name, int64_t bytes);
+
+    /*
+     * Reads each of |names| and appends the names and bytes left to |quotas|. Quotas that can't be
+     * read are left out. Returns 0 if all of them were read, or the first error.
+     */
+    int getAll(const std::vector<std::string>& names, QuotaList *quotas);
+
+    // Closes the file of quota |name|, if it is open.
+    void forget(const std::string& name);
+    // Closes all files.
+    void forgetAll();
+
+    // For testing. Closes all files, and opens the quotas in |directory| from now on.
+    void setDirectory(const std::string& directory);
+
+private:
+    QuotaRegistry(const QuotaRegistry&) = delete;
+    QuotaRegistry& operator=(const QuotaRegistry&) = delete;
+
+    // Returns the open file of quota |name|, or a negative errno.
+    int getFd(const std::string& name);
+    int read(int fd, int64_t *bytes);
+    int write(int fd, int64_t bytes);
+
+    std::string mDirectory;
+    std::unordered_map<std::string, int> mFds;
+    // Long enough for any int64_t and a newline.
+    char mBuffer[32];
+};
+
+#endif  // NETD_SERVER_QUOTA_REGISTRY_H
@@ -0,0 +1,143 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * QuotaRegistryTest.cpp - unit tests for QuotaRegistry.cpp
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <android-base/file.h>
+
+#include "QuotaRegistry.h"
+
+using android::base::ReadFileToString;
+using android::base::WriteStringToFile;
+
+class QuotaRegistryTest : public ::testing::Test {
+protected:
+    QuotaRegistryTest() {
+        char dir[] = "/data/local/tmp/quota_registry_test.XXXXXX";
+        EXPECT_NE(nullptr, mkdtemp(dir));
+        mDir = dir;
+    }
+
+    ~QuotaRegistryTest() {
+        for (const auto& name : mFiles) {
+            unlink(path(name).c_str());
+        }
+        rmdir(mDir.c_str());
+    }
+
+    std::string path(const std::string& name) {
+        return mDir + "/" + name;
+    }
+
+    // Creates or rewrites the counter file of quota |name|, like xt_quota2 prints it.
+    void writeQuota(const std::string& name, const std::string& contents) {
+        ASSERT_TRUE(WriteStringToFile(contents, path(name)));
+        mFiles.push_back(name);
+    }
+
+    std::string readQuota(const std::string& name) {
+        std::string contents;
+        EXPECT_TRUE(ReadFileToString(path(name), &contents));
+        return contents;
+    }
+
+    std::string mDir;
+    std::vector<std::string> mFiles;
+};
+
+TEST_F(QuotaRegistryTest, TestGetAndSet) {
+    QuotaRegistry registry(mDir);
+    writeQuota("rmnet0", "123456\n");
+
+    int64_t bytes = 0;
+    EXPECT_EQ(0, registry.get("rmnet0", &bytes));
+    EXPECT_EQ(123456, bytes);
+
+    // The file stays open, and each read starts from the beginning.
+    writeQuota("rmnet0", "9876543210\n");
+    EXPECT_EQ(0, registry.get("rmnet0", &bytes));
+    EXPECT_EQ(9876543210, bytes);
+
+    EXPECT_EQ(0, registry.set("rmnet0", 42));
+    EXPECT_EQ("42\n", readQuota("rmnet0").substr(0, 3));
+    EXPECT_EQ(0, registry.get("rmnet0", &bytes));
+    EXPECT_EQ(42, bytes);
+}
+
+TEST_F(QuotaRegistryTest, TestErrors) {
+    QuotaRegistry registry(mDir);
+    int64_t bytes = 7;
+
+    EXPECT_EQ(-ENOENT, registry.get("rmnet0", &bytes));
+    EXPECT_EQ(-ENOENT, registry.set("rmnet0", 1));
+    EXPECT_EQ(7, bytes);
+
+    EXPECT_EQ(-EINVAL, registry.get("", &bytes));
+    EXPECT_EQ(-EINVAL, registry.get("..", &bytes));
+    EXPECT_EQ(-EINVAL, registry.get("../rmnet0", &bytes));
+
+    writeQuota("wlan0", "garbage\n");
+    EXPECT_EQ(-EINVAL, registry.get("wlan0", &bytes));
+    EXPECT_EQ(7, bytes);
+}
+
+TEST_F(QuotaRegistryTest, TestReopensRecreatedQuota) {
+    QuotaRegistry registry(mDir);
+    int64_t bytes;
+    writeQuota("rmnet0", "100\n");
+    EXPECT_EQ(0, registry.get("rmnet0", &bytes));
+
+    // A quota that was deleted and added again has a new file, and the old one can't be read any
+    // more. Here, the old file is left empty instead.
+    ASSERT_EQ(0, truncate(path("rmnet0").c_str(), 0));
+    ASSERT_EQ(0, unlink(path("rmnet0").c_str()));
+    writeQuota("rmnet0", "200\n");
+    EXPECT_EQ(0, registry.get("rmnet0", &bytes));
+    EXPECT_EQ(200, bytes);
+
+    // Once the quota is forgotten and gone, reads fail.
+    ASSERT_EQ(0, unlink(path("rmnet0").c_str()));
+    registry.forget("rmnet0");
+    EXPECT_EQ(-ENOENT, registry.get("rmnet0", &bytes));
+}
+
+TEST_F(QuotaRegistryTest, TestGetAll) {
+    QuotaRegistry registry(mDir);
+    writeQuota("shared", "1000\n");
+    writeQuota("rmnet0", "2000\n");
+    writeQuota("wlan0", "0\n");
+
+    QuotaRegistry::QuotaList quotas;
+    EXPECT_EQ(0, registry.getAll({ "rmnet0", "shared", "wlan0" }, &quotas));
+    QuotaRegistry::QuotaList expected = { { "rmnet0", 2000 }, { "shared", 1000 }, { "wlan0", 0 } };
+    EXPECT_EQ(expected, quotas);
+
+    // Missing quotas are left out, and reported.
+    quotas.clear();
+    EXPECT_EQ(-ENOENT, registry.getAll({ "rmnet1", "rmnet0" }, &quotas));
+    expected = { { "rmnet0", 2000 } };
+    EXPECT_EQ(expected, quotas);
+}
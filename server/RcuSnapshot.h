@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_RCU_SNAPSHOT_H
+#define NETD_SERVER_RCU_SNAPSHOT_H
+
+#include <sched.h>
+#include <unistd.h>
+
+#include <atomic>
+
+/*
+ * Publishes an immutable object of type T to readers that must never block, in the style of RCU
+ * (read-copy-update). A writer builds a new object and passes it to publish(). Readers see either
+ * the old object or the new one, and the old one is deleted once no reader can still be using it.
+ *
+ *   RcuSnapshot<State> state(new State());
+ *
+ *   // Any thread:
+ *   RcuSnapshot<State>::Reader reader(state);
+ *   use(reader->value);
+ *
+ *   // Writers, which must be serialized by the caller:
+ *   state.publish(new State(...));
+ *
+ * Readers only increment and decrement a counter. They never wait for a writer, and a writer never
+ * waits for readers that started after it published. publish() waits for the readers that may
+ * still see the old object, so a Reader must not be held for long, and must never be held by the
+ * thread that calls publish().
+ */
+template <typename T>
+class RcuSnapshot {
+public:
+    // Takes ownership of |initial|, which must not be null.
+    explicit RcuSnapshot(const T* initial) : mCurrent(initial), mEpoch(0) {
+        mReaders[0] = 0;
+        mReaders[1] = 0;
+    }
+
+    ~RcuSnapshot() {
+        delete mCurrent.load();
+    }
+
+    // A read-side critical section. The object it points to stays valid until it goes out of scope.
+    class Reader {
+    public:
+        explicit Reader(const RcuSnapshot& snapshot) :
+                mReaders(&snapshot.mReaders[snapshot.mEpoch.load() & 1]) {
+            // The counter must be incremented before the pointer is loaded. Otherwise, a writer
+            // could see no readers and delete the object that this reader is about to load.
+            mReaders->fetch_add(1);
+            mObject = snapshot.mCurrent.load();
+        }
+
+        ~Reader() {
+            mReaders->fetch_sub(1);
+        }
+
+        const T& operator*() const { return *mObject; }
+        const T* operator->() const { return mObject; }
+
+    private:
+        Reader(const Reader&) = delete;
+        Reader& operator=(const Reader&) = delete;
+
+        std::atomic<unsigned>* const mReaders;
+        const T* mObject;
+    };
+
+    // Returns the current object. Only for use by writers.
+    const T* get() const {
+        return mCurrent.load();
+    }
+
+    // Makes |next| visible to new readers, waits until no reader can still see the previous object,
+    // and deletes it. Takes ownership of |next|, which must not be null.
+    void publish(const T* next) {
+        const T* previous = mCurrent.exchange(next);
+        synchronize();
+        delete previous;
+    }
+
+private:
+    RcuSnapshot(const RcuSnapshot&) = delete;
+    RcuSnapshot& operator=(const RcuSnapshot&) = delete;
+
+    // Waits for the readers that started before the call. Readers count themselves in the counter
+    // selected by the epoch they saw when they started. A reader may be preempted between reading
+    // the epoch and incrementing the counter, so it can end up counted under the previous epoch.
+    // Flipping the epoch twice and waiting for each counter to drain covers both cases. Only
+    // readers that saw the epoch before a flip can join the counter being waited for, so the wait
+    // always terminates.
+    void synchronize() {
+        for (int i = 0; i < 2; i++) {
+            unsigned previous = mEpoch.fetch_add(1);
+            for (int tries = 0; mReaders[previous & 1].load() != 0; tries++) {
+                // Readers hold the counter for a few instructions at a time, so it almost always
+                // drains right away. If not, a reader was preempted; don't compete with it.
+                if (tries < 10) {
+                    sched_yield();
+                } else {
+                    usleep(100);
+                }
+            }
+        }
+    }
+
+    std::atomic<const T*> mCurrent;
+    std::atomic<unsigned> mEpoch;
+    mutable std::atomic<unsigned> mReaders[2];
+};
+
+#endif  // NETD_SERVER_RCU_SNAPSHOT_H
@@ -0,0 +1,230 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * RcuSnapshotTest.cpp - unit tests for RcuSnapshot.h
+ */
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "utils/RWLock.h"
+
+#include "RcuSnapshot.h"
+
+namespace {
+
+const uint32_t kAlive = 0xa11fe;
+
+struct State {
+    explicit State(unsigned v) : version(v), alive(kAlive) { sLive++; }
+    ~State() { alive = 0; sLive--; }
+
+    const unsigned version;
+    uint32_t alive;  // Lets readers detect a use after free.
+    std::map<unsigned, unsigned> users;
+
+    static std::atomic<int> sLive;
+};
+
+std::atomic<int> State::sLive(0);
+
+}  // namespace
+
+TEST(RcuSnapshotTest, TestPublish) {
+    {
+        RcuSnapshot<State> snapshot(new State(1));
+        {
+            RcuSnapshot<State>::Reader reader(snapshot);
+            EXPECT_EQ(1U, reader->version);
+        }
+        snapshot.publish(new State(2));
+        EXPECT_EQ(1, State::sLive.load());
+        RcuSnapshot<State>::Reader reader(snapshot);
+        EXPECT_EQ(2U, reader->version);
+        EXPECT_EQ(2U, snapshot.get()->version);
+    }
+    EXPECT_EQ(0, State::sLive.load());
+}
+
+TEST(RcuSnapshotTest, TestPublishWaitsForReaders) {
+    RcuSnapshot<State> snapshot(new State(1));
+    std::atomic<bool> published(false);
+    std::thread writer;
+    {
+        RcuSnapshot<State>::Reader reader(snapshot);
+        writer = std::thread([&snapshot, &published] {
+            snapshot.publish(new State(2));
+            published = true;
+        });
+
+        // The writer makes the new state visible right away, but cannot delete the old one.
+        while (snapshot.get()->version != 2) {
+            std::this_thread::yield();
+        }
+        RcuSnapshot<State>::Reader newReader(snapshot);
+        EXPECT_EQ(2U, newReader->version);
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        EXPECT_FALSE(published);
+        EXPECT_EQ(1U, reader->version);
+        EXPECT_EQ(kAlive, reader->alive);
+    }
+    writer.join();
+    EXPECT_TRUE(published);
+    EXPECT_EQ(1, State::sLive.load());
+}
+
+TEST(RcuSnapshotTest, TestConcurrentReaders) {
+    const int kReaders = 4;
+    const unsigned kVersions = 2000;
+
+    RcuSnapshot<State> snapshot(new State(0));
+    std::atomic<bool> done(false);
+    std::atomic<int> errors(0);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < kReaders; i++) {
+        readers.emplace_back([&] {
+            unsigned last = 0;
+            while (!done) {
+                RcuSnapshot<State>::Reader reader(snapshot);
+                // Versions never go backwards, and a state is never deleted while in use.
+                if (reader->alive != kAlive || reader->version < last) errors++;
+                last = reader->version;
+            }
+        });
+    }
+    for (unsigned version = 1; version <= kVersions; version++) {
+        snapshot.publish(new State(version));
+    }
+    done = true;
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    EXPECT_EQ(0, errors.load());
+    EXPECT_EQ(1, State::sLive.load());
+}
+
+namespace {
+
+const int kNumUsers = 1000;
+const auto kBenchmarkDuration = std::chrono::milliseconds(500);
+
+using us = std::chrono::duration<float, std::ratio<1, 1000000>>;
+
+struct BenchmarkResult {
+    uint64_t reads;
+    int writes;
+    float maxWriteUs;
+    float avgWriteUs;
+};
+
+// Runs |numReaders| threads that call |read| in a loop, while this thread calls |write| once per
+// millisecond, and measures how long each write takes to get through. The readers stop on their
+// own at the end, so that a writer that they starve still finishes. The values returned by |read|
+// are summed only so that the reads can't be optimized away.
+template <typename ReadFn, typename WriteFn>
+BenchmarkResult runContentionBenchmark(int numReaders, ReadFn read, WriteFn write) {
+    const auto end = std::chrono::steady_clock::now() + kBenchmarkDuration;
+    std::atomic<uint64_t> reads(0);
+    std::atomic<unsigned> checksum(0);
+    std::vector<std::thread> readers;
+    for (int i = 0; i < numReaders; i++) {
+        readers.emplace_back([&] {
+            uint64_t count = 0;
+            unsigned sum = 0;
+            for (unsigned uid = 0; ; uid = (uid + 1) % kNumUsers) {
+                sum += read(uid);
+                if (++count % 256 == 0 && std::chrono::steady_clock::now() >= end) break;
+            }
+            reads += count;
+            checksum += sum;
+        });
+    }
+
+    BenchmarkResult result = { 0, 0, 0, 0 };
+    float total = 0;
+    while (std::chrono::steady_clock::now() < end) {
+        auto start = std::chrono::steady_clock::now();
+        write(result.writes);
+        float elapsed = std::chrono::duration_cast<us>(
+                std::chrono::steady_clock::now() - start).count();
+        total += elapsed;
+        result.maxWriteUs = std::max(result.maxWriteUs, elapsed);
+        result.writes++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (auto& reader : readers) {
+        reader.join();
+    }
+    result.reads = reads;
+    result.avgWriteUs = total / result.writes;
+    return result;
+}
+
+void printBenchmarkResult(const char* name, const BenchmarkResult& r) {
+    fprintf(stderr, "  %-12s %10.1f reads/ms, %4d writes, write avg %8.1f us, max %8.1f us\n",
+            name, r.reads / float(kBenchmarkDuration.count()), r.writes, r.avgWriteUs,
+            r.maxWriteUs);
+}
+
+}  // namespace
+
+// Compares RWLock and RcuSnapshot under contention. It keeps several threads busy for seconds and
+// only prints timings, so it only runs when asked for, with --gtest_also_run_disabled_tests.
+TEST(RcuSnapshotTest, DISABLED_TestContentionBenchmark) {
+    // The reader does what NetworkController does for a connect(): look up the user in a map.
+    // The writer changes one user, like a permission change during a network switch.
+    for (int numReaders : { 1, 4, 16 }) {
+        fprintf(stderr, "Benchmarking %d readers and 1 writer for %lld ms\n", numReaders,
+                static_cast<long long>(kBenchmarkDuration.count()));
+
+        android::RWLock lock;
+        State locked(0);
+        for (int i = 0; i < kNumUsers; i++) locked.users[i] = i;
+        BenchmarkResult result = runContentionBenchmark(numReaders,
+            [&](unsigned uid) {
+                android::RWLock::AutoRLock rlock(lock);
+                return locked.users.find(uid)->second;
+            },
+            [&](int n) {
+                android::RWLock::AutoWLock wlock(lock);
+                locked.users[n % kNumUsers] = n;
+            });
+        printBenchmarkResult("RWLock", result);
+
+        RcuSnapshot<State> snapshot(new State(0));
+        State* initial = new State(0);
+        for (int i = 0; i < kNumUsers; i++) initial->users[i] = i;
+        snapshot.publish(initial);
+        result = runContentionBenchmark(numReaders,
+            [&](unsigned uid) {
+                RcuSnapshot<State>::Reader reader(snapshot);
+                return reader->users.find(uid)->second;
+            },
+            [&](int n) {
+                State* next = new State(n);
+                next->users = snapshot.get()->users;
+                next->users[n % kNumUsers] = n;
+                snapshot.publish(next);
+            });
+        printBenchmarkResult("RcuSnapshot", result);
+        EXPECT_LT(0, result.writes);
+    }
+}
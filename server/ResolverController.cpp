@@ -18,10 +18,13 @@
 #define DBG 0
 
 #include <algorithm>
+#include <climits>
 #include <cstdlib>
+#include <cstring>
 #include <string>
 #include <vector>
 #include <cutils/log.h>
+#include <arpa/nameser.h>
 #include <net/if.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -33,23 +36,124 @@
 #include <resolv_params.h>
 #include <resolv_stats.h>
 
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <android/net/INetd.h>
 
 #include "DumpWriter.h"
 #include "ResolverController.h"
-#include "ResolverStats.h"
+#include "android/net/ResolverStats.h"
+
+namespace {
+
+// The shortest time to wait for the fastest server before racing the next one. Less than this and
+// a race would start for every little bit of jitter.
+const int kMinRaceDelayMs = 50;
+
+socklen_t sockaddrLen(const sockaddr_storage& ss) {
+    return ss.ss_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+}
+
+// Adds what android_net_res_stats_aggregate() leaves out: the RTT histogram of the successes,
+// which it counts the same way, the answers by rcode, and the time of the oldest sample.
+void aggregateSamples(const __res_stats& stats, android::net::ResolverStats* out) {
+    using android::net::ResolverStats;
+    out->rtt_histogram.assign(ResolverStats::RTT_BUCKETS, 0);
+    out->rcode_counts.assign(ResolverStats::RCODE_COUNT, 0);
+    out->first_sample_time = 0;
+    for (int i = 0 ; i < stats.sample_count ; ++i) {
+        const __res_sample& sample = stats.samples[i];
+        if (out->first_sample_time == 0 || sample.at < out->first_sample_time) {
+            out->first_sample_time = sample.at;
+        }
+        if (sample.rcode < ResolverStats::RCODE_COUNT) {
+            out->rcode_counts[sample.rcode]++;
+        }
+        if (sample.rcode == ns_r_noerror || sample.rcode == ns_r_notauth ||
+                sample.rcode == ns_r_nxdomain) {
+            out->rtt_histogram[ResolverStats::rttBucket(sample.rtt)]++;
+        }
+    }
+}
+
+// Formats the RTT histogram and the rcodes of |stats| for dump(), leaving out the empty buckets.
+std::string formatSamples(const android::net::ResolverStats& stats, time_t now) {
+    using android::base::StringAppendF;
+    std::string out = "RTTs:";
+    for (size_t i = 0 ; i < stats.rtt_histogram.size() ; ++i) {
+        if (stats.rtt_histogram[i] == 0) continue;
+        if (i + 1 < stats.rtt_histogram.size()) {
+            StringAppendF(&out, " <%dms:%d", 2 << i, stats.rtt_histogram[i]);
+        } else {
+            StringAppendF(&out, " >=%dms:%d", 1 << i, stats.rtt_histogram[i]);
+        }
+    }
+    out += ", rcodes:";
+    for (size_t i = 0 ; i < stats.rcode_counts.size() ; ++i) {
+        if (stats.rcode_counts[i] == 0) continue;
+        StringAppendF(&out, " %zu:%d", i, stats.rcode_counts[i]);
+    }
+    StringAppendF(&out, ", since %lds ago", static_cast<long>(now - stats.first_sample_time));
+    return out;
+}
+
+}  // namespace
+
+std::vector<std::string> ResolverController::getServerNames(unsigned netId,
+        const sockaddr_storage* addrs, int count) {
+    // The servers rarely change, so only convert the ones that did.
+    std::lock_guard<std::mutex> lock(mServerNamesLock);
+    std::vector<ServerName>& cached = mServerNames[netId];
+    cached.resize(count);
+    std::vector<std::string> names;
+    for (int i = 0 ; i < count ; ++i) {
+        ServerName& cur = cached[i];
+        const socklen_t len = sockaddrLen(addrs[i]);
+        if (cur.name.empty() || memcmp(&cur.addr, &addrs[i], len) != 0) {
+            memcpy(&cur.addr, &addrs[i], len);
+            char hbuf[NI_MAXHOST];
+            int rv = getnameinfo(reinterpret_cast<const sockaddr*>(&addrs[i]), len, hbuf,
+                    sizeof(hbuf), nullptr, 0, NI_NUMERICHOST);
+            if (rv == 0) {
+                cur.name.assign(hbuf);
+            } else {
+                ALOGE("getnameinfo() failed for server #%d: %s", i, gai_strerror(rv));
+                cur.name.assign("<invalid>");
+            }
+        }
+        names.push_back(cur.name);
+    }
+    return names;
+}
 
 int ResolverController::setDnsServers(unsigned netId, const char* searchDomains,
         const char** servers, int numservers, const __res_params* params) {
     if (DBG) {
         ALOGD("setDnsServers netId = %u\n", netId);
     }
-    return -_resolv_set_nameservers_for_net(netId, servers, numservers, searchDomains, params);
+    std::vector<std::string> oldServers = getConfiguredServers(netId);
+    int rv = -_resolv_set_nameservers_for_net(netId, servers, numservers, searchDomains, params);
+    // Bionic flushes its cache and clears its stats when the servers change. Do the same for
+    // netd's cache, whose answers came from those servers, and for the engine's samples.
+    if (rv == 0 && getConfiguredServers(netId) != oldServers) {
+        mDnsCache.flush(netId);
+        mServerStats.clear(netId);
+    }
+    return rv;
 }
 
 int ResolverController::clearDnsServers(unsigned netId) {
     _resolv_set_nameservers_for_net(netId, NULL, 0, "", NULL);
+    mDnsCache.flush(netId);
+    mServerStats.clear(netId);
+    {
+        std::lock_guard<std::mutex> lock(mRaceLock);
+        mMaxRaceDelayMs.erase(netId);
+    }
+    {
+        std::lock_guard<std::mutex> lock(mServerNamesLock);
+        mServerNames.erase(netId);
+    }
     if (DBG) {
         ALOGD("clearDnsServers netId = %u\n", netId);
     }
@@ -62,6 +166,7 @@ int ResolverController::flushDnsCache(unsigned netId) {
     }
 
     _resolv_flush_cache_for_net(netId);
+    mDnsCache.flush(netId);
 
     return 0;
 }
@@ -70,16 +175,6 @@ int ResolverController::getDnsInfo(unsigned netId, std::vector<std::string>* ser
         std::vector<std::string>* domains, __res_params* params,
         std::vector<android::net::ResolverStats>* stats) {
     using android::net::ResolverStats;
-    using android::net::INetd;
-    static_assert(ResolverStats::STATS_SUCCESSES == INetd::RESOLVER_STATS_SUCCESSES &&
-            ResolverStats::STATS_ERRORS == INetd::RESOLVER_STATS_ERRORS &&
-            ResolverStats::STATS_TIMEOUTS == INetd::RESOLVER_STATS_TIMEOUTS &&
-            ResolverStats::STATS_INTERNAL_ERRORS == INetd::RESOLVER_STATS_INTERNAL_ERRORS &&
-            ResolverStats::STATS_RTT_AVG == INetd::RESOLVER_STATS_RTT_AVG &&
-            ResolverStats::STATS_LAST_SAMPLE_TIME == INetd::RESOLVER_STATS_LAST_SAMPLE_TIME &&
-            ResolverStats::STATS_USABLE == INetd::RESOLVER_STATS_USABLE &&
-            ResolverStats::STATS_COUNT == INetd::RESOLVER_STATS_COUNT,
-            "AIDL and ResolverStats.h out of sync");
     int nscount = -1;
     sockaddr_storage res_servers[MAXNS];
     int dcount = -1;
@@ -103,31 +198,22 @@ int ResolverController::getDnsInfo(unsigned netId, std::vector<std::string>* ser
         ALOGE("%s: nscount=%d, dcount=%d", __FUNCTION__, nscount, dcount);
         return -ENOTRECOVERABLE;
     }
+    mServerStats.merge(netId, res_servers, nscount, params->max_samples, res_stats);
 
     // Determine which servers are considered usable by the resolver.
     bool valid_servers[MAXNS];
     std::fill_n(valid_servers, MAXNS, false);
     android_net_res_stats_get_usable_servers(params, res_stats, nscount, valid_servers);
 
-    // Convert the server sockaddr structures to std::string.
+    *servers = getServerNames(netId, res_servers, nscount);
     stats->resize(nscount);
     for (int i = 0 ; i < nscount ; ++i) {
-        char hbuf[NI_MAXHOST];
-        int rv = getnameinfo(reinterpret_cast<const sockaddr*>(&res_servers[i]),
-                sizeof(res_servers[i]), hbuf, sizeof(hbuf), nullptr, 0, NI_NUMERICHOST);
-        std::string server_str;
-        if (rv == 0) {
-            server_str.assign(hbuf);
-        } else {
-            ALOGE("getnameinfo() failed for server #%d: %s", i, gai_strerror(rv));
-            server_str.assign("<invalid>");
-        }
-        servers->push_back(std::move(server_str));
-        android::net::ResolverStats& cur_stats = (*stats)[i];
+        ResolverStats& cur_stats = (*stats)[i];
         android_net_res_stats_aggregate(&res_stats[i], &cur_stats.successes, &cur_stats.errors,
                 &cur_stats.timeouts, &cur_stats.internal_errors, &cur_stats.rtt_avg,
                 &cur_stats.last_sample_time);
         cur_stats.usable = valid_servers[i];
+        aggregateSamples(res_stats[i], &cur_stats);
     }
 
     // Convert the stack-allocated search domain strings to std::string.
@@ -137,14 +223,99 @@ int ResolverController::getDnsInfo(unsigned netId, std::vector<std::string>* ser
     return 0;
 }
 
+std::vector<std::string> ResolverController::getConfiguredServers(unsigned netId) {
+    std::vector<std::string> servers;
+    std::vector<std::string> domains;
+    __res_params params;
+    std::vector<android::net::ResolverStats> stats;
+    getDnsInfo(netId, &servers, &domains, &params, &stats);
+    return servers;
+}
+
+int ResolverController::getMaxRaceDelayMs(unsigned netId) {
+    std::lock_guard<std::mutex> lock(mRaceLock);
+    auto found = mMaxRaceDelayMs.find(netId);
+    return (found != mMaxRaceDelayMs.end()) ? found->second : 0;
+}
+
+int ResolverController::getDnsServers(unsigned netId, std::vector<sockaddr_storage>* servers,
+        int* raceDelayMs) {
+    int nscount = -1;
+    sockaddr_storage res_servers[MAXNS];
+    int dcount = -1;
+    char res_domains[MAXDNSRCH][MAXDNSRCHPATH];
+    __res_params params;
+    __res_stats res_stats[MAXNS];
+    servers->clear();
+    *raceDelayMs = 0;
+    if (android_net_res_stats_get_info_for_net(netId, &nscount, res_servers, &dcount, res_domains,
+            &params, res_stats) < 0) {
+        return 0;
+    }
+    if (nscount < 0 || nscount > MAXNS) {
+        ALOGE("%s: nscount=%d", __FUNCTION__, nscount);
+        return -ENOTRECOVERABLE;
+    }
+    // Racing only happens in the engine, so the RTTs that order the servers and set the delay
+    // have to include the engine's own samples.
+    mServerStats.merge(netId, res_servers, nscount, params.max_samples, res_stats);
+
+    bool valid_servers[MAXNS];
+    std::fill_n(valid_servers, MAXNS, false);
+    android_net_res_stats_get_usable_servers(&params, res_stats, nscount, valid_servers);
+    std::vector<int> order;
+    for (int i = 0 ; i < nscount ; ++i) {
+        if (valid_servers[i]) {
+            order.push_back(i);
+        }
+    }
+    if (order.empty()) {
+        for (int i = 0 ; i < nscount ; ++i) {
+            order.push_back(i);
+        }
+    }
+
+    const int maxRaceDelayMs = getMaxRaceDelayMs(netId);
+    if (maxRaceDelayMs > 0 && order.size() > 1) {
+        // Servers that have never answered go last, in the configured order.
+        int rtt[MAXNS];
+        for (int i : order) {
+            int successes, errors, timeouts, internal_errors, rtt_avg;
+            time_t last_sample_time;
+            android_net_res_stats_aggregate(&res_stats[i], &successes, &errors, &timeouts,
+                    &internal_errors, &rtt_avg, &last_sample_time);
+            rtt[i] = (rtt_avg >= 0) ? rtt_avg : INT_MAX;
+        }
+        std::stable_sort(order.begin(), order.end(),
+                [&rtt](int a, int b) { return rtt[a] < rtt[b]; });
+
+        // Give the fastest server twice its usual time before asking the next one too.
+        const int best = rtt[order[0]];
+        *raceDelayMs = (best == INT_MAX) ? maxRaceDelayMs :
+                std::min(maxRaceDelayMs, std::max(kMinRaceDelayMs, 2 * best));
+    }
+    for (int i : order) {
+        servers->push_back(res_servers[i]);
+    }
+    return 0;
+}
+
 int ResolverController::setResolverConfiguration(int32_t netId,
         const std::vector<std::string>& servers, const std::vector<std::string>& domains,
         const std::vector<int32_t>& params) {
     using android::net::INetd;
-    if (params.size() != INetd::RESOLVER_PARAMS_COUNT) {
+    // Callers that predate RESOLVER_PARAMS_RACE_DELAY_MS leave it out.
+    if (params.size() != INetd::RESOLVER_PARAMS_COUNT &&
+            params.size() != INetd::RESOLVER_PARAMS_RACE_DELAY_MS) {
         ALOGE("%s: params.size()=%zu", __FUNCTION__, params.size());
         return -EINVAL;
     }
+    const int raceDelayMs = (params.size() > INetd::RESOLVER_PARAMS_RACE_DELAY_MS) ?
+            params[INetd::RESOLVER_PARAMS_RACE_DELAY_MS] : 0;
+    if (raceDelayMs < 0) {
+        ALOGE("%s: raceDelayMs=%d", __FUNCTION__, raceDelayMs);
+        return -EINVAL;
+    }
 
     auto server_count = std::min<size_t>(MAXNS, servers.size());
     std::vector<const char*> server_ptrs;
@@ -166,30 +337,47 @@ int ResolverController::setResolverConfiguration(int32_t netId,
     res_params.min_samples = params[INetd::RESOLVER_PARAMS_MIN_SAMPLES];
     res_params.max_samples = params[INetd::RESOLVER_PARAMS_MAX_SAMPLES];
 
-    return setDnsServers(netId, domains_str.c_str(), server_ptrs.data(), server_ptrs.size(),
+    int ret = setDnsServers(netId, domains_str.c_str(), server_ptrs.data(), server_ptrs.size(),
             &res_params);
+    if (ret == 0) {
+        std::lock_guard<std::mutex> lock(mRaceLock);
+        if (raceDelayMs > 0) {
+            mMaxRaceDelayMs[netId] = raceDelayMs;
+        } else {
+            mMaxRaceDelayMs.erase(netId);
+        }
+    }
+    return ret;
 }
 
 int ResolverController::getResolverInfo(int32_t netId, std::vector<std::string>* servers,
         std::vector<std::string>* domains, std::vector<int32_t>* params,
-        std::vector<int32_t>* stats) {
-    using android::net::ResolverStats;
+        std::vector<android::net::ResolverStats>* stats, std::vector<int32_t>* cacheStats) {
     using android::net::INetd;
     __res_params res_params;
-    std::vector<ResolverStats> res_stats;
-    int ret = getDnsInfo(netId, servers, domains, &res_params, &res_stats);
+    int ret = getDnsInfo(netId, servers, domains, &res_params, stats);
     if (ret != 0) {
         return ret;
     }
 
-    // Serialize the information for binder.
-    ResolverStats::encodeAll(res_stats, stats);
-
+    // Serialize the params for binder.
     params->resize(INetd::RESOLVER_PARAMS_COUNT);
     (*params)[INetd::RESOLVER_PARAMS_SAMPLE_VALIDITY] = res_params.sample_validity;
     (*params)[INetd::RESOLVER_PARAMS_SUCCESS_THRESHOLD] = res_params.success_threshold;
     (*params)[INetd::RESOLVER_PARAMS_MIN_SAMPLES] = res_params.min_samples;
     (*params)[INetd::RESOLVER_PARAMS_MAX_SAMPLES] = res_params.max_samples;
+    (*params)[INetd::RESOLVER_PARAMS_RACE_DELAY_MS] = getMaxRaceDelayMs(netId);
+
+    const DnsCache::Stats cache = mDnsCache.getStats(netId);
+    auto clamp = [](uint64_t value) {
+        return static_cast<int32_t>(std::min<uint64_t>(value, INT32_MAX));
+    };
+    cacheStats->resize(INetd::RESOLVER_CACHE_STATS_COUNT);
+    (*cacheStats)[INetd::RESOLVER_CACHE_HITS] = clamp(cache.hits);
+    (*cacheStats)[INetd::RESOLVER_CACHE_MISSES] = clamp(cache.misses);
+    (*cacheStats)[INetd::RESOLVER_CACHE_EVICTIONS] = clamp(cache.evictions);
+    (*cacheStats)[INetd::RESOLVER_CACHE_PREFETCHES] = clamp(cache.prefetches);
+    (*cacheStats)[INetd::RESOLVER_CACHE_ENTRIES] = clamp(cache.entries);
     return 0;
 }
 
@@ -221,6 +409,9 @@ void ResolverController::dump(DumpWriter& dw, unsigned netId) {
                         dw.println("%s (%d, %d, %d, %d, %d, %dms, %ds)%s", servers[i].c_str(),
                                 total, s.successes, s.errors, s.timeouts, s.internal_errors,
                                 s.rtt_avg, time_delta, s.usable ? "" : " BROKEN");
+                        dw.incIndent();
+                        dw.println("%s", formatSamples(s, now).c_str());
+                        dw.decIndent();
                     } else {
                         dw.println("%s <no data>", servers[i].c_str());
                     }
@@ -243,6 +434,11 @@ void ResolverController::dump(DumpWriter& dw, unsigned netId) {
                     static_cast<unsigned>(params.min_samples),
                     static_cast<unsigned>(params.max_samples));
         }
+        const int maxRaceDelayMs = getMaxRaceDelayMs(netId);
+        if (maxRaceDelayMs > 0) {
+            dw.println("Racing servers after at most %dms", maxRaceDelayMs);
+        }
     }
+    mDnsCache.dump(dw, netId);
     dw.decIndent();
 }
@@ -17,9 +17,16 @@
 #ifndef _RESOLVER_CONTROLLER_H_
 #define _RESOLVER_CONTROLLER_H_
 
+#include <map>
+#include <mutex>
+#include <string>
 #include <vector>
 #include <netinet/in.h>
 #include <linux/in.h>
+#include <sys/socket.h>
+
+#include "DnsCache.h"
+#include "DnsServerStats.h"
 
 struct __res_params;
 class DumpWriter;
@@ -48,6 +55,13 @@ public:
             std::vector<std::string>* domains, __res_params* params,
             std::vector<android::net::ResolverStats>* stats);
 
+    // Gets the servers that bionic's resolver would query for |netId|: the usable ones, or all of
+    // them if none are usable. If the network races its servers, they are sorted fastest first,
+    // and |*raceDelayMs| is how long to wait for one before also asking the next; otherwise they
+    // are in the configured order and it is 0. Both go by the samples of bionic's queries and of
+    // DnsQueryEngine's. Returns 0 on success or a negative errno.
+    int getDnsServers(unsigned netId, std::vector<sockaddr_storage>* servers, int* raceDelayMs);
+
     // Binder specific functions, which convert between the binder int/string arrays and the
     // actual data structures, and call setDnsServer() / getDnsInfo() for the actual processing.
     int setResolverConfiguration(int32_t netId, const std::vector<std::string>& servers,
@@ -55,8 +69,36 @@ public:
 
     int getResolverInfo(int32_t netId, std::vector<std::string>* servers,
             std::vector<std::string>* domains, std::vector<int32_t>* params,
-            std::vector<int32_t>* stats);
+            std::vector<android::net::ResolverStats>* stats, std::vector<int32_t>* cacheStats);
     void dump(DumpWriter& dw, unsigned netId);
+
+    // The cache in front of DnsQueryEngine. Flushed along with Bionic's cache.
+    DnsCache* getDnsCache() { return &mDnsCache; }
+    // Where DnsQueryEngine records how each server did. Merged into Bionic's stats when they're
+    // read, and cleared along with them.
+    DnsServerStats* getDnsServerStats() { return &mServerStats; }
+
+private:
+    std::vector<std::string> getConfiguredServers(unsigned netId);
+    std::vector<std::string> getServerNames(unsigned netId, const sockaddr_storage* addrs,
+            int count);
+    int getMaxRaceDelayMs(unsigned netId);
+
+    DnsCache mDnsCache;
+    DnsServerStats mServerStats;
+
+    // RESOLVER_PARAMS_RACE_DELAY_MS of each network that races its servers. Bionic's
+    // __res_params has no room for it.
+    std::mutex mRaceLock;
+    std::map<unsigned, int> mMaxRaceDelayMs;
+
+    // The numeric host strings of each network's servers, as of the last getDnsInfo().
+    struct ServerName {
+        sockaddr_storage addr;
+        std::string name;
+    };
+    std::mutex mServerNamesLock;
+    std::map<unsigned, std::vector<ServerName>> mServerNames;
 };
 
 #endif /* _RESOLVER_CONTROLLER_H_ */
@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "Rfc6724Sort.h"
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+// Scopes, as in the multicast scope field of an IPv6 address (RFC 4291 section 2.7).
+const int kScopeNodeLocal = 0x01;
+const int kScopeLinkLocal = 0x02;
+const int kScopeSiteLocal = 0x05;
+const int kScopeGlobal = 0x0e;
+
+struct Entry {
+    addrinfo* ai;
+    bool hasSource;
+    sockaddr_storage source;  // All zeros if !hasSource.
+    size_t originalOrder;
+};
+
+const in6_addr& addr6(const sockaddr* sa) {
+    return reinterpret_cast<const sockaddr_in6*>(sa)->sin6_addr;
+}
+
+bool isTeredo(const in6_addr& a) {
+    return a.s6_addr[0] == 0x20 && a.s6_addr[1] == 0x01 && a.s6_addr[2] == 0 && a.s6_addr[3] == 0;
+}
+
+bool is6to4(const in6_addr& a) {
+    return a.s6_addr[0] == 0x20 && a.s6_addr[1] == 0x02;
+}
+
+bool isUla(const in6_addr& a) {
+    return (a.s6_addr[0] & 0xfe) == 0xfc;
+}
+
+bool is6bone(const in6_addr& a) {
+    return a.s6_addr[0] == 0x3f && a.s6_addr[1] == 0xfe;
+}
+
+int getScope(const sockaddr* sa) {
+    if (sa->sa_family == AF_INET6) {
+        const in6_addr& a = addr6(sa);
+        if (IN6_IS_ADDR_MULTICAST(&a)) {
+            return a.s6_addr[1] & 0x0f;
+        }
+        if (IN6_IS_ADDR_LOOPBACK(&a) || IN6_IS_ADDR_LINKLOCAL(&a)) {
+            return kScopeLinkLocal;
+        }
+        return IN6_IS_ADDR_SITELOCAL(&a) ? kScopeSiteLocal : kScopeGlobal;
+    }
+    if (sa->sa_family == AF_INET) {
+        // Loopback and link-local addresses are link-local, and the rest global, private ones
+        // included (RFC 6724 section 3.2).
+        const uint32_t a = ntohl(reinterpret_cast<const sockaddr_in*>(sa)->sin_addr.s_addr);
+        if ((a >> 24) == 127 || (a & 0xffff0000) == 0xa9fe0000) {
+            return kScopeLinkLocal;
+        }
+        return kScopeGlobal;
+    }
+    return kScopeNodeLocal;
+}
+
+// The labels and precedences of the default policy table (RFC 6724 section 2.1), in which IPv4
+// addresses are ::ffff:0:0/96.
+int getLabel(const sockaddr* sa) {
+    if (sa->sa_family == AF_INET) {
+        return 4;
+    }
+    if (sa->sa_family != AF_INET6) {
+        return 1;
+    }
+    const in6_addr& a = addr6(sa);
+    if (IN6_IS_ADDR_LOOPBACK(&a)) return 0;
+    if (IN6_IS_ADDR_V4MAPPED(&a)) return 4;
+    if (is6to4(a)) return 2;
+    if (isTeredo(a)) return 5;
+    if (isUla(a)) return 13;
+    if (IN6_IS_ADDR_V4COMPAT(&a)) return 3;
+    if (IN6_IS_ADDR_SITELOCAL(&a)) return 11;
+    if (is6bone(a)) return 12;
+    return 1;
+}
+
+int getPrecedence(const sockaddr* sa) {
+    if (sa->sa_family == AF_INET) {
+        return 35;
+    }
+    if (sa->sa_family != AF_INET6) {
+        return 1;
+    }
+    const in6_addr& a = addr6(sa);
+    if (IN6_IS_ADDR_LOOPBACK(&a)) return 50;
+    if (IN6_IS_ADDR_V4MAPPED(&a)) return 35;
+    if (is6to4(a)) return 30;
+    if (isTeredo(a)) return 5;
+    if (isUla(a)) return 3;
+    if (IN6_IS_ADDR_V4COMPAT(&a) || IN6_IS_ADDR_SITELOCAL(&a) || is6bone(a)) return 1;
+    return 40;
+}
+
+int commonPrefixLen(const in6_addr& a, const in6_addr& b) {
+    for (size_t i = 0; i < sizeof(a.s6_addr); i++) {
+        const uint8_t x = a.s6_addr[i] ^ b.s6_addr[i];
+        if (x) {
+            return i * 8 + __builtin_clz(x) - 24;
+        }
+    }
+    return sizeof(a.s6_addr) * 8;
+}
+
+// Returns a negative number if |e1| should come before |e2|, and a positive one if after.
+int compare(const Entry& e1, const Entry& e2) {
+    const sockaddr* dst1 = e1.ai->ai_addr;
+    const sockaddr* dst2 = e2.ai->ai_addr;
+    const sockaddr* src1 = reinterpret_cast<const sockaddr*>(&e1.source);
+    const sockaddr* src2 = reinterpret_cast<const sockaddr*>(&e2.source);
+
+    // Rule 1: Avoid unusable destinations.
+    if (e1.hasSource != e2.hasSource) {
+        return e2.hasSource - e1.hasSource;
+    }
+
+    // Rule 2: Prefer matching scope.
+    const int dstScope1 = getScope(dst1);
+    const int dstScope2 = getScope(dst2);
+    const bool scopeMatch1 = (getScope(src1) == dstScope1);
+    const bool scopeMatch2 = (getScope(src2) == dstScope2);
+    if (scopeMatch1 != scopeMatch2) {
+        return scopeMatch2 - scopeMatch1;
+    }
+
+    // Rules 3 and 4, avoid deprecated addresses and prefer home addresses, need to know more
+    // about the source addresses than a socket can tell.
+
+    // Rule 5: Prefer matching label.
+    const bool labelMatch1 = (getLabel(src1) == getLabel(dst1));
+    const bool labelMatch2 = (getLabel(src2) == getLabel(dst2));
+    if (labelMatch1 != labelMatch2) {
+        return labelMatch2 - labelMatch1;
+    }
+
+    // Rule 6: Prefer higher precedence.
+    const int precedence1 = getPrecedence(dst1);
+    const int precedence2 = getPrecedence(dst2);
+    if (precedence1 != precedence2) {
+        return precedence2 - precedence1;
+    }
+
+    // Rule 7, prefer native transport, needs to know about tunnels.
+
+    // Rule 8: Prefer smaller scope.
+    if (dstScope1 != dstScope2) {
+        return dstScope1 - dstScope2;
+    }
+
+    // Rule 9: Use longest matching prefix. Only for IPv6, where it makes sense.
+    if (dst1->sa_family == AF_INET6 && dst2->sa_family == AF_INET6) {
+        const int prefixLen1 = commonPrefixLen(addr6(src1), addr6(dst1));
+        const int prefixLen2 = commonPrefixLen(addr6(src2), addr6(dst2));
+        if (prefixLen1 != prefixLen2) {
+            return prefixLen2 - prefixLen1;
+        }
+    }
+
+    // Rule 10: Otherwise, leave the order unchanged.
+    return static_cast<int>(e1.originalOrder) - static_cast<int>(e2.originalOrder);
+}
+
+// Connecting a UDP socket picks a source address without sending anything.
+int findSourceAddress(const sockaddr* dst, sockaddr_storage* src, unsigned mark, uid_t uid) {
+    socklen_t len;
+    switch (dst->sa_family) {
+        case AF_INET:
+            len = sizeof(sockaddr_in);
+            break;
+        case AF_INET6:
+            len = sizeof(sockaddr_in6);
+            break;
+        default:
+            return 0;
+    }
+    int s = socket(dst->sa_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+    if (s == -1) {
+        return (errno == EAFNOSUPPORT) ? 0 : -1;
+    }
+    if ((mark && setsockopt(s, SOL_SOCKET, SO_MARK, &mark, sizeof(mark)) == -1) ||
+            (uid > 0 && uid != static_cast<uid_t>(-1) && fchown(s, uid, -1) == -1)) {
+        close(s);
+        return 0;
+    }
+    int ret;
+    do {
+        ret = connect(s, dst, len);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == -1) {
+        close(s);
+        return 0;
+    }
+    if (getsockname(s, reinterpret_cast<sockaddr*>(src), &len) == -1) {
+        close(s);
+        return -1;
+    }
+    close(s);
+    return 1;
+}
+
+}  // namespace
+
+void rfc6724Sort(addrinfo** list, unsigned mark, uid_t uid) {
+    rfc6724Sort(list, [mark, uid](const sockaddr* dst, sockaddr_storage* src) {
+        return findSourceAddress(dst, src, mark, uid);
+    });
+}
+
+void rfc6724Sort(addrinfo** list, const SourceAddressFinder& findSource) {
+    if (!*list || !(*list)->ai_next) {
+        return;
+    }
+    std::vector<Entry> entries;
+    for (addrinfo* ai = *list; ai; ai = ai->ai_next) {
+        Entry entry;
+        entry.ai = ai;
+        entry.originalOrder = entries.size();
+        memset(&entry.source, 0, sizeof(entry.source));
+        const int found = findSource(ai->ai_addr, &entry.source);
+        if (found == -1) {
+            return;
+        }
+        entry.hasSource = (found == 1);
+        if (!entry.hasSource) {
+            memset(&entry.source, 0, sizeof(entry.source));
+        }
+        entries.push_back(entry);
+    }
+    std::sort(entries.begin(), entries.end(),
+            [](const Entry& a, const Entry& b) { return compare(a, b) < 0; });
+    addrinfo** next = list;
+    for (Entry& entry : entries) {
+        *next = entry.ai;
+        next = &entry.ai->ai_next;
+    }
+    *next = nullptr;
+}
@@ -0,0 +1,46 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_RFC6724_SORT_H
+#define NETD_SERVER_RFC6724_SORT_H
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <functional>
+
+/*
+ * Sorts the results of a lookup by the destination address selection rules of RFC 6724, the way
+ * bionic's getaddrinfo() sorts the answers it gets from DNS. Like bionic, it uses the policy
+ * table of RFC 6724, skips the rules that need to know about deprecated, home or native
+ * addresses, and applies the longest matching prefix rule only to IPv6.
+ */
+
+// Finds the source address that a packet to |dst| would have. Returns 1 and fills in |*src| if
+// there is a route to |dst|, 0 if not, or -1 if something went wrong.
+typedef std::function<int(const sockaddr* dst, sockaddr_storage* src)> SourceAddressFinder;
+
+// Sorts |*list|, using the source addresses that a UDP socket with |mark| and owned by |uid|
+// would get, as bionic does for the app that asked. A |mark| of 0 or a |uid| of 0 or -1 leave the
+// socket as it is.
+void rfc6724Sort(addrinfo** list, unsigned mark, uid_t uid);
+
+// The same, with |findSource| choosing the source addresses. If it fails, |*list| is left as it
+// is.
+void rfc6724Sort(addrinfo** list, const SourceAddressFinder& findSource);
+
+#endif  // NETD_SERVER_RFC6724_SORT_H
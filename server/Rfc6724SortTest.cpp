@@ -0,0 +1,157 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * Rfc6724SortTest.cpp - unit tests for Rfc6724Sort.cpp
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "Rfc6724Sort.h"
+
+namespace {
+
+sockaddr_storage parse(const std::string& addr) {
+    sockaddr_storage ss;
+    memset(&ss, 0, sizeof(ss));
+    if (addr.find(':') != std::string::npos) {
+        sockaddr_in6* sin6 = reinterpret_cast<sockaddr_in6*>(&ss);
+        sin6->sin6_family = AF_INET6;
+        inet_pton(AF_INET6, addr.c_str(), &sin6->sin6_addr);
+    } else {
+        sockaddr_in* sin = reinterpret_cast<sockaddr_in*>(&ss);
+        sin->sin_family = AF_INET;
+        inet_pton(AF_INET, addr.c_str(), &sin->sin_addr);
+    }
+    return ss;
+}
+
+std::string format(const sockaddr* sa) {
+    char buf[INET6_ADDRSTRLEN];
+    const void* addr = (sa->sa_family == AF_INET6) ?
+            static_cast<const void*>(&reinterpret_cast<const sockaddr_in6*>(sa)->sin6_addr) :
+            static_cast<const void*>(&reinterpret_cast<const sockaddr_in*>(sa)->sin_addr);
+    return inet_ntop(sa->sa_family, addr, buf, sizeof(buf));
+}
+
+// Sorts |addresses| with the source addresses in |sources|. A destination that isn't in there is
+// unreachable.
+std::vector<std::string> sort(const std::vector<std::string>& addresses,
+                              const std::map<std::string, std::string>& sources) {
+    std::vector<addrinfo> entries(addresses.size());
+    std::vector<sockaddr_storage> addrs(addresses.size());
+    for (size_t i = 0; i < addresses.size(); i++) {
+        addrs[i] = parse(addresses[i]);
+        memset(&entries[i], 0, sizeof(entries[i]));
+        entries[i].ai_family = addrs[i].ss_family;
+        entries[i].ai_addr = reinterpret_cast<sockaddr*>(&addrs[i]);
+        entries[i].ai_next = (i + 1 < addresses.size()) ? &entries[i + 1] : nullptr;
+    }
+    addrinfo* list = entries.empty() ? nullptr : &entries[0];
+    rfc6724Sort(&list, [&sources](const sockaddr* dst, sockaddr_storage* src) {
+        auto found = sources.find(format(dst));
+        if (found == sources.end()) {
+            return 0;
+        }
+        if (found->second.empty()) {
+            return -1;
+        }
+        *src = parse(found->second);
+        return 1;
+    });
+    std::vector<std::string> sorted;
+    for (const addrinfo* ai = list; ai; ai = ai->ai_next) {
+        sorted.push_back(format(ai->ai_addr));
+    }
+    return sorted;
+}
+
+}  // namespace
+
+TEST(Rfc6724SortTest, TestPrefersReachableIPv6) {
+    // IPv6 has the higher precedence, as long as there's a route to it.
+    std::map<std::string, std::string> sources = {
+        { "192.0.2.1", "198.51.100.1" },
+        { "2001:db8::1", "2001:db8:1::1" },
+    };
+    EXPECT_EQ(std::vector<std::string>({ "2001:db8::1", "192.0.2.1" }),
+              sort({ "192.0.2.1", "2001:db8::1" }, sources));
+
+    sources.erase("2001:db8::1");
+    EXPECT_EQ(std::vector<std::string>({ "192.0.2.1", "2001:db8::1" }),
+              sort({ "2001:db8::1", "192.0.2.1" }, sources));
+}
+
+TEST(Rfc6724SortTest, TestScopeAndLabel) {
+    // A global destination with only a link-local source goes after one whose scope matches.
+    std::map<std::string, std::string> sources = {
+        { "2001:db8::1", "fe80::1" },
+        { "192.0.2.1", "198.51.100.1" },
+    };
+    EXPECT_EQ(std::vector<std::string>({ "192.0.2.1", "2001:db8::1" }),
+              sort({ "2001:db8::1", "192.0.2.1" }, sources));
+
+    // With only a ULA source, a ULA destination beats a global one of higher precedence.
+    sources = {
+        { "2001:db8::1", "fd00::100" },
+        { "fd00::1", "fd00::100" },
+    };
+    EXPECT_EQ(std::vector<std::string>({ "fd00::1", "2001:db8::1" }),
+              sort({ "2001:db8::1", "fd00::1" }, sources));
+
+    // Native IPv6 beats 6to4, which beats Teredo.
+    sources = {
+        { "2002:c000:201::1", "2001:db8::100" },
+        { "2001:0:53aa:64c::1", "2001:db8::100" },
+        { "2001:db8::1", "2001:db8::100" },
+    };
+    EXPECT_EQ(std::vector<std::string>({ "2001:db8::1", "2002:c000:201::1",
+                                         "2001:0:53aa:64c::1" }),
+              sort({ "2001:0:53aa:64c::1", "2002:c000:201::1", "2001:db8::1" }, sources));
+}
+
+TEST(Rfc6724SortTest, TestLongestMatchingPrefix) {
+    std::map<std::string, std::string> sources = {
+        { "2001:db8:2::1", "2001:db8:1::100" },
+        { "2001:db8:1::1", "2001:db8:1::100" },
+    };
+    EXPECT_EQ(std::vector<std::string>({ "2001:db8:1::1", "2001:db8:2::1" }),
+              sort({ "2001:db8:2::1", "2001:db8:1::1" }, sources));
+
+    // Not for IPv4, where the order stays as it was.
+    sources = {
+        { "192.0.2.1", "198.51.100.1" },
+        { "198.51.100.2", "198.51.100.1" },
+    };
+    EXPECT_EQ(std::vector<std::string>({ "192.0.2.1", "198.51.100.2" }),
+              sort({ "192.0.2.1", "198.51.100.2" }, sources));
+}
+
+TEST(Rfc6724SortTest, TestLeavesListAloneOnError) {
+    std::map<std::string, std::string> sources = {
+        { "2001:db8::1", "2001:db8::100" },
+        { "192.0.2.1", "" },
+    };
+    EXPECT_EQ(std::vector<std::string>({ "192.0.2.1", "2001:db8::1" }),
+              sort({ "192.0.2.1", "2001:db8::1" }, sources));
+    EXPECT_EQ(std::vector<std::string>(), sort({}, sources));
+}
@@ -26,6 +26,7 @@
 #include <private/android_filesystem_config.h>
 
 #include <map>
+#include <vector>
 
 #include "Fwmark.h"
 #include "UidRanges.h"
@@ -34,7 +35,6 @@
 #include "android-base/file.h"
 #define LOG_TAG "Netd"
 #include "log/log.h"
-#include "logwrap/logwrap.h"
 #include "netutils/ifc.h"
 #include "resolv_netid.h"
 
@@ -90,8 +90,6 @@ const sockaddr_nl NETLINK_ADDRESS = {AF_NETLINK, 0, 0, 0};
 
 const uint8_t AF_FAMILIES[] = {AF_INET, AF_INET6};
 
-const char* const IP_VERSIONS[] = {"-4", "-6"};
-
 const uid_t UID_ROOT = 0;
 const char* const IIF_LOOPBACK = "lo";
 const char* const IIF_NONE = NULL;
@@ -103,6 +101,7 @@ const bool MODIFY_NON_UID_BASED_RULES = true;
 const char* const RT_TABLES_PATH = "/data/misc/net/rt_tables";
 const mode_t RT_TABLES_MODE = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;  // mode 0644, rw-r--r--
 
+// How many times to dump and flush a routing table if the dump is interrupted by other changes.
 const unsigned ROUTE_FLUSH_ATTEMPTS = 2;
 
 // Avoids "non-constant-expression cannot be narrowed from type 'unsigned int' to 'unsigned short'"
@@ -128,6 +127,7 @@ uint8_t PADDING_BUFFER[RTA_ALIGNTO] = {0, 0, 0, 0};
 // END CONSTANTS ----------------------------------------------------------------------------------
 
 // No locks needed because RouteController is accessed only from one thread (in CommandListener).
+// The same goes for the netlink socket and NetlinkBatch below.
 std::map<std::string, uint32_t> interfaceToTable;
 
 uint32_t getRouteTableForInterface(const char* interface) {
@@ -177,10 +177,228 @@ void updateTableNamesFile() {
     }
 }
 
+// Maximum number of requests that a NetlinkBatch sends in one sendmsg(). The kernel sends one ack
+// per request, and must not overflow the socket receive buffer before we read them.
+const size_t MAX_NETLINK_BATCH_REQUESTS = 64;
+
+// The netlink socket used for all rule and route changes. It's opened on first use and kept open,
+// so that network changes don't pay for socket setup on every rule. -1 if not open.
+int netlinkSocket = -1;
+
+// Sequence number of the last netlink request. Used to match acks to requests.
+uint32_t netlinkSequence = 0;
+
+void closeNetlinkSocket() {
+    if (netlinkSocket != -1) {
+        close(netlinkSocket);
+        netlinkSocket = -1;
+    }
+}
+
+// Returns the netlink socket, opening it if necessary, or negative errno on failure.
+int getNetlinkSocket() {
+    if (netlinkSocket != -1) {
+        return netlinkSocket;
+    }
+    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (sock == -1 ||
+            connect(sock, reinterpret_cast<const sockaddr*>(&NETLINK_ADDRESS),
+                    sizeof(NETLINK_ADDRESS)) == -1) {
+        int ret = -errno;
+        ALOGE("netlink socket/connect failed (%s)", strerror(errno));
+        if (sock != -1) {
+            close(sock);
+        }
+        return ret;
+    }
+    netlinkSocket = sock;
+    return sock;
+}
+
+// Reads acks from |sock| until the kernel has answered the |count| requests starting at sequence
+// number |firstSeq|, and stores the result of each in |errors| (0 or negative errno). Acks with
+// other sequence numbers belong to earlier requests whose acks weren't read, and are dropped.
+// Returns 0 if all acks were read, or negative errno if the socket failed. In that case the socket
+// is closed, since it may still hold acks that would get in the way of future requests.
+WARN_UNUSED_RESULT int readNetlinkAcks(int sock, uint32_t firstSeq, size_t count,
+                                       std::vector<int>* errors) {
+    errors->assign(count, 0);
+    std::vector<bool> acked(count, false);
+    size_t pending = count;
+
+    union {
+        nlmsghdr hdr;
+        uint8_t buf[8192];
+    } response;
+
+    while (pending > 0) {
+        int len = recv(sock, &response, sizeof(response), 0);
+        if (len == -1) {
+            int ret = -errno;
+            ALOGE("netlink recv failed (%s)", strerror(errno));
+            closeNetlinkSocket();
+            return ret;
+        }
+        for (nlmsghdr* nlmsg = &response.hdr; NLMSG_OK(nlmsg, len);
+                nlmsg = NLMSG_NEXT(nlmsg, len)) {
+            if (nlmsg->nlmsg_type != NLMSG_ERROR) {
+                continue;
+            }
+            uint32_t index = nlmsg->nlmsg_seq - firstSeq;
+            if (index >= count || acked[index]) {
+                continue;
+            }
+            if (nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(nlmsgerr))) {
+                ALOGE("bad netlink response message size (%u < %zu)", nlmsg->nlmsg_len,
+                      NLMSG_LENGTH(sizeof(nlmsgerr)));
+                (*errors)[index] = -EBADMSG;
+            } else {
+                // Netlink errors are negative errno.
+                (*errors)[index] = reinterpret_cast<nlmsgerr*>(NLMSG_DATA(nlmsg))->error;
+            }
+            acked[index] = true;
+            --pending;
+        }
+    }
+    return 0;
+}
+
+// Queues netlink requests while it is in scope, and sends them to the kernel with as few
+// sendmsg() calls as possible. Every request still has its own sequence number and ack, so errors
+// are matched back to the request that caused them.
+//
+// The kernel processes all requests in a batch even if one of them fails, and commit() returns the
+// first error other than |toleratedError|. Batches don't nest: a batch created while another one is
+// active does nothing, and its requests go into the outer batch.
+class NetlinkBatch {
+public:
+    explicit NetlinkBatch(int toleratedError = 0)
+            : mActive(current == NULL), mToleratedError(toleratedError) {
+        if (mActive) {
+            current = this;
+        }
+    }
+
+    ~NetlinkBatch() {
+        if (!mActive) {
+            return;
+        }
+        if (!mTypes.empty()) {
+            ALOGE("dropping %zu uncommitted netlink requests", mTypes.size());
+        }
+        current = NULL;
+    }
+
+    // The active batch, or NULL if requests are sent immediately.
+    static NetlinkBatch* current;
+
+    // Queues the request in |iov|, whose first element is a complete netlink header.
+    void add(const iovec* iov, int iovlen) {
+        const nlmsghdr* nlmsg = static_cast<const nlmsghdr*>(iov[0].iov_base);
+        if (mTypes.empty()) {
+            mFirstSeq = nlmsg->nlmsg_seq;
+        }
+        for (int i = 0; i < iovlen; ++i) {
+            const uint8_t* data = static_cast<const uint8_t*>(iov[i].iov_base);
+            mBuffer.insert(mBuffer.end(), data, data + iov[i].iov_len);
+        }
+        mBuffer.resize(NLMSG_ALIGN(mBuffer.size()));
+        mTypes.push_back(nlmsg->nlmsg_type);
+
+        if (mTypes.size() >= MAX_NETLINK_BATCH_REQUESTS) {
+            flush();
+        }
+    }
+
+    // Sends all queued requests. Returns 0 if all of them succeeded, or the first error.
+    WARN_UNUSED_RESULT int commit() {
+        if (mActive) {
+            flush();
+        }
+        int ret = mError;
+        mError = 0;
+        return ret;
+    }
+
+    // Number of requests sent so far that succeeded.
+    size_t succeeded() const { return mSucceeded; }
+
+private:
+    void flush() {
+        if (mTypes.empty()) {
+            return;
+        }
+        int ret = send();
+        if (ret && !mError) {
+            mError = ret;
+        }
+        mBuffer.clear();
+        mTypes.clear();
+    }
+
+    int send() {
+        int sock = getNetlinkSocket();
+        if (sock < 0) {
+            return sock;
+        }
+
+        iovec iov = { &mBuffer[0], mBuffer.size() };
+        msghdr msg = {};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        if (sendmsg(sock, &msg, 0) == -1) {
+            int ret = -errno;
+            ALOGE("netlink sendmsg of %zu requests failed (%s)", mTypes.size(), strerror(errno));
+            closeNetlinkSocket();
+            return ret;
+        }
+
+        std::vector<int> errors;
+        if (int ret = readNetlinkAcks(sock, mFirstSeq, mTypes.size(), &errors)) {
+            return ret;
+        }
+        int ret = 0;
+        for (size_t i = 0; i < errors.size(); ++i) {
+            if (errors[i] == 0) {
+                ++mSucceeded;
+            } else if (errors[i] != mToleratedError) {
+                ALOGE("netlink request %u (type %u) failed (%s)",
+                      static_cast<uint32_t>(mFirstSeq + i), mTypes[i], strerror(-errors[i]));
+                if (!ret) {
+                    ret = errors[i];
+                }
+            }
+        }
+        return ret;
+    }
+
+    const bool mActive;
+    const int mToleratedError;
+    std::vector<uint8_t> mBuffer;
+    std::vector<uint16_t> mTypes;  // Type of each queued request, for logging.
+    uint32_t mFirstSeq = 0;        // Sequence number of the first queued request.
+    int mError = 0;                // First error of the requests sent so far.
+    size_t mSucceeded = 0;
+};
+
+NetlinkBatch* NetlinkBatch::current = NULL;
+
+// Calls |fn| with a NetlinkBatch active, and commits the batch even if |fn| fails halfway, so the
+// kernel sees the same requests it would have seen without batching.
+template <typename Fn>
+WARN_UNUSED_RESULT int withNetlinkBatch(Fn fn) {
+    NetlinkBatch batch;
+    int ret = fn();
+    int commitRet = batch.commit();
+    return ret ? ret : commitRet;
+}
+
 // Sends a netlink request and expects an ack.
 // |iov| is an array of struct iovec that contains the netlink message payload.
 // The netlink header is generated by this function based on |action| and |flags|.
 // Returns -errno if there was an error or if the kernel reported an error.
+// If a NetlinkBatch is active, the request is queued, and errors are reported when the batch is
+// committed.
 
 // Disable optimizations in ASan build.
 // ASan reports an out-of-bounds 32-bit(!) access in the first loop of the
@@ -194,6 +412,7 @@ WARN_UNUSED_RESULT int sendNetlinkRequest(uint16_t action, uint16_t flags, iovec
     nlmsghdr nlmsg = {
         .nlmsg_type = action,
         .nlmsg_flags = flags,
+        .nlmsg_seq = ++netlinkSequence,
     };
     iov[0].iov_base = &nlmsg;
     iov[0].iov_len = sizeof(nlmsg);
@@ -201,37 +420,160 @@ WARN_UNUSED_RESULT int sendNetlinkRequest(uint16_t action, uint16_t flags, iovec
         nlmsg.nlmsg_len += iov[i].iov_len;
     }
 
-    int ret;
+    if (NetlinkBatch::current) {
+        NetlinkBatch::current->add(iov, iovlen);
+        return 0;
+    }
+
+    int sock = getNetlinkSocket();
+    if (sock < 0) {
+        return sock;
+    }
+    if (writev(sock, iov, iovlen) == -1) {
+        int ret = -errno;
+        ALOGE("netlink writev failed (%s)", strerror(errno));
+        closeNetlinkSocket();
+        return ret;
+    }
+
+    std::vector<int> errors;
+    if (int ret = readNetlinkAcks(sock, nlmsg.nlmsg_seq, 1, &errors)) {
+        return ret;
+    }
+    if (errors[0]) {
+        ALOGE("netlink response contains error (%s)", strerror(-errors[0]));
+    }
+    return errors[0];
+}
+
+// Returns the value of the 32-bit attribute |type| of |nlmsg|, whose payload starts with a fixed
+// header of |headerSize| bytes, or |defaultValue| if there is no such attribute.
+uint32_t getU32Attribute(const nlmsghdr* nlmsg, size_t headerSize, uint16_t type,
+                         uint32_t defaultValue) {
+    int len = nlmsg->nlmsg_len - NLMSG_LENGTH(headerSize);
+    const rtattr* rta = reinterpret_cast<const rtattr*>(
+            static_cast<const uint8_t*>(NLMSG_DATA(nlmsg)) + NLMSG_ALIGN(headerSize));
+    for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (rta->rta_type == type && RTA_PAYLOAD(rta) >= sizeof(uint32_t)) {
+            return *static_cast<const uint32_t*>(RTA_DATA(rta));
+        }
+    }
+    return defaultValue;
+}
+
+// Dumps all rules or routes (|type| is RTM_GETRULE or RTM_GETROUTE) of |family|, and appends the
+// payload of each one for which |match| returns true to |payloads|. Sets |interrupted| if the
+// kernel reports that the rules or routes changed during the dump, so it may be incomplete.
+// Returns 0 on success or negative errno on failure.
+template <typename Match>
+WARN_UNUSED_RESULT int dumpNetlinkObjects(uint16_t type, uint8_t family, Match match,
+                                          std::vector<std::vector<uint8_t>>* payloads,
+                                          bool* interrupted) {
+    int sock = getNetlinkSocket();
+    if (sock < 0) {
+        return sock;
+    }
+
+    // fib_rule_hdr and rtmsg both start with the family, and have the same size.
+    static_assert(sizeof(fib_rule_hdr) == sizeof(rtmsg), "unexpected fib_rule_hdr size");
     struct {
-        nlmsghdr msg;
-        nlmsgerr err;
-    } response;
+        nlmsghdr hdr;
+        rtmsg msg;
+    } request = {};
+    request.hdr.nlmsg_len = sizeof(request);
+    request.hdr.nlmsg_type = type;
+    request.hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.hdr.nlmsg_seq = ++netlinkSequence;
+    request.msg.rtm_family = family;
+
+    if (send(sock, &request, sizeof(request), 0) == -1) {
+        int ret = -errno;
+        ALOGE("netlink dump request failed (%s)", strerror(errno));
+        closeNetlinkSocket();
+        return ret;
+    }
 
-    int sock = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
-    if (sock != -1 &&
-            connect(sock, reinterpret_cast<const sockaddr*>(&NETLINK_ADDRESS),
-                    sizeof(NETLINK_ADDRESS)) != -1 &&
-            writev(sock, iov, iovlen) != -1 &&
-            (ret = recv(sock, &response, sizeof(response), 0)) != -1) {
-        if (ret == sizeof(response)) {
-            ret = response.err.error;  // Netlink errors are negative errno.
-            if (ret) {
-                ALOGE("netlink response contains error (%s)", strerror(-ret));
+    // Dumps come in multipart messages of up to 32k.
+    std::vector<uint8_t> buf(32768);
+    *interrupted = false;
+    while (true) {
+        ssize_t bytes = recv(sock, &buf[0], buf.size(), 0);
+        if (bytes == -1) {
+            int ret = -errno;
+            ALOGE("netlink dump recv failed (%s)", strerror(errno));
+            closeNetlinkSocket();
+            return ret;
+        }
+        int len = bytes;
+        for (const nlmsghdr* nlmsg = reinterpret_cast<const nlmsghdr*>(&buf[0]);
+                NLMSG_OK(nlmsg, len); nlmsg = NLMSG_NEXT(nlmsg, len)) {
+            if (nlmsg->nlmsg_seq != request.hdr.nlmsg_seq) {
+                continue;  // Left over from an earlier request.
+            }
+            if (nlmsg->nlmsg_flags & NLM_F_DUMP_INTR) {
+                *interrupted = true;
+            }
+            if (nlmsg->nlmsg_type == NLMSG_DONE) {
+                return 0;
+            }
+            if (nlmsg->nlmsg_type == NLMSG_ERROR) {
+                int ret = reinterpret_cast<const nlmsgerr*>(NLMSG_DATA(nlmsg))->error;
+                ALOGE("netlink dump failed (%s)", strerror(-ret));
+                return ret ? ret : -EBADMSG;
+            }
+            if (match(nlmsg)) {
+                const uint8_t* payload = static_cast<const uint8_t*>(NLMSG_DATA(nlmsg));
+                payloads->emplace_back(payload, payload + NLMSG_PAYLOAD(nlmsg, 0));
             }
-        } else {
-            ALOGE("bad netlink response message size (%d != %zu)", ret, sizeof(response));
-            ret = -EBADMSG;
         }
-    } else {
-        ALOGE("netlink socket/connect/writev/recv failed (%s)", strerror(errno));
-        ret = -errno;
     }
+}
 
-    if (sock != -1) {
-        close(sock);
+// Deletes the rules or routes (|action| is RTM_DELRULE or RTM_DELROUTE) in |payloads|, as returned
+// by dumpNetlinkObjects(), in one batch. Objects that are already gone are not an error, since
+// something else (e.g., the interface going down) may delete them between the dump and the delete.
+// Must not be called while a NetlinkBatch is active.
+// Returns the number of objects deleted, or negative errno on failure.
+WARN_UNUSED_RESULT int deleteNetlinkObjects(uint16_t action,
+                                            std::vector<std::vector<uint8_t>>& payloads) {
+    // The kernel reports missing rules with ENOENT, but missing routes with ESRCH.
+    NetlinkBatch batch(action == RTM_DELROUTE ? -ESRCH : -ENOENT);
+    for (auto& payload : payloads) {
+        iovec iov[] = {
+            { NULL,        0 },
+            { &payload[0], payload.size() },
+        };
+        if (int ret = sendNetlinkRequest(action, NETLINK_REQUEST_FLAGS, iov, ARRAY_SIZE(iov))) {
+            return ret;
+        }
     }
+    if (int ret = batch.commit()) {
+        return ret;
+    }
+    return batch.succeeded();
+}
 
-    return ret;
+// Dumps the rules or routes of |family| that |match| selects, and deletes them. If the dump was
+// interrupted by concurrent changes, repeats it so that nothing is left behind.
+// Returns the number of objects deleted, or negative errno on failure.
+template <typename Match>
+WARN_UNUSED_RESULT int flushNetlinkObjects(uint16_t dumpType, uint16_t deleteType, uint8_t family,
+                                           Match match) {
+    int deleted = 0;
+    bool interrupted;
+    unsigned attempts = 0;
+    do {
+        std::vector<std::vector<uint8_t>> payloads;
+        if (int ret = dumpNetlinkObjects(dumpType, family, match, &payloads, &interrupted)) {
+            return ret;
+        }
+        int ret = deleteNetlinkObjects(deleteType, payloads);
+        if (ret < 0) {
+            return ret;
+        }
+        deleted += ret;
+    } while (interrupted && ++attempts < ROUTE_FLUSH_ATTEMPTS);
+    return deleted;
 }
 
 // Returns 0 on success or negative errno on failure.
@@ -856,23 +1198,6 @@ WARN_UNUSED_RESULT int modifyTetheredNetwork(uint16_t action, const char* inputI
                         inputInterface, OIF_NONE, INVALID_UID, INVALID_UID);
 }
 
-// Returns 0 on success or negative errno on failure.
-WARN_UNUSED_RESULT int flushRules() {
-    for (size_t i = 0; i < ARRAY_SIZE(IP_VERSIONS); ++i) {
-        const char* argv[] = {
-            IP_PATH,
-            IP_VERSIONS[i],
-            "rule",
-            "flush",
-        };
-        if (android_fork_execvp(ARRAY_SIZE(argv), const_cast<char**>(argv), NULL, false, false)) {
-            ALOGE("failed to flush rules");
-            return -EREMOTEIO;
-        }
-    }
-    return 0;
-}
-
 // Adds or removes an IPv4 or IPv6 route to the specified table and, if it's a directly-connected
 // route, to the main table as well.
 // Returns 0 on success or negative errno on failure.
@@ -917,39 +1242,26 @@ WARN_UNUSED_RESULT int flushRoutes(const char* interface) {
         return -ESRCH;
     }
 
-    char tableString[UINT32_STRLEN];
-    snprintf(tableString, sizeof(tableString), "%u", table);
+    auto inTable = [table] (const nlmsghdr* nlmsg) {
+        const rtmsg* route = static_cast<const rtmsg*>(NLMSG_DATA(nlmsg));
+        // Cloned routes are cache entries, and can't be deleted.
+        return !(route->rtm_flags & RTM_F_CLONED) &&
+                getU32Attribute(nlmsg, sizeof(rtmsg), RTA_TABLE, route->rtm_table) == table;
+    };
 
     int ret = 0;
-    for (size_t i = 0; i < ARRAY_SIZE(IP_VERSIONS); ++i) {
-        const char* argv[] = {
-            IP_PATH,
-            IP_VERSIONS[i],
-            "route",
-            "flush",
-            "table",
-            tableString,
-        };
-
-        // A flush works by dumping routes and deleting each route as it's returned, and it can
-        // fail if something else deletes the route between the dump and the delete. This can
-        // happen, for example, if an interface goes down while we're trying to flush its routes.
-        // So try multiple times and only return an error if the last attempt fails.
-        //
-        // TODO: replace this with our own netlink code.
-        unsigned attempts = 0;
-        int err;
-        do {
-            err = android_fork_execvp(ARRAY_SIZE(argv), const_cast<char**>(argv),
-                                      NULL, false, false);
-            ++attempts;
-        } while (err != 0 && attempts < ROUTE_FLUSH_ATTEMPTS);
-        if (err) {
-            ALOGE("failed to flush %s routes in table %s after %d attempts",
-                  IP_VERSIONS[i], tableString, attempts);
-            ret = -EREMOTEIO;
+    int deleted = 0;
+    for (size_t i = 0; i < ARRAY_SIZE(AF_FAMILIES); ++i) {
+        int flushed = flushNetlinkObjects(RTM_GETROUTE, RTM_DELROUTE, AF_FAMILIES[i], inTable);
+        if (flushed < 0) {
+            ALOGE("failed to flush %s routes in table %u (%s)",
+                  AF_FAMILIES[i] == AF_INET ? "IPv4" : "IPv6", table, strerror(-flushed));
+            ret = flushed;
+        } else {
+            deleted += flushed;
         }
     }
+    ALOGD("flushed %d routes from table %u", deleted, table);
 
     // If we failed to flush routes, the caller may elect to keep this interface around, so keep
     // track of its name.
@@ -976,6 +1288,28 @@ WARN_UNUSED_RESULT int clearTetheringRules(const char* inputInterface) {
 
 }  // namespace
 
+// Deletes all rules except the ones with priority 0, which can't be deleted. This includes the
+// kernel's default rules that look up the main and default tables.
+// Returns 0 on success or negative errno on failure.
+int RouteController::flushRules() {
+    auto deletable = [] (const nlmsghdr* nlmsg) {
+        return getU32Attribute(nlmsg, sizeof(fib_rule_hdr), FRA_PRIORITY, 0) != 0;
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(AF_FAMILIES); ++i) {
+        int ret = flushNetlinkObjects(RTM_GETRULE, RTM_DELRULE, AF_FAMILIES[i], deletable);
+        if (ret < 0) {
+            ALOGE("failed to flush rules (%s)", strerror(-ret));
+            return ret;
+        }
+    }
+    return 0;
+}
+
+void RouteController::setNetlinkSocket(int sock) {
+    closeNetlinkSocket();
+    netlinkSocket = sock;
+}
+
 int RouteController::Init(unsigned localNetId) {
     if (int ret = flushRules()) {
         return ret;
@@ -1009,7 +1343,9 @@ int RouteController::removeInterfaceFromLocalNetwork(unsigned netId, const char*
 
 int RouteController::addInterfaceToPhysicalNetwork(unsigned netId, const char* interface,
                                                    Permission permission) {
-    if (int ret = modifyPhysicalNetwork(netId, interface, permission, ACTION_ADD)) {
+    if (int ret = withNetlinkBatch([&] {
+            return modifyPhysicalNetwork(netId, interface, permission, ACTION_ADD);
+        })) {
         return ret;
     }
     updateTableNamesFile();
@@ -1018,7 +1354,9 @@ int RouteController::addInterfaceToPhysicalNetwork(unsigned netId, const char* i
 
 int RouteController::removeInterfaceFromPhysicalNetwork(unsigned netId, const char* interface,
                                                         Permission permission) {
-    if (int ret = modifyPhysicalNetwork(netId, interface, permission, ACTION_DEL)) {
+    if (int ret = withNetlinkBatch([&] {
+            return modifyPhysicalNetwork(netId, interface, permission, ACTION_DEL);
+        })) {
         return ret;
     }
     if (int ret = flushRoutes(interface)) {
@@ -1033,8 +1371,10 @@ int RouteController::removeInterfaceFromPhysicalNetwork(unsigned netId, const ch
 
 int RouteController::addInterfaceToVirtualNetwork(unsigned netId, const char* interface,
                                                   bool secure, const UidRanges& uidRanges) {
-    if (int ret = modifyVirtualNetwork(netId, interface, uidRanges, secure, ACTION_ADD,
-                                       MODIFY_NON_UID_BASED_RULES)) {
+    if (int ret = withNetlinkBatch([&] {
+            return modifyVirtualNetwork(netId, interface, uidRanges, secure, ACTION_ADD,
+                                        MODIFY_NON_UID_BASED_RULES);
+        })) {
         return ret;
     }
     updateTableNamesFile();
@@ -1043,8 +1383,10 @@ int RouteController::addInterfaceToVirtualNetwork(unsigned netId, const char* in
 
 int RouteController::removeInterfaceFromVirtualNetwork(unsigned netId, const char* interface,
                                                        bool secure, const UidRanges& uidRanges) {
-    if (int ret = modifyVirtualNetwork(netId, interface, uidRanges, secure, ACTION_DEL,
-                                       MODIFY_NON_UID_BASED_RULES)) {
+    if (int ret = withNetlinkBatch([&] {
+            return modifyVirtualNetwork(netId, interface, uidRanges, secure, ACTION_DEL,
+                                        MODIFY_NON_UID_BASED_RULES);
+        })) {
         return ret;
     }
     if (int ret = flushRoutes(interface)) {
@@ -1057,31 +1399,40 @@ int RouteController::removeInterfaceFromVirtualNetwork(unsigned netId, const cha
 int RouteController::modifyPhysicalNetworkPermission(unsigned netId, const char* interface,
                                                      Permission oldPermission,
                                                      Permission newPermission) {
-    // Add the new rules before deleting the old ones, to avoid race conditions.
-    if (int ret = modifyPhysicalNetwork(netId, interface, newPermission, ACTION_ADD)) {
+    // Add the new rules before deleting the old ones, to avoid race conditions. These are separate
+    // batches, so that the old rules stay if the new ones can't be added.
+    if (int ret = withNetlinkBatch([&] {
+            return modifyPhysicalNetwork(netId, interface, newPermission, ACTION_ADD);
+        })) {
         return ret;
     }
-    return modifyPhysicalNetwork(netId, interface, oldPermission, ACTION_DEL);
+    return withNetlinkBatch([&] {
+        return modifyPhysicalNetwork(netId, interface, oldPermission, ACTION_DEL);
+    });
 }
 
 int RouteController::addUsersToRejectNonSecureNetworkRule(const UidRanges& uidRanges) {
-    return modifyRejectNonSecureNetworkRule(uidRanges, true);
+    return withNetlinkBatch([&] { return modifyRejectNonSecureNetworkRule(uidRanges, true); });
 }
 
 int RouteController::removeUsersFromRejectNonSecureNetworkRule(const UidRanges& uidRanges) {
-    return modifyRejectNonSecureNetworkRule(uidRanges, false);
+    return withNetlinkBatch([&] { return modifyRejectNonSecureNetworkRule(uidRanges, false); });
 }
 
 int RouteController::addUsersToVirtualNetwork(unsigned netId, const char* interface, bool secure,
                                               const UidRanges& uidRanges) {
-    return modifyVirtualNetwork(netId, interface, uidRanges, secure, ACTION_ADD,
-                                !MODIFY_NON_UID_BASED_RULES);
+    return withNetlinkBatch([&] {
+        return modifyVirtualNetwork(netId, interface, uidRanges, secure, ACTION_ADD,
+                                    !MODIFY_NON_UID_BASED_RULES);
+    });
 }
 
 int RouteController::removeUsersFromVirtualNetwork(unsigned netId, const char* interface,
                                                    bool secure, const UidRanges& uidRanges) {
-    return modifyVirtualNetwork(netId, interface, uidRanges, secure, ACTION_DEL,
-                                !MODIFY_NON_UID_BASED_RULES);
+    return withNetlinkBatch([&] {
+        return modifyVirtualNetwork(netId, interface, uidRanges, secure, ACTION_DEL,
+                                    !MODIFY_NON_UID_BASED_RULES);
+    });
 }
 
 int RouteController::addInterfaceToDefaultNetwork(const char* interface, Permission permission) {
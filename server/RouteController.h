@@ -87,6 +87,16 @@ public:
                                             Permission permission) WARN_UNUSED_RESULT;
     static int removeVirtualNetworkFallthrough(unsigned vpnNetId, const char* physicalInterface,
                                                Permission permission) WARN_UNUSED_RESULT;
+
+protected:
+    friend class RouteControllerTest;
+
+    // Deletes all rules except the ones with priority 0, which can't be deleted.
+    static int flushRules() WARN_UNUSED_RESULT;
+
+    // Closes the netlink socket, and sends all further requests to |sock| instead, which is
+    // closed like the real socket on errors. -1 opens a real socket again on next use.
+    static void setNetlinkSocket(int sock);
 };
 
 #endif  // NETD_SERVER_ROUTE_CONTROLLER_H
@@ -0,0 +1,250 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * RouteControllerTest.cpp - unit tests for the netlink batching in RouteController.cpp
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <linux/fib_rules.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <chrono>
+#include <future>
+#include <utility>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "RouteController.h"
+#include "UidRanges.h"
+
+namespace {
+
+// A netlink message as seen by the fake kernel: the header and the payload after it.
+struct Message {
+    nlmsghdr hdr;
+    std::vector<uint8_t> payload;
+};
+
+}  // namespace
+
+// Plays the kernel on the other end of a socketpair that RouteController uses as its netlink
+// socket. SOCK_SEQPACKET keeps message boundaries, like netlink does.
+class RouteControllerTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        int fds[2];
+        ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds));
+        RouteController::setNetlinkSocket(fds[0]);
+        mKernel = fds[1];
+    }
+
+    void TearDown() override {
+        RouteController::setNetlinkSocket(-1);
+        close(mKernel);
+    }
+
+    int flushRules() {
+        return RouteController::flushRules();
+    }
+
+    // Reads one sendmsg() worth of requests.
+    std::vector<Message> readRequests() {
+        std::vector<uint8_t> buf(65536);
+        std::vector<Message> messages;
+        ssize_t bytes = recv(mKernel, &buf[0], buf.size(), 0);
+        EXPECT_LT(0, bytes) << strerror(errno);
+        int len = bytes;
+        for (const nlmsghdr* nlmsg = reinterpret_cast<const nlmsghdr*>(&buf[0]);
+                bytes > 0 && NLMSG_OK(nlmsg, len); nlmsg = NLMSG_NEXT(nlmsg, len)) {
+            const uint8_t* payload = static_cast<const uint8_t*>(NLMSG_DATA(nlmsg));
+            messages.push_back({ *nlmsg, { payload, payload + NLMSG_PAYLOAD(nlmsg, 0) } });
+        }
+        return messages;
+    }
+
+    // Sends |messages| to RouteController in one datagram.
+    void reply(const std::vector<Message>& messages) {
+        std::vector<uint8_t> buf;
+        for (const Message& message : messages) {
+            nlmsghdr hdr = message.hdr;
+            hdr.nlmsg_len = NLMSG_LENGTH(message.payload.size());
+            const uint8_t* h = reinterpret_cast<const uint8_t*>(&hdr);
+            buf.insert(buf.end(), h, h + sizeof(hdr));
+            buf.insert(buf.end(), message.payload.begin(), message.payload.end());
+            buf.resize(NLMSG_ALIGN(buf.size()));
+        }
+        ASSERT_EQ(ssize_t(buf.size()), send(mKernel, &buf[0], buf.size(), 0));
+    }
+
+    static Message ack(uint32_t seq, int error) {
+        nlmsgerr err = {};
+        err.error = error;
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(&err);
+        return { { 0, NLMSG_ERROR, 0, seq, 0 }, { p, p + sizeof(err) } };
+    }
+
+    static Message done(uint32_t seq) {
+        return { { 0, NLMSG_DONE, NLM_F_MULTI, seq, 0 }, { 0, 0, 0, 0 } };
+    }
+
+    // A dumped rule with the given priority.
+    static Message rule(uint32_t seq, uint16_t flags, uint8_t family, uint32_t priority) {
+        fib_rule_hdr frh = {};
+        frh.family = family;
+        frh.action = FR_ACT_TO_TBL;
+        rtattr rta = { RTA_LENGTH(sizeof(priority)), FRA_PRIORITY };
+        std::vector<uint8_t> payload;
+        const uint8_t* p = reinterpret_cast<const uint8_t*>(&frh);
+        payload.insert(payload.end(), p, p + sizeof(frh));
+        p = reinterpret_cast<const uint8_t*>(&rta);
+        payload.insert(payload.end(), p, p + sizeof(rta));
+        p = reinterpret_cast<const uint8_t*>(&priority);
+        payload.insert(payload.end(), p, p + sizeof(priority));
+        return { { 0, RTM_NEWRULE, static_cast<uint16_t>(NLM_F_MULTI | flags), seq, 0 }, payload };
+    }
+
+    static UidRanges makeUidRanges(std::vector<const char*> ranges) {
+        UidRanges uidRanges;
+        EXPECT_TRUE(uidRanges.parseFrom(ranges.size(), const_cast<char**>(ranges.data())));
+        return uidRanges;
+    }
+
+    int mKernel = -1;
+};
+
+TEST_F(RouteControllerTest, TestAcksMatchedBySequenceNumber) {
+    const UidRanges ranges = makeUidRanges({ "10000-10099", "20000-20099", "30000-30099" });
+    auto result = std::async(std::launch::async, [&ranges] {
+        return RouteController::addUsersToRejectNonSecureNetworkRule(ranges);
+    });
+
+    // One rule per range and IP family, all in one sendmsg().
+    std::vector<Message> requests = readRequests();
+    ASSERT_EQ(6U, requests.size());
+    for (size_t i = 0; i < requests.size(); ++i) {
+        EXPECT_EQ(RTM_NEWRULE, requests[i].hdr.nlmsg_type);
+        EXPECT_EQ(requests[0].hdr.nlmsg_seq + i, requests[i].hdr.nlmsg_seq);
+        EXPECT_TRUE(requests[i].hdr.nlmsg_flags & NLM_F_ACK);
+    }
+
+    // A stale error from an earlier request, and a duplicate, must not count as acks. The real
+    // acks come back out of order and in two datagrams.
+    const uint32_t seq = requests[0].hdr.nlmsg_seq;
+    reply({ ack(seq - 100, -EPERM), ack(seq + 5, 0), ack(seq + 3, 0), ack(seq + 5, -EPERM) });
+    EXPECT_EQ(std::future_status::timeout, result.wait_for(std::chrono::milliseconds(50)));
+    reply({ ack(seq + 4, 0), ack(seq + 2, 0), ack(seq + 1, 0), ack(seq, 0) });
+    EXPECT_EQ(0, result.get());
+}
+
+TEST_F(RouteControllerTest, TestErrorInMiddleOfBatch) {
+    const UidRanges ranges = makeUidRanges({ "10000-10099", "20000-20099", "30000-30099" });
+    auto result = std::async(std::launch::async, [&ranges] {
+        return RouteController::removeUsersFromRejectNonSecureNetworkRule(ranges);
+    });
+
+    std::vector<Message> requests = readRequests();
+    ASSERT_EQ(6U, requests.size());
+    EXPECT_EQ(RTM_DELRULE, requests[0].hdr.nlmsg_type);
+
+    // The kernel carries on after a failed request. The error of the earliest request wins,
+    // whatever order the acks arrive in.
+    const uint32_t seq = requests[0].hdr.nlmsg_seq;
+    reply({ ack(seq, 0), ack(seq + 1, 0), ack(seq + 4, -EINVAL), ack(seq + 3, 0),
+            ack(seq + 2, -ENOENT), ack(seq + 5, 0) });
+    EXPECT_EQ(-ENOENT, result.get());
+
+    // The socket is still in sync: the next batch gets its own acks.
+    result = std::async(std::launch::async, [&ranges] {
+        return RouteController::addUsersToRejectNonSecureNetworkRule(ranges);
+    });
+    requests = readRequests();
+    ASSERT_EQ(6U, requests.size());
+    EXPECT_EQ(seq + 6, requests[0].hdr.nlmsg_seq);
+    std::vector<Message> acks;
+    for (const Message& request : requests) {
+        acks.push_back(ack(request.hdr.nlmsg_seq, 0));
+    }
+    reply(acks);
+    EXPECT_EQ(0, result.get());
+}
+
+TEST_F(RouteControllerTest, TestFlushRules) {
+    auto result = std::async(std::launch::async, [this] { return flushRules(); });
+
+    // IPv4: priority 0 rules stay, the others are deleted in one batch.
+    std::vector<Message> requests = readRequests();
+    ASSERT_EQ(1U, requests.size());
+    EXPECT_EQ(RTM_GETRULE, requests[0].hdr.nlmsg_type);
+    EXPECT_TRUE(requests[0].hdr.nlmsg_flags & NLM_F_DUMP);
+    EXPECT_EQ(AF_INET, requests[0].payload[0]);
+    uint32_t seq = requests[0].hdr.nlmsg_seq;
+    reply({ rule(seq - 1, 0, AF_INET, 999),  // Left over from an earlier dump.
+            rule(seq, 0, AF_INET, 0), rule(seq, 0, AF_INET, 1000) });
+    reply({ rule(seq, 0, AF_INET, 2000), done(seq) });
+
+    requests = readRequests();
+    ASSERT_EQ(2U, requests.size());
+    for (uint32_t i = 0; i < 2; ++i) {
+        EXPECT_EQ(RTM_DELRULE, requests[i].hdr.nlmsg_type);
+        EXPECT_EQ(seq + 1 + i, requests[i].hdr.nlmsg_seq);
+    }
+    EXPECT_EQ(rule(0, 0, AF_INET, 1000).payload, requests[0].payload);
+    EXPECT_EQ(rule(0, 0, AF_INET, 2000).payload, requests[1].payload);
+    // Rules that are already gone are not an error.
+    reply({ ack(seq + 2, 0), ack(seq + 1, -ENOENT) });
+
+    // IPv6: the dump is interrupted by a concurrent change, so it's repeated after the delete.
+    requests = readRequests();
+    ASSERT_EQ(1U, requests.size());
+    EXPECT_EQ(RTM_GETRULE, requests[0].hdr.nlmsg_type);
+    EXPECT_EQ(AF_INET6, requests[0].payload[0]);
+    seq = requests[0].hdr.nlmsg_seq;
+    reply({ rule(seq, NLM_F_DUMP_INTR, AF_INET6, 1000), done(seq) });
+
+    requests = readRequests();
+    ASSERT_EQ(1U, requests.size());
+    EXPECT_EQ(RTM_DELRULE, requests[0].hdr.nlmsg_type);
+    reply({ ack(requests[0].hdr.nlmsg_seq, 0) });
+
+    requests = readRequests();
+    ASSERT_EQ(1U, requests.size());
+    EXPECT_EQ(RTM_GETRULE, requests[0].hdr.nlmsg_type);
+    seq = requests[0].hdr.nlmsg_seq;
+    reply({ rule(seq, 0, AF_INET6, 0), done(seq) });
+
+    EXPECT_EQ(0, result.get());
+}
+
+TEST_F(RouteControllerTest, TestFlushRulesDeleteFails) {
+    auto result = std::async(std::launch::async, [this] { return flushRules(); });
+
+    std::vector<Message> requests = readRequests();
+    ASSERT_EQ(1U, requests.size());
+    uint32_t seq = requests[0].hdr.nlmsg_seq;
+    reply({ rule(seq, 0, AF_INET, 1000), rule(seq, 0, AF_INET, 2000), done(seq) });
+
+    requests = readRequests();
+    ASSERT_EQ(2U, requests.size());
+    reply({ ack(seq + 1, -EPERM), ack(seq + 2, 0) });
+
+    // The IPv6 rules are not touched.
+    EXPECT_EQ(-EPERM, result.get());
+}
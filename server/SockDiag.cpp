@@ -28,6 +28,7 @@
 
 #define LOG_TAG "Netd"
 
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
 #include <cutils/log.h>
 
@@ -36,7 +37,9 @@
 #include "Permission.h"
 #include "SockDiag.h"
 
+#include <algorithm>
 #include <chrono>
+#include <thread>
 
 #ifndef SOCK_DESTROY
 #define SOCK_DESTROY 21
@@ -44,8 +47,31 @@
 
 #define INET_DIAG_BC_MARK_COND 10
 
+using android::base::StringPrintf;
+
 namespace {
 
+const char *familyName(int family) {
+    return (family == AF_INET) ? "IPv4" : "IPv6";
+}
+
+SockDiag::DestroyRequest makeDestroyRequest(uint8_t proto, const inet_diag_msg *msg) {
+    SockDiag::DestroyRequest request = {
+        .nlh = {
+            .nlmsg_type = SOCK_DESTROY,
+            .nlmsg_flags = NLM_F_REQUEST,
+        },
+        .req = {
+            .sdiag_family = msg->idiag_family,
+            .sdiag_protocol = proto,
+            .idiag_states = (uint32_t) (1 << msg->idiag_state),
+            .id = msg->id,
+        },
+    };
+    request.nlh.nlmsg_len = sizeof(request);
+    return request;
+}
+
 int checkError(int fd) {
     struct {
         nlmsghdr h;
@@ -65,6 +91,59 @@ int checkError(int fd) {
     }
 }
 
+// Builds a SOCK_DIAG bytecode program, wrapped in an INET_DIAG_REQ_BYTECODE attribute, out of
+// conditions that each reject the sockets they match. A socket that no condition rejects is
+// accepted.
+//
+// The kernel's bytecode validator only walks the "yes" jumps, and requires every "no" target to be
+// on that walk. So each condition's "yes" is the next instruction, a JMP that rejects, and its "no"
+// skips over the JMP. A rejecting JMP goes exactly one instruction past the end of the program.
+class RejectBytecode {
+public:
+    RejectBytecode() : mBytecode(sizeof(nlattr)) {}
+
+    // Rejects sockets whose source (INET_DIAG_BC_S_COND) or destination (INET_DIAG_BC_D_COND)
+    // address is in the given prefix. An AF_INET prefix also matches v4-mapped IPv6 sockets.
+    void rejectHost(uint8_t code, uint8_t family, const void *addr, uint8_t addrlen,
+                    uint8_t prefixlen) {
+        const uint8_t condlen = sizeof(inet_diag_bc_op) + sizeof(inet_diag_hostcond) + addrlen;
+        const inet_diag_bc_op op = { code, condlen, (uint16_t) (condlen + kJmpLen) };
+        const inet_diag_hostcond cond = { family, prefixlen, -1 };
+        append(&op, sizeof(op));
+        append(&cond, sizeof(cond));
+        append(addr, addrlen);
+
+        mRejects.push_back(mBytecode.size());
+        const inet_diag_bc_op jmp = { INET_DIAG_BC_JMP, kJmpLen, 0 };  // Target set by finish().
+        append(&jmp, sizeof(jmp));
+    }
+
+    // Points the rejecting JMPs past the end of the program, and returns the attribute.
+    std::vector<uint8_t> finish() {
+        for (size_t offset : mRejects) {
+            inet_diag_bc_op *jmp = reinterpret_cast<inet_diag_bc_op *>(&mBytecode[offset]);
+            jmp->no = mBytecode.size() - offset + kJmpLen;
+        }
+        nlattr *nla = reinterpret_cast<nlattr *>(&mBytecode[0]);
+        nla->nla_type = INET_DIAG_REQ_BYTECODE;
+        nla->nla_len = mBytecode.size();
+        return mBytecode;
+    }
+
+private:
+    static constexpr uint8_t kJmpLen = sizeof(inet_diag_bc_op);
+
+    void append(const void *data, size_t len) {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+        mBytecode.insert(mBytecode.end(), bytes, bytes + len);
+    }
+
+    std::vector<uint8_t> mBytecode;
+    std::vector<size_t> mRejects;
+};
+
+constexpr uint8_t RejectBytecode::kJmpLen;
+
 }  // namespace
 
 bool SockDiag::open() {
@@ -200,38 +279,92 @@ int SockDiag::sendDumpRequest(uint8_t proto, uint8_t family, const char *addrstr
 }
 
 int SockDiag::readDiagMsg(uint8_t proto, SockDiag::DumpCallback callback) {
-    char buf[kBufferSize];
+    const int ret = readDumpMessages(proto, callback);
+    // Even if the dump failed, destroy the sockets that were already picked.
+    flushDestroys();
+    return ret;
+}
+
+// Makes sure the buffers that dumps are read into can hold the next datagram, which a peek tells us
+// the length of. Each buffer takes kDumpBufferSize, so that the kernel fills the datagrams of the
+// rest of the dump as far as it will. The kernel keeps filling datagrams until half the socket's
+// receive buffer is in use, so that is how many datagrams we read at once.
+int SockDiag::sizeDumpBuffers() {
+    const ssize_t len = recv(mSock, nullptr, 0, MSG_PEEK | MSG_TRUNC);
+    if (len < 0) {
+        return -errno;
+    }
+    int rcvbuf = 0;
+    socklen_t optlen = sizeof(rcvbuf);
+    if (getsockopt(mSock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &optlen) == -1) {
+        rcvbuf = 0;
+    }
+
+    const size_t bufferSize = std::max({ (size_t) kDumpBufferSize, (size_t) len, mDumpBufferSize });
+    const size_t count = std::min((size_t) kMaxDumpBatch, rcvbuf / 2 / bufferSize + 1);
+    if (bufferSize == mDumpBufferSize && count == mDumpHeaders.size()) {
+        return 0;
+    }
+
+    mDumpBufferSize = bufferSize;
+    mDumpBuffer.resize(bufferSize * count);
+    mDumpIov.resize(count);
+    mDumpHeaders.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        mDumpIov[i] = { &mDumpBuffer[i * bufferSize], bufferSize };
+        mDumpHeaders[i] = {};
+        mDumpHeaders[i].msg_hdr.msg_iov = &mDumpIov[i];
+        mDumpHeaders[i].msg_hdr.msg_iovlen = 1;
+    }
+    return 0;
+}
 
-    ssize_t bytesread;
-    do {
-        bytesread = read(mSock, buf, sizeof(buf));
+int SockDiag::readDumpMessages(uint8_t proto, const DumpCallback& callback) {
+    if (int ret = sizeDumpBuffers()) {
+        return ret;
+    }
 
-        if (bytesread < 0) {
+    while (true) {
+        // Wait for one datagram, and take whatever else is already there along with it.
+        const int count = recvmmsg(mSock, mDumpHeaders.data(), mDumpHeaders.size(),
+                                   MSG_WAITFORONE, nullptr);
+        if (count < 0) {
             return -errno;
         }
 
-        uint32_t len = bytesread;
-        for (nlmsghdr *nlh = reinterpret_cast<nlmsghdr *>(buf);
-             NLMSG_OK(nlh, len);
-             nlh = NLMSG_NEXT(nlh, len)) {
-            switch (nlh->nlmsg_type) {
-              case NLMSG_DONE:
-                callback(proto, NULL);
+        for (int i = 0; i < count; i++) {
+            const msghdr& hdr = mDumpHeaders[i].msg_hdr;
+            if (hdr.msg_flags & MSG_TRUNC) {
+                return -EMSGSIZE;
+            }
+            uint32_t len = mDumpHeaders[i].msg_len;
+            if (len == 0) {
                 return 0;
-              case NLMSG_ERROR: {
-                nlmsgerr *err = reinterpret_cast<nlmsgerr *>(NLMSG_DATA(nlh));
-                return err->error;
-              }
-              default:
-                inet_diag_msg *msg = reinterpret_cast<inet_diag_msg *>(NLMSG_DATA(nlh));
-                if (callback(proto, msg)) {
-                    sockDestroy(proto, msg);
+            }
+            for (nlmsghdr *nlh = reinterpret_cast<nlmsghdr *>(hdr.msg_iov->iov_base);
+                 NLMSG_OK(nlh, len);
+                 nlh = NLMSG_NEXT(nlh, len)) {
+                switch (nlh->nlmsg_type) {
+                  case NLMSG_DONE:
+                    callback(proto, NULL);
+                    return 0;
+                  case NLMSG_ERROR: {
+                    nlmsgerr *err = reinterpret_cast<nlmsgerr *>(NLMSG_DATA(nlh));
+                    return err->error;
+                  }
+                  default:
+                    inet_diag_msg *msg = reinterpret_cast<inet_diag_msg *>(NLMSG_DATA(nlh));
+                    if (callback(proto, msg)) {
+                        if (mPipelined) {
+                            queueDestroy(proto, msg);
+                        } else {
+                            sockDestroy(proto, msg);
+                        }
+                    }
                 }
             }
         }
-    } while (bytesread > 0);
-
-    return 0;
+    }
 }
 
 // Determines whether a socket is a loopback socket. Does not check socket state.
@@ -256,34 +389,139 @@ bool SockDiag::isLoopbackSocket(const inet_diag_msg *msg) {
     }
 }
 
+const std::vector<uint8_t>& SockDiag::excludeLoopbackBytecode() {
+    static const std::vector<uint8_t> bytecode = [] {
+        const in_addr loopback4 = { htonl(INADDR_LOOPBACK) };
+        RejectBytecode bc;
+        for (uint8_t code : { INET_DIAG_BC_S_COND, INET_DIAG_BC_D_COND }) {
+            bc.rejectHost(code, AF_INET, &loopback4, sizeof(loopback4), 8);  // 127/8
+            bc.rejectHost(code, AF_INET6, &in6addr_loopback, sizeof(in6addr_loopback), 128);
+        }
+        return bc.finish();
+    }();
+    return bytecode;
+}
+
 int SockDiag::sockDestroy(uint8_t proto, const inet_diag_msg *msg) {
     if (msg == nullptr) {
        return 0;
     }
 
-    DestroyRequest request = {
-        .nlh = {
-            .nlmsg_type = SOCK_DESTROY,
-            .nlmsg_flags = NLM_F_REQUEST,
-        },
-        .req = {
-            .sdiag_family = msg->idiag_family,
-            .sdiag_protocol = proto,
-            .idiag_states = (uint32_t) (1 << msg->idiag_state),
-            .id = msg->id,
-        },
-    };
-    request.nlh.nlmsg_len = sizeof(request);
+    Stopwatch s;
+    DestroyRequest request = makeDestroyRequest(proto, msg);
 
+    int ret;
     if (write(mWriteSock, &request, sizeof(request)) < (ssize_t) sizeof(request)) {
-        return -errno;
+        ret = -errno;
+    } else {
+        ret = checkError(mWriteSock);
+        if (!ret) mSocketsDestroyed++;
+    }
+    mDestroyMs += s.timeTaken();
+    return ret;
+}
+
+void SockDiag::queueDestroy(uint8_t proto, const inet_diag_msg *msg) {
+    mDestroyBatch.push_back(makeDestroyRequest(proto, msg));
+    if (mDestroyBatch.size() >= (size_t) kDestroyBatchSize) {
+        flushDestroys();
+    }
+}
+
+// Sends the queued SOCK_DESTROY requests in a single write. The kernel handles them one after the
+// other before the write returns, and only replies to those that fail, so the replies that are
+// waiting once it has returned tell us how many sockets were not destroyed.
+int SockDiag::flushDestroys() {
+    if (mDestroyBatch.empty()) {
+        return 0;
+    }
+
+    Stopwatch s;
+    const size_t len = mDestroyBatch.size() * sizeof(DestroyRequest);
+    int ret = 0;
+    if (write(mWriteSock, mDestroyBatch.data(), len) < (ssize_t) len) {
+        ret = -errno;
+    } else {
+        size_t failed = 0;
+        char buf[kBufferSize];
+        ssize_t bytesread;
+        while ((bytesread = recv(mWriteSock, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+            uint32_t remaining = bytesread;
+            for (nlmsghdr *nlh = reinterpret_cast<nlmsghdr *>(buf);
+                 NLMSG_OK(nlh, remaining);
+                 nlh = NLMSG_NEXT(nlh, remaining)) {
+                if (nlh->nlmsg_type == NLMSG_ERROR &&
+                        reinterpret_cast<nlmsgerr *>(NLMSG_DATA(nlh))->error != 0) {
+                    failed++;
+                }
+            }
+        }
+        mSocketsDestroyed += mDestroyBatch.size() - std::min(failed, mDestroyBatch.size());
+    }
+    mDestroyBatch.clear();
+    mDestroyMs += s.timeTaken();
+    return ret;
+}
+
+int SockDiag::runFamily(int family, const FamilyFunction& function, PhaseTiming *timing) {
+    Stopwatch s;
+    const int destroyedBefore = mSocketsDestroyed;
+    mDestroyMs = 0;
+
+    const int ret = function(this, family);
+
+    timing->destroyMs = mDestroyMs;
+    timing->dumpMs = s.timeTaken() - mDestroyMs;
+    timing->destroyed = mSocketsDestroyed - destroyedBefore;
+    return ret;
+}
+
+int SockDiag::forEachFamily(const std::vector<int>& families, const FamilyFunction& function) {
+    Stopwatch s;
+    mTiming = Timing();
+    auto timingFor = [this] (int family) {
+        return (family == AF_INET) ? &mTiming.ipv4 : &mTiming.ipv6;
+    };
+
+    if (mPipelined && families.size() == 2 && !mOther) {
+        std::unique_ptr<SockDiag> other(new SockDiag());
+        if (other->open()) {
+            mOther = std::move(other);
+        }
     }
 
-    int ret = checkError(mWriteSock);
-    if (!ret) mSocketsDestroyed++;
+    int ret = 0;
+    if (mPipelined && families.size() == 2 && mOther) {
+        // The second family is dumped on the other SockDiag, on another thread.
+        int otherRet = 0;
+        std::thread thread([&] {
+            otherRet = mOther->runFamily(families[1], function, timingFor(families[1]));
+        });
+        ret = runFamily(families[0], function, timingFor(families[0]));
+        thread.join();
+        mSocketsDestroyed += timingFor(families[1])->destroyed;
+        if (!ret) {
+            ret = otherRet;
+        }
+    } else {
+        for (const int family : families) {
+            if ((ret = runFamily(family, function, timingFor(family)))) {
+                break;
+            }
+        }
+    }
+
+    mTiming.totalMs = s.timeTaken();
     return ret;
 }
 
+std::string SockDiag::timingToString() const {
+    return StringPrintf("IPv4: %d, dump %.1f ms, destroy %.1f ms; "
+                        "IPv6: %d, dump %.1f ms, destroy %.1f ms",
+                        mTiming.ipv4.destroyed, mTiming.ipv4.dumpMs, mTiming.ipv4.destroyMs,
+                        mTiming.ipv6.destroyed, mTiming.ipv6.dumpMs, mTiming.ipv6.destroyMs);
+}
+
 int SockDiag::destroySockets(uint8_t proto, int family, const char *addrstr) {
     if (!hasSocks()) {
         return -EBADFD;
@@ -299,50 +537,66 @@ int SockDiag::destroySockets(uint8_t proto, int family, const char *addrstr) {
 }
 
 int SockDiag::destroySockets(const char *addrstr) {
-    Stopwatch s;
     mSocketsDestroyed = 0;
 
+    // IPv4 addresses also have to be looked for in the IPv6 dump, as v4-mapped addresses.
+    std::vector<int> families;
     if (!strchr(addrstr, ':')) {
-        if (int ret = destroySockets(IPPROTO_TCP, AF_INET, addrstr)) {
-            ALOGE("Failed to destroy IPv4 sockets on %s: %s", addrstr, strerror(-ret));
-            return ret;
-        }
+        families.push_back(AF_INET);
     }
-    if (int ret = destroySockets(IPPROTO_TCP, AF_INET6, addrstr)) {
-        ALOGE("Failed to destroy IPv6 sockets on %s: %s", addrstr, strerror(-ret));
+    families.push_back(AF_INET6);
+
+    int ret = forEachFamily(families, [addrstr] (SockDiag *sd, int family) {
+        int ret = sd->destroySockets(IPPROTO_TCP, family, addrstr);
+        if (ret) {
+            ALOGE("Failed to destroy %s sockets on %s: %s", familyName(family), addrstr,
+                  strerror(-ret));
+        }
+        return ret;
+    });
+    if (ret) {
         return ret;
     }
 
     if (mSocketsDestroyed > 0) {
-        ALOGI("Destroyed %d sockets on %s in %.1f ms", mSocketsDestroyed, addrstr, s.timeTaken());
+        ALOGI("Destroyed %d sockets on %s in %.1f ms (%s)", mSocketsDestroyed, addrstr,
+              mTiming.totalMs, timingToString().c_str());
     }
 
     return mSocketsDestroyed;
 }
 
-int SockDiag::destroyLiveSockets(DumpCallback destroyFilter, const char *what,
+int SockDiag::destroyLiveSockets(uint8_t proto, DumpCallback destroyFilter, const char *what,
                                  iovec *iov, int iovcnt) {
-    int proto = IPPROTO_TCP;
-
-    for (const int family : {AF_INET, AF_INET6}) {
-        const char *familyName = (family == AF_INET) ? "IPv4" : "IPv6";
+    return forEachFamily({AF_INET, AF_INET6}, [&] (SockDiag *sd, int family) {
+        // sendDumpRequest() fills in the first iovec, so each family needs its own copy.
+        std::vector<iovec> familyIov(iov, iov + iovcnt);
         uint32_t states = (1 << TCP_ESTABLISHED) | (1 << TCP_SYN_SENT) | (1 << TCP_SYN_RECV);
-        if (int ret = sendDumpRequest(proto, family, states, iov, iovcnt)) {
-            ALOGE("Failed to dump %s sockets for %s: %s", familyName, what, strerror(-ret));
+        if (int ret = sd->sendDumpRequest(proto, family, states, familyIov.data(), iovcnt)) {
+            ALOGE("Failed to dump %s sockets for %s: %s", familyName(family), what,
+                  strerror(-ret));
             return ret;
         }
-        if (int ret = readDiagMsg(proto, destroyFilter)) {
-            ALOGE("Failed to destroy %s sockets for %s: %s", familyName, what, strerror(-ret));
+        if (int ret = sd->readDiagMsg(proto, destroyFilter)) {
+            ALOGE("Failed to destroy %s sockets for %s: %s", familyName(family), what,
+                  strerror(-ret));
             return ret;
         }
-    }
-
-    return 0;
+        return 0;
+    });
 }
 
 int SockDiag::destroySockets(uint8_t proto, const uid_t uid, bool excludeLoopback) {
     mSocketsDestroyed = 0;
-    Stopwatch s;
+
+    // The kernel has no condition for the UID, but it can leave out the loopback sockets. Those
+    // whose source and destination are the same non-loopback address are still checked below.
+    const std::vector<uint8_t>& bytecode = excludeLoopbackBytecode();
+    iovec iov[] = {
+        { nullptr, 0 },
+        { const_cast<uint8_t *>(bytecode.data()), bytecode.size() },
+    };
+    const int iovcnt = excludeLoopback ? ARRAY_SIZE(iov) : 1;
 
     auto shouldDestroy = [uid, excludeLoopback] (uint8_t, const inet_diag_msg *msg) {
         return msg != nullptr &&
@@ -350,21 +604,13 @@ int SockDiag::destroySockets(uint8_t proto, const uid_t uid, bool excludeLoopbac
                !(excludeLoopback && isLoopbackSocket(msg));
     };
 
-    for (const int family : {AF_INET, AF_INET6}) {
-        const char *familyName = family == AF_INET ? "IPv4" : "IPv6";
-        uint32_t states = (1 << TCP_ESTABLISHED) | (1 << TCP_SYN_SENT) | (1 << TCP_SYN_RECV);
-        if (int ret = sendDumpRequest(proto, family, states)) {
-            ALOGE("Failed to dump %s sockets for UID: %s", familyName, strerror(-ret));
-            return ret;
-        }
-        if (int ret = readDiagMsg(proto, shouldDestroy)) {
-            ALOGE("Failed to destroy %s sockets for UID: %s", familyName, strerror(-ret));
-            return ret;
-        }
+    if (int ret = destroyLiveSockets(proto, shouldDestroy, "UID", iov, iovcnt)) {
+        return ret;
     }
 
     if (mSocketsDestroyed > 0) {
-        ALOGI("Destroyed %d sockets for UID in %.1f ms", mSocketsDestroyed, s.timeTaken());
+        ALOGI("Destroyed %d sockets for UID in %.1f ms (%s)", mSocketsDestroyed, mTiming.totalMs,
+              timingToString().c_str());
     }
 
     return 0;
@@ -373,7 +619,6 @@ int SockDiag::destroySockets(uint8_t proto, const uid_t uid, bool excludeLoopbac
 int SockDiag::destroySockets(const UidRanges& uidRanges, const std::set<uid_t>& skipUids,
                              bool excludeLoopback) {
     mSocketsDestroyed = 0;
-    Stopwatch s;
 
     auto shouldDestroy = [&] (uint8_t, const inet_diag_msg *msg) {
         return msg != nullptr &&
@@ -382,11 +627,15 @@ int SockDiag::destroySockets(const UidRanges& uidRanges, const std::set<uid_t>&
                !(excludeLoopback && isLoopbackSocket(msg));
     };
 
+    // As above, only the loopback check can be done by the kernel.
+    const std::vector<uint8_t>& bytecode = excludeLoopbackBytecode();
     iovec iov[] = {
         { nullptr, 0 },
+        { const_cast<uint8_t *>(bytecode.data()), bytecode.size() },
     };
+    const int iovcnt = excludeLoopback ? ARRAY_SIZE(iov) : 1;
 
-    if (int ret = destroyLiveSockets(shouldDestroy, "UID", iov, ARRAY_SIZE(iov))) {
+    if (int ret = destroyLiveSockets(IPPROTO_TCP, shouldDestroy, "UID", iov, iovcnt)) {
         return ret;
     }
 
@@ -397,9 +646,10 @@ int SockDiag::destroySockets(const UidRanges& uidRanges, const std::set<uid_t>&
     std::sort(skipUidStrings.begin(), skipUidStrings.end());
 
     if (mSocketsDestroyed > 0) {
-        ALOGI("Destroyed %d sockets for %s skip={%s} in %.1f ms",
+        ALOGI("Destroyed %d sockets for %s skip={%s} in %.1f ms (%s)",
               mSocketsDestroyed, uidRanges.toString().c_str(),
-              android::base::Join(skipUidStrings, " ").c_str(), s.timeTaken());
+              android::base::Join(skipUidStrings, " ").c_str(), mTiming.totalMs,
+              timingToString().c_str());
     }
 
     return 0;
@@ -479,19 +729,19 @@ int SockDiag::destroySocketsLackingPermission(unsigned netId, Permission permiss
     };
 
     mSocketsDestroyed = 0;
-    Stopwatch s;
 
     auto shouldDestroy = [&] (uint8_t, const inet_diag_msg *msg) {
         return msg != nullptr && !(excludeLoopback && isLoopbackSocket(msg));
     };
 
-    if (int ret = destroyLiveSockets(shouldDestroy, "permission change", iov, ARRAY_SIZE(iov))) {
+    if (int ret = destroyLiveSockets(IPPROTO_TCP, shouldDestroy, "permission change", iov,
+                                     ARRAY_SIZE(iov))) {
         return ret;
     }
 
     if (mSocketsDestroyed > 0) {
-        ALOGI("Destroyed %d sockets for netId %d permission=%d in %.1f ms",
-              mSocketsDestroyed, netId, permission, s.timeTaken());
+        ALOGI("Destroyed %d sockets for netId %d permission=%d in %.1f ms (%s)",
+              mSocketsDestroyed, netId, permission, mTiming.totalMs, timingToString().c_str());
     }
 
     return 0;
@@ -22,7 +22,10 @@
 #include <linux/inet_diag.h>
 
 #include <functional>
+#include <memory>
 #include <set>
+#include <string>
+#include <vector>
 
 #include "Permission.h"
 #include "UidRanges.h"
@@ -34,6 +37,13 @@ class SockDiag {
 
   public:
     static const int kBufferSize = 4096;
+    // The most a single datagram of a dump can hold. The kernel fills datagrams up to the largest
+    // buffer it has seen us read with, but to no more than 32 KiB.
+    static const int kDumpBufferSize = 32768;
+    // The most dump datagrams that are read with one recvmmsg().
+    static const int kMaxDumpBatch = 8;
+    // In pipelined mode, the number of SOCK_DESTROY requests that are sent in a single write.
+    static const int kDestroyBatchSize = 32;
 
     // Callback function that is called once for every socket in the dump. A return value of true
     // means destroy the socket.
@@ -44,10 +54,30 @@ class SockDiag {
         inet_diag_req_v2 req;
     } __attribute__((__packed__));
 
-    SockDiag() : mSock(-1), mWriteSock(-1), mSocketsDestroyed(0) {}
+    // How long each phase of the last destroySockets() or destroySocketsLackingPermission() took.
+    struct PhaseTiming {
+        float dumpMs;     // Sending the dump request, and reading and filtering the dump.
+        float destroyMs;  // Sending SOCK_DESTROY requests and reading their errors.
+        int destroyed;
+    };
+    struct Timing {
+        PhaseTiming ipv4;
+        PhaseTiming ipv6;
+        float totalMs;
+    };
+
+    SockDiag() : mSock(-1), mWriteSock(-1), mSocketsDestroyed(0), mPipelined(true),
+                 mDestroyMs(0), mTiming(), mDumpBufferSize(0) {}
     bool open();
     virtual ~SockDiag() { closeSocks(); }
 
+    // In pipelined mode, which is the default, sockets are destroyed kDestroyBatchSize at a time,
+    // with a single write, and the bulk destroy methods dump the IPv4 and IPv6 sockets at the same
+    // time, on a second SockDiag that is opened the first time it's needed. Otherwise, each socket
+    // is destroyed with a write of its own, and the families are dumped one after the other.
+    void setPipelined(bool pipelined) { mPipelined = pipelined; }
+    const Timing& getTiming() const { return mTiming; }
+
     int sendDumpRequest(uint8_t proto, uint8_t family, uint32_t states);
     int sendDumpRequest(uint8_t proto, uint8_t family, const char *addrstr);
     int readDiagMsg(uint8_t proto, DumpCallback callback);
@@ -69,10 +99,37 @@ class SockDiag {
     int mSock;
     int mWriteSock;
     int mSocketsDestroyed;
+    bool mPipelined;
+    // Dumps the second family in pipelined mode. Kept open, along with its dump buffers.
+    std::unique_ptr<SockDiag> mOther;
+    std::vector<DestroyRequest> mDestroyBatch;
+    float mDestroyMs;  // Time spent destroying sockets since the current family started.
+    Timing mTiming;
+    // The buffers that dumps are read into, kept between dumps.
+    std::vector<char> mDumpBuffer;
+    std::vector<iovec> mDumpIov;
+    std::vector<mmsghdr> mDumpHeaders;
+    size_t mDumpBufferSize;
+
+    // Dumps and destroys the sockets of one family, on the given SockDiag.
+    typedef std::function<int(SockDiag *sd, int family)> FamilyFunction;
+
     int sendDumpRequest(uint8_t proto, uint8_t family, uint32_t states, iovec *iov, int iovcnt);
+    int readDumpMessages(uint8_t proto, const DumpCallback& callback);
+    int sizeDumpBuffers();
+    void queueDestroy(uint8_t proto, const inet_diag_msg *msg);
+    int flushDestroys();
     int destroySockets(uint8_t proto, int family, const char *addrstr);
-    int destroyLiveSockets(DumpCallback destroy, const char *what, iovec *iov, int iovcnt);
+    int destroyLiveSockets(uint8_t proto, DumpCallback destroy, const char *what, iovec *iov,
+                           int iovcnt);
+    // Runs |function| for each of |families|, at the same time if pipelined, and fills in mTiming.
+    int forEachFamily(const std::vector<int>& families, const FamilyFunction& function);
+    int runFamily(int family, const FamilyFunction& function, PhaseTiming *timing);
+    std::string timingToString() const;
     bool hasSocks() { return mSock != -1 && mWriteSock != -1; }
     void closeSocks() { close(mSock); close(mWriteSock); mSock = mWriteSock = -1; }
     static bool isLoopbackSocket(const inet_diag_msg *msg);
+    // An INET_DIAG_REQ_BYTECODE attribute that makes the kernel leave sockets on loopback
+    // addresses out of the dump, so we don't have to read them only to skip them.
+    static const std::vector<uint8_t>& excludeLoopbackBytecode();
 };
@@ -16,6 +16,7 @@
  * sock_diag_test.cpp - unit tests for SockDiag.cpp
  */
 
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -35,6 +36,42 @@ protected:
     static bool isLoopbackSocket(const inet_diag_msg *msg) {
         return SockDiag::isLoopbackSocket(msg);
     };
+
+    // Dumps the live TCP sockets of |family|, leaving out loopback sockets if |excludeLoopback|.
+    static int sendLiveDumpRequest(SockDiag& sd, uint8_t family, bool excludeLoopback) {
+        const std::vector<uint8_t>& bytecode = SockDiag::excludeLoopbackBytecode();
+        iovec iov[] = {
+            { nullptr, 0 },
+            { const_cast<uint8_t *>(bytecode.data()), bytecode.size() },
+        };
+        uint32_t states = (1 << TCP_ESTABLISHED) | (1 << TCP_SYN_SENT) | (1 << TCP_SYN_RECV);
+        return sd.sendDumpRequest(IPPROTO_TCP, family, states, iov, excludeLoopback ? 2 : 1);
+    }
+
+    // Reads a dump the way readDiagMsg() used to, one 4 KiB read() at a time, and counts the
+    // sockets that |filter| accepts.
+    static int readDumpWithSmallReads(SockDiag& sd, const SockDiag::DumpCallback& filter) {
+        char buf[4096];
+        int accepted = 0;
+        while (true) {
+            ssize_t bytesread = read(sd.mSock, buf, sizeof(buf));
+            if (bytesread <= 0) {
+                return -1;
+            }
+            uint32_t len = bytesread;
+            for (nlmsghdr *nlh = reinterpret_cast<nlmsghdr *>(buf);
+                 NLMSG_OK(nlh, len);
+                 nlh = NLMSG_NEXT(nlh, len)) {
+                if (nlh->nlmsg_type == NLMSG_DONE) {
+                    return accepted;
+                } else if (nlh->nlmsg_type == NLMSG_ERROR) {
+                    return -1;
+                }
+                accepted += filter(IPPROTO_TCP,
+                                   reinterpret_cast<inet_diag_msg *>(NLMSG_DATA(nlh)));
+            }
+        }
+    }
 };
 
 uint16_t bindAndListen(int s) {
@@ -273,8 +310,141 @@ TEST_F(SockDiagTest, TestIsLoopbackSocket) {
     EXPECT_TRUE(isLoopbackSocket(&msg));
 }
 
+TEST_F(SockDiagTest, TestExcludeLoopbackBytecode) {
+    int listensocket = socket(AF_INET6, SOCK_STREAM, 0);
+    ASSERT_NE(-1, listensocket) << "Failed to open listen socket: " << strerror(errno);
+    uint16_t port = bindAndListen(listensocket);
+    ASSERT_NE(0, port) << "Can't bind to server port";
+
+    // One IPv4 connection, which the server sees as v4-mapped, and one IPv6 connection.
+    int v4socket = socket(AF_INET, SOCK_STREAM, 0);
+    int v6socket = socket(AF_INET6, SOCK_STREAM, 0);
+    sockaddr_in server4 = { .sin_family = AF_INET, .sin_port = htons(port) };
+    sockaddr_in6 server6 = { .sin6_family = AF_INET6, .sin6_port = htons(port) };
+    server4.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    server6.sin6_addr = in6addr_loopback;
+    ASSERT_EQ(0, connect(v4socket, (sockaddr *) &server4, sizeof(server4)));
+    ASSERT_EQ(0, connect(v6socket, (sockaddr *) &server6, sizeof(server6)));
+    int accepted4 = accept(listensocket, nullptr, nullptr);
+    int accepted6 = accept(listensocket, nullptr, nullptr);
+    ASSERT_NE(-1, accepted4);
+    ASSERT_NE(-1, accepted6);
+
+    SockDiag sd;
+    ASSERT_TRUE(sd.open()) << "Failed to open SOCK_DIAG socket";
+
+    int ourSockets = 0;
+    auto countOurSockets = [&] (uint8_t /* proto */, const inet_diag_msg *msg) {
+        if (msg != nullptr &&
+                (msg->id.idiag_sport == htons(port) || msg->id.idiag_dport == htons(port))) {
+            ourSockets++;
+        }
+        return false;
+    };
+
+    for (const bool excludeLoopback : { false, true }) {
+        ourSockets = 0;
+        for (const uint8_t family : { AF_INET, AF_INET6 }) {
+            // The kernel checks the bytecode, and would reject the request if it were invalid.
+            int ret = sendLiveDumpRequest(sd, family, excludeLoopback);
+            ASSERT_EQ(0, ret) << "Failed to send dump request: " << strerror(-ret);
+            ret = sd.readDiagMsg(IPPROTO_TCP, countOurSockets);
+            ASSERT_EQ(0, ret) << "Failed to read dump: " << strerror(-ret);
+        }
+        EXPECT_EQ(excludeLoopback ? 0 : 4, ourSockets);
+    }
+
+    close(v4socket);
+    close(v6socket);
+    close(accepted4);
+    close(accepted6);
+    close(listensocket);
+}
+
+// Measures how fast a dump of 10000 sockets can be read and filtered. It needs an fd for each of
+// those sockets, so it only runs when asked for, with --gtest_also_run_disabled_tests.
+TEST_F(SockDiagTest, DISABLED_TestDumpBenchmark) {
+    constexpr int kConnections = 5000;  // Both ends of each are in the dump.
+    constexpr rlim_t kFdsNeeded = 2 * kConnections + 100;
+
+    rlimit limit;
+    ASSERT_EQ(0, getrlimit(RLIMIT_NOFILE, &limit));
+    const rlimit oldLimit = limit;
+    if (limit.rlim_cur < kFdsNeeded) {
+        limit.rlim_cur = std::min(kFdsNeeded, limit.rlim_max);
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (limit.rlim_cur < kFdsNeeded) {
+        fprintf(stderr, "Skipping: can only open %llu fds, need %llu\n",
+                (unsigned long long) limit.rlim_cur, (unsigned long long) kFdsNeeded);
+        return;
+    }
+
+    int listensocket = socket(AF_INET6, SOCK_STREAM, 0);
+    ASSERT_NE(-1, listensocket) << "Failed to open listen socket";
+    uint16_t port = bindAndListen(listensocket);
+    ASSERT_NE(0, port) << "Can't bind to server port";
+    sockaddr_in6 server = { .sin6_family = AF_INET6, .sin6_port = htons(port) };
+    server.sin6_addr = in6addr_loopback;
+
+    std::vector<int> sockets;
+    for (int i = 0; i < kConnections; i++) {
+        int s = socket(AF_INET6, SOCK_STREAM, 0);
+        ASSERT_NE(-1, s) << "Opening socket " << i << " failed: " << strerror(errno);
+        sockets.push_back(s);
+        ASSERT_EQ(0, connect(s, (sockaddr *) &server, sizeof(server)))
+            << "Connecting socket " << i << " failed: " << strerror(errno);
+        int accepted = accept(listensocket, nullptr, nullptr);
+        ASSERT_NE(-1, accepted) << "Accepting socket " << i << " failed: " << strerror(errno);
+        sockets.push_back(accepted);
+    }
+
+    // The filter picks our sockets, but never asks for anything to be destroyed.
+    int ourSockets = 0;
+    auto filter = [&] (uint8_t, const inet_diag_msg *msg) {
+        if (msg != nullptr &&
+                (msg->id.idiag_sport == htons(port) || msg->id.idiag_dport == htons(port))) {
+            ourSockets++;
+        }
+        return false;
+    };
+    const uint32_t states = 1 << TCP_ESTABLISHED;
+    using ms = std::chrono::duration<float, std::ratio<1, 1000>>;
+
+    // Each SockDiag gets its own netlink socket, since the kernel sizes the datagrams of a dump by
+    // the reads it has seen on that socket.
+    SockDiag smallReads;
+    ASSERT_TRUE(smallReads.open()) << "Failed to open SOCK_DIAG socket";
+    auto start = std::chrono::steady_clock::now();
+    ASSERT_EQ(0, smallReads.sendDumpRequest(IPPROTO_TCP, AF_INET6, states));
+    readDumpWithSmallReads(smallReads, filter);
+    const float smallReadsMs =
+            std::chrono::duration_cast<ms>(std::chrono::steady_clock::now() - start).count();
+    EXPECT_EQ(2 * kConnections, ourSockets);
+
+    ourSockets = 0;
+    SockDiag sd;
+    ASSERT_TRUE(sd.open()) << "Failed to open SOCK_DIAG socket";
+    start = std::chrono::steady_clock::now();
+    ASSERT_EQ(0, sd.sendDumpRequest(IPPROTO_TCP, AF_INET6, states));
+    ASSERT_EQ(0, sd.readDiagMsg(IPPROTO_TCP, filter));
+    const float dumpMs =
+            std::chrono::duration_cast<ms>(std::chrono::steady_clock::now() - start).count();
+    EXPECT_EQ(2 * kConnections, ourSockets);
+
+    fprintf(stderr, "Dumped and filtered %d sockets in %.1f ms (%.0f sockets/ms), "
+            "%.1f ms with 4 KiB reads\n", ourSockets, dumpMs, ourSockets / dumpMs, smallReadsMs);
+
+    for (int s : sockets) {
+        close(s);
+    }
+    close(listensocket);
+    setrlimit(RLIMIT_NOFILE, &oldLimit);
+}
+
 enum MicroBenchmarkTestType {
     ADDRESS,
+    ADDRESS_SEQUENTIAL,
     UID,
     UID_EXCLUDE_LOOPBACK,
     UIDRANGE,
@@ -286,6 +456,7 @@ const char *testTypeName(MicroBenchmarkTestType mode) {
 #define TO_STRING_TYPE(x) case ((x)): return #x;
     switch((mode)) {
         TO_STRING_TYPE(ADDRESS);
+        TO_STRING_TYPE(ADDRESS_SEQUENTIAL);
         TO_STRING_TYPE(UID);
         TO_STRING_TYPE(UID_EXCLUDE_LOOPBACK);
         TO_STRING_TYPE(UIDRANGE);
@@ -340,6 +511,7 @@ protected:
         MicroBenchmarkTestType mode = GetParam();
         switch (mode) {
         case ADDRESS:
+        case ADDRESS_SEQUENTIAL:
             return ADDRESS_SOCKETS;
         case UID:
         case UID_EXCLUDE_LOOPBACK:
@@ -378,8 +550,13 @@ protected:
         int ret;
         switch (mode) {
             case ADDRESS:
+            case ADDRESS_SEQUENTIAL:
+                mSd.setPipelined(mode == ADDRESS);
                 ret = mSd.destroySockets("::1");
                 EXPECT_LE(0, ret) << ": Failed to destroy sockets on ::1: " << strerror(-ret);
+                // At least one end of every connection. Destroying one end resets the other, which
+                // might then be gone by the time the dump gets to it.
+                EXPECT_LE(ADDRESS_SOCKETS, ret);
                 break;
             case UID:
             case UID_EXCLUDE_LOOPBACK: {
@@ -411,6 +588,7 @@ protected:
         MicroBenchmarkTestType mode = GetParam();
         switch (mode) {
             case ADDRESS:
+            case ADDRESS_SEQUENTIAL:
                 return true;
             case UID:
                 return i == CLOSE_UID - START_UID;
@@ -502,6 +680,12 @@ TEST_P(SockDiagMicroBenchmarkTest, TestMicroBenchmark) {
     destroySockets();
     fprintf(stderr, "  Destroying: %6.1f ms\n",
             std::chrono::duration_cast<ms>(std::chrono::steady_clock::now() - start).count());
+    const SockDiag::Timing& timing = mSd.getTiming();
+    for (const auto& phase : { std::make_pair("IPv4", timing.ipv4),
+                               std::make_pair("IPv6", timing.ipv6) }) {
+        fprintf(stderr, "        %s: %6.1f ms dumping, %6.1f ms destroying %d sockets\n",
+                phase.first, phase.second.dumpMs, phase.second.destroyMs, phase.second.destroyed);
+    }
 
     start = std::chrono::steady_clock::now();
     int socketsClosed = 0;
@@ -529,8 +713,9 @@ TEST_P(SockDiagMicroBenchmarkTest, TestMicroBenchmark) {
 
 // "SockDiagTest.cpp:232: error: undefined reference to 'SockDiagMicroBenchmarkTest::CLOSE_UID'".
 constexpr int SockDiagMicroBenchmarkTest::CLOSE_UID;
+constexpr int SockDiagMicroBenchmarkTest::ADDRESS_SOCKETS;
 
 INSTANTIATE_TEST_CASE_P(Address, SockDiagMicroBenchmarkTest,
-                        testing::Values(ADDRESS, UID, UIDRANGE,
+                        testing::Values(ADDRESS, ADDRESS_SEQUENTIAL, UID, UIDRANGE,
                                         UID_EXCLUDE_LOOPBACK, UIDRANGE_EXCLUDE_LOOPBACK,
                                         PERMISSION));
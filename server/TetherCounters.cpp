@@ -0,0 +1,114 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "TetherCounters"
+
+#include "TetherCounters.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cutils/log.h>
+
+TetherCounters::TetherCounters(const std::string& prefix) : mPrefix(prefix), mEnabled(false) {
+}
+
+std::string TetherCounters::nameOf(size_t index) const {
+    return mPrefix + std::to_string(index);
+}
+
+ssize_t TetherCounters::indexOf(const char* name) const {
+    if (strncmp(name, mPrefix.c_str(), mPrefix.size())) {
+        return -1;
+    }
+    const char* number = name + mPrefix.size();
+    if (!*number || strspn(number, "0123456789") != strlen(number)) {
+        return -1;
+    }
+    return strtoul(number, nullptr, 10);
+}
+
+int TetherCounters::add(const std::string& inIface, const std::string& outIface,
+                        std::string* name) {
+    std::lock_guard<std::mutex> lock(mLock);
+    size_t index = 0;
+    while (index < mCounters.size() &&
+            (mCounters[index].inIface != inIface || mCounters[index].outIface != outIface)) {
+        index++;
+    }
+    // Replacing an object that exists resets it.
+    int res = mNfacct.create({ nameOf(index) });
+    if (res) {
+        ALOGE("Failed to create counter for %s -> %s (%s)", inIface.c_str(), outIface.c_str(),
+              strerror(-res));
+        return res;
+    }
+    if (index == mCounters.size()) {
+        mCounters.push_back(Counter{ inIface, outIface, 0, 0 });
+    }
+    mCounters[index].packets = mCounters[index].bytes = 0;
+    *name = nameOf(index);
+    return 0;
+}
+
+int TetherCounters::clear() {
+    std::lock_guard<std::mutex> lock(mLock);
+    mCounters.clear();
+
+    std::vector<std::string> names;
+    int res = mNfacct.dump([this, &names] (const char* name, uint64_t, uint64_t) {
+        if (indexOf(name) >= 0) {
+            names.push_back(name);
+        }
+    });
+    if (res || names.empty()) {
+        return res;
+    }
+    res = mNfacct.remove(names);
+    // Someone else's rules may still use an object with a name like ours.
+    return (res == -EBUSY || res == -ENOENT) ? 0 : res;
+}
+
+int TetherCounters::read(std::vector<Counter>* counters) {
+    std::lock_guard<std::mutex> lock(mLock);
+    // An object that someone else deleted counts as zero.
+    for (Counter& counter : mCounters) {
+        counter.packets = counter.bytes = 0;
+    }
+    int res = mNfacct.dump([this] (const char* name, uint64_t packets, uint64_t bytes) {
+        const ssize_t index = indexOf(name);
+        if (index >= 0 && static_cast<size_t>(index) < mCounters.size()) {
+            mCounters[index].packets = packets;
+            mCounters[index].bytes = bytes;
+        }
+    });
+    if (res) {
+        return res;
+    }
+    *counters = mCounters;
+    return 0;
+}
+
+void TetherCounters::setEnabled(bool enabled) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mEnabled = enabled;
+}
+
+bool TetherCounters::isEnabled() const {
+    std::lock_guard<std::mutex> lock(mLock);
+    return mEnabled;
+}
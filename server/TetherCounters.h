@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_TETHER_COUNTERS_H
+#define NETD_SERVER_TETHER_COUNTERS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "NfacctSocket.h"
+
+/*
+ * Tethering traffic counters, one for each direction of each pair of interfaces.
+ *
+ * Each counter is an nfacct object, which NatController's IPv4 and IPv6 rules in
+ * natctrl_tether_counters both add to. So one NfacctSocket dump reads the counters of both
+ * families, already added together, without listing any iptables chain. There is no room in an
+ * nfacct name for two interface names, so the objects are numbered, and the interfaces are kept
+ * here.
+ *
+ * Thread-safe. NatController adds counters under gBigNetdLock, and BandwidthController reads them
+ * under its own lock.
+ */
+class TetherCounters {
+public:
+    struct Counter {
+        std::string inIface;
+        std::string outIface;
+        uint64_t packets;
+        uint64_t bytes;
+    };
+
+    // The names of our nfacct objects are |prefix| followed by a number.
+    explicit TetherCounters(const std::string& prefix = "natctrl_tether");
+
+    // Creates the counter of traffic from |inIface| to |outIface|, or resets it if it exists, and
+    // stores the name of its nfacct object in |*name|. Returns 0 or a negative errno.
+    int add(const std::string& inIface, const std::string& outIface, std::string* name);
+
+    // Forgets all counters, and deletes every nfacct object we may have created before, including
+    // those left over from a previous run. No rule may use them any more.
+    int clear();
+
+    // Replaces |*counters| with the values of all counters, in the order they were added. Returns
+    // 0 or a negative errno.
+    int read(std::vector<Counter>* counters);
+
+    // Whether NatController's rules count into nfacct objects at all. That needs the nfacct match,
+    // which NatController checks for at startup.
+    void setEnabled(bool enabled);
+    bool isEnabled() const;
+
+private:
+    TetherCounters(const TetherCounters&) = delete;
+    TetherCounters& operator=(const TetherCounters&) = delete;
+
+    std::string nameOf(size_t index) const;
+    // Returns the index in a name of one of our objects, or -1 if it isn't one.
+    ssize_t indexOf(const char* name) const;
+
+    const std::string mPrefix;
+    mutable std::mutex mLock;
+    NfacctSocket mNfacct;
+    std::vector<Counter> mCounters;  // mCounters[i] is object nameOf(i).
+    bool mEnabled;
+};
+
+#endif  // NETD_SERVER_TETHER_COUNTERS_H
@@ -0,0 +1,94 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * TetherCountersTest.cpp - unit tests for TetherCounters.cpp
+ */
+
+#include <errno.h>
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "TetherCounters.h"
+
+namespace {
+
+// Not netd's own prefix, so that running the tests doesn't touch its counters.
+const char kPrefix[] = "natctrl_test";
+
+std::string describe(const std::vector<TetherCounters::Counter>& counters) {
+    std::string s;
+    for (const auto& c : counters) {
+        s += c.inIface + " " + c.outIface + " " + std::to_string(c.packets) + " " +
+             std::to_string(c.bytes) + "\n";
+    }
+    return s;
+}
+
+}  // namespace
+
+TEST(TetherCountersTest, TestKernelCounters) {
+    TetherCounters counters(kPrefix);
+    ASSERT_EQ(0, counters.clear());
+    EXPECT_FALSE(counters.isEnabled());
+
+    std::string name;
+    ASSERT_EQ(0, counters.add("wlan0", "rmnet0", &name));
+    EXPECT_EQ("natctrl_test0", name);
+    ASSERT_EQ(0, counters.add("rmnet0", "wlan0", &name));
+    EXPECT_EQ("natctrl_test1", name);
+    // The same pair keeps its object.
+    ASSERT_EQ(0, counters.add("wlan0", "rmnet0", &name));
+    EXPECT_EQ("natctrl_test0", name);
+
+    std::vector<TetherCounters::Counter> values;
+    ASSERT_EQ(0, counters.read(&values));
+    EXPECT_EQ("wlan0 rmnet0 0 0\n"
+              "rmnet0 wlan0 0 0\n", describe(values));
+
+    // Objects left over from a previous run are deleted by clear(), and read as zero.
+    TetherCounters restarted(kPrefix);
+    EXPECT_EQ(0, restarted.clear());
+    ASSERT_EQ(0, restarted.read(&values));
+    EXPECT_TRUE(values.empty());
+    ASSERT_EQ(0, counters.read(&values));
+    EXPECT_EQ(2U, values.size());
+
+    ASSERT_EQ(0, counters.add("bt-pan", "rmnet0", &name));
+    EXPECT_EQ(0, counters.clear());
+    ASSERT_EQ(0, counters.read(&values));
+    EXPECT_TRUE(values.empty());
+}
+
+TEST(TetherCountersTest, TestIgnoresOtherObjects) {
+    TetherCounters counters(kPrefix);
+    TetherCounters others("natctrl_testx");
+    ASSERT_EQ(0, counters.clear());
+    ASSERT_EQ(0, others.clear());
+
+    std::string name;
+    ASSERT_EQ(0, others.add("wlan0", "rmnet0", &name));
+    EXPECT_EQ("natctrl_testx0", name);
+    ASSERT_EQ(0, counters.add("usb0", "rmnet0", &name));
+
+    // Neither reads nor deletes the other's objects, although one prefix starts the other.
+    EXPECT_EQ(0, counters.clear());
+    std::vector<TetherCounters::Counter> values;
+    ASSERT_EQ(0, others.read(&values));
+    EXPECT_EQ("wlan0 rmnet0 0 0\n", describe(values));
+    EXPECT_EQ(0, others.clear());
+}
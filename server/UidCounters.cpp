@@ -0,0 +1,273 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define LOG_TAG "UidCounters"
+
+#include "UidCounters.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include <android-base/stringprintf.h>
+#include <cutils/log.h>
+
+using android::base::StringPrintf;
+
+namespace {
+
+// All our nfacct objects are called bwu<uid>_<iface>_<r or t>, which fits in NFACCT_NAME_MAX.
+const char NAME_PREFIX[] = "bwu";
+
+uint64_t bootTimeUs() {
+    timespec ts;
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+}  // namespace
+
+const uint32_t UidCounters::SNAPSHOT_VERSION;
+
+// Generations start at the time netd started, so that a caller that kept a generation from a
+// previous run of netd gets everything the new one counts.
+UidCounters::UidCounters() : mHead(NONE), mGeneration(bootTimeUs()), mTouched(false) {
+}
+
+std::string UidCounters::keyFor(int32_t uid, const std::string& iface) {
+    return StringPrintf("%s%d_%s_", NAME_PREFIX, uid, iface.c_str());
+}
+
+std::string UidCounters::rxName(int32_t uid, const std::string& iface) {
+    return keyFor(uid, iface) + "r";
+}
+
+std::string UidCounters::txName(int32_t uid, const std::string& iface) {
+    return keyFor(uid, iface) + "t";
+}
+
+int UidCounters::add(int32_t uid, const std::string& iface) {
+    if (uid < 0 || iface.size() >= IFNAMSIZ) {
+        return -EINVAL;
+    }
+    const std::vector<std::string> names = { rxName(uid, iface), txName(uid, iface) };
+    // Replacing an object that is left over from before resets it.
+    int res = mNfacct.create(names);
+    if (res) {
+        ALOGE("Failed to create counters for uid %d on \"%s\" (%s)", uid, iface.c_str(),
+              strerror(-res));
+        mNfacct.remove(names);
+        return res;
+    }
+    addEntry(uid, iface);
+    return 0;
+}
+
+int UidCounters::remove(int32_t uid, const std::string& iface) {
+    auto it = mIndex.find(keyFor(uid, iface));
+    if (it == mIndex.end()) {
+        return -ENOENT;
+    }
+    removeEntry(it->second);
+
+    int res = mNfacct.remove({ rxName(uid, iface), txName(uid, iface) });
+    if (res && res != -ENOENT) {
+        ALOGE("Failed to delete counters for uid %d on \"%s\" (%s)", uid, iface.c_str(),
+              strerror(-res));
+        return res;
+    }
+    return 0;
+}
+
+bool UidCounters::contains(int32_t uid, const std::string& iface) const {
+    return mIndex.count(keyFor(uid, iface));
+}
+
+int UidCounters::clear() {
+    mEntries.clear();
+    mSlots.clear();
+    mIndex.clear();
+    mHead = NONE;
+
+    std::vector<std::string> names;
+    int res = mNfacct.dump([&names] (const char *name, uint64_t, uint64_t) {
+        if (!strncmp(name, NAME_PREFIX, strlen(NAME_PREFIX))) {
+            names.push_back(name);
+        }
+    });
+    if (res) {
+        return res;
+    }
+    if (names.empty()) {
+        return 0;
+    }
+    res = mNfacct.remove(names);
+    // Someone else's rules may still use an object with a name like ours.
+    if (res == -EBUSY || res == -ENOENT) {
+        res = 0;
+    }
+    ALOGI("Deleted %zu stale counters", names.size());
+    return res;
+}
+
+int UidCounters::refresh() {
+    mTouched = false;
+    return mNfacct.dump([this] (const char *name, uint64_t packets, uint64_t bytes) {
+        update(name, packets, bytes);
+    });
+}
+
+void UidCounters::getSnapshot(uint64_t since, std::vector<uint8_t> *snapshot) const {
+    // A generation we never handed out, e.g. from before netd restarted.
+    if (since > mGeneration) {
+        since = 0;
+    }
+
+    Header header = {};
+    header.version = SNAPSHOT_VERSION;
+    header.entrySize = sizeof(Entry);
+    header.generation = mGeneration;
+
+    snapshot->clear();
+    if (since == 0) {
+        header.count = mEntries.size();
+        snapshot->resize(sizeof(header) + mEntries.size() * sizeof(Entry));
+        memcpy(snapshot->data(), &header, sizeof(header));
+        if (!mEntries.empty()) {
+            memcpy(snapshot->data() + sizeof(header), mEntries.data(),
+                   mEntries.size() * sizeof(Entry));
+        }
+        return;
+    }
+
+    snapshot->resize(sizeof(header));
+    for (size_t slot = mHead; slot != NONE && mSlots[slot].generation > since;
+            slot = mSlots[slot].next) {
+        const uint8_t *entry = reinterpret_cast<const uint8_t *>(&mEntries[slot]);
+        snapshot->insert(snapshot->end(), entry, entry + sizeof(Entry));
+        header.count++;
+    }
+    memcpy(snapshot->data(), &header, sizeof(header));
+}
+
+size_t UidCounters::addEntry(int32_t uid, const std::string& iface) {
+    const std::string key = keyFor(uid, iface);
+    auto it = mIndex.find(key);
+    if (it != mIndex.end()) {
+        // The kernel objects were just reset.
+        const size_t slot = it->second;
+        Entry& entry = mEntries[slot];
+        entry.rxBytes = entry.rxPackets = entry.txBytes = entry.txPackets = 0;
+        mSlots[slot].generation = ++mGeneration;
+        unlink(slot);
+        pushFront(slot);
+        return slot;
+    }
+
+    Entry entry = {};
+    entry.uid = uid;
+    strncpy(entry.iface, iface.c_str(), sizeof(entry.iface) - 1);
+    const size_t slot = mEntries.size();
+    mEntries.push_back(entry);
+    mSlots.push_back({ key, ++mGeneration, NONE, NONE });
+    mIndex[key] = slot;
+    pushFront(slot);
+    return slot;
+}
+
+void UidCounters::removeEntry(size_t slot) {
+    unlink(slot);
+    mIndex.erase(mSlots[slot].key);
+
+    // Keep mEntries dense by moving the last entry into the hole.
+    const size_t last = mEntries.size() - 1;
+    if (slot != last) {
+        mEntries[slot] = mEntries[last];
+        mSlots[slot] = std::move(mSlots[last]);
+        Slot& moved = mSlots[slot];
+        if (moved.prev != NONE) {
+            mSlots[moved.prev].next = slot;
+        } else {
+            mHead = slot;
+        }
+        if (moved.next != NONE) {
+            mSlots[moved.next].prev = slot;
+        }
+        mIndex[moved.key] = slot;
+    }
+    mEntries.pop_back();
+    mSlots.pop_back();
+}
+
+void UidCounters::update(const char *name, uint64_t packets, uint64_t bytes) {
+    const size_t len = strlen(name);
+    if (len < 2) {
+        return;
+    }
+    const char direction = name[len - 1];
+    auto it = mIndex.find(std::string(name, len - 1));
+    if (it == mIndex.end() || (direction != 'r' && direction != 't')) {
+        return;
+    }
+
+    const size_t slot = it->second;
+    Entry& entry = mEntries[slot];
+    if (direction == 'r') {
+        if (entry.rxBytes == bytes && entry.rxPackets == packets) return;
+        entry.rxBytes = bytes;
+        entry.rxPackets = packets;
+    } else {
+        if (entry.txBytes == bytes && entry.txPackets == packets) return;
+        entry.txBytes = bytes;
+        entry.txPackets = packets;
+    }
+    touch(slot);
+}
+
+void UidCounters::touch(size_t slot) {
+    if (!mTouched) {
+        mGeneration++;
+        mTouched = true;
+    }
+    if (mSlots[slot].generation == mGeneration) {
+        return;
+    }
+    mSlots[slot].generation = mGeneration;
+    unlink(slot);
+    pushFront(slot);
+}
+
+void UidCounters::unlink(size_t slot) {
+    Slot& s = mSlots[slot];
+    if (s.prev != NONE) {
+        mSlots[s.prev].next = s.next;
+    } else {
+        mHead = s.next;
+    }
+    if (s.next != NONE) {
+        mSlots[s.next].prev = s.prev;
+    }
+    s.prev = s.next = NONE;
+}
+
+void UidCounters::pushFront(size_t slot) {
+    mSlots[slot].prev = NONE;
+    mSlots[slot].next = mHead;
+    if (mHead != NONE) {
+        mSlots[mHead].prev = slot;
+    }
+    mHead = slot;
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_UID_COUNTERS_H
+#define NETD_SERVER_UID_COUNTERS_H
+
+#include <net/if.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "NfacctSocket.h"
+
+class UidCountersTest;
+
+/*
+ * Per-uid, and optionally per-interface, traffic counters.
+ *
+ * Each counter is a pair of nfacct objects, one for received and one for sent traffic, which
+ * BandwidthController's rules in bw_uid_INPUT and bw_uid_OUTPUT add to. Reading all of them is one
+ * NfacctSocket dump.
+ *
+ * The values read are kept in one packed array of Entry, which is exactly what a snapshot holds,
+ * so a snapshot of all counters is a single copy. Every refresh that sees a counter change starts
+ * a new generation. A snapshot can be limited to the counters that changed after a generation the
+ * caller saw before. Counters are kept in the order they last changed, so such a snapshot only
+ * looks at the counters it returns.
+ *
+ * Not thread-safe. BandwidthController only uses it under its lock.
+ */
+class UidCounters {
+public:
+    static const uint32_t SNAPSHOT_VERSION = 1;
+
+    // A snapshot is a Header followed by Header.count entries of Header.entrySize bytes, in host
+    // byte order.
+    struct Header {
+        uint32_t version;
+        uint32_t entrySize;  // sizeof(Entry) for this version. Later versions only add fields.
+        uint32_t count;
+        uint32_t reserved;
+        uint64_t generation;  // Pass this to the next getSnapshot() to get only what changed.
+    } __attribute__((__packed__));
+
+    struct Entry {
+        int32_t uid;
+        char iface[IFNAMSIZ];  // Empty if the counter covers all interfaces.
+        uint64_t rxBytes;
+        uint64_t rxPackets;
+        uint64_t txBytes;
+        uint64_t txPackets;
+    } __attribute__((__packed__));
+
+    UidCounters();
+
+    // Starts counting the traffic of |uid| on |iface|, or on all interfaces if |iface| is empty.
+    // Creates the nfacct objects, or resets them if they exist. Returns 0 or a negative errno.
+    int add(int32_t uid, const std::string& iface);
+    // Stops counting, and deletes the nfacct objects. They must no longer be used by any rule.
+    int remove(int32_t uid, const std::string& iface);
+    bool contains(int32_t uid, const std::string& iface) const;
+    // Forgets all counters, and deletes every nfacct object we may have created before, including
+    // those left over from a previous run.
+    int clear();
+
+    // Reads all counters from the kernel. Returns 0 or a negative errno.
+    int refresh();
+
+    /*
+     * Replaces |snapshot| with the counters that changed after generation |since|, or all of them
+     * if |since| is 0. Counters that are removed are not reported; a snapshot of all counters
+     * lists exactly the current ones.
+     */
+    void getSnapshot(uint64_t since, std::vector<uint8_t> *snapshot) const;
+
+    uint64_t generation() const { return mGeneration; }
+
+    // The names of the nfacct objects of a counter.
+    static std::string rxName(int32_t uid, const std::string& iface);
+    static std::string txName(int32_t uid, const std::string& iface);
+
+private:
+    friend class UidCountersTest;
+
+    UidCounters(const UidCounters&) = delete;
+    UidCounters& operator=(const UidCounters&) = delete;
+
+    static const size_t NONE = SIZE_MAX;
+
+    // Bookkeeping for mEntries[i], kept apart so that mEntries stays a valid snapshot.
+    struct Slot {
+        std::string key;
+        uint64_t generation;  // When the counter last changed.
+        size_t prev;          // Neighbours in the list of counters by last change, newest first.
+        size_t next;
+    };
+
+    static std::string keyFor(int32_t uid, const std::string& iface);
+
+    // The parts that don't talk to the kernel.
+    size_t addEntry(int32_t uid, const std::string& iface);
+    void removeEntry(size_t slot);
+    // Stores the values read for one nfacct object.
+    void update(const char *name, uint64_t packets, uint64_t bytes);
+    // Marks mEntries[slot] as changed in the current refresh.
+    void touch(size_t slot);
+    void unlink(size_t slot);
+    void pushFront(size_t slot);
+
+    NfacctSocket mNfacct;
+
+    std::vector<Entry> mEntries;
+    std::vector<Slot> mSlots;
+    std::unordered_map<std::string, size_t> mIndex;  // Slot by key.
+    size_t mHead;
+    uint64_t mGeneration;
+    bool mTouched;  // Whether the current refresh changed a counter yet.
+};
+
+#endif  // NETD_SERVER_UID_COUNTERS_H
@@ -0,0 +1,255 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * UidCountersTest.cpp - unit tests for UidCounters.cpp
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_acct.h>
+
+#include "UidCounters.h"
+
+typedef UidCounters::Entry Entry;
+typedef UidCounters::Header Header;
+
+class UidCountersTest : public ::testing::Test {
+protected:
+    // Adds a counter without creating any nfacct objects.
+    void addEntry(UidCounters& counters, int32_t uid, const std::string& iface) {
+        counters.addEntry(uid, iface);
+    }
+
+    void removeEntry(UidCounters& counters, int32_t uid, const std::string& iface) {
+        counters.removeEntry(counters.mIndex.at(UidCounters::keyFor(uid, iface)));
+    }
+
+    int deleteObject(UidCounters& counters, const std::string& name) {
+        return counters.mNfacct.remove({ name });
+    }
+
+    // Asks to delete |name| on the counters' socket, and leaves the ack unread, as a request that
+    // failed halfway would.
+    void leaveUnreadAck(UidCounters& counters, const std::string& name) {
+        ASSERT_EQ(0, counters.mNfacct.openSocket());
+        struct {
+            nlmsghdr nlh;
+            nfgenmsg nfh;
+            nlattr nla;
+            char name[NFACCT_NAME_MAX];
+        } __attribute__((__packed__)) request = {};
+        request.nlh.nlmsg_len = sizeof(request);
+        request.nlh.nlmsg_type = (NFNL_SUBSYS_ACCT << 8) | NFNL_MSG_ACCT_DEL;
+        request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+        request.nlh.nlmsg_seq = ++counters.mNfacct.mSeq;
+        request.nfh.nfgen_family = AF_UNSPEC;
+        request.nfh.version = NFNETLINK_V0;
+        request.nla.nla_type = NFACCT_NAME;
+        request.nla.nla_len = sizeof(request.nla) + sizeof(request.name);
+        strncpy(request.name, name.c_str(), sizeof(request.name) - 1);
+        ASSERT_EQ((ssize_t) sizeof(request), write(counters.mNfacct.mSock, &request,
+                                                   sizeof(request)));
+    }
+
+    // Pretends that a refresh read these values.
+    void fakeRefresh(UidCounters& counters,
+                     const std::vector<std::tuple<std::string, uint64_t, uint64_t>>& values) {
+        counters.mTouched = false;
+        for (const auto& value : values) {
+            counters.update(std::get<0>(value).c_str(), std::get<1>(value), std::get<2>(value));
+        }
+    }
+
+    // Checks the header of |snapshot|, and returns its entries.
+    std::vector<Entry> parse(const std::vector<uint8_t>& snapshot, uint64_t generation) {
+        std::vector<Entry> entries;
+        Header header;
+        EXPECT_LE(sizeof(header), snapshot.size());
+        if (snapshot.size() < sizeof(header)) {
+            return entries;
+        }
+        memcpy(&header, snapshot.data(), sizeof(header));
+        EXPECT_EQ(UidCounters::SNAPSHOT_VERSION, header.version);
+        EXPECT_EQ(sizeof(Entry), header.entrySize);
+        EXPECT_EQ(generation, header.generation);
+        EXPECT_EQ(sizeof(header) + header.count * sizeof(Entry), snapshot.size());
+        entries.resize(header.count);
+        if (header.count && snapshot.size() == sizeof(header) + header.count * sizeof(Entry)) {
+            memcpy(entries.data(), snapshot.data() + sizeof(header), header.count * sizeof(Entry));
+        }
+        return entries;
+    }
+
+    std::vector<Entry> getSnapshot(UidCounters& counters, uint64_t since) {
+        std::vector<uint8_t> snapshot;
+        counters.getSnapshot(since, &snapshot);
+        return parse(snapshot, counters.generation());
+    }
+
+    static std::string describe(const std::vector<Entry>& entries) {
+        std::string s;
+        for (const auto& e : entries) {
+            s += std::to_string(e.uid) + "/" + e.iface + " " +
+                 std::to_string(e.rxBytes) + " " + std::to_string(e.rxPackets) + " " +
+                 std::to_string(e.txBytes) + " " + std::to_string(e.txPackets) + "\n";
+        }
+        return s;
+    }
+};
+
+TEST_F(UidCountersTest, TestNames) {
+    EXPECT_EQ("bwu10005_rmnet0_r", UidCounters::rxName(10005, "rmnet0"));
+    EXPECT_EQ("bwu10005_rmnet0_t", UidCounters::txName(10005, "rmnet0"));
+    EXPECT_EQ("bwu0__r", UidCounters::rxName(0, ""));
+    // The longest names still fit in an nfacct name.
+    EXPECT_GT(32U, UidCounters::txName(INT32_MAX, "123456789012345").size());
+}
+
+TEST_F(UidCountersTest, TestSnapshots) {
+    UidCounters counters;
+    addEntry(counters, 10001, "wlan0");
+    addEntry(counters, 10002, "");
+    addEntry(counters, 10003, "rmnet0");
+    EXPECT_TRUE(counters.contains(10002, ""));
+    EXPECT_FALSE(counters.contains(10002, "wlan0"));
+
+    EXPECT_EQ("10001/wlan0 0 0 0 0\n"
+              "10002/ 0 0 0 0\n"
+              "10003/rmnet0 0 0 0 0\n", describe(getSnapshot(counters, 0)));
+
+    uint64_t seen = counters.generation();
+    EXPECT_EQ("", describe(getSnapshot(counters, seen)));
+
+    fakeRefresh(counters, {
+        std::make_tuple("bwu10001_wlan0_r", 2, 3000),
+        std::make_tuple("bwu10001_wlan0_t", 1, 100),
+        std::make_tuple("bwu10002__t", 0, 0),
+        std::make_tuple("bwu10003_rmnet0_r", 0, 0),
+        std::make_tuple("bwu10099_wlan0_r", 5, 5000),
+        std::make_tuple("somebody_else", 5, 5000),
+    });
+    EXPECT_EQ(seen + 1, counters.generation());
+    EXPECT_EQ("10001/wlan0 3000 2 100 1\n", describe(getSnapshot(counters, seen)));
+
+    seen = counters.generation();
+    fakeRefresh(counters, {
+        std::make_tuple("bwu10001_wlan0_r", 2, 3000),
+        std::make_tuple("bwu10003_rmnet0_t", 7, 700),
+    });
+    EXPECT_EQ("10003/rmnet0 0 0 700 7\n", describe(getSnapshot(counters, seen)));
+    // Newest first.
+    EXPECT_EQ("10003/rmnet0 0 0 700 7\n"
+              "10001/wlan0 3000 2 100 1\n", describe(getSnapshot(counters, seen - 1)));
+
+    // A refresh that changes nothing does not start a generation.
+    seen = counters.generation();
+    fakeRefresh(counters, { std::make_tuple("bwu10003_rmnet0_t", 7, 700) });
+    EXPECT_EQ(seen, counters.generation());
+
+    // Generations from the future, e.g. from a previous run of netd, get everything.
+    EXPECT_EQ(3U, getSnapshot(counters, seen + 1000).size());
+}
+
+TEST_F(UidCountersTest, TestRemoveEntry) {
+    UidCounters counters;
+    for (int32_t uid = 10000; uid < 10005; uid++) {
+        addEntry(counters, uid, "wlan0");
+    }
+    const uint64_t seen = counters.generation();
+    fakeRefresh(counters, {
+        std::make_tuple("bwu10001_wlan0_r", 1, 10),
+        std::make_tuple("bwu10004_wlan0_r", 4, 40),
+    });
+
+    // Removing an entry moves the last one into its place, which must stay findable and keep
+    // its position in the list.
+    removeEntry(counters, 10001, "wlan0");
+    EXPECT_FALSE(counters.contains(10001, "wlan0"));
+    EXPECT_TRUE(counters.contains(10004, "wlan0"));
+    EXPECT_EQ("10000/wlan0 0 0 0 0\n"
+              "10004/wlan0 40 4 0 0\n"
+              "10002/wlan0 0 0 0 0\n"
+              "10003/wlan0 0 0 0 0\n", describe(getSnapshot(counters, 0)));
+    EXPECT_EQ("10004/wlan0 40 4 0 0\n", describe(getSnapshot(counters, seen)));
+
+    fakeRefresh(counters, { std::make_tuple("bwu10004_wlan0_t", 1, 1) });
+    EXPECT_EQ("10004/wlan0 40 4 1 1\n", describe(getSnapshot(counters, seen)));
+
+    removeEntry(counters, 10004, "wlan0");
+    removeEntry(counters, 10000, "wlan0");
+    EXPECT_EQ("", describe(getSnapshot(counters, seen)));
+    EXPECT_EQ("10002/wlan0 0 0 0 0\n"
+              "10003/wlan0 0 0 0 0\n", describe(getSnapshot(counters, 0)));
+
+    // Adding an existing counter again resets it.
+    fakeRefresh(counters, { std::make_tuple("bwu10003_wlan0_r", 9, 9) });
+    addEntry(counters, 10003, "wlan0");
+    EXPECT_EQ("10003/wlan0 0 0 0 0\n", describe(getSnapshot(counters, counters.generation() - 1)));
+    EXPECT_EQ(2U, getSnapshot(counters, 0).size());
+}
+
+TEST_F(UidCountersTest, TestKernelCounters) {
+    UidCounters counters;
+    const int32_t uid = 99999;
+    ASSERT_EQ(0, counters.add(uid, "lo"));
+    EXPECT_TRUE(counters.contains(uid, "lo"));
+
+    // Fresh objects count nothing.
+    ASSERT_EQ(0, counters.refresh());
+    std::vector<Entry> entries = getSnapshot(counters, 0);
+    ASSERT_EQ(1U, entries.size());
+    EXPECT_EQ("99999/lo 0 0 0 0\n", describe(entries));
+
+    EXPECT_EQ(0, counters.remove(uid, "lo"));
+    EXPECT_FALSE(counters.contains(uid, "lo"));
+    EXPECT_EQ(-ENOENT, counters.remove(uid, "lo"));
+
+    // Objects left over from a previous run are deleted by clear().
+    ASSERT_EQ(0, counters.add(uid, "lo"));
+    UidCounters restarted;
+    EXPECT_EQ(0, restarted.clear());
+    EXPECT_EQ(0, restarted.refresh());
+    EXPECT_EQ(0, counters.refresh());
+    EXPECT_EQ("99999/lo 0 0 0 0\n", describe(getSnapshot(counters, 0)));
+    EXPECT_EQ(-ENOENT, deleteObject(counters, UidCounters::rxName(uid, "lo")));
+}
+
+TEST_F(UidCountersTest, TestSkipsStaleReplies) {
+    UidCounters counters;
+    const int32_t uid = 99999;
+
+    // The failed delete's ack comes first, and must not be taken for one of add()'s.
+    leaveUnreadAck(counters, UidCounters::rxName(uid, "nonexistent"));
+    ASSERT_EQ(0, counters.add(uid, "lo"));
+
+    // Nor for the end of a dump.
+    leaveUnreadAck(counters, UidCounters::rxName(uid, "nonexistent"));
+    ASSERT_EQ(0, counters.refresh());
+    EXPECT_EQ("99999/lo 0 0 0 0\n", describe(getSnapshot(counters, 0)));
+
+    EXPECT_EQ(0, counters.remove(uid, "lo"));
+    EXPECT_EQ(-ENOENT, deleteObject(counters, UidCounters::rxName(uid, "lo")));
+}
@@ -42,6 +42,10 @@ bool VirtualNetwork::appliesToUser(uid_t uid) const {
     return mUidRanges.hasUid(uid);
 }
 
+const UidRanges& VirtualNetwork::getUidRanges() const {
+    return mUidRanges;
+}
+
 
 int VirtualNetwork::maybeCloseSockets(bool add, const UidRanges& uidRanges,
                                       const std::set<uid_t>& protectableUsers) {
@@ -37,6 +37,7 @@ public:
     bool getHasDns() const;
     bool isSecure() const;
     bool appliesToUser(uid_t uid) const;
+    const UidRanges& getUidRanges() const;
 
     int addUsers(const UidRanges& uidRanges,
                  const std::set<uid_t>& protectableUsers) WARN_UNUSED_RESULT;
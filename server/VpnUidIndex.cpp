@@ -0,0 +1,143 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "VpnUidIndex.h"
+
+#include <algorithm>
+#include <iterator>
+#include <limits>
+
+#include "VirtualNetwork.h"
+
+void VpnUidIndex::add(VirtualNetwork* virtualNetwork, const UidRanges& uidRanges) {
+    for (const auto& range : uidRanges.getRanges()) {
+        paint(virtualNetwork, range.first, range.second);
+        merge(range.first, range.second);
+    }
+}
+
+void VpnUidIndex::remove(VirtualNetwork* virtualNetwork, const UidRanges& uidRanges,
+                         const std::vector<VirtualNetwork*>& virtualNetworks) {
+    for (const auto& range : uidRanges.getRanges()) {
+        const uid_t start = range.first;
+        const uid_t end = range.second;
+        split(start);
+        if (end != std::numeric_limits<uid_t>::max()) {
+            split(end + 1);
+        }
+        for (auto iter = mEntries.lower_bound(start);
+                iter != mEntries.end() && iter->first <= end;) {
+            if (iter->second.network == virtualNetwork) {
+                iter = mEntries.erase(iter);
+            } else {
+                ++iter;
+            }
+        }
+
+        for (VirtualNetwork* other : virtualNetworks) {
+            for (const auto& otherRange : other->getUidRanges().getRanges()) {
+                if (otherRange.second < start || otherRange.first > end) {
+                    continue;
+                }
+                paint(other, std::max(start, otherRange.first), std::min(end, otherRange.second));
+            }
+        }
+        merge(start, end);
+    }
+}
+
+VirtualNetwork* VpnUidIndex::lookup(uid_t uid) const {
+    auto iter = mEntries.upper_bound(uid);
+    if (iter == mEntries.begin()) {
+        return NULL;
+    }
+    --iter;
+    return uid <= iter->second.end ? iter->second.network : NULL;
+}
+
+const std::map<uid_t, VpnUidIndex::Entry>& VpnUidIndex::getEntries() const {
+    return mEntries;
+}
+
+// Makes |virtualNetwork| apply to all uids between |start| and |end| that are not already covered
+// by a VPN with a lower NetId. Since the lowest NetId always wins, the order in which ranges are
+// painted does not matter.
+void VpnUidIndex::paint(VirtualNetwork* virtualNetwork, uid_t start, uid_t end) {
+    split(start);
+    if (end != std::numeric_limits<uid_t>::max()) {
+        split(end + 1);
+    }
+    // 64 bits, so that a range ending at the largest uid doesn't wrap around.
+    uint64_t next = start;
+    auto iter = mEntries.lower_bound(start);
+    while (next <= end) {
+        if (iter == mEntries.end() || iter->first > end) {
+            mEntries[next] = {end, virtualNetwork};
+            break;
+        }
+        if (iter->first > next) {
+            mEntries[next] = {iter->first - 1, virtualNetwork};
+        }
+        if (iter->second.network->getNetId() > virtualNetwork->getNetId()) {
+            iter->second.network = virtualNetwork;
+        }
+        next = static_cast<uint64_t>(iter->second.end) + 1;
+        ++iter;
+    }
+}
+
+// Ensures that no entry straddles |uid|, i.e., that |uid| is either not covered or is the first
+// uid of an entry.
+void VpnUidIndex::split(uid_t uid) {
+    auto iter = mEntries.upper_bound(uid);
+    if (iter == mEntries.begin()) {
+        return;
+    }
+    --iter;
+    if (iter->first < uid && uid <= iter->second.end) {
+        mEntries[uid] = {iter->second.end, iter->second.network};
+        iter->second.end = uid - 1;
+    }
+}
+
+// Coalesces adjacent entries that map to the same VPN, in and around the range |start|..|end|, so
+// that repeated updates don't fragment the index.
+void VpnUidIndex::merge(uid_t start, uid_t end) {
+    auto iter = mEntries.upper_bound(start);
+    if (iter != mEntries.begin()) {
+        --iter;
+    }
+    if (iter != mEntries.begin()) {
+        --iter;
+    }
+    while (iter != mEntries.end()) {
+        auto next = std::next(iter);
+        if (next == mEntries.end()) {
+            break;
+        }
+        if (iter->second.end != std::numeric_limits<uid_t>::max() &&
+                next->first == iter->second.end + 1 &&
+                next->second.network == iter->second.network) {
+            iter->second.end = next->second.end;
+            mEntries.erase(next);
+            continue;
+        }
+        if (iter->first > end) {
+            break;
+        }
+        iter = next;
+    }
+}
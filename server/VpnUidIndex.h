@@ -0,0 +1,63 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_VPN_UID_INDEX_H
+#define NETD_SERVER_VPN_UID_INDEX_H
+
+#include "UidRanges.h"
+
+#include <map>
+#include <sys/types.h>
+#include <vector>
+
+class VirtualNetwork;
+
+// Maps uids to the VPN that applies to them, as disjoint uid ranges keyed by their first uid.
+// Where the users of several VPNs overlap, the VPN with the lowest NetId wins, like a linear scan
+// of the networks in NetId order would.
+//
+// Not thread-safe. NetworkController only changes it with its write lock held.
+class VpnUidIndex {
+public:
+    struct Entry {
+        uid_t end;
+        VirtualNetwork* network;
+    };
+
+    // Makes |virtualNetwork| apply to the uids in |uidRanges| that are not already covered by a
+    // VPN with a lower NetId.
+    void add(VirtualNetwork* virtualNetwork, const UidRanges& uidRanges);
+
+    // Removes |virtualNetwork| from |uidRanges|, and hands the uids it leaves behind to those of
+    // |virtualNetworks| whose getUidRanges() still cover them. This includes |virtualNetwork|
+    // itself if it is in |virtualNetworks| and has other, overlapping ranges.
+    void remove(VirtualNetwork* virtualNetwork, const UidRanges& uidRanges,
+                const std::vector<VirtualNetwork*>& virtualNetworks);
+
+    // Returns the VPN that applies to |uid|, or NULL if there is none.
+    VirtualNetwork* lookup(uid_t uid) const;
+
+    const std::map<uid_t, Entry>& getEntries() const;
+
+private:
+    void paint(VirtualNetwork* virtualNetwork, uid_t start, uid_t end);
+    void split(uid_t uid);
+    void merge(uid_t start, uid_t end);
+
+    std::map<uid_t, Entry> mEntries;
+};
+
+#endif  // NETD_SERVER_VPN_UID_INDEX_H
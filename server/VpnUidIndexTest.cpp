@@ -0,0 +1,193 @@
+/*
+ * Copyright 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ * VpnUidIndexTest.cpp - unit tests for VpnUidIndex.cpp
+ */
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "VirtualNetwork.h"
+#include "VpnUidIndex.h"
+
+class VpnUidIndexTest : public ::testing::Test {
+protected:
+    VpnUidIndexTest() : mVpn100(100, false, false), mVpn101(101, false, false),
+                        mVpn102(102, false, false), mVpns({ &mVpn100, &mVpn101, &mVpn102 }) {}
+
+    static UidRanges makeUidRanges(std::vector<const char*> ranges) {
+        UidRanges uidRanges;
+        EXPECT_TRUE(uidRanges.parseFrom(ranges.size(), const_cast<char**>(ranges.data())));
+        return uidRanges;
+    }
+
+    // Adds |ranges| to |vpn| and to the index, like NetworkController::addUsersToNetwork().
+    void addUsers(VirtualNetwork* vpn, std::vector<const char*> ranges) {
+        UidRanges uidRanges = makeUidRanges(ranges);
+        ASSERT_EQ(0, vpn->addUsers(uidRanges, {}));
+        mIndex.add(vpn, uidRanges);
+    }
+
+    // Like NetworkController::removeUsersFromNetwork().
+    void removeUsers(VirtualNetwork* vpn, std::vector<const char*> ranges) {
+        UidRanges uidRanges = makeUidRanges(ranges);
+        ASSERT_EQ(0, vpn->removeUsers(uidRanges, {}));
+        mIndex.remove(vpn, uidRanges, mVpns);
+    }
+
+    // Like NetworkController::destroyNetwork(), which removes the VPN from the list first.
+    void destroy(VirtualNetwork* vpn) {
+        mVpns.erase(std::find(mVpns.begin(), mVpns.end(), vpn));
+        mIndex.remove(vpn, vpn->getUidRanges(), mVpns);
+    }
+
+    unsigned lookup(uid_t uid) {
+        VirtualNetwork* vpn = mIndex.lookup(uid);
+        return vpn ? vpn->getNetId() : 0;
+    }
+
+    // Returns the entries of the index as "first-last:netId", separated by spaces.
+    std::string describe() {
+        std::string s;
+        for (const auto& entry : mIndex.getEntries()) {
+            if (!s.empty()) s += " ";
+            s += std::to_string(entry.first) + "-" + std::to_string(entry.second.end) + ":" +
+                 std::to_string(entry.second.network->getNetId());
+        }
+        return s;
+    }
+
+    VirtualNetwork mVpn100;
+    VirtualNetwork mVpn101;
+    VirtualNetwork mVpn102;
+    std::vector<VirtualNetwork*> mVpns;  // The VPNs that haven't been destroyed.
+    VpnUidIndex mIndex;
+};
+
+TEST_F(VpnUidIndexTest, TestLookupAtBoundaries) {
+    EXPECT_EQ(0U, lookup(0));
+    addUsers(&mVpn101, { "1000-1999" });
+    EXPECT_EQ("1000-1999:101", describe());
+
+    EXPECT_EQ(0U, lookup(999));
+    EXPECT_EQ(101U, lookup(1000));
+    EXPECT_EQ(101U, lookup(1500));
+    EXPECT_EQ(101U, lookup(1999));
+    EXPECT_EQ(0U, lookup(2000));
+
+    // Single uids, the first uid, and the highest valid uid.
+    addUsers(&mVpn102, { "0", "5000", "4294967294" });
+    EXPECT_EQ(102U, lookup(0));
+    EXPECT_EQ(0U, lookup(1));
+    EXPECT_EQ(0U, lookup(4999));
+    EXPECT_EQ(102U, lookup(5000));
+    EXPECT_EQ(0U, lookup(5001));
+    EXPECT_EQ(102U, lookup(4294967294));
+    EXPECT_EQ(0U, lookup(4294967293));
+    EXPECT_EQ(0U, lookup(4294967295));
+}
+
+TEST_F(VpnUidIndexTest, TestOverlappingRanges) {
+    addUsers(&mVpn101, { "1000-1999" });
+    addUsers(&mVpn100, { "1500-2499" });
+    // The lower NetId wins where they overlap, whichever was added first.
+    EXPECT_EQ("1000-1499:101 1500-2499:100", describe());
+    EXPECT_EQ(101U, lookup(1499));
+    EXPECT_EQ(100U, lookup(1500));
+    EXPECT_EQ(100U, lookup(1999));
+    EXPECT_EQ(100U, lookup(2499));
+    EXPECT_EQ(0U, lookup(2500));
+
+    addUsers(&mVpn102, { "500-3000" });
+    EXPECT_EQ("500-999:102 1000-1499:101 1500-2499:100 2500-3000:102", describe());
+}
+
+TEST_F(VpnUidIndexTest, TestAdjacentRanges) {
+    // Adjacent ranges of the same VPN are merged, whatever order they come in.
+    addUsers(&mVpn100, { "2000-2999" });
+    addUsers(&mVpn100, { "1000-1999" });
+    addUsers(&mVpn100, { "3000-3999" });
+    EXPECT_EQ("1000-3999:100", describe());
+
+    // Adjacent ranges of different VPNs are not.
+    addUsers(&mVpn101, { "4000-4999" });
+    EXPECT_EQ("1000-3999:100 4000-4999:101", describe());
+    EXPECT_EQ(100U, lookup(3999));
+    EXPECT_EQ(101U, lookup(4000));
+
+    // Filling the gap between two entries of the same VPN merges all three.
+    addUsers(&mVpn102, { "10000-10999", "12000-12999" });
+    addUsers(&mVpn102, { "11000-11999" });
+    EXPECT_EQ("1000-3999:100 4000-4999:101 10000-12999:102", describe());
+}
+
+TEST_F(VpnUidIndexTest, TestNestedRanges) {
+    // A VPN with a lower NetId punches a hole into a wider one.
+    addUsers(&mVpn101, { "1000-4999" });
+    addUsers(&mVpn100, { "2000-2999" });
+    EXPECT_EQ("1000-1999:101 2000-2999:100 3000-4999:101", describe());
+    EXPECT_EQ(101U, lookup(1999));
+    EXPECT_EQ(100U, lookup(2000));
+    EXPECT_EQ(100U, lookup(2999));
+    EXPECT_EQ(101U, lookup(3000));
+
+    // A VPN with a higher NetId nested inside a lower one changes nothing.
+    addUsers(&mVpn102, { "2200-2300" });
+    EXPECT_EQ("1000-1999:101 2000-2999:100 3000-4999:101", describe());
+
+    // Removing the hole gives it back to the wider VPN in one piece.
+    removeUsers(&mVpn100, { "2000-2999" });
+    EXPECT_EQ("1000-4999:101", describe());
+
+    // And removing the wider VPN's range uncovers the nested one.
+    removeUsers(&mVpn101, { "1000-4999" });
+    EXPECT_EQ("2200-2300:102", describe());
+    EXPECT_EQ(0U, lookup(2199));
+    EXPECT_EQ(102U, lookup(2200));
+    EXPECT_EQ(102U, lookup(2300));
+    EXPECT_EQ(0U, lookup(2301));
+}
+
+TEST_F(VpnUidIndexTest, TestRemoveWhileAnotherCoversSameUids) {
+    addUsers(&mVpn100, { "1000-1999" });
+    addUsers(&mVpn101, { "1000-1999" });
+    addUsers(&mVpn102, { "1500-2499" });
+    EXPECT_EQ("1000-1999:100 2000-2499:102", describe());
+
+    // The next VPN in NetId order takes over.
+    removeUsers(&mVpn100, { "1000-1999" });
+    EXPECT_EQ("1000-1999:101 2000-2499:102", describe());
+
+    destroy(&mVpn101);
+    EXPECT_EQ("1500-2499:102", describe());
+    EXPECT_EQ(0U, lookup(1499));
+    EXPECT_EQ(102U, lookup(1500));
+
+    // Removing uids that a VPN doesn't have leaves the index alone.
+    removeUsers(&mVpn100, { "1500-2499" });
+    EXPECT_EQ("1500-2499:102", describe());
+}
+
+TEST_F(VpnUidIndexTest, TestRemoveKeepsOverlappingRangesOfSameVpn) {
+    addUsers(&mVpn100, { "1000-1999", "1500-2999" });
+    EXPECT_EQ("1000-2999:100", describe());
+
+    // The VPN still has 1500-1999 from its second range.
+    removeUsers(&mVpn100, { "1000-1999" });
+    EXPECT_EQ("1500-2999:100", describe());
+}
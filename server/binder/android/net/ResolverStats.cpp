@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "android/net/ResolverStats.h"
+
+#define LOG_TAG "ResolverStats"
+
+#include <binder/Parcel.h>
+#include <log/log.h>
+#include <utils/Errors.h>
+
+using android::BAD_VALUE;
+using android::NO_ERROR;
+using android::Parcel;
+using android::status_t;
+
+namespace android {
+
+namespace net {
+
+const int32_t ResolverStats::VERSION;
+const int ResolverStats::RTT_BUCKETS;
+const int ResolverStats::RCODE_COUNT;
+
+status_t ResolverStats::writeToParcel(Parcel* parcel) const {
+    const size_t start = parcel->dataPosition();
+    if (status_t err = parcel->writeInt32(VERSION)) {
+        return err;
+    }
+    // The size of the whole parcelable, filled in at the end.
+    const size_t sizePosition = parcel->dataPosition();
+    if (status_t err = parcel->writeInt32(0)) {
+        return err;
+    }
+
+    for (int32_t value : { successes, errors, timeouts, internal_errors, rtt_avg }) {
+        if (status_t err = parcel->writeInt32(value)) {
+            return err;
+        }
+    }
+    if (status_t err = parcel->writeInt64(first_sample_time)) {
+        return err;
+    }
+    if (status_t err = parcel->writeInt64(last_sample_time)) {
+        return err;
+    }
+    if (status_t err = parcel->writeBool(usable)) {
+        return err;
+    }
+    if (status_t err = parcel->writeInt32Vector(rtt_histogram)) {
+        return err;
+    }
+    if (status_t err = parcel->writeInt32Vector(rcode_counts)) {
+        return err;
+    }
+
+    const size_t end = parcel->dataPosition();
+    parcel->setDataPosition(sizePosition);
+    status_t err = parcel->writeInt32(end - start);
+    parcel->setDataPosition(end);
+    return err;
+}
+
+status_t ResolverStats::readFromParcel(const Parcel* parcel) {
+    const size_t start = parcel->dataPosition();
+    int32_t version;
+    int32_t size;
+    if (status_t err = parcel->readInt32(&version)) {
+        return err;
+    }
+    if (status_t err = parcel->readInt32(&size)) {
+        return err;
+    }
+    if (version < 1 || size < 0 || static_cast<size_t>(size) > parcel->dataSize() - start) {
+        return BAD_VALUE;
+    }
+
+    for (int* value : { &successes, &errors, &timeouts, &internal_errors, &rtt_avg }) {
+        if (status_t err = parcel->readInt32(value)) {
+            return err;
+        }
+    }
+    int64_t time;
+    if (status_t err = parcel->readInt64(&time)) {
+        return err;
+    }
+    first_sample_time = time;
+    if (status_t err = parcel->readInt64(&time)) {
+        return err;
+    }
+    last_sample_time = time;
+    if (status_t err = parcel->readBool(&usable)) {
+        return err;
+    }
+    if (status_t err = parcel->readInt32Vector(&rtt_histogram)) {
+        return err;
+    }
+    if (status_t err = parcel->readInt32Vector(&rcode_counts)) {
+        return err;
+    }
+
+    // Skip whatever a later version added.
+    if (parcel->dataPosition() > start + size) {
+        return BAD_VALUE;
+    }
+    parcel->setDataPosition(start + size);
+    return NO_ERROR;
+}
+
+int ResolverStats::rttBucket(int rttMs) {
+    int bucket = 0;
+    while (bucket < RTT_BUCKETS - 1 && rttMs >= (2 << bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+}  // namespace net
+
+}  // namespace android
@@ -0,0 +1,74 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_ANDROID_NET_RESOLVER_STATS_H
+#define NETD_SERVER_ANDROID_NET_RESOLVER_STATS_H
+
+#include <time.h>
+
+#include <vector>
+
+#include <binder/Parcelable.h>
+
+namespace android {
+
+namespace net {
+
+/*
+ * C++ implementation of ResolverStats, the stats of one DNS server as returned by
+ * getResolverInfo() of Netd's binder interface. The stats are based on the samples reported by
+ * android_net_res_stats_get_info_for_net(), the usability is calculated by applying
+ * android_net_res_stats_get_usable_servers() to them.
+ *
+ * The parcel starts with a version and its own size, so a reader can skip any fields that a later
+ * version adds at the end.
+ */
+struct ResolverStats : public Parcelable {
+    static const int32_t VERSION = 1;
+
+    // RTTs are bucketed by powers of two: bucket 0 counts RTTs below 2ms, bucket i counts RTTs in
+    // [2^i, 2^(i+1)) ms, and the last bucket counts everything from 2^(RTT_BUCKETS-1) ms up.
+    static const int RTT_BUCKETS = 12;
+    // The four-bit rcodes of DNS answers.
+    static const int RCODE_COUNT = 16;
+
+    int successes {-1};             // # successes counted for this server
+    int errors {-1};                // # errors
+    int timeouts {-1};              // # timeouts
+    int internal_errors {-1};       // # internal errors
+    int rtt_avg {-1};               // average round-trip-time of the successes
+    time_t first_sample_time {0};   // time in s when the oldest sample was recorded
+    time_t last_sample_time {0};    // time in s when the last sample was recorded
+    bool usable {false};            // whether the server is considered usable
+    std::vector<int32_t> rtt_histogram;  // RTT_BUCKETS counts of successes, by RTT
+    std::vector<int32_t> rcode_counts;   // RCODE_COUNT counts of answers, by rcode
+
+    ResolverStats() = default;
+    virtual ~ResolverStats() = default;
+    ResolverStats(const ResolverStats& stats) = default;
+
+    status_t writeToParcel(Parcel* parcel) const override;
+    status_t readFromParcel(const Parcel* parcel) override;
+
+    // Returns the bucket of rtt_histogram that counts |rttMs|.
+    static int rttBucket(int rttMs);
+};
+
+}  // namespace net
+
+}  // namespace android
+
+#endif  // NETD_SERVER_ANDROID_NET_RESOLVER_STATS_H
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "android/net/TetherStatsParcel.h"
+
+#define LOG_TAG "TetherStatsParcel"
+
+#include <utility>
+
+#include <binder/Parcel.h>
+#include <log/log.h>
+#include <utils/Errors.h>
+
+using android::BAD_VALUE;
+using android::NO_ERROR;
+using android::Parcel;
+using android::status_t;
+
+namespace android {
+
+namespace net {
+
+const int32_t TetherStatsParcel::VERSION;
+
+TetherStatsParcel::TetherStatsParcel(std::string intIface, std::string extIface, int64_t rxBytes,
+                                     int64_t rxPackets, int64_t txBytes, int64_t txPackets)
+        : intIface(std::move(intIface)), extIface(std::move(extIface)), rxBytes(rxBytes),
+          rxPackets(rxPackets), txBytes(txBytes), txPackets(txPackets) {
+}
+
+status_t TetherStatsParcel::writeToParcel(Parcel* parcel) const {
+    const size_t start = parcel->dataPosition();
+    if (status_t err = parcel->writeInt32(VERSION)) {
+        return err;
+    }
+    // The size of the whole parcelable, filled in at the end.
+    const size_t sizePosition = parcel->dataPosition();
+    if (status_t err = parcel->writeInt32(0)) {
+        return err;
+    }
+
+    if (status_t err = parcel->writeUtf8AsUtf16(intIface)) {
+        return err;
+    }
+    if (status_t err = parcel->writeUtf8AsUtf16(extIface)) {
+        return err;
+    }
+    for (int64_t value : { rxBytes, rxPackets, txBytes, txPackets }) {
+        if (status_t err = parcel->writeInt64(value)) {
+            return err;
+        }
+    }
+
+    const size_t end = parcel->dataPosition();
+    parcel->setDataPosition(sizePosition);
+    status_t err = parcel->writeInt32(end - start);
+    parcel->setDataPosition(end);
+    return err;
+}
+
+status_t TetherStatsParcel::readFromParcel(const Parcel* parcel) {
+    const size_t start = parcel->dataPosition();
+    int32_t version;
+    int32_t size;
+    if (status_t err = parcel->readInt32(&version)) {
+        return err;
+    }
+    if (status_t err = parcel->readInt32(&size)) {
+        return err;
+    }
+    if (version < 1 || size < 0 || static_cast<size_t>(size) > parcel->dataSize() - start) {
+        return BAD_VALUE;
+    }
+
+    if (status_t err = parcel->readUtf8FromUtf16(&intIface)) {
+        return err;
+    }
+    if (status_t err = parcel->readUtf8FromUtf16(&extIface)) {
+        return err;
+    }
+    for (int64_t* value : { &rxBytes, &rxPackets, &txBytes, &txPackets }) {
+        if (status_t err = parcel->readInt64(value)) {
+            return err;
+        }
+    }
+
+    // Skip whatever a later version added.
+    if (parcel->dataPosition() > start + size) {
+        return BAD_VALUE;
+    }
+    parcel->setDataPosition(start + size);
+    return NO_ERROR;
+}
+
+}  // namespace net
+
+}  // namespace android
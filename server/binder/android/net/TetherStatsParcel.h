@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2016 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef NETD_SERVER_ANDROID_NET_TETHER_STATS_PARCEL_H
+#define NETD_SERVER_ANDROID_NET_TETHER_STATS_PARCEL_H
+
+#include <stdint.h>
+
+#include <string>
+
+#include <binder/Parcelable.h>
+
+namespace android {
+
+namespace net {
+
+/*
+ * C++ implementation of TetherStatsParcel, the counters of one tethering interface pair as
+ * returned by tetherGetStats() of Netd's binder interface. rx counts the traffic from intIface to
+ * extIface, tx the traffic back.
+ *
+ * Like ResolverStats, the parcel starts with a version and its own size, so a reader can skip any
+ * fields that a later version adds at the end.
+ */
+struct TetherStatsParcel : public Parcelable {
+    static const int32_t VERSION = 1;
+
+    std::string intIface;
+    std::string extIface;
+    int64_t rxBytes {-1};
+    int64_t rxPackets {-1};
+    int64_t txBytes {-1};
+    int64_t txPackets {-1};
+
+    TetherStatsParcel() = default;
+    virtual ~TetherStatsParcel() = default;
+    TetherStatsParcel(const TetherStatsParcel& stats) = default;
+    TetherStatsParcel(std::string intIface, std::string extIface, int64_t rxBytes,
+                      int64_t rxPackets, int64_t txBytes, int64_t txPackets);
+
+    status_t writeToParcel(Parcel* parcel) const override;
+    status_t readFromParcel(const Parcel* parcel) override;
+};
+
+}  // namespace net
+
+}  // namespace android
+
+#endif  // NETD_SERVER_ANDROID_NET_TETHER_STATS_PARCEL_H
@@ -29,6 +29,7 @@
 #define LOG_TAG "Netd"
 
 #include "cutils/log.h"
+#include "cutils/properties.h"
 #include "utils/RWLock.h"
 
 #include <binder/IPCThreadState.h>
@@ -87,7 +88,15 @@ int main() {
     // Set local DNS mode, to prevent bionic from proxying
     // back to this service, recursively.
     setenv("ANDROID_DNS_MODE", "local", 1);
-    DnsProxyListener dpl(&gCtls->netCtrl);
+    // The query engine is off unless persist.netd.dns_query_engine is set. Without it, every
+    // lookup goes to bionic's resolver on the worker pool.
+    if (property_get_int32("persist.netd.dns_query_engine", 0) &&
+            gCtls->dnsQueryEngine.start()) {
+        ALOGE("Unable to start DnsQueryEngine, using bionic's resolver for all lookups");
+    }
+    DnsProxyListener dpl(&gCtls->netCtrl, &gCtls->resolverCtrl, &gCtls->dnsWorkerPool,
+                         &gCtls->dnsSingleFlight, &gCtls->dnsQueryEngine,
+                         &gCtls->dnsEventReporter);
     if (dpl.startListener()) {
         ALOGE("Unable to start DnsProxyListener (%s)", strerror(errno));
         exit(1);
@@ -34,6 +34,7 @@ LOCAL_SRC_FILES := binder_test.cpp \
                    dns_responder.cpp \
                    netd_integration_test.cpp \
                    netd_test.cpp \
+                   ../server/IptablesRestoreController.cpp \
                    ../server/NetdConstants.cpp
 LOCAL_MODULE_TAGS := eng tests
 include $(BUILD_NATIVE_TEST)
@@ -16,11 +16,13 @@
  * binder_test.cpp - unit tests for netd binder RPCs.
  */
 
+#include <algorithm>
 #include <cerrno>
 #include <cinttypes>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <set>
 #include <vector>
 
@@ -43,8 +45,11 @@
 
 #include "NetdConstants.h"
 #include "android/net/INetd.h"
+#include "android/net/ResolverStats.h"
+#include "android/net/TetherStatsParcel.h"
 #include "android/net/UidRange.h"
 #include "binder/IServiceManager.h"
+#include "binder/Parcel.h"
 
 #define TUN_DEV "/dev/tun"
 
@@ -52,6 +57,8 @@ using namespace android;
 using namespace android::base;
 using namespace android::binder;
 using android::net::INetd;
+using android::net::ResolverStats;
+using android::net::TetherStatsParcel;
 using android::net::UidRange;
 
 static const char* IP_RULE_V4 = "-4";
@@ -267,6 +274,151 @@ TEST_F(BinderTest, TestBandwidthEnableDataSaver) {
     }
 }
 
+// Returns the single uids that have a rule in the given chain, as listed by iptables -S. Uid
+// ranges are skipped.
+static std::vector<int32_t> listIptablesUids(const char *binary, const char *chainName) {
+    static const char kUidOwner[] = "--uid-owner ";
+    std::vector<int32_t> uids;
+    for (const auto& line : runCommand(StringPrintf("%s -w -S %s", binary, chainName))) {
+        size_t pos = line.find(kUidOwner);
+        if (pos == std::string::npos) continue;
+        char *end;
+        long uid = strtol(line.c_str() + pos + sizeof(kUidOwner) - 1, &end, 10);
+        if (*end == ' ') {
+            uids.push_back(uid);
+        }
+    }
+    return uids;
+}
+
+TEST_F(BinderTest, TestBandwidthReplaceNaughtyApps) {
+    const int kNumUids = 500;
+    const std::vector<int32_t> oldUids = listIptablesUids(IPTABLES_PATH, "bw_penalty_box");
+    std::vector<int32_t> uids(kNumUids);
+    for (int i = 0; i < kNumUids; i++) {
+        uids[i] = randomUid();
+    }
+    std::sort(uids.begin(), uids.end());
+    uids.erase(std::unique(uids.begin(), uids.end()), uids.end());
+
+    bool ret;
+    {
+        TimedOperation op(StringPrintf("Programming %d-UID penalty box", kNumUids));
+        mNetd->bandwidthReplaceNaughtyApps(uids, &ret);
+    }
+    EXPECT_TRUE(ret);
+    for (const auto binary : { IPTABLES_PATH, IP6TABLES_PATH }) {
+        std::vector<int32_t> actual = listIptablesUids(binary, "bw_penalty_box");
+        std::sort(actual.begin(), actual.end());
+        EXPECT_EQ(uids, actual);
+        // The uid rules, the chain itself, and the jump to bw_happy_box.
+        EXPECT_EQ(uids.size() + 2, runCommand(StringPrintf("%s -w -S bw_penalty_box",
+                                                            binary)).size());
+    }
+
+    {
+        TimedOperation op("Restoring penalty box");
+        mNetd->bandwidthReplaceNaughtyApps(oldUids, &ret);
+    }
+    EXPECT_TRUE(ret);
+    EXPECT_EQ(oldUids.size(), listIptablesUids(IPTABLES_PATH, "bw_penalty_box").size());
+}
+
+TEST_F(BinderTest, TestBandwidthReplaceNiceApps) {
+    const std::vector<int32_t> oldUids = listIptablesUids(IP6TABLES_PATH, "bw_happy_box");
+    const std::vector<int32_t> uids = { randomUid() };
+
+    bool ret;
+    mNetd->bandwidthReplaceNiceApps(uids, &ret);
+    EXPECT_TRUE(ret);
+    for (const auto binary : { IPTABLES_PATH, IP6TABLES_PATH }) {
+        // The system uid range is always there, and always comes first.
+        std::vector<std::string> rules = runCommand(StringPrintf("%s -w -S bw_happy_box", binary));
+        ASSERT_EQ(4U, rules.size());
+        EXPECT_NE(std::string::npos, rules[1].find(StringPrintf("--uid-owner 0-%d ",
+                                                                MAX_SYSTEM_UID)));
+        EXPECT_EQ(uids, listIptablesUids(binary, "bw_happy_box"));
+    }
+
+    // listIptablesUids() skips the system range, so this puts back exactly what was there.
+    mNetd->bandwidthReplaceNiceApps(oldUids, &ret);
+    EXPECT_TRUE(ret);
+}
+
+// Returns the counters in a bandwidthGetUidStats() snapshot for |uid|, as "iface rxBytes txBytes".
+static std::vector<std::string> uidStatsFor(const std::vector<uint8_t>& snapshot, int32_t uid,
+                                            uint64_t *generation) {
+    // Header: version, entrySize, count, reserved, generation.
+    struct {
+        uint32_t version, entrySize, count, reserved;
+        uint64_t generation;
+    } __attribute__((__packed__)) header;
+    struct {
+        int32_t uid;
+        char iface[IFNAMSIZ];
+        uint64_t rxBytes, rxPackets, txBytes, txPackets;
+    } __attribute__((__packed__)) entry;
+
+    std::vector<std::string> stats;
+    EXPECT_LE(sizeof(header), snapshot.size());
+    if (snapshot.size() < sizeof(header)) return stats;
+    memcpy(&header, snapshot.data(), sizeof(header));
+    EXPECT_EQ(1U, header.version);
+    EXPECT_LE(sizeof(entry), header.entrySize);
+    EXPECT_EQ(sizeof(header) + header.count * header.entrySize, snapshot.size());
+    *generation = header.generation;
+    for (size_t offset = sizeof(header); offset + header.entrySize <= snapshot.size();
+            offset += header.entrySize) {
+        memcpy(&entry, snapshot.data() + offset, sizeof(entry));
+        if (entry.uid == uid) {
+            stats.push_back(StringPrintf("%s %" PRIu64 " %" PRIu64,
+                                         entry.iface, entry.rxBytes, entry.txBytes));
+        }
+    }
+    return stats;
+}
+
+TEST_F(BinderTest, TestBandwidthUidCounters) {
+    const int32_t uid = randomUid();
+    const std::string rxName = StringPrintf("bwu%d__r", uid);
+    const std::string txName = StringPrintf("bwu%d__t", uid);
+
+    auto countRules = [] (const char *binary, const char *chain, const std::string& name) {
+        std::vector<std::string> rules = listIptablesRule(binary, chain);
+        return std::count_if(rules.begin(), rules.end(), [&name] (const std::string& rule) {
+            return rule.find(name + " ") != std::string::npos;
+        });
+    };
+
+    bool ret;
+    ASSERT_TRUE(mNetd->bandwidthAddUidCounter(uid, "", &ret).isOk());
+    EXPECT_TRUE(ret);
+    for (const auto binary : { IPTABLES_PATH, IP6TABLES_PATH }) {
+        EXPECT_EQ(1, countRules(binary, "bw_uid_INPUT", rxName));
+        EXPECT_EQ(1, countRules(binary, "bw_uid_OUTPUT", txName));
+    }
+
+    // Nothing runs as this uid, so the counter stays at zero, and does not show up in deltas.
+    std::vector<uint8_t> snapshot;
+    uint64_t generation = 0;
+    ASSERT_TRUE(mNetd->bandwidthGetUidStats(0, &snapshot).isOk());
+    EXPECT_EQ(std::vector<std::string>({ " 0 0" }), uidStatsFor(snapshot, uid, &generation));
+    ASSERT_TRUE(mNetd->bandwidthGetUidStats(generation, &snapshot).isOk());
+    EXPECT_TRUE(uidStatsFor(snapshot, uid, &generation).empty());
+
+    ASSERT_TRUE(mNetd->bandwidthRemoveUidCounter(uid, "", &ret).isOk());
+    EXPECT_TRUE(ret);
+    for (const auto binary : { IPTABLES_PATH, IP6TABLES_PATH }) {
+        EXPECT_EQ(0, countRules(binary, "bw_uid_INPUT", rxName));
+        EXPECT_EQ(0, countRules(binary, "bw_uid_OUTPUT", txName));
+    }
+    ASSERT_TRUE(mNetd->bandwidthGetUidStats(0, &snapshot).isOk());
+    EXPECT_TRUE(uidStatsFor(snapshot, uid, &generation).empty());
+
+    mNetd->bandwidthRemoveUidCounter(uid, "", &ret);
+    EXPECT_FALSE(ret);
+}
+
 static bool ipRuleExistsForRange(const uint32_t priority, const UidRange& range,
         const std::string& action, const char* ipVersion) {
     // Output looks like this:
@@ -654,3 +806,89 @@ TEST_F(BinderTest, TestSetProcSysNet) {
         }
     }
 }
+
+TEST(ResolverStatsTest, TestParcelSkipsNewerFields) {
+    ResolverStats stats;
+    stats.successes = 10;
+    stats.errors = 2;
+    stats.timeouts = 1;
+    stats.internal_errors = 0;
+    stats.rtt_avg = 25;
+    stats.first_sample_time = 1000;
+    stats.last_sample_time = 1300;
+    stats.usable = true;
+    stats.rtt_histogram.assign(ResolverStats::RTT_BUCKETS, 0);
+    stats.rtt_histogram[ResolverStats::rttBucket(25)] = 10;
+    stats.rcode_counts.assign(ResolverStats::RCODE_COUNT, 0);
+    stats.rcode_counts[0] = 10;
+    stats.rcode_counts[2] = 2;
+
+    // Pretend that a later version added a field, and then write something after the stats.
+    Parcel parcel;
+    ASSERT_EQ(NO_ERROR, stats.writeToParcel(&parcel));
+    const size_t size = parcel.dataPosition();
+    ASSERT_EQ(NO_ERROR, parcel.writeInt32(12345));
+    parcel.setDataPosition(sizeof(int32_t));
+    ASSERT_EQ(NO_ERROR, parcel.writeInt32(size + sizeof(int32_t)));
+    parcel.setDataPosition(size + sizeof(int32_t));
+    ASSERT_EQ(NO_ERROR, parcel.writeInt32(67890));
+
+    parcel.setDataPosition(0);
+    ResolverStats read;
+    ASSERT_EQ(NO_ERROR, read.readFromParcel(&parcel));
+    EXPECT_EQ(stats.successes, read.successes);
+    EXPECT_EQ(stats.errors, read.errors);
+    EXPECT_EQ(stats.timeouts, read.timeouts);
+    EXPECT_EQ(stats.internal_errors, read.internal_errors);
+    EXPECT_EQ(stats.rtt_avg, read.rtt_avg);
+    EXPECT_EQ(stats.first_sample_time, read.first_sample_time);
+    EXPECT_EQ(stats.last_sample_time, read.last_sample_time);
+    EXPECT_EQ(stats.usable, read.usable);
+    EXPECT_EQ(stats.rtt_histogram, read.rtt_histogram);
+    EXPECT_EQ(stats.rcode_counts, read.rcode_counts);
+    EXPECT_EQ(67890, parcel.readInt32());
+
+    EXPECT_EQ(0, ResolverStats::rttBucket(0));
+    EXPECT_EQ(1, ResolverStats::rttBucket(2));
+    EXPECT_EQ(4, ResolverStats::rttBucket(25));
+    EXPECT_EQ(ResolverStats::RTT_BUCKETS - 1, ResolverStats::rttBucket(60000));
+}
+
+TEST_F(BinderTest, TestTetherGetStats) {
+    std::vector<TetherStatsParcel> stats;
+    binder::Status status = mNetd->tetherGetStats(&stats);
+    ASSERT_TRUE(status.isOk()) << status.exceptionMessage();
+    for (const auto& s : stats) {
+        EXPECT_FALSE(s.intIface.empty());
+        EXPECT_FALSE(s.extIface.empty());
+        EXPECT_LE(0, s.rxBytes);
+        EXPECT_LE(0, s.rxPackets);
+        EXPECT_LE(0, s.txBytes);
+        EXPECT_LE(0, s.txPackets);
+    }
+}
+
+TEST(TetherStatsParcelTest, TestParcelSkipsNewerFields) {
+    TetherStatsParcel stats("wlan0", "rmnet0", 10002373, 10026, 20002002, 20027);
+
+    // Pretend that a later version added a field, and then write something after the stats.
+    Parcel parcel;
+    ASSERT_EQ(NO_ERROR, stats.writeToParcel(&parcel));
+    const size_t size = parcel.dataPosition();
+    ASSERT_EQ(NO_ERROR, parcel.writeInt64(12345));
+    parcel.setDataPosition(sizeof(int32_t));
+    ASSERT_EQ(NO_ERROR, parcel.writeInt32(size + sizeof(int64_t)));
+    parcel.setDataPosition(size + sizeof(int64_t));
+    ASSERT_EQ(NO_ERROR, parcel.writeInt32(67890));
+
+    parcel.setDataPosition(0);
+    TetherStatsParcel read;
+    ASSERT_EQ(NO_ERROR, read.readFromParcel(&parcel));
+    EXPECT_EQ(stats.intIface, read.intIface);
+    EXPECT_EQ(stats.extIface, read.extIface);
+    EXPECT_EQ(stats.rxBytes, read.rxBytes);
+    EXPECT_EQ(stats.rxPackets, read.rxPackets);
+    EXPECT_EQ(stats.txBytes, read.txBytes);
+    EXPECT_EQ(stats.txPackets, read.txPackets);
+    EXPECT_EQ(67890, parcel.readInt32());
+}
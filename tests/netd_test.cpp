@@ -48,9 +48,9 @@
 
 #include "dns_responder.h"
 #include "resolv_params.h"
-#include "ResolverStats.h"
 
 #include "android/net/INetd.h"
+#include "android/net/ResolverStats.h"
 #include "binder/IServiceManager.h"
 
 using android::base::StringPrintf;
@@ -299,9 +299,11 @@ protected:
             __res_params* params, std::vector<ResolverStats>* stats) {
         using android::net::INetd;
         std::vector<int32_t> params32;
-        std::vector<int32_t> stats32;
-        auto rv = mNetdSrv->getResolverInfo(TEST_NETID, servers, domains, &params32, &stats32);
-        if (!rv.isOk() || params32.size() != INetd::RESOLVER_PARAMS_COUNT) {
+        std::vector<int32_t> cacheStats32;
+        auto rv = mNetdSrv->getResolverInfo(TEST_NETID, servers, domains, &params32, stats,
+                &cacheStats32);
+        if (!rv.isOk() || params32.size() != INetd::RESOLVER_PARAMS_COUNT ||
+                cacheStats32.size() != INetd::RESOLVER_CACHE_STATS_COUNT) {
             return false;
         }
         *params = __res_params {
@@ -314,7 +316,7 @@ protected:
             .max_samples = static_cast<uint8_t>(
                     params32[INetd::RESOLVER_PARAMS_MAX_SAMPLES])
         };
-        return ResolverStats::decodeAll(stats32, stats);
+        return true;
     }
 
     std::string ToString(const hostent* he) const {
@@ -415,7 +417,7 @@ protected:
     const std::vector<std::string> mDefaultSearchDomains = { "example.com" };
     // <sample validity in s> <success threshold in percent> <min samples> <max samples>
     const std::string mDefaultParams = "300 25 8 8";
-    const std::vector<int> mDefaultParams_Binder = { 300, 25, 8, 8 };
+    const std::vector<int> mDefaultParams_Binder = { 300, 25, 8, 8, 0 };
 };
 
 TEST_F(ResolverTest, GetHostByName) {
@@ -445,7 +447,8 @@ TEST_F(ResolverTest, TestBinderSerialization) {
         INetd::RESOLVER_PARAMS_SAMPLE_VALIDITY,
         INetd::RESOLVER_PARAMS_SUCCESS_THRESHOLD,
         INetd::RESOLVER_PARAMS_MIN_SAMPLES,
-        INetd::RESOLVER_PARAMS_MAX_SAMPLES
+        INetd::RESOLVER_PARAMS_MAX_SAMPLES,
+        INetd::RESOLVER_PARAMS_RACE_DELAY_MS
     };
     int size = static_cast<int>(params_offsets.size());
     EXPECT_EQ(size, INetd::RESOLVER_PARAMS_COUNT);
@@ -455,6 +458,35 @@ TEST_F(ResolverTest, TestBinderSerialization) {
     }
 }
 
+TEST_F(ResolverTest, RaceDelay_Binder) {
+    using android::net::INetd;
+    const std::vector<std::string> servers = { "127.0.0.3", "127.0.0.4" };
+    const std::vector<std::string> domains = { "example.com" };
+    std::vector<int> params = mDefaultParams_Binder;
+    params[INetd::RESOLVER_PARAMS_RACE_DELAY_MS] = 200;
+    ASSERT_TRUE(SetResolversForNetwork(servers, domains, params));
+
+    std::vector<std::string> res_servers;
+    std::vector<std::string> res_domains;
+    std::vector<int32_t> params32;
+    std::vector<ResolverStats> stats;
+    std::vector<int32_t> cacheStats32;
+    ASSERT_TRUE(mNetdSrv->getResolverInfo(TEST_NETID, &res_servers, &res_domains, &params32,
+            &stats, &cacheStats32).isOk());
+    ASSERT_EQ(INetd::RESOLVER_PARAMS_COUNT, params32.size());
+    EXPECT_EQ(200, params32[INetd::RESOLVER_PARAMS_RACE_DELAY_MS]);
+
+    // Callers that don't know about racing leave it out, which turns it off.
+    params.resize(INetd::RESOLVER_PARAMS_RACE_DELAY_MS);
+    ASSERT_TRUE(SetResolversForNetwork(servers, domains, params));
+    ASSERT_TRUE(mNetdSrv->getResolverInfo(TEST_NETID, &res_servers, &res_domains, &params32,
+            &stats, &cacheStats32).isOk());
+    EXPECT_EQ(0, params32[INetd::RESOLVER_PARAMS_RACE_DELAY_MS]);
+
+    params.push_back(-1);
+    EXPECT_FALSE(SetResolversForNetwork(servers, domains, params));
+}
+
 TEST_F(ResolverTest, GetHostByName_Binder) {
     using android::net::INetd;
 
@@ -501,6 +533,19 @@ TEST_F(ResolverTest, GetHostByName_Binder) {
     EXPECT_TRUE(UnorderedCompareArray(res_servers, servers));
     EXPECT_TRUE(UnorderedCompareArray(res_domains, domains));
 
+    // Every success is in the RTT histogram, and every answer is counted by its rcode.
+    int successes = 0;
+    for (const ResolverStats& s : res_stats) {
+        ASSERT_EQ(static_cast<size_t>(ResolverStats::RTT_BUCKETS), s.rtt_histogram.size());
+        ASSERT_EQ(static_cast<size_t>(ResolverStats::RCODE_COUNT), s.rcode_counts.size());
+        EXPECT_EQ(s.successes, std::accumulate(s.rtt_histogram.begin(), s.rtt_histogram.end(), 0));
+        EXPECT_EQ(s.successes + s.errors,
+                std::accumulate(s.rcode_counts.begin(), s.rcode_counts.end(), 0));
+        EXPECT_LE(s.first_sample_time, s.last_sample_time);
+        successes += s.successes;
+    }
+    EXPECT_LE(1, successes);
+
     ASSERT_NO_FATAL_FAILURE(ShutdownDNSServers(&dns));
 }
 